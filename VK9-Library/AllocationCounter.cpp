@@ -0,0 +1,180 @@
+/*
+Copyright(c) 2019 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "AllocationCounter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <malloc.h>
+
+#ifdef VK9_COUNT_ALLOCATIONS
+
+static std::atomic<uint64_t> AllocationCount = 0;
+static thread_local uint64_t ThreadAllocationCount = 0;
+
+uint64_t GetAllocationCount() noexcept
+{
+	return AllocationCount.load(std::memory_order_relaxed);
+}
+
+uint64_t GetThreadAllocationCount() noexcept
+{
+	return ThreadAllocationCount;
+}
+
+static void* CountedAllocate(size_t size) noexcept
+{
+	AllocationCount.fetch_add(1, std::memory_order_relaxed);
+	ThreadAllocationCount++;
+	return malloc(size ? size : 1);
+}
+
+static void* CountedAllocate(size_t size, std::align_val_t alignment) noexcept
+{
+	AllocationCount.fetch_add(1, std::memory_order_relaxed);
+	ThreadAllocationCount++;
+	return _aligned_malloc(size ? size : 1, (size_t)alignment);
+}
+
+void* operator new(size_t size)
+{
+	void* memory = CountedAllocate(size);
+	if (!memory)
+	{
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+	void* memory = CountedAllocate(size, alignment);
+	if (!memory)
+	{
+		throw std::bad_alloc();
+	}
+	return memory;
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+	return operator new(size, alignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size, alignment);
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+	return CountedAllocate(size, alignment);
+}
+
+//Frees aren't counted, the stats are about how often the heap is hit rather than what is live.
+void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, std::align_val_t) noexcept
+{
+	_aligned_free(memory);
+}
+
+void operator delete[](void* memory, std::align_val_t) noexcept
+{
+	_aligned_free(memory);
+}
+
+void operator delete(void* memory, size_t, std::align_val_t) noexcept
+{
+	_aligned_free(memory);
+}
+
+void operator delete[](void* memory, size_t, std::align_val_t) noexcept
+{
+	_aligned_free(memory);
+}
+
+void operator delete(void* memory, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	_aligned_free(memory);
+}
+
+void operator delete[](void* memory, std::align_val_t, const std::nothrow_t&) noexcept
+{
+	_aligned_free(memory);
+}
+
+#else
+
+uint64_t GetAllocationCount() noexcept
+{
+	return 0;
+}
+
+uint64_t GetThreadAllocationCount() noexcept
+{
+	return 0;
+}
+
+#endif
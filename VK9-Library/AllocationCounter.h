@@ -1,7 +1,7 @@
 #pragma once
 
 /*
-Copyright(c) 2018-2019 Christopher Joseph Dean Schaefer
+Copyright(c) 2019 Christopher Joseph Dean Schaefer
 
 This software is provided 'as-is', without any express or implied
 warranty.In no event will the authors be held liable for any damages
@@ -20,38 +20,16 @@ misrepresented as being the original software.
 3. This notice may not be removed or altered from any source distribution.
 */
 
-#include <atomic>
-#include "WorkItemType.h"
-#include "d3d9.h"
+#include <cstdint>
 
-struct WorkItem
-{
-	WorkItemType WorkItemType = WorkItemType::None;
-	int32_t Id = 0;
-	void* Argument1 = nullptr;
-	void* Argument2 = nullptr;
-	void* Argument3 = nullptr;
-	void* Argument4 = nullptr;
-	void* Argument5 = nullptr;
-	void* Argument6 = nullptr;
+//Debug builds always count, release builds only count when the build asks for it.
+#if defined(_DEBUG) && !defined(VK9_COUNT_ALLOCATIONS)
+#define VK9_COUNT_ALLOCATIONS
+#endif
 
-	IUnknown* Caller = nullptr;
-
-	bool WillWait = false;
-	HANDLE WaitHandle;
-
-	WorkItem()
-	{
-		WaitHandle = CreateEvent(
-			NULL,               // default security attributes
-			TRUE,               // manual-reset event
-			FALSE,              // initial state is nonsignaled
-			TEXT("WorkCompleteEvent")  // object name
-		);
-	}
-
-	~WorkItem()
-	{
-		CloseHandle(WaitHandle);
-	}
-};
+/*
+With VK9_COUNT_ALLOCATIONS defined the library replaces the global operator new so its heap traffic can be reported.
+Only allocations made by code in this module are seen and without the define both counts stay at zero.
+*/
+uint64_t GetAllocationCount() noexcept; //Every thread.
+uint64_t GetThreadAllocationCount() noexcept; //The calling thread only.
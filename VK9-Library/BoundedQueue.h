@@ -0,0 +1,214 @@
+#pragma once
+
+/*
+Copyright(c) 2018-2019 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <cstdint>
+#include <cstddef>
+#include <xmmintrin.h>
+
+#define BOUNDED_QUEUE_CACHE_LINE_SIZE 64
+#define BOUNDED_QUEUE_PAUSE_COUNT 64
+#define BOUNDED_QUEUE_YIELD_COUNT 1024
+
+/*
+A fixed size multiple producer multiple consumer ring.
+Every cell carries a sequence number so producers and consumers only contend on the index they're moving and never on a lock.
+The blocking calls spin, then yield, then park on a condition variable, and the other side only touches the mutex when somebody is parked.
+*/
+template <class ElementType, size_t Capacity>
+class BoundedQueue
+{
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "BoundedQueue capacity must be a power of two.");
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> Sequence;
+		ElementType Value;
+	};
+
+	//Producers and consumers each get their own line so they don't invalidate each other.
+	alignas(BOUNDED_QUEUE_CACHE_LINE_SIZE) std::atomic<size_t> mTail = 0;
+	alignas(BOUNDED_QUEUE_CACHE_LINE_SIZE) std::atomic<size_t> mHead = 0;
+	alignas(BOUNDED_QUEUE_CACHE_LINE_SIZE) std::atomic<uint32_t> mParkedProducers = 0;
+	std::atomic<uint32_t> mParkedConsumers = 0;
+	std::mutex mMutex;
+	std::condition_variable mNotFull;
+	std::condition_variable mNotEmpty;
+	alignas(BOUNDED_QUEUE_CACHE_LINE_SIZE) Cell mCells[Capacity];
+
+	void Wake(std::atomic<uint32_t>& parked, std::condition_variable& condition)
+	{
+		//Pairs with the increment in Wait so either the parked thread sees the new item or this sees the parked thread.
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		if (parked.load(std::memory_order_relaxed))
+		{
+			{
+				std::lock_guard<std::mutex> lock(mMutex);
+			}
+			condition.notify_all();
+		}
+	}
+
+	bool CanPush() const
+	{
+		const size_t position = mTail.load(std::memory_order_seq_cst);
+		return mCells[position & (Capacity - 1)].Sequence.load(std::memory_order_seq_cst) == position;
+	}
+
+	bool CanPop() const
+	{
+		const size_t position = mHead.load(std::memory_order_seq_cst);
+		return mCells[position & (Capacity - 1)].Sequence.load(std::memory_order_seq_cst) == position + 1;
+	}
+
+	//The try runs outside of the lock because a successful one wakes the other side which takes the same lock.
+	template <typename TryFunction, typename ReadyFunction>
+	void Wait(TryFunction tryFunction, ReadyFunction readyFunction, std::atomic<uint32_t>& parked, std::condition_variable& condition)
+	{
+		for (uint32_t i = 0; i < BOUNDED_QUEUE_PAUSE_COUNT; i++)
+		{
+			if (tryFunction())
+			{
+				return;
+			}
+			_mm_pause();
+		}
+
+		for (uint32_t i = 0; i < BOUNDED_QUEUE_YIELD_COUNT; i++)
+		{
+			if (tryFunction())
+			{
+				return;
+			}
+			std::this_thread::yield();
+		}
+
+		mParkCount.fetch_add(1, std::memory_order_relaxed);
+
+		parked.fetch_add(1, std::memory_order_seq_cst);
+		while (!tryFunction())
+		{
+			std::unique_lock<std::mutex> lock(mMutex);
+			if (!readyFunction())
+			{
+				condition.wait(lock);
+			}
+		}
+		parked.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+public:
+	std::atomic<uint64_t> mParkCount = 0;
+
+	BoundedQueue()
+	{
+		for (size_t i = 0; i < Capacity; i++)
+		{
+			mCells[i].Sequence.store(i, std::memory_order_relaxed);
+		}
+	}
+
+	BoundedQueue(const BoundedQueue&) = delete;
+	BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+	bool TryPush(const ElementType& item)
+	{
+		size_t position = mTail.load(std::memory_order_relaxed);
+
+		while (true)
+		{
+			Cell& cell = mCells[position & (Capacity - 1)];
+			const size_t sequence = cell.Sequence.load(std::memory_order_acquire);
+			const intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+			if (difference == 0)
+			{
+				if (mTail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					cell.Value = item;
+					cell.Sequence.store(position + 1, std::memory_order_release);
+					Wake(mParkedConsumers, mNotEmpty);
+					return true;
+				}
+			}
+			else if (difference < 0)
+			{
+				return false; //Full
+			}
+			else
+			{
+				position = mTail.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	bool TryPop(ElementType& item)
+	{
+		size_t position = mHead.load(std::memory_order_relaxed);
+
+		while (true)
+		{
+			Cell& cell = mCells[position & (Capacity - 1)];
+			const size_t sequence = cell.Sequence.load(std::memory_order_acquire);
+			const intptr_t difference = (intptr_t)sequence - (intptr_t)(position + 1);
+
+			if (difference == 0)
+			{
+				if (mHead.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				{
+					item = cell.Value;
+					cell.Sequence.store(position + Capacity, std::memory_order_release);
+					Wake(mParkedProducers, mNotFull);
+					return true;
+				}
+			}
+			else if (difference < 0)
+			{
+				return false; //Empty
+			}
+			else
+			{
+				position = mHead.load(std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void Push(const ElementType& item)
+	{
+		if (!TryPush(item))
+		{
+			Wait([&]() { return TryPush(item); }, [this]() { return CanPush(); }, mParkedProducers, mNotFull);
+		}
+	}
+
+	void Pop(ElementType& item)
+	{
+		if (!TryPop(item))
+		{
+			Wait([&]() { return TryPop(item); }, [this]() { return CanPop(); }, mParkedConsumers, mNotEmpty);
+		}
+	}
+};
@@ -345,6 +345,18 @@ C9::C9()
 	//Load Configuration
 	mConfiguration["LogFile"] = "VK9.log";
 	mConfiguration["VSync"] = "1";
+	mConfiguration["PipelineCacheFile"] = "";
+	mConfiguration["PipelineCacheSaveInterval"] = "60";
+	mConfiguration["AsyncPipelineCompile"] = "0";
+	mConfiguration["AsyncPipelineFallback"] = "1";
+	mConfiguration["AsyncPipelineThreads"] = "0";
+	mConfiguration["PipelineDatabaseFile"] = "";
+	mConfiguration["PipelineWarmUp"] = "1";
+	mConfiguration["DynamicRenderState"] = "1";
+	mConfiguration["PipelineLibrary"] = "1";
+	mConfiguration["PushDescriptors"] = "1";
+	mConfiguration["BindlessTextures"] = "0";
+	mConfiguration["PerformanceStatsFile"] = "";
 #ifdef _DEBUG
 	mConfiguration["LogLevel"] = "0";
 	mConfiguration["EnableDebugLayers"] = "1";
@@ -433,6 +445,17 @@ C9::C9()
 		mGameName.erase(period_idx);
 	}
 
+	//Default to one pipeline cache per executable so games don't stomp on each other.
+	if (mConfiguration["PipelineCacheFile"].empty())
+	{
+		mConfiguration["PipelineCacheFile"] = mGameName + ".vk9cache";
+	}
+
+	if (mConfiguration["PipelineDatabaseFile"].empty())
+	{
+		mConfiguration["PipelineDatabaseFile"] = mGameName + ".vk9pipelines";
+	}
+
 	//Create the Vulkan instance
 	const vk::ApplicationInfo applicationInfo(mGameName.c_str(), 1, APP_SHORT_NAME, 1, VK_MAKE_VERSION(1, 1, 0));
 	const vk::InstanceCreateInfo createInfo({}, &applicationInfo, static_cast<uint32_t>(layerNames.size()), layerNames.data(), static_cast<uint32_t>(extensionNames.size()), extensionNames.data());
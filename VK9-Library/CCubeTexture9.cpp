@@ -139,6 +139,9 @@ CCubeTexture9::~CCubeTexture9()
 {
 	Log(info) << "CCubeTexture9::~CCubeTexture9" << std::endl;
 
+	mDevice->ReleaseBindlessTexture(mImageView.get());
+	mDevice->EvictDescriptorSets(mImageView.get());
+
 	for (int32_t i = 0; i < 6; i++)
 	{
 		for (int32_t j = 0; j < (int32_t)mSurfaces[i].size(); j++)
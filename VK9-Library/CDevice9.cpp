@@ -22,20 +22,42 @@ misrepresented as being the original software.
 #define NOMINMAX
 #endif // NOMINMAX
 
-#ifndef MAX_DESCRIPTOR
-#define MAX_DESCRIPTOR 2048u
-#endif // !MAX_DESCRIPTOR
+#ifndef DESCRIPTOR_POOL_SETS
+#define DESCRIPTOR_POOL_SETS 1024u
+#endif // !DESCRIPTOR_POOL_SETS
+
+#ifndef UNIFORM_RING_SIZE
+#define UNIFORM_RING_SIZE (1024u * 1024u)
+#endif // !UNIFORM_RING_SIZE
+
+#ifndef MAX_BINDLESS_TEXTURES
+#define MAX_BINDLESS_TEXTURES 16384u
+#endif // !MAX_BINDLESS_TEXTURES
+
+//Push constant layout. Has to match TransformationPushBlock in CommonVertex and FragmentPushBlock in CommonFragment.
+#define MVP_PUSH_CONSTANT_OFFSET 0u
+#define ALPHA_REFERENCE_PUSH_CONSTANT_OFFSET 64u
+#define TEXTURE_INDEX_PUSH_CONSTANT_OFFSET 80u
 
 #ifndef MAX_BUFFERUPDATE
 #define MAX_BUFFERUPDATE 65536u
 #endif // !MAX_BUFFERUPDATE
 
+#define PIPELINE_CACHE_MAGIC 0x50394B56 //VK9P
+#define PIPELINE_CACHE_VERSION 1
+#define PIPELINE_CACHE_MAX_SIZE (256u * 1024u * 1024u)
+
+#define PIPELINE_DATABASE_MAGIC 0x44394B56 //VK9D
+#define PIPELINE_DATABASE_VERSION 1
+
 #define D3DCOLOR_A(dw) (((float)(((dw) >> 24) & 0xFF)) / 255.0f)
 #define D3DCOLOR_R(dw) (((float)(((dw) >> 16) & 0xFF)) / 255.0f)
 #define D3DCOLOR_G(dw) (((float)(((dw) >> 8) & 0xFF)) / 255.0f)
 #define D3DCOLOR_B(dw) (((float)(((dw) >> 0) & 0xFF)) / 255.0f)
 
 #include <wingdi.h> //used for gamma ramp
+#include <bitset>
+#include <algorithm>
 
 #include "C9.h"
 #include "CDevice9.h"
@@ -56,6 +78,8 @@ misrepresented as being the original software.
 #include "CVolume9.h"
 #include "LogManager.h"
 #include "BitCast.h"
+#include "AllocationCounter.h"
+#include "MatrixMultiply.h"
 //#include "PrivateTypes.h"
 
 const uint32_t XYZRHW_VERT[] =
@@ -167,20 +191,34 @@ const uint32_t PIXEL_PASSTHROUGH_FRAG[] =
 #include "PixelPassthrough.frag.h"
 ;
 
+//Written in front of the driver blob so we can throw out caches from a different GPU or driver before Vulkan sees them.
+struct PipelineCacheFileHeader
+{
+	uint32_t mMagic;
+	uint32_t mVersion;
+	uint32_t mVendorID;
+	uint32_t mDeviceID;
+	uint8_t mPipelineCacheUUID[VK_UUID_SIZE];
+	uint64_t mDataSize;
+	uint64_t mDataHash;
+};
+
+//Every pipeline key a game has used plus the shaders and vertex declarations needed to rebuild them.
+struct PipelineDatabaseFileHeader
+{
+	uint32_t mMagic;
+	uint32_t mVersion;
+	uint32_t mPipelineKeySize;
+	uint32_t mShaderCount;
+	uint32_t mVertexDeclarationCount;
+	uint32_t mPipelineCount;
+	uint64_t mDataSize;
+	uint64_t mDataHash;
+};
+
 D3DMATRIX operator* (const D3DMATRIX& m1, const D3DMATRIX& m2)
 {
-	D3DMATRIX result;
-
-	//TODO: Check to see msvc auto vectorization picks this up.
-	for (int i = 0; i < 4; i++)
-	{
-		for (int j = 0; j < 4; j++)
-		{
-			result.m[i][j] = m1.m[i][0] * m2.m[0][j] + m1.m[i][1] * m2.m[1][j] + m1.m[i][2] * m2.m[2][j] + m1.m[i][3] * m2.m[3][j];
-		}
-	}
-
-	return result;
+	return MultiplyMatrix(m1, m2);
 }
 
 int32_t ConvertPrimitiveCountToVertexCount(D3DPRIMITIVETYPE primtiveType, int32_t primtiveCount) noexcept
@@ -432,6 +470,20 @@ vk::PrimitiveTopology ConvertPrimitiveType(D3DPRIMITIVETYPE input) noexcept
 	return output;
 }
 
+D3DPRIMITIVETYPE GetPrimitiveTopologyClass(D3DPRIMITIVETYPE input) noexcept
+{
+	switch (input)
+	{
+	case D3DPT_POINTLIST:
+		return D3DPT_POINTLIST;
+	case D3DPT_LINELIST:
+	case D3DPT_LINESTRIP:
+		return D3DPT_LINELIST;
+	default:
+		return D3DPT_TRIANGLELIST;
+	}
+}
+
 vk::BlendFactor ConvertColorFactor(D3DBLEND input) noexcept
 {
 	vk::BlendFactor output;
@@ -652,7 +704,8 @@ CDevice9::CDevice9(C9* c9, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocusWindo
 	mDeviceType(DeviceType),
 	mFocusWindow(hFocusWindow),
 	mBehaviorFlags(BehaviorFlags),
-	mInternalDeviceState(this, D3DSBT_ALL)
+	mInternalDeviceState(this, D3DSBT_ALL),
+	mApplicationDeviceState(this, (D3DSTATEBLOCKTYPE)0)
 {
 	Log(info) << "CDevice9::CDevice9" << std::endl;
 
@@ -779,18 +832,19 @@ CDevice9::CDevice9(C9* c9, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocusWindo
 		}
 	}
 
+	//Straight into the internal state so the defaults don't count as registers the application set, see WriteShaderConstants.
 	for (int i = 0; i < MAX_PIXEL_SHADER_CONST; i++)
 	{
 		const float zero[4] = { 0, 0, 0, 0 };
 
-		SetPixelShaderConstantF(i, zero, 1);
+		mInternalDeviceState.SetPixelShaderConstantF(i, zero, 1);
 	}
 
 	for (int i = 0; i < MAX_VERTEX_SHADER_CONST; i++)
 	{
 		const float zero[4] = { 0, 0, 0, 0 };
 
-		SetVertexShaderConstantF(i, zero, 1);
+		mInternalDeviceState.SetVertexShaderConstantF(i, zero, 1);
 	}
 
 	for (int i = 0; i < 16; i++)
@@ -982,17 +1036,59 @@ CDevice9::CDevice9(C9* c9, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocusWindo
 		SetSamplerState(i, D3DSAMP_DMAPOFFSET, 0);
 	}
 
+	/*
+	The command stream is started last so the defaults above are applied directly.
+	Nothing is bound yet so the application's copy of the state doesn't need to take any references.
+	*/
+	if (!mC9->mConfiguration["CommandStream"].empty() && std::stoi(mC9->mConfiguration["CommandStream"]))
+	{
+		mApplicationDeviceState.mDeviceState = mInternalDeviceState.mDeviceState;
+		mCommandStream = std::make_unique<CommandStream>(this, (mBehaviorFlags & D3DCREATE_MULTITHREADED) != 0);
+	}
+	Log(info) << "CDevice9::CDevice9 command stream " << (mCommandStream ? "enabled" : "disabled") << std::endl;
 }
 
 CDevice9::~CDevice9()
 {
-	for (int32_t i = 0; i < (int32_t)mDrawCommandBuffers.size(); i++)
+	mCommandStream.reset(); //Let the worker finish anything queued, everything after this runs here.
+
+	StopPipelineCompileThreads();
+
+	if (mAsyncPipelineCompile)
+	{
+		Log(info) << "CDevice9::~CDevice9 async pipelines completed " << mPipelineCompilesCompleted << " draws skipped " << mDrawsSkipped << " draws with fallback pipeline " << mDrawsWithFallbackPipeline << std::endl;
+	}
+
+	if (mPipelineLibrary)
+	{
+		Log(info) << "CDevice9::~CDevice9 pipeline libraries " << mPipelineLibraries.size() << " linked pipelines " << mPipelinesLinked << std::endl;
+	}
+
+	Log(info) << "CDevice9::~CDevice9 binds issued " << mBindsIssued << " binds skipped " << mBindsSkipped << std::endl;
+	Log(info) << "CDevice9::~CDevice9 most texture descriptor sets in a frame " << mTextureDescriptorSetHighWater << " most descriptor pools in a frame " << mTextureDescriptorPoolHighWater << std::endl;
+	Log(info) << "CDevice9::~CDevice9 most uniform ring chunks in a frame " << mUniformRingChunkHighWater << std::endl;
+	Log(info) << "CDevice9::~CDevice9 command buffer splits " << mCommandBufferSplits << std::endl;
+
+	if (mBindlessTextures)
+	{
+		Log(info) << "CDevice9::~CDevice9 bindless texture slots used " << mBindlessNextSlot << " of " << mBindlessTextureCount << std::endl;
+	}
+
+	for (size_t i = 0; i < mFenceWaitTime.size(); i++)
 	{
-		mDevice->waitForFences(1, &mDrawFences[mFrameIndex].get(), VK_TRUE, UINT64_MAX);
+		Log(info) << "CDevice9::~CDevice9 frame " << i << " fence wait " << std::chrono::duration_cast<std::chrono::milliseconds>(mFenceWaitTime[i]).count() << "ms" << std::endl;
+	}
+
+	for (int32_t i = 0; i < (int32_t)mDrawFences.size(); i++)
+	{
+		mDevice->waitForFences(1, &mDrawFences[i].get(), VK_TRUE, UINT64_MAX);
 	}
 
 	mDevice->waitIdle();
 
+	SavePipelineCache();
+	SavePipelineDatabase();
+
 	for (int32_t i = 0; i < 16; i++)
 	{
 		//if (mInternalDeviceState.mDeviceState.mTexture[i])
@@ -1067,6 +1163,41 @@ bool CDevice9::FindMemoryTypeFromProperties(uint32_t typeBits, vk::MemoryPropert
 
 void CDevice9::ResetVulkanDevice()
 {
+	//Pipelines belong to the old device so they have to go before it does.
+	CancelPipelineCompiles();
+	if (mPipelineCache)
+	{
+		SavePipelineCache();
+		SavePipelineDatabase();
+	}
+	mPipelines.clear();
+	mPipelineLibraries.clear();
+	mSamplerContainers.clear();
+	for (auto& descriptorPools : mTextureDescriptorPools)
+	{
+		descriptorPools.clear();
+	}
+	for (size_t i = 0; i < mUniformRingChunks.size(); i++)
+	{
+		mUniformRingChunks[i].clear();
+		mUniformRingChunkIndex[i] = 0;
+	}
+	mUniformRingOffset = 0;
+	mDirtyUniformBlocks = UNIFORM_BLOCK_ALL;
+
+	//These belong to the old device and pool too, and would otherwise pile up behind the new ones.
+	mDrawCommandBuffers.clear();
+	mDrawFences.clear();
+	for (size_t i = 0; i < mSplitCommandBuffers.size(); i++)
+	{
+		mSplitCommandBuffers[i].clear();
+		mSplitSemaphores[i].clear();
+	}
+	mImageAvailableSemaphores.clear();
+	mRenderFinishedSemaphores.clear();
+	mUtilityCommandBuffers.clear();
+	mUtilityFences.clear();
+
 	//Create a device and command pool (unique device will auto destroy)
 	{
 		float queuePriority = 0.0f;
@@ -1080,7 +1211,178 @@ void CDevice9::ResetVulkanDevice()
 		deviceExtensionNames.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
 		deviceExtensionNames.push_back("VK_KHR_maintenance1");
 
-		mDevice = mC9->mPhysicalDevices[mC9->mPhysicalDeviceIndex].createDeviceUnique(vk::DeviceCreateInfo({}, 1, &deviceQueueCreateInfo, 0, nullptr, static_cast<uint32_t>(deviceExtensionNames.size()), deviceExtensionNames.data(), &features));
+		//Stencil reference and masks are core so those can always be dynamic unless the user wants the fully static path.
+		mDynamicRenderState = 0;
+		if (mC9->mConfiguration["DynamicRenderState"].empty() || std::stoi(mC9->mConfiguration["DynamicRenderState"]))
+		{
+			mDynamicRenderState |= DYNAMIC_RENDER_STATE_STENCIL;
+		}
+
+		auto deviceCreateInfo = vk::DeviceCreateInfo({}, 1, &deviceQueueCreateInfo, 0, nullptr, 0, nullptr, &features);
+
+#ifdef VK_EXT_extended_dynamic_state
+		vk::PhysicalDeviceExtendedDynamicStateFeaturesEXT extendedDynamicStateFeatures;
+		if (mDynamicRenderState && mC9->mPhysicalDeviceProperties.apiVersion >= VK_API_VERSION_1_1)
+		{
+			const auto extensionProperties = device.enumerateDeviceExtensionProperties();
+			for (auto& extensionProperty : extensionProperties)
+			{
+				if (!strcmp(extensionProperty.extensionName, VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME))
+				{
+					vk::PhysicalDeviceFeatures2 features2;
+					features2.pNext = &extendedDynamicStateFeatures;
+					device.getFeatures2(&features2);
+
+					if (extendedDynamicStateFeatures.extendedDynamicState)
+					{
+						deviceExtensionNames.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+						deviceCreateInfo.pNext = &extendedDynamicStateFeatures;
+						mDynamicRenderState |= DYNAMIC_RENDER_STATE_EXTENDED;
+					}
+					break;
+				}
+			}
+		}
+#endif
+
+#ifdef VK_KHR_push_descriptor
+		//Push descriptors let texture changes go straight into the command buffer instead of through a pool.
+		//The limit query needs getProperties2 so 1.0 devices stay on regular descriptor sets.
+		mPushDescriptors = false;
+		if ((mC9->mConfiguration["PushDescriptors"].empty() || std::stoi(mC9->mConfiguration["PushDescriptors"])) && mC9->mPhysicalDeviceProperties.apiVersion >= VK_API_VERSION_1_1)
+		{
+			const auto extensionProperties = device.enumerateDeviceExtensionProperties();
+			for (auto& extensionProperty : extensionProperties)
+			{
+				if (!strcmp(extensionProperty.extensionName, VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME))
+				{
+					vk::PhysicalDevicePushDescriptorPropertiesKHR pushDescriptorProperties;
+					vk::PhysicalDeviceProperties2 properties2;
+					properties2.pNext = &pushDescriptorProperties;
+					device.getProperties2(&properties2);
+
+					//Only the 16 textures get pushed, the buffers have their own set.
+					if (pushDescriptorProperties.maxPushDescriptors >= 16)
+					{
+						deviceExtensionNames.push_back(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+						mPushDescriptors = true;
+					}
+					break;
+				}
+			}
+		}
+#endif
+
+#ifdef VK_EXT_graphics_pipeline_library
+		/*
+		With graphics pipeline libraries the vertex input, pre-rasterization, fragment shader and fragment output parts are compiled on their own and linked.
+		Linking is only worth it if the driver says it's fast so otherwise stick with full pipelines.
+		*/
+		vk::PhysicalDeviceGraphicsPipelineLibraryFeaturesEXT graphicsPipelineLibraryFeatures;
+		mPipelineLibrary = false;
+		if ((mC9->mConfiguration["PipelineLibrary"].empty() || std::stoi(mC9->mConfiguration["PipelineLibrary"])) && mC9->mPhysicalDeviceProperties.apiVersion >= VK_API_VERSION_1_1)
+		{
+			bool hasPipelineLibrary = false;
+			bool hasGraphicsPipelineLibrary = false;
+
+			const auto extensionProperties = device.enumerateDeviceExtensionProperties();
+			for (auto& extensionProperty : extensionProperties)
+			{
+				if (!strcmp(extensionProperty.extensionName, VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME))
+				{
+					hasPipelineLibrary = true;
+				}
+				else if (!strcmp(extensionProperty.extensionName, VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME))
+				{
+					hasGraphicsPipelineLibrary = true;
+				}
+			}
+
+			if (hasPipelineLibrary && hasGraphicsPipelineLibrary)
+			{
+				vk::PhysicalDeviceGraphicsPipelineLibraryPropertiesEXT graphicsPipelineLibraryProperties;
+				vk::PhysicalDeviceProperties2 properties2;
+				properties2.pNext = &graphicsPipelineLibraryProperties;
+				device.getProperties2(&properties2);
+
+				vk::PhysicalDeviceFeatures2 features2;
+				features2.pNext = &graphicsPipelineLibraryFeatures;
+				device.getFeatures2(&features2);
+
+				if (graphicsPipelineLibraryFeatures.graphicsPipelineLibrary && graphicsPipelineLibraryProperties.graphicsPipelineLibraryFastLinking)
+				{
+					deviceExtensionNames.push_back(VK_KHR_PIPELINE_LIBRARY_EXTENSION_NAME);
+					deviceExtensionNames.push_back(VK_EXT_GRAPHICS_PIPELINE_LIBRARY_EXTENSION_NAME);
+					graphicsPipelineLibraryFeatures.pNext = const_cast<void*>(deviceCreateInfo.pNext);
+					deviceCreateInfo.pNext = &graphicsPipelineLibraryFeatures;
+					mPipelineLibrary = true;
+				}
+			}
+		}
+#endif
+
+#ifdef VK_EXT_descriptor_indexing
+		/*
+		Bindless textures put every texture the fixed function shaders see into one big update-after-bind array.
+		Each texture/sampler pair is written once and a draw only pushes the 16 indices it wants.
+		This is opt-in because it needs the array to be updated while earlier frames using it are still in flight.
+		*/
+		vk::PhysicalDeviceDescriptorIndexingFeaturesEXT descriptorIndexingFeatures;
+		mBindlessTextures = false;
+		if (!mC9->mConfiguration["BindlessTextures"].empty() && std::stoi(mC9->mConfiguration["BindlessTextures"]) && mC9->mPhysicalDeviceProperties.apiVersion >= VK_API_VERSION_1_1)
+		{
+			bool hasMaintenance3 = false;
+			bool hasDescriptorIndexing = false;
+
+			const auto extensionProperties = device.enumerateDeviceExtensionProperties();
+			for (auto& extensionProperty : extensionProperties)
+			{
+				if (!strcmp(extensionProperty.extensionName, VK_KHR_MAINTENANCE3_EXTENSION_NAME))
+				{
+					hasMaintenance3 = true;
+				}
+				else if (!strcmp(extensionProperty.extensionName, VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME))
+				{
+					hasDescriptorIndexing = true;
+				}
+			}
+
+			if (hasMaintenance3 && hasDescriptorIndexing)
+			{
+				vk::PhysicalDeviceDescriptorIndexingPropertiesEXT descriptorIndexingProperties;
+				vk::PhysicalDeviceProperties2 properties2;
+				properties2.pNext = &descriptorIndexingProperties;
+				device.getProperties2(&properties2);
+
+				vk::PhysicalDeviceFeatures2 features2;
+				features2.pNext = &descriptorIndexingFeatures;
+				device.getFeatures2(&features2);
+
+				//The indices are pushed as 16 bit values so that caps the array too.
+				mBindlessTextureCount = std::min({ MAX_BINDLESS_TEXTURES, 65535u
+					, descriptorIndexingProperties.maxDescriptorSetUpdateAfterBindSamplers
+					, descriptorIndexingProperties.maxDescriptorSetUpdateAfterBindSampledImages
+					, descriptorIndexingProperties.maxPerStageDescriptorUpdateAfterBindSamplers
+					, descriptorIndexingProperties.maxPerStageDescriptorUpdateAfterBindSampledImages });
+
+				if (descriptorIndexingFeatures.descriptorBindingSampledImageUpdateAfterBind
+					&& descriptorIndexingFeatures.descriptorBindingPartiallyBound
+					&& descriptorIndexingFeatures.descriptorBindingUpdateUnusedWhilePending
+					&& mBindlessTextureCount >= 256)
+				{
+					deviceExtensionNames.push_back(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+					deviceExtensionNames.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+					descriptorIndexingFeatures.pNext = const_cast<void*>(deviceCreateInfo.pNext);
+					deviceCreateInfo.pNext = &descriptorIndexingFeatures;
+					mBindlessTextures = true;
+				}
+			}
+		}
+#endif
+
+		deviceCreateInfo.enabledExtensionCount = static_cast<uint32_t>(deviceExtensionNames.size());
+		deviceCreateInfo.ppEnabledExtensionNames = deviceExtensionNames.data();
+		mDevice = mC9->mPhysicalDevices[mC9->mPhysicalDeviceIndex].createDeviceUnique(deviceCreateInfo);
 		mCommandPool = mDevice->createCommandPoolUnique(vk::CommandPoolCreateInfo(vk::CommandPoolCreateFlagBits::eResetCommandBuffer, deviceQueueCreateInfo.queueFamilyIndex));
 	}
 
@@ -1088,23 +1390,67 @@ void CDevice9::ResetVulkanDevice()
 		mDevice->getQueue(static_cast<uint32_t>(mC9->mGraphicsQueueFamilyIndex), 0, &mQueue);
 	}
 
-	//Create a descriptor pool that should be able to allocate enough of any type.
+#ifdef VK_EXT_extended_dynamic_state
+	if (mDynamicRenderState & DYNAMIC_RENDER_STATE_EXTENDED)
 	{
-		const vk::DescriptorPoolSize descriptorPoolSizes[11] =
+		mCmdSetCullModeEXT = reinterpret_cast<PFN_vkCmdSetCullModeEXT>(mDevice->getProcAddr("vkCmdSetCullModeEXT"));
+		mCmdSetFrontFaceEXT = reinterpret_cast<PFN_vkCmdSetFrontFaceEXT>(mDevice->getProcAddr("vkCmdSetFrontFaceEXT"));
+		mCmdSetPrimitiveTopologyEXT = reinterpret_cast<PFN_vkCmdSetPrimitiveTopologyEXT>(mDevice->getProcAddr("vkCmdSetPrimitiveTopologyEXT"));
+		mCmdSetDepthTestEnableEXT = reinterpret_cast<PFN_vkCmdSetDepthTestEnableEXT>(mDevice->getProcAddr("vkCmdSetDepthTestEnableEXT"));
+		mCmdSetDepthWriteEnableEXT = reinterpret_cast<PFN_vkCmdSetDepthWriteEnableEXT>(mDevice->getProcAddr("vkCmdSetDepthWriteEnableEXT"));
+		mCmdSetDepthCompareOpEXT = reinterpret_cast<PFN_vkCmdSetDepthCompareOpEXT>(mDevice->getProcAddr("vkCmdSetDepthCompareOpEXT"));
+		mCmdSetStencilTestEnableEXT = reinterpret_cast<PFN_vkCmdSetStencilTestEnableEXT>(mDevice->getProcAddr("vkCmdSetStencilTestEnableEXT"));
+		mCmdSetStencilOpEXT = reinterpret_cast<PFN_vkCmdSetStencilOpEXT>(mDevice->getProcAddr("vkCmdSetStencilOpEXT"));
+
+		if (!mCmdSetCullModeEXT || !mCmdSetFrontFaceEXT || !mCmdSetPrimitiveTopologyEXT || !mCmdSetDepthTestEnableEXT || !mCmdSetDepthWriteEnableEXT || !mCmdSetDepthCompareOpEXT || !mCmdSetStencilTestEnableEXT || !mCmdSetStencilOpEXT)
 		{
-			vk::DescriptorPoolSize(vk::DescriptorType::eSampler,std::min((uint32_t)MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxDescriptorSetSamplers)),
-			vk::DescriptorPoolSize(vk::DescriptorType::eCombinedImageSampler,std::min((uint32_t)MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxPerStageDescriptorSamplers)),
-			vk::DescriptorPoolSize(vk::DescriptorType::eSampledImage,std::min((uint32_t)MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxDescriptorSetSampledImages)),
-			vk::DescriptorPoolSize(vk::DescriptorType::eStorageImage,std::min((uint32_t)MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxDescriptorSetStorageImages)),
-			vk::DescriptorPoolSize(vk::DescriptorType::eUniformTexelBuffer,std::min((uint32_t)MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxPerStageDescriptorSampledImages)),
-			vk::DescriptorPoolSize(vk::DescriptorType::eStorageTexelBuffer,std::min((uint32_t)MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxPerStageDescriptorStorageImages)),
-			vk::DescriptorPoolSize(vk::DescriptorType::eUniformBuffer,std::min((uint32_t)MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxDescriptorSetUniformBuffers)),
-			vk::DescriptorPoolSize(vk::DescriptorType::eStorageBuffer,std::min((uint32_t)MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxDescriptorSetStorageBuffers)),
-			vk::DescriptorPoolSize(vk::DescriptorType::eUniformBufferDynamic,std::min((uint32_t)MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxDescriptorSetUniformBuffersDynamic)),
-			vk::DescriptorPoolSize(vk::DescriptorType::eStorageBufferDynamic,std::min((uint32_t)MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxDescriptorSetStorageBuffersDynamic)),
-			vk::DescriptorPoolSize(vk::DescriptorType::eInputAttachment,std::min((uint32_t)MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxDescriptorSetInputAttachments))
-		};
-		mDescriptorPool = mDevice->createDescriptorPoolUnique(vk::DescriptorPoolCreateInfo(vk::DescriptorPoolCreateFlags(), std::min(MAX_DESCRIPTOR, mC9->mPhysicalDeviceProperties.limits.maxDescriptorSetSamplers), 11, &descriptorPoolSizes[0]));
+			Log(warning) << "CDevice9::ResetVulkanDevice VK_EXT_extended_dynamic_state is missing entry points so falling back to static state." << std::endl;
+			mDynamicRenderState &= ~DYNAMIC_RENDER_STATE_EXTENDED;
+		}
+	}
+#endif
+
+	Log(info) << "CDevice9::ResetVulkanDevice dynamic render state flags " << mDynamicRenderState << std::endl;
+	Log(info) << "CDevice9::ResetVulkanDevice pipeline libraries " << (mPipelineLibrary ? "enabled" : "disabled") << std::endl;
+
+#ifdef VK_KHR_push_descriptor
+	if (mPushDescriptors)
+	{
+		mCmdPushDescriptorSetWithTemplateKHR = reinterpret_cast<PFN_vkCmdPushDescriptorSetWithTemplateKHR>(mDevice->getProcAddr("vkCmdPushDescriptorSetWithTemplateKHR"));
+		if (!mCmdPushDescriptorSetWithTemplateKHR)
+		{
+			Log(warning) << "CDevice9::ResetVulkanDevice VK_KHR_push_descriptor is missing vkCmdPushDescriptorSetWithTemplateKHR so falling back to descriptor sets." << std::endl;
+			mPushDescriptors = false;
+		}
+	}
+#endif
+	Log(info) << "CDevice9::ResetVulkanDevice push descriptors " << (mPushDescriptors ? "enabled" : "disabled") << std::endl;
+	Log(info) << "CDevice9::ResetVulkanDevice bindless textures " << (mBindlessTextures ? "enabled" : "disabled") << std::endl;
+
+	//The fixed function fragment shaders size their texture array and pick how to index it from these.
+	mBindlessSpecializationData[0] = mBindlessTextureCount;
+	mBindlessSpecializationData[1] = VK_TRUE;
+	mBindlessSpecializationEntries[0] = vk::SpecializationMapEntry(0, 0, sizeof(uint32_t));
+	mBindlessSpecializationEntries[1] = vk::SpecializationMapEntry(1, sizeof(uint32_t), sizeof(uint32_t));
+	mBindlessSpecializationInfo = vk::SpecializationInfo(2, mBindlessSpecializationEntries, sizeof(mBindlessSpecializationData), mBindlessSpecializationData);
+
+	//Which states are part of the pipeline key depends on what the device supports.
+	mInternalDeviceState.mDeviceState.mPipelineKey.SetDynamicRenderState(mDynamicRenderState, mInternalDeviceState.mDeviceState.mRenderState.data());
+	mInternalDeviceState.mDeviceState.mCapturedPipelineKey = true;
+	mInternalDeviceState.mDeviceState.mCapturedDynamicRenderState = true;
+
+	/*
+	Texture sets come from a chain of pools per frame, see AllocateTextureDescriptorSet.
+	Set 0 lives with its chunk of the uniform ring, see CreateUniformRingChunk.
+	*/
+	{
+		//Any sets from before came out of the old pools.
+		for (size_t i = 0; i < mDescriptorSetCache.size(); i++)
+		{
+			mDescriptorSetCache[i].Clear();
+			mTextureDescriptorPoolIndex[i] = 0;
+			mTextureDescriptorSetCount[i] = 0;
+		}
 	}
 
 	//Setup buffers for up draw methods
@@ -1139,304 +1485,369 @@ void CDevice9::ResetVulkanDevice()
 		mDevice->bindBufferMemory(mUpIndexBuffer.get(), mUpIndexBufferMemory.get(), 0);
 	}
 
-	//Setup FF Buffers
-
-	//RenderState
-	{
-		auto const renderStateBufferInfo = vk::BufferCreateInfo().setSize(sizeof(mInternalDeviceState.mDeviceState.mRenderState)).setUsage(vk::BufferUsageFlagBits::eUniformBuffer | vk::BufferUsageFlagBits::eTransferDst);
-		mRenderStateBuffer = mDevice->createBufferUnique(renderStateBufferInfo);
-		vk::MemoryRequirements renderStateMemoryRequirements;
-		mDevice->getBufferMemoryRequirements(mRenderStateBuffer.get(), &renderStateMemoryRequirements);
-		auto renderStateMemoryAllocateInfo = vk::MemoryAllocateInfo().setAllocationSize(renderStateMemoryRequirements.size).setMemoryTypeIndex(0);
-		FindMemoryTypeFromProperties(renderStateMemoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &renderStateMemoryAllocateInfo.memoryTypeIndex);
-		mRenderStateBufferMemory = mDevice->allocateMemoryUnique(renderStateMemoryAllocateInfo);
-		mDevice->bindBufferMemory(mRenderStateBuffer.get(), mRenderStateBufferMemory.get(), 0);
-	}
-
-	//TextureStage
-	{
-		auto const textureStageBufferInfo = vk::BufferCreateInfo().setSize(sizeof(PaddedTextureStage) * 16).setUsage(vk::BufferUsageFlagBits::eUniformBuffer | vk::BufferUsageFlagBits::eTransferDst);
-		mTextureStageBuffer = mDevice->createBufferUnique(textureStageBufferInfo);
-		vk::MemoryRequirements textureStageMemoryRequirements;
-		mDevice->getBufferMemoryRequirements(mTextureStageBuffer.get(), &textureStageMemoryRequirements);
-		auto textureStageMemoryAllocateInfo = vk::MemoryAllocateInfo().setAllocationSize(textureStageMemoryRequirements.size).setMemoryTypeIndex(0);
-		FindMemoryTypeFromProperties(textureStageMemoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &textureStageMemoryAllocateInfo.memoryTypeIndex);
-		mTextureStageBufferMemory = mDevice->allocateMemoryUnique(textureStageMemoryAllocateInfo);
-		mDevice->bindBufferMemory(mTextureStageBuffer.get(), mTextureStageBufferMemory.get(), 0);
-	}
-
-	//Light
-	{
-		auto const lightBufferInfo = vk::BufferCreateInfo().setSize(sizeof(PaddedLight) * 8).setUsage(vk::BufferUsageFlagBits::eUniformBuffer | vk::BufferUsageFlagBits::eTransferDst);
-		mLightBuffer = mDevice->createBufferUnique(lightBufferInfo);
-		vk::MemoryRequirements lightMemoryRequirements;
-		mDevice->getBufferMemoryRequirements(mLightBuffer.get(), &lightMemoryRequirements);
-		auto lightMemoryAllocateInfo = vk::MemoryAllocateInfo().setAllocationSize(lightMemoryRequirements.size).setMemoryTypeIndex(0);
-		FindMemoryTypeFromProperties(lightMemoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &lightMemoryAllocateInfo.memoryTypeIndex);
-		mLightBufferMemory = mDevice->allocateMemoryUnique(lightMemoryAllocateInfo);
-		mDevice->bindBufferMemory(mLightBuffer.get(), mLightBufferMemory.get(), 0);
-	}
-
-	//Light Enable
-	{
-		//Padding on the GPU side makes it 4 times as big.
-		auto const lightEnableBufferInfo = vk::BufferCreateInfo().setSize(sizeof(mInternalDeviceState.mDeviceState.mLightEnableState) * 4).setUsage(vk::BufferUsageFlagBits::eUniformBuffer | vk::BufferUsageFlagBits::eTransferDst);
-		mLightEnableBuffer = mDevice->createBufferUnique(lightEnableBufferInfo);
-		vk::MemoryRequirements lightEnableMemoryRequirements;
-		mDevice->getBufferMemoryRequirements(mLightEnableBuffer.get(), &lightEnableMemoryRequirements);
-		auto lightEnableMemoryAllocateInfo = vk::MemoryAllocateInfo().setAllocationSize(lightEnableMemoryRequirements.size).setMemoryTypeIndex(0);
-		FindMemoryTypeFromProperties(lightEnableMemoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &lightEnableMemoryAllocateInfo.memoryTypeIndex);
-		mLightEnableBufferMemory = mDevice->allocateMemoryUnique(lightEnableMemoryAllocateInfo);
-		mDevice->bindBufferMemory(mLightEnableBuffer.get(), mLightEnableBufferMemory.get(), 0);
-	}
-
-	//Material
-	{
-		auto const materialBufferInfo = vk::BufferCreateInfo().setSize(sizeof(mInternalDeviceState.mDeviceState.mMaterial)).setUsage(vk::BufferUsageFlagBits::eUniformBuffer | vk::BufferUsageFlagBits::eTransferDst);
-		mMaterialBuffer = mDevice->createBufferUnique(materialBufferInfo);
-		vk::MemoryRequirements materialMemoryRequirements;
-		mDevice->getBufferMemoryRequirements(mMaterialBuffer.get(), &materialMemoryRequirements);
-		auto materialMemoryAllocateInfo = vk::MemoryAllocateInfo().setAllocationSize(materialMemoryRequirements.size).setMemoryTypeIndex(0);
-		FindMemoryTypeFromProperties(materialMemoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &materialMemoryAllocateInfo.memoryTypeIndex);
-		mMaterialBufferMemory = mDevice->allocateMemoryUnique(materialMemoryAllocateInfo);
-		mDevice->bindBufferMemory(mMaterialBuffer.get(), mMaterialBufferMemory.get(), 0);
-	}
-
-	//Transformation
-	{
-		auto const transformationBufferInfo = vk::BufferCreateInfo().setSize(sizeof(mInternalDeviceState.mDeviceState.mTransform)).setUsage(vk::BufferUsageFlagBits::eUniformBuffer | vk::BufferUsageFlagBits::eTransferDst);
-		mTransformationBuffer = mDevice->createBufferUnique(transformationBufferInfo);
-		vk::MemoryRequirements transformationMemoryRequirements;
-		mDevice->getBufferMemoryRequirements(mTransformationBuffer.get(), &transformationMemoryRequirements);
-		auto transformationMemoryAllocateInfo = vk::MemoryAllocateInfo().setAllocationSize(transformationMemoryRequirements.size).setMemoryTypeIndex(0);
-		FindMemoryTypeFromProperties(transformationMemoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &transformationMemoryAllocateInfo.memoryTypeIndex);
-		mTransformationBufferMemory = mDevice->allocateMemoryUnique(transformationMemoryAllocateInfo);
-		mDevice->bindBufferMemory(mTransformationBuffer.get(), mTransformationBufferMemory.get(), 0);
-	}
-
-	//Setup Shader buffers
-
-	//VertexConstant
-	{
-		auto const vertexConstantBufferInfo = vk::BufferCreateInfo().setSize(sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantI) + sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantB) + sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantF)).setUsage(vk::BufferUsageFlagBits::eUniformBuffer | vk::BufferUsageFlagBits::eTransferDst);
-		mVertexConstantBuffer = mDevice->createBufferUnique(vertexConstantBufferInfo);
-		vk::MemoryRequirements vertexConstantMemoryRequirements;
-		mDevice->getBufferMemoryRequirements(mVertexConstantBuffer.get(), &vertexConstantMemoryRequirements);
-		auto vertexConstantMemoryAllocateInfo = vk::MemoryAllocateInfo().setAllocationSize(vertexConstantMemoryRequirements.size).setMemoryTypeIndex(0);
-		FindMemoryTypeFromProperties(vertexConstantMemoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &vertexConstantMemoryAllocateInfo.memoryTypeIndex);
-		mVertexConstantBufferMemory = mDevice->allocateMemoryUnique(vertexConstantMemoryAllocateInfo);
-		mDevice->bindBufferMemory(mVertexConstantBuffer.get(), mVertexConstantBufferMemory.get(), 0);
-	}
-
-	//PixelConstant
-	{
-		auto const pixelConstantBufferInfo = vk::BufferCreateInfo().setSize(sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantI) + sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantB) + sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantF)).setUsage(vk::BufferUsageFlagBits::eUniformBuffer | vk::BufferUsageFlagBits::eTransferDst);
-		mPixelConstantBuffer = mDevice->createBufferUnique(pixelConstantBufferInfo);
-		vk::MemoryRequirements pixelConstantMemoryRequirements;
-		mDevice->getBufferMemoryRequirements(mPixelConstantBuffer.get(), &pixelConstantMemoryRequirements);
-		auto pixelConstantMemoryAllocateInfo = vk::MemoryAllocateInfo().setAllocationSize(pixelConstantMemoryRequirements.size).setMemoryTypeIndex(0);
-		FindMemoryTypeFromProperties(pixelConstantMemoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &pixelConstantMemoryAllocateInfo.memoryTypeIndex);
-		mPixelConstantBufferMemory = mDevice->allocateMemoryUnique(pixelConstantMemoryAllocateInfo);
-		mDevice->bindBufferMemory(mPixelConstantBuffer.get(), mPixelConstantBufferMemory.get(), 0);
-	}
-
 	//Handle B and I with constants maybe
 
-	//Create Descriptor layout.
+	/*
+	Create Descriptor layouts.
+	The uniform blocks go in set 0 as dynamic buffers so a new copy in the uniform ring is just a different offset. The textures change all the time so they get set 1 to themselves.
+	*/
 	const uint32_t textureCount = 16;
 	{
-		const vk::DescriptorSetLayoutBinding layoutBindings[9] =
+		const vk::DescriptorSetLayoutBinding layoutBindings[8] =
 		{
 			vk::DescriptorSetLayoutBinding() /*Render State*/
 				.setBinding(0)
-				.setDescriptorType(vk::DescriptorType::eUniformBuffer)
+				.setDescriptorType(vk::DescriptorType::eUniformBufferDynamic)
 				.setDescriptorCount(1)
 				.setStageFlags(vk::ShaderStageFlagBits::eAllGraphics)
 				.setPImmutableSamplers(nullptr),
 			vk::DescriptorSetLayoutBinding() /*Lights*/
 				.setBinding(1)
-				.setDescriptorType(vk::DescriptorType::eUniformBuffer)
+				.setDescriptorType(vk::DescriptorType::eUniformBufferDynamic)
 				.setDescriptorCount(1)
 				.setStageFlags(vk::ShaderStageFlagBits::eVertex)
 				.setPImmutableSamplers(nullptr),
 			vk::DescriptorSetLayoutBinding() /*Light Enable*/
 				.setBinding(2)
-				.setDescriptorType(vk::DescriptorType::eUniformBuffer)
+				.setDescriptorType(vk::DescriptorType::eUniformBufferDynamic)
 				.setDescriptorCount(1)
 				.setStageFlags(vk::ShaderStageFlagBits::eVertex)
 				.setPImmutableSamplers(nullptr),
 			vk::DescriptorSetLayoutBinding() /*Material*/
 				.setBinding(3)
-				.setDescriptorType(vk::DescriptorType::eUniformBuffer)
+				.setDescriptorType(vk::DescriptorType::eUniformBufferDynamic)
 				.setDescriptorCount(1)
 				.setStageFlags(vk::ShaderStageFlagBits::eVertex)
 				.setPImmutableSamplers(nullptr),
 			vk::DescriptorSetLayoutBinding() /*Matrix/Transformation*/
 				.setBinding(4)
-				.setDescriptorType(vk::DescriptorType::eUniformBuffer)
+				.setDescriptorType(vk::DescriptorType::eUniformBufferDynamic)
 				.setDescriptorCount(1)
 				.setStageFlags(vk::ShaderStageFlagBits::eVertex)
 				.setPImmutableSamplers(nullptr),
 			vk::DescriptorSetLayoutBinding() /*Texture Stages*/
 				.setBinding(5)
-				.setDescriptorType(vk::DescriptorType::eUniformBuffer)
+				.setDescriptorType(vk::DescriptorType::eUniformBufferDynamic)
 				.setDescriptorCount(1)
 				.setStageFlags(vk::ShaderStageFlagBits::eFragment)
 				.setPImmutableSamplers(nullptr),
-			vk::DescriptorSetLayoutBinding() /*Image/Sampler*/
-				.setBinding(6)
-				.setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
-				.setDescriptorCount(textureCount)
-				.setStageFlags(vk::ShaderStageFlagBits::eFragment)
-				.setPImmutableSamplers(nullptr),
 			vk::DescriptorSetLayoutBinding() /*Vertex Shader Const*/
 				.setBinding(7)
-				.setDescriptorType(vk::DescriptorType::eUniformBuffer)
+				.setDescriptorType(vk::DescriptorType::eUniformBufferDynamic)
 				.setDescriptorCount(1)
 				.setStageFlags(vk::ShaderStageFlagBits::eVertex)
 				.setPImmutableSamplers(nullptr),
 			vk::DescriptorSetLayoutBinding() /*Pixel Shader Const*/
 				.setBinding(8)
-				.setDescriptorType(vk::DescriptorType::eUniformBuffer)
+				.setDescriptorType(vk::DescriptorType::eUniformBufferDynamic)
 				.setDescriptorCount(1)
 				.setStageFlags(vk::ShaderStageFlagBits::eFragment)
 				.setPImmutableSamplers(nullptr),
 		};
-		auto const descriptorLayout = vk::DescriptorSetLayoutCreateInfo().setBindingCount(9).setPBindings(layoutBindings);
+		auto const descriptorLayout = vk::DescriptorSetLayoutCreateInfo().setBindingCount(8).setPBindings(layoutBindings);
 		mDescriptorLayout = mDevice->createDescriptorSetLayoutUnique(descriptorLayout);
 	}
 
+	{
+		const vk::DescriptorSetLayoutBinding layoutBinding = vk::DescriptorSetLayoutBinding() /*Image/Sampler*/
+			.setBinding(0)
+			.setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+			.setDescriptorCount(textureCount)
+			.setStageFlags(vk::ShaderStageFlagBits::eFragment)
+			.setPImmutableSamplers(nullptr);
+
+		auto textureDescriptorLayout = vk::DescriptorSetLayoutCreateInfo().setBindingCount(1).setPBindings(&layoutBinding);
+#ifdef VK_KHR_push_descriptor
+		if (mPushDescriptors)
+		{
+			textureDescriptorLayout.setFlags(vk::DescriptorSetLayoutCreateFlagBits::ePushDescriptorKHR);
+		}
+#endif
+		mTextureDescriptorLayout = mDevice->createDescriptorSetLayoutUnique(textureDescriptorLayout);
+	}
+
+#ifdef VK_EXT_descriptor_indexing
+	//The bindless array stands in for the texture set in fixed function pipelines. There is only ever one of it and entries are written as textures show up.
+	mBindlessTextureSlots.clear();
+	mBindlessFreeSlots.clear();
+	for (auto& releasedSlots : mBindlessReleasedSlots)
+	{
+		releasedSlots.clear();
+	}
+	mBindlessNextSlot = 0;
+
+	if (mBindlessTextures)
+	{
+		const vk::DescriptorBindingFlagsEXT bindingFlags = vk::DescriptorBindingFlagBitsEXT::ePartiallyBound | vk::DescriptorBindingFlagBitsEXT::eUpdateAfterBind | vk::DescriptorBindingFlagBitsEXT::eUpdateUnusedWhilePending;
+		auto const bindingFlagsInfo = vk::DescriptorSetLayoutBindingFlagsCreateInfoEXT().setBindingCount(1).setPBindingFlags(&bindingFlags);
+
+		const vk::DescriptorSetLayoutBinding layoutBinding = vk::DescriptorSetLayoutBinding() /*Image/Sampler*/
+			.setBinding(0)
+			.setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+			.setDescriptorCount(mBindlessTextureCount)
+			.setStageFlags(vk::ShaderStageFlagBits::eFragment)
+			.setPImmutableSamplers(nullptr);
+
+		auto const bindlessDescriptorLayout = vk::DescriptorSetLayoutCreateInfo()
+			.setPNext(&bindingFlagsInfo)
+			.setFlags(vk::DescriptorSetLayoutCreateFlagBits::eUpdateAfterBindPoolEXT)
+			.setBindingCount(1)
+			.setPBindings(&layoutBinding);
+		mBindlessDescriptorLayout = mDevice->createDescriptorSetLayoutUnique(bindlessDescriptorLayout);
+
+		const vk::DescriptorPoolSize descriptorPoolSize(vk::DescriptorType::eCombinedImageSampler, mBindlessTextureCount);
+		mBindlessDescriptorPool = mDevice->createDescriptorPoolUnique(vk::DescriptorPoolCreateInfo(vk::DescriptorPoolCreateFlagBits::eUpdateAfterBindEXT, 1, 1, &descriptorPoolSize));
+
+		vk::DescriptorSetAllocateInfo descriptorSetInfo(mBindlessDescriptorPool.get(), 1, &mBindlessDescriptorLayout.get());
+		vk::Result result = mDevice->allocateDescriptorSets(&descriptorSetInfo, &mBindlessDescriptorSet);
+		if (result != vk::Result::eSuccess)
+		{
+			Log(fatal) << "CDevice9::ResetVulkanDevice vkAllocateDescriptorSets failed for the bindless textures with return code of " << result << std::endl;
+		}
+	}
+#endif
+
 	//Setup descriptor write structures
 	{
 		//Render State
-		mDescriptorBufferInfo[0].buffer = mRenderStateBuffer.get();
-		mDescriptorBufferInfo[0].offset = 0;
-		mDescriptorBufferInfo[0].range = sizeof(mInternalDeviceState.mDeviceState.mRenderState);
+		mDescriptorUpdateData.mBufferInfo[0].offset = 0;
+		mDescriptorUpdateData.mBufferInfo[0].range = sizeof(mInternalDeviceState.mDeviceState.mRenderState);
 
 		mWriteDescriptorSet[0].dstBinding = 0;
 		mWriteDescriptorSet[0].dstArrayElement = 0;
-		mWriteDescriptorSet[0].descriptorType = vk::DescriptorType::eUniformBuffer;
+		mWriteDescriptorSet[0].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
 		mWriteDescriptorSet[0].descriptorCount = 1;
-		mWriteDescriptorSet[0].pBufferInfo = &mDescriptorBufferInfo[0];
+		mWriteDescriptorSet[0].pBufferInfo = &mDescriptorUpdateData.mBufferInfo[0];
 
 		//Lights
-		mDescriptorBufferInfo[1].buffer = mLightBuffer.get();
-		mDescriptorBufferInfo[1].offset = 0;
-		mDescriptorBufferInfo[1].range = sizeof(PaddedLight) * 8;
+		mDescriptorUpdateData.mBufferInfo[1].offset = 0;
+		mDescriptorUpdateData.mBufferInfo[1].range = sizeof(PaddedLight) * 8;
 
 		mWriteDescriptorSet[1].dstBinding = 1;
 		mWriteDescriptorSet[1].dstArrayElement = 0;
-		mWriteDescriptorSet[1].descriptorType = vk::DescriptorType::eUniformBuffer;
+		mWriteDescriptorSet[1].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
 		mWriteDescriptorSet[1].descriptorCount = 1;
-		mWriteDescriptorSet[1].pBufferInfo = &mDescriptorBufferInfo[1];
+		mWriteDescriptorSet[1].pBufferInfo = &mDescriptorUpdateData.mBufferInfo[1];
 
 		//Light Enable
-		mDescriptorBufferInfo[2].buffer = mLightEnableBuffer.get();
-		mDescriptorBufferInfo[2].offset = 0;
-		mDescriptorBufferInfo[2].range = sizeof(mInternalDeviceState.mDeviceState.mLightEnableState) * 4;
+		mDescriptorUpdateData.mBufferInfo[2].offset = 0;
+		mDescriptorUpdateData.mBufferInfo[2].range = sizeof(mInternalDeviceState.mDeviceState.mLightEnableState) * 4;
 
 		mWriteDescriptorSet[2].dstBinding = 2;
 		mWriteDescriptorSet[2].dstArrayElement = 0;
-		mWriteDescriptorSet[2].descriptorType = vk::DescriptorType::eUniformBuffer;
+		mWriteDescriptorSet[2].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
 		mWriteDescriptorSet[2].descriptorCount = 1;
-		mWriteDescriptorSet[2].pBufferInfo = &mDescriptorBufferInfo[2];
+		mWriteDescriptorSet[2].pBufferInfo = &mDescriptorUpdateData.mBufferInfo[2];
 
 		//Material
-		mDescriptorBufferInfo[3].buffer = mMaterialBuffer.get();
-		mDescriptorBufferInfo[3].offset = 0;
-		mDescriptorBufferInfo[3].range = sizeof(mInternalDeviceState.mDeviceState.mMaterial);
+		mDescriptorUpdateData.mBufferInfo[3].offset = 0;
+		mDescriptorUpdateData.mBufferInfo[3].range = sizeof(mInternalDeviceState.mDeviceState.mMaterial);
 
 		mWriteDescriptorSet[3].dstBinding = 3;
 		mWriteDescriptorSet[3].dstArrayElement = 0;
-		mWriteDescriptorSet[3].descriptorType = vk::DescriptorType::eUniformBuffer;
+		mWriteDescriptorSet[3].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
 		mWriteDescriptorSet[3].descriptorCount = 1;
-		mWriteDescriptorSet[3].pBufferInfo = &mDescriptorBufferInfo[3];
+		mWriteDescriptorSet[3].pBufferInfo = &mDescriptorUpdateData.mBufferInfo[3];
 
 		//Transformation
-		mDescriptorBufferInfo[4].buffer = mTransformationBuffer.get();
-		mDescriptorBufferInfo[4].offset = 0;
-		mDescriptorBufferInfo[4].range = sizeof(mInternalDeviceState.mDeviceState.mTransform);
+		mDescriptorUpdateData.mBufferInfo[4].offset = 0;
+		mDescriptorUpdateData.mBufferInfo[4].range = sizeof(D3DMATRIX) * PACKED_TRANSFORM_COUNT;
 
 		mWriteDescriptorSet[4].dstBinding = 4;
 		mWriteDescriptorSet[4].dstArrayElement = 0;
-		mWriteDescriptorSet[4].descriptorType = vk::DescriptorType::eUniformBuffer;
+		mWriteDescriptorSet[4].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
 		mWriteDescriptorSet[4].descriptorCount = 1;
-		mWriteDescriptorSet[4].pBufferInfo = &mDescriptorBufferInfo[4];
+		mWriteDescriptorSet[4].pBufferInfo = &mDescriptorUpdateData.mBufferInfo[4];
 
 		//Texture Stages
-		mDescriptorBufferInfo[5].buffer = mTextureStageBuffer.get();
-		mDescriptorBufferInfo[5].offset = 0;
-		mDescriptorBufferInfo[5].range = sizeof(PaddedTextureStage) * 16;
+		mDescriptorUpdateData.mBufferInfo[5].offset = 0;
+		mDescriptorUpdateData.mBufferInfo[5].range = sizeof(PaddedTextureStage) * 16;
 
 		mWriteDescriptorSet[5].dstBinding = 5;
 		mWriteDescriptorSet[5].dstArrayElement = 0;
-		mWriteDescriptorSet[5].descriptorType = vk::DescriptorType::eUniformBuffer;
+		mWriteDescriptorSet[5].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
 		mWriteDescriptorSet[5].descriptorCount = 1;
-		mWriteDescriptorSet[5].pBufferInfo = &mDescriptorBufferInfo[5];
+		mWriteDescriptorSet[5].pBufferInfo = &mDescriptorUpdateData.mBufferInfo[5];
 
 		//Image/Sampler
 		//for (int32_t i = 0; i < textureCount; i++)
 		//{
-		//	//mDescriptorImageInfo[i].sampler = mSampler;
-		//	//mDescriptorImageInfo[i].imageView = mImageView;
-		//	mDescriptorImageInfo[i].imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+		//	//mDescriptorUpdateData.mImageInfo[i].sampler = mSampler;
+		//	//mDescriptorUpdateData.mImageInfo[i].imageView = mImageView;
+		//	mDescriptorUpdateData.mImageInfo[i].imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
 		//}
 
-		mWriteDescriptorSet[6].dstBinding = 6;
+		mWriteDescriptorSet[6].dstBinding = 0; //This one is in the texture set.
 		mWriteDescriptorSet[6].dstArrayElement = 0;
 		mWriteDescriptorSet[6].descriptorType = vk::DescriptorType::eCombinedImageSampler;
 		mWriteDescriptorSet[6].descriptorCount = textureCount;
-		mWriteDescriptorSet[6].pImageInfo = mDescriptorImageInfo;
+		mWriteDescriptorSet[6].pImageInfo = mDescriptorUpdateData.mImageInfo;
 
 		//Vertex Shader Const
-		mDescriptorBufferInfo[7].buffer = mVertexConstantBuffer.get();
-		mDescriptorBufferInfo[7].offset = 0;
-		mDescriptorBufferInfo[7].range = sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantI) + sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantB) + sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantF);
+		mDescriptorUpdateData.mBufferInfo[7].offset = 0;
+		mDescriptorUpdateData.mBufferInfo[7].range = sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantI) + sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantB) + sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantF);
 
 		mWriteDescriptorSet[7].dstBinding = 7;
 		mWriteDescriptorSet[7].dstArrayElement = 0;
-		mWriteDescriptorSet[7].descriptorType = vk::DescriptorType::eUniformBuffer;
+		mWriteDescriptorSet[7].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
 		mWriteDescriptorSet[7].descriptorCount = 1;
-		mWriteDescriptorSet[7].pBufferInfo = &mDescriptorBufferInfo[7];
+		mWriteDescriptorSet[7].pBufferInfo = &mDescriptorUpdateData.mBufferInfo[7];
 
 		//Pixel Shader Const
-		mDescriptorBufferInfo[8].buffer = mPixelConstantBuffer.get();
-		mDescriptorBufferInfo[8].offset = 0;
-		mDescriptorBufferInfo[8].range = sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantI) + sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantB) + sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantF);
+		mDescriptorUpdateData.mBufferInfo[8].offset = 0;
+		mDescriptorUpdateData.mBufferInfo[8].range = sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantI) + sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantB) + sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantF);
 
 		mWriteDescriptorSet[8].dstBinding = 8;
 		mWriteDescriptorSet[8].dstArrayElement = 0;
-		mWriteDescriptorSet[8].descriptorType = vk::DescriptorType::eUniformBuffer;
+		mWriteDescriptorSet[8].descriptorType = vk::DescriptorType::eUniformBufferDynamic;
 		mWriteDescriptorSet[8].descriptorCount = 1;
-		mWriteDescriptorSet[8].pBufferInfo = &mDescriptorBufferInfo[8];
+		mWriteDescriptorSet[8].pBufferInfo = &mDescriptorUpdateData.mBufferInfo[8];
+
+		//The buffer and set are filled in per chunk of the uniform ring. Each block takes up its range rounded up to the offset alignment.
+		mUniformBufferAlignment = std::max(mC9->mPhysicalDeviceProperties.limits.minUniformBufferOffsetAlignment, (vk::DeviceSize)16);
+		const uint32_t bufferInfoIndices[UNIFORM_BLOCK_COUNT] = { 0, 1, 2, 3, 4, 5, 7, 8 };
+		for (uint32_t i = 0; i < UNIFORM_BLOCK_COUNT; i++)
+		{
+			const vk::DeviceSize range = mDescriptorUpdateData.mBufferInfo[bufferInfoIndices[i]].range;
+			mUniformBlockSizes[i] = static_cast<uint32_t>((range + mUniformBufferAlignment - 1) & ~(mUniformBufferAlignment - 1));
+		}
 	}
 
 	//Create Pipeline layout.
 	{
-		std::array<vk::PushConstantRange, 1> ranges =
+		std::array<vk::PushConstantRange, 2> ranges =
 		{
-			vk::PushConstantRange
+			vk::PushConstantRange /*MVP*/
 			{
 				vk::ShaderStageFlagBits::eVertex,
-				0,
-				sizeof(uint32_t) * 4
+				MVP_PUSH_CONSTANT_OFFSET,
+				sizeof(D3DMATRIX)
+			},
+			vk::PushConstantRange /*Alpha reference and bindless texture indices*/
+			{
+				vk::ShaderStageFlagBits::eFragment,
+				ALPHA_REFERENCE_PUSH_CONSTANT_OFFSET,
+				(TEXTURE_INDEX_PUSH_CONSTANT_OFFSET - ALPHA_REFERENCE_PUSH_CONSTANT_OFFSET) + sizeof(BoundCommandBufferState::mTextureIndices)
 			}
 		};
 
-		//TODO: look into optimizations using push constants and specialization constants.
+		//112 bytes in all which is under the 128 every device has to support.
 
-		auto const pipelineLayoutCreateInfo = vk::PipelineLayoutCreateInfo()
-			.setSetLayoutCount(1)
+		vk::DescriptorSetLayout setLayouts[2] = { mDescriptorLayout.get(), mTextureDescriptorLayout.get() };
+
+		auto pipelineLayoutCreateInfo = vk::PipelineLayoutCreateInfo()
+			.setSetLayoutCount(2)
 			.setPPushConstantRanges(ranges.data())
-			.setPushConstantRangeCount(1)
-			.setPSetLayouts(&mDescriptorLayout.get());
+			.setPushConstantRangeCount((uint32_t)ranges.size())
+			.setPSetLayouts(setLayouts);
 		mPipelineLayout = mDevice->createPipelineLayoutUnique(pipelineLayoutCreateInfo);
+
+		//Fixed function pipelines get the bindless array in place of the texture set. Everything else matches so set 0 and push constants carry over between the two.
+		if (mBindlessTextures)
+		{
+			setLayouts[1] = mBindlessDescriptorLayout.get();
+			mBindlessPipelineLayout = mDevice->createPipelineLayoutUnique(pipelineLayoutCreateInfo);
+		}
+	}
+
+	//Create a descriptor update template so the texture set is written from mDescriptorUpdateData in one call.
+	{
+		auto const templateEntry = vk::DescriptorUpdateTemplateEntry()
+			.setDstBinding(0)
+			.setDstArrayElement(0)
+			.setDescriptorCount(textureCount)
+			.setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+			.setOffset(offsetof(DescriptorUpdateData, mImageInfo))
+			.setStride(sizeof(vk::DescriptorImageInfo));
+
+		auto templateCreateInfo = vk::DescriptorUpdateTemplateCreateInfo()
+			.setDescriptorUpdateEntryCount(1)
+			.setPDescriptorUpdateEntries(&templateEntry)
+			.setTemplateType(vk::DescriptorUpdateTemplateType::eDescriptorSet)
+			.setDescriptorSetLayout(mTextureDescriptorLayout.get());
+#ifdef VK_KHR_push_descriptor
+		if (mPushDescriptors)
+		{
+			templateCreateInfo
+				.setTemplateType(vk::DescriptorUpdateTemplateType::ePushDescriptorsKHR)
+				.setPipelineBindPoint(vk::PipelineBindPoint::eGraphics)
+				.setPipelineLayout(mPipelineLayout.get())
+				.setSet(1);
+		}
+#endif
+		mDescriptorUpdateTemplate = mDevice->createDescriptorUpdateTemplateUnique(templateCreateInfo);
 	}
 
 	//Setup Pipeline Cache
 	{
-		vk::PipelineCacheCreateInfo const pipelineCacheInfo;
+		mPipelineCacheFile = mC9->mConfiguration["PipelineCacheFile"];
+		if (!mC9->mConfiguration["PipelineCacheSaveInterval"].empty())
+		{
+			mPipelineCacheSaveInterval = std::stoi(mC9->mConfiguration["PipelineCacheSaveInterval"]);
+		}
+
+		const std::vector<char> pipelineCacheData = LoadPipelineCache();
+
+		auto const pipelineCacheInfo = vk::PipelineCacheCreateInfo()
+			.setInitialDataSize(pipelineCacheData.size())
+			.setPInitialData(pipelineCacheData.data());
 		mPipelineCache = mDevice->createPipelineCacheUnique(pipelineCacheInfo);
+
+		mPipelineCountAtLastSave = 0;
+		mLastPipelineCacheSave = std::chrono::steady_clock::now();
+	}
+
+	//Setup Async Pipeline Compilation
+	if (!mC9->mConfiguration["AsyncPipelineCompile"].empty())
+	{
+		mAsyncPipelineCompile = std::stoi(mC9->mConfiguration["AsyncPipelineCompile"]);
+	}
+
+	if (!mC9->mConfiguration["AsyncPipelineFallback"].empty())
+	{
+		mAsyncPipelineFallback = std::stoi(mC9->mConfiguration["AsyncPipelineFallback"]);
+	}
+
+	if (mAsyncPipelineCompile && mPipelineCompileThreads.empty())
+	{
+		int32_t threadCount = 0;
+		if (!mC9->mConfiguration["AsyncPipelineThreads"].empty())
+		{
+			threadCount = std::stoi(mC9->mConfiguration["AsyncPipelineThreads"]);
+		}
+
+		//Leave room for the game's own threads by default.
+		if (threadCount <= 0)
+		{
+			threadCount = std::max(1, static_cast<int32_t>(std::thread::hardware_concurrency()) / 2);
+		}
+
+		StartPipelineCompileThreads(threadCount);
+	}
+
+	//Setup Pipeline Warm-up
+	mPipelineDatabaseFile = mC9->mConfiguration["PipelineDatabaseFile"];
+	if (!mC9->mConfiguration["PipelineWarmUp"].empty())
+	{
+		mPipelineWarmUp = std::stoi(mC9->mConfiguration["PipelineWarmUp"]);
+	}
+
+	if (!mLoadedPipelineDatabase)
+	{
+		LoadPipelineDatabase();
+		mLoadedPipelineDatabase = true;
+	}
+
+	//Setup Performance Stats
+	if (!mC9->mConfiguration["PerformanceStatsFile"].empty() && !mPerformanceStatsFile.is_open())
+	{
+		mPerformanceStatsFile.open(mC9->mConfiguration["PerformanceStatsFile"], std::ios::out | std::ios::trunc);
+		mPerformanceStats = mPerformanceStatsFile.is_open();
+		if (!mPerformanceStats)
+		{
+			Log(warning) << "CDevice9::ResetVulkanDevice unable to open performance stats file " << mC9->mConfiguration["PerformanceStatsFile"] << std::endl;
+		}
+		mFrameStart = std::chrono::steady_clock::now();
 	}
 
 	//Load fixed function shaders.
@@ -1485,11 +1896,15 @@ void CDevice9::ResetVulkanDevice()
 
 	mFragShaderModule_Passthrough = LoadShaderFromConst(PIXEL_PASSTHROUGH_FRAG);
 
+	//The fixed function shaders have to be loaded before we can rebuild any recorded pipelines.
+	WarmUpPipelines();
+
 	//Create Command Buffers, Fences, and semaphores
 	vk::SemaphoreCreateInfo semaphoreCreateInfo;
 	vk::FenceCreateInfo fenceCreateInfo(vk::FenceCreateFlagBits::eSignaled);
 
-	mDrawCommandBuffers = mDevice->allocateCommandBuffersUnique(vk::CommandBufferAllocateInfo(mCommandPool.get(), vk::CommandBufferLevel::ePrimary, 2));
+	//All of them are created so the depth can change between frames without touching the device.
+	mDrawCommandBuffers = mDevice->allocateCommandBuffersUnique(vk::CommandBufferAllocateInfo(mCommandPool.get(), vk::CommandBufferLevel::ePrimary, MAX_FRAMES_IN_FLIGHT));
 	for (int32_t i = 0; i < (int32_t)mDrawCommandBuffers.size(); i++)
 	{
 		mDrawFences.push_back(mDevice->createFenceUnique(fenceCreateInfo));
@@ -1497,6 +1912,22 @@ void CDevice9::ResetVulkanDevice()
 		mRenderFinishedSemaphores.push_back(mDevice->createSemaphoreUnique(semaphoreCreateInfo));
 	}
 
+	mSplitDrawCount = 0;
+	if (!mC9->mConfiguration["CommandBufferSplitDraws"].empty())
+	{
+		mSplitDrawCount = std::stoi(mC9->mConfiguration["CommandBufferSplitDraws"]);
+	}
+	mSplitTime = {};
+	if (!mC9->mConfiguration["CommandBufferSplitMicroseconds"].empty())
+	{
+		mSplitTime = std::chrono::microseconds(std::stoi(mC9->mConfiguration["CommandBufferSplitMicroseconds"]));
+	}
+
+	mFramesInFlight = GetConfiguredFramesInFlight();
+	mPendingFramesInFlight = mFramesInFlight;
+	mFrameIndex = 0;
+	Log(info) << "CDevice9::ResetVulkanDevice frames in flight " << mFramesInFlight << std::endl;
+
 	mUtilityCommandBuffers = mDevice->allocateCommandBuffersUnique(vk::CommandBufferAllocateInfo(mCommandPool.get(), vk::CommandBufferLevel::ePrimary, 7));
 	for (int32_t i = 0; i < (int32_t)mUtilityCommandBuffers.size(); i++)
 	{
@@ -1535,30 +1966,243 @@ void CDevice9::ResetVulkanDevice()
 	mBlankTexture->Clear(clearColorValue);
 }
 
-void CDevice9::BeginRecordingCommands()
+//Write to a temporary file and swap it in so a crash part way through can't leave a truncated file behind.
+static bool WriteFileAtomic(const std::string& filename, const void* header, size_t headerSize, const void* data, size_t dataSize)
 {
-	if (mIsRecording)
+	const std::string temporaryFile = filename + ".tmp";
 	{
-		return;
-	}
+		std::ofstream output(temporaryFile, std::ios::binary | std::ios::trunc);
+		output.write(reinterpret_cast<const char*>(header), headerSize);
+		output.write(reinterpret_cast<const char*>(data), dataSize);
+		output.flush();
 
-	mFrameIndex = (++mFrameIndex) % mDrawCommandBuffers.size();
-	mDescriptorSetIndex = 0;
+		if (!output)
+		{
+			Log(warning) << "WriteFileAtomic unable to write " << temporaryFile << std::endl;
+			return false;
+		}
+	}
 
-	mDevice->waitForFences(1, &mDrawFences[mFrameIndex].get(), VK_TRUE, UINT64_MAX);
-	mDevice->resetFences(1, &mDrawFences[mFrameIndex].get());
+	if (!MoveFileExA(temporaryFile.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		Log(warning) << "WriteFileAtomic unable to replace " << filename << " error " << GetLastError() << std::endl;
+		DeleteFileA(temporaryFile.c_str());
+		return false;
+	}
 
-	mPipelines[mFrameIndex].clear(); //I need to profile this to see what the cost of deleting all of these each frame is.
-	mLastPrimitiveType = D3DPT_FORCE_DWORD; //Force pipeline rebuild on first draw.
+	return true;
+}
 
-	mCurrentDrawCommandBuffer = mDrawCommandBuffers[mFrameIndex].get();
+std::vector<char> CDevice9::LoadPipelineCache()
+{
+	std::vector<char> data;
 
-	vk::CommandBufferBeginInfo beginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
-	mCurrentDrawCommandBuffer.begin(&beginInfo);
+	if (mPipelineCacheFile.empty())
+	{
+		return data;
+	}
 
-	//Set Scissor because we don't know if the user will set a new one this frame.
-	const vk::Rect2D scissor(vk::Offset2D(mInternalDeviceState.mDeviceState.mScissorRect.left, mInternalDeviceState.mDeviceState.mScissorRect.top), vk::Extent2D(mInternalDeviceState.mDeviceState.mScissorRect.right, mInternalDeviceState.mDeviceState.mScissorRect.bottom));
-	mCurrentDrawCommandBuffer.setScissor(0, 1, &scissor);
+	std::ifstream input(mPipelineCacheFile, std::ios::binary);
+	if (!input)
+	{
+		Log(info) << "CDevice9::LoadPipelineCache no pipeline cache found at " << mPipelineCacheFile << std::endl;
+		return data;
+	}
+
+	PipelineCacheFileHeader header = {};
+	if (!input.read(reinterpret_cast<char*>(&header), sizeof(PipelineCacheFileHeader)))
+	{
+		Log(warning) << "CDevice9::LoadPipelineCache unable to read header from " << mPipelineCacheFile << std::endl;
+		return data;
+	}
+
+	//A cache from another GPU or driver version is useless and may even crash some drivers so don't bother handing it over.
+	const auto& properties = mC9->mPhysicalDeviceProperties;
+	if (header.mMagic != PIPELINE_CACHE_MAGIC
+		|| header.mVersion != PIPELINE_CACHE_VERSION
+		|| header.mVendorID != properties.vendorID
+		|| header.mDeviceID != properties.deviceID
+		|| memcmp(header.mPipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+	{
+		Log(info) << "CDevice9::LoadPipelineCache ignoring stale pipeline cache " << mPipelineCacheFile << std::endl;
+		return data;
+	}
+
+	if (header.mDataSize > PIPELINE_CACHE_MAX_SIZE)
+	{
+		Log(warning) << "CDevice9::LoadPipelineCache pipeline cache is too large " << header.mDataSize << std::endl;
+		return data;
+	}
+
+	data.resize(static_cast<size_t>(header.mDataSize));
+	if (!input.read(data.data(), data.size()) || HashBytes(data.data(), data.size()) != header.mDataHash)
+	{
+		Log(warning) << "CDevice9::LoadPipelineCache pipeline cache is corrupt " << mPipelineCacheFile << std::endl;
+		data.clear();
+		return data;
+	}
+
+	Log(info) << "CDevice9::LoadPipelineCache loaded " << data.size() << " bytes from " << mPipelineCacheFile << std::endl;
+
+	return data;
+}
+
+void CDevice9::SavePipelineCache()
+{
+	mPipelineCountAtLastSave = mPipelines.size();
+	mLastPipelineCacheSave = std::chrono::steady_clock::now();
+
+	if (mPipelineCacheFile.empty() || !mPipelineCache)
+	{
+		return;
+	}
+
+	size_t size = 0;
+	vk::Result result = mDevice->getPipelineCacheData(mPipelineCache.get(), &size, nullptr);
+	if (result != vk::Result::eSuccess || size == 0)
+	{
+		Log(warning) << "CDevice9::SavePipelineCache vkGetPipelineCacheData failed with return code of " << result << std::endl;
+		return;
+	}
+
+	std::vector<char> data(size);
+	result = mDevice->getPipelineCacheData(mPipelineCache.get(), &size, data.data());
+	if (result != vk::Result::eSuccess)
+	{
+		Log(warning) << "CDevice9::SavePipelineCache vkGetPipelineCacheData failed with return code of " << result << std::endl;
+		return;
+	}
+	data.resize(size);
+
+	const auto& properties = mC9->mPhysicalDeviceProperties;
+	PipelineCacheFileHeader header = {};
+	header.mMagic = PIPELINE_CACHE_MAGIC;
+	header.mVersion = PIPELINE_CACHE_VERSION;
+	header.mVendorID = properties.vendorID;
+	header.mDeviceID = properties.deviceID;
+	memcpy(header.mPipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+	header.mDataSize = data.size();
+	header.mDataHash = HashBytes(data.data(), data.size());
+
+	if (WriteFileAtomic(mPipelineCacheFile, &header, sizeof(PipelineCacheFileHeader), data.data(), data.size()))
+	{
+		Log(info) << "CDevice9::SavePipelineCache saved " << data.size() << " bytes to " << mPipelineCacheFile << std::endl;
+	}
+}
+
+/*
+The conf file wins, then whatever the application asked for with SetMaximumFrameLatency, then the default.
+One frame keeps latency down and three keeps the GPU busy when the CPU side is uneven.
+*/
+uint32_t CDevice9::GetConfiguredFramesInFlight()
+{
+	uint32_t framesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
+
+	if (mMaxLatency)
+	{
+		framesInFlight = mMaxLatency;
+	}
+
+	if (!mC9->mConfiguration["FramesInFlight"].empty() && std::stoi(mC9->mConfiguration["FramesInFlight"]) > 0)
+	{
+		framesInFlight = std::stoi(mC9->mConfiguration["FramesInFlight"]);
+	}
+
+	return std::min(std::max(framesInFlight, 1u), (uint32_t)MAX_FRAMES_IN_FLIGHT);
+}
+
+void CDevice9::WaitForFrame(uint32_t frameIndex)
+{
+	const auto waitStart = std::chrono::steady_clock::now();
+	mDevice->waitForFences(1, &mDrawFences[frameIndex].get(), VK_TRUE, UINT64_MAX);
+	const auto waitTime = std::chrono::steady_clock::now() - waitStart;
+
+	mFenceWaitTime[frameIndex] += waitTime;
+	mFrameFenceWaitTime += waitTime;
+}
+
+//Only call this once the frame's fence has signaled.
+void CDevice9::ReleaseFrameResources(uint32_t frameIndex)
+{
+	mDescriptorSetCache[frameIndex].Clear(); //This frame's sets are about to be freed.
+
+	//The GPU is done with this frame so every texture set it used can go back in one go.
+	for (size_t i = 0; i <= mTextureDescriptorPoolIndex[frameIndex] && i < mTextureDescriptorPools[frameIndex].size(); i++)
+	{
+		mDevice->resetDescriptorPool(mTextureDescriptorPools[frameIndex][i].get());
+	}
+	mTextureDescriptorPoolIndex[frameIndex] = 0;
+	mTextureDescriptorSetCount[frameIndex] = 0;
+
+	//Same goes for bindless slots released while this frame was recorded.
+	mBindlessFreeSlots.insert(mBindlessFreeSlots.end(), mBindlessReleasedSlots[frameIndex].begin(), mBindlessReleasedSlots[frameIndex].end());
+	mBindlessReleasedSlots[frameIndex].clear();
+
+	//This frame's uniform ring is free again too.
+	mUniformRingChunkIndex[frameIndex] = 0;
+}
+
+void CDevice9::BeginRecordingCommands()
+{
+	if (mIsRecording)
+	{
+		return;
+	}
+
+	//A new depth only takes effect between frames. Frames that drop out of the rotation are finished here so nothing they hold is stranded.
+	const uint32_t pendingFramesInFlight = mPendingFramesInFlight;
+	if (pendingFramesInFlight != mFramesInFlight)
+	{
+		for (uint32_t i = pendingFramesInFlight; i < mFramesInFlight; i++)
+		{
+			WaitForFrame(i);
+			ReleaseFrameResources(i);
+		}
+
+		Log(info) << "CDevice9::BeginRecordingCommands frames in flight changed from " << mFramesInFlight << " to " << pendingFramesInFlight << std::endl;
+		mFramesInFlight = pendingFramesInFlight;
+	}
+
+	mFrameIndex = (mFrameIndex + 1) % mFramesInFlight;
+
+	WaitForFrame(mFrameIndex);
+	mDevice->resetFences(1, &mDrawFences[mFrameIndex].get());
+	ReleaseFrameResources(mFrameIndex);
+
+	mUniformRingOffset = 0; //Pieces after a split carry on from wherever the last one stopped.
+
+	//Save the pipeline cache every so often so we don't lose everything compiled this session if the game crashes.
+	if (mPipelineCacheSaveInterval > 0 && mPipelines.size() != mPipelineCountAtLastSave && (std::chrono::steady_clock::now() - mLastPipelineCacheSave) > std::chrono::seconds(mPipelineCacheSaveInterval))
+	{
+		SavePipelineCache();
+		SavePipelineDatabase();
+	}
+
+	mSplitIndex = 0;
+	BeginDrawCommandBuffer(mDrawCommandBuffers[mFrameIndex].get());
+
+	mIsRecording = true;
+}
+
+/*
+Starts a draw command buffer for the current frame, either the frame's first or the next piece after a split.
+Nothing bound on the previous command buffer carries over so everything the next draw needs is marked to be bound again.
+*/
+void CDevice9::BeginDrawCommandBuffer(vk::CommandBuffer commandBuffer)
+{
+	mInternalDeviceState.mDeviceState.mCapturedPipelineKey = true; //Force pipeline bind on first draw because this is a new command buffer.
+	mInternalDeviceState.mDeviceState.mCapturedDynamicRenderState = true;
+	mBoundPrimitiveType = (D3DPRIMITIVETYPE)0;
+	mBoundState = BoundCommandBufferState(); //Nothing is bound on a fresh command buffer.
+
+	mCurrentDrawCommandBuffer = commandBuffer;
+
+	vk::CommandBufferBeginInfo beginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+	mCurrentDrawCommandBuffer.begin(&beginInfo);
+
+	//Set Scissor because we don't know if the user will set a new one this frame.
+	const vk::Rect2D scissor(vk::Offset2D(mInternalDeviceState.mDeviceState.mScissorRect.left, mInternalDeviceState.mDeviceState.mScissorRect.top), vk::Extent2D(mInternalDeviceState.mDeviceState.mScissorRect.right, mInternalDeviceState.mDeviceState.mScissorRect.bottom));
+	mCurrentDrawCommandBuffer.setScissor(0, 1, &scissor);
 
 	//Set the view because we don't know if the user will set a new one this frame.
 	const auto viewport = vk::Viewport()
@@ -1586,16 +2230,61 @@ void CDevice9::BeginRecordingCommands()
 			0.0f);
 	}
 
-	//Bind the descriptor because we don't know if the user will set a new one this frame.
-	if (mLastDescriptorSet != vk::DescriptorSet())
-	{
-		mCurrentDrawCommandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, mPipelineLayout.get(), 0, 1, &mLastDescriptorSet, 0, nullptr);
-	}
+	//Set 0 goes first so binding it again later doesn't disturb the texture set.
+	mDirtyUniformBlocks = UNIFORM_BLOCK_ALL;
+	FlushUniformBlocks();
 
-	mIsRecording = true;
+	//Pushed descriptors don't carry over to a new command buffer and a set from another frame's pools can be reset while this one runs.
+	//Redoing the textures on the first draw finds or writes a set from this frame's own pools.
+	mInternalDeviceState.mDeviceState.mCapturedAnyTexture = true;
 
 	mInternalDeviceState.mDeviceState.mCapturedAnyStreamSource = true; //Mark vertex streams as dirty so next draw will reset them.
 	mInternalDeviceState.mDeviceState.mCapturedIndexBuffer = true; //Mark index as dirty so next draw will reset it.
+
+	mCommandBufferDraws = 0;
+	if (mSplitTime.count())
+	{
+		mCommandBufferStart = std::chrono::steady_clock::now();
+	}
+	mFrameCommandBuffers++;
+}
+
+/*
+Submits what has been recorded so far this frame so the GPU can start on it while the rest of the frame is recorded.
+The pieces are chained with semaphores so they run in order and only the last one waits on the swap chain image and signals the frame's fence.
+*/
+void CDevice9::SplitCommandBuffer()
+{
+	StopDraw(); //The render pass loads what's already there so the next piece can pick up where this one left off.
+	mCurrentDrawCommandBuffer.end();
+
+	auto& semaphores = mSplitSemaphores[mFrameIndex];
+	auto& commandBuffers = mSplitCommandBuffers[mFrameIndex];
+	if (mSplitIndex >= semaphores.size())
+	{
+		semaphores.push_back(mDevice->createSemaphoreUnique(vk::SemaphoreCreateInfo()));
+		auto newCommandBuffers = mDevice->allocateCommandBuffersUnique(vk::CommandBufferAllocateInfo(mCommandPool.get(), vk::CommandBufferLevel::ePrimary, 1));
+		commandBuffers.push_back(std::move(newCommandBuffers[0]));
+	}
+
+	vk::PipelineStageFlags waitStage = vk::PipelineStageFlagBits::eAllCommands;
+	vk::SubmitInfo submitInfo;
+	if (mSplitIndex > 0)
+	{
+		submitInfo.waitSemaphoreCount = 1;
+		submitInfo.pWaitSemaphores = &semaphores[mSplitIndex - 1].get();
+		submitInfo.pWaitDstStageMask = &waitStage;
+	}
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &mCurrentDrawCommandBuffer;
+	submitInfo.signalSemaphoreCount = 1;
+	submitInfo.pSignalSemaphores = &semaphores[mSplitIndex].get();
+	mQueue.submit(1, &submitInfo, vk::Fence());
+
+	BeginDrawCommandBuffer(commandBuffers[mSplitIndex].get());
+
+	mSplitIndex++;
+	mCommandBufferSplits++;
 }
 
 void CDevice9::StopRecordingCommands()
@@ -1607,10 +2296,17 @@ void CDevice9::StopRecordingCommands()
 
 	mCurrentDrawCommandBuffer.end();
 
-	vk::PipelineStageFlags pipelineFlag[] = { vk::PipelineStageFlagBits::eColorAttachmentOutput };
+	//If the frame was split this piece also has to wait for the one before it.
+	vk::Semaphore waitSemaphores[] = { mImageAvailableSemaphores[mFrameIndex].get(), vk::Semaphore() };
+	vk::PipelineStageFlags pipelineFlag[] = { vk::PipelineStageFlagBits::eColorAttachmentOutput, vk::PipelineStageFlagBits::eAllCommands };
 	vk::SubmitInfo submitInfo;
 	submitInfo.waitSemaphoreCount = 1;
-	submitInfo.pWaitSemaphores = &mImageAvailableSemaphores[mFrameIndex].get();
+	if (mSplitIndex > 0)
+	{
+		waitSemaphores[1] = mSplitSemaphores[mFrameIndex][mSplitIndex - 1].get();
+		submitInfo.waitSemaphoreCount = 2;
+	}
+	submitInfo.pWaitSemaphores = waitSemaphores;
 	submitInfo.pWaitDstStageMask = pipelineFlag;
 	submitInfo.commandBufferCount = 1;
 	submitInfo.pCommandBuffers = &mCurrentDrawCommandBuffer;
@@ -1618,479 +2314,1917 @@ void CDevice9::StopRecordingCommands()
 	submitInfo.pSignalSemaphores = &mRenderFinishedSemaphores[mFrameIndex].get();
 	mQueue.submit(1, &submitInfo, mDrawFences[mFrameIndex].get());
 
-	mIsRecording = false;
+	mIsRecording = false;
+}
+
+/*
+With a command stream running, calls made on the application thread are queued for the worker instead of running straight away.
+The worker replays them through the same methods so this is false there.
+*/
+bool CDevice9::QueueCommands() const
+{
+	return mCommandStream && !mCommandStream->IsWorkerThread();
+}
+
+/*
+Waits for the worker to run everything queued so far.
+Anything that touches Vulkan or the worker's state outside of a work item has to call this first.
+*/
+void CDevice9::SynchronizeCommandStream()
+{
+	if (mCommandStream)
+	{
+		mCommandStream->Synchronize();
+	}
+}
+
+/*
+Get* and state block captures have to see what the application set even when the worker hasn't got to it yet.
+*/
+DeviceState& CDevice9::GetApplicationDeviceState()
+{
+	return mCommandStream ? mApplicationDeviceState.mDeviceState : mInternalDeviceState.mDeviceState;
+}
+
+/*
+Sets a stream on the state draws are recorded from.
+The version of the buffer comes from whoever queued the call because the application can rename the buffer again before the worker gets here.
+*/
+void CDevice9::SetInternalStreamSource(UINT StreamNumber, IDirect3DVertexBuffer9* pStreamData, UINT OffsetInBytes, UINT Stride, vk::Buffer currentVertexBuffer)
+{
+	mInternalDeviceState.SetStreamSource(StreamNumber, pStreamData, OffsetInBytes, Stride);
+	mInternalDeviceState.mDeviceState.mStreamSource[StreamNumber].currentVertexBuffer = currentVertexBuffer;
+}
+
+void CDevice9::SetInternalIndices(IDirect3DIndexBuffer9* pIndexData, vk::Buffer currentIndexBuffer)
+{
+	mInternalDeviceState.SetIndices(pIndexData);
+	mInternalDeviceState.mDeviceState.mCurrentIndexBuffer = currentIndexBuffer;
+}
+
+/*
+If a lock has renamed a buffer since the last draw this returns the current version of every stream followed by the index buffer, otherwise null.
+Only call this on the application thread, the draw that gets these hands them to SetRenamedBuffers.
+*/
+const vk::Buffer* CDevice9::GetRenamedBuffers()
+{
+	if (!mBuffersRenamed)
+	{
+		return nullptr;
+	}
+	mBuffersRenamed = false;
+
+	auto& deviceState = GetApplicationDeviceState();
+	for (uint32_t i = 0; i < MAX_VERTEX_STREAMS; i++)
+	{
+		auto vertexBuffer = deviceState.mStreamSource[i].vertexBuffer;
+		mRenamedBuffers[i] = vertexBuffer ? vertexBuffer->mCurrentVertexBuffer : vk::Buffer();
+	}
+	mRenamedBuffers[MAX_VERTEX_STREAMS] = deviceState.mIndexBuffer ? deviceState.mIndexBuffer->mCurrentIndexBuffer : vk::Buffer();
+
+	return mRenamedBuffers.data();
+}
+
+void CDevice9::SetRenamedBuffers(const vk::Buffer* renamedBuffers)
+{
+	if (!renamedBuffers)
+	{
+		return;
+	}
+
+	auto& deviceState = mInternalDeviceState.mDeviceState;
+	for (uint32_t i = 0; i < MAX_VERTEX_STREAMS; i++)
+	{
+		if (deviceState.mStreamSource[i].currentVertexBuffer != renamedBuffers[i])
+		{
+			deviceState.mStreamSource[i].currentVertexBuffer = renamedBuffers[i];
+			deviceState.mCapturedAnyStreamSource = true;
+		}
+	}
+
+	if (deviceState.mCurrentIndexBuffer != renamedBuffers[MAX_VERTEX_STREAMS])
+	{
+		deviceState.mCurrentIndexBuffer = renamedBuffers[MAX_VERTEX_STREAMS];
+		deviceState.mCapturedIndexBuffer = true;
+	}
+}
+
+void CDevice9::BeginRecordingUtilityCommands()
+{
+	//Resources record their copies here from the application thread.
+	SynchronizeCommandStream();
+
+	mUtilityRecordingCount++;
+
+	if (mUtilityRecordingCount > 1)
+	{
+		return;
+	}
+
+	mUtilityIndex = (mUtilityIndex++) % mUtilityCommandBuffers.size();
+
+	mDevice->waitForFences(1, &mUtilityFences[mUtilityIndex].get(), VK_TRUE, UINT64_MAX);
+	mDevice->resetFences(1, &mUtilityFences[mUtilityIndex].get());
+
+	mCurrentUtilityCommandBuffer = mUtilityCommandBuffers[mUtilityIndex].get();
+
+	vk::CommandBufferBeginInfo beginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
+	mCurrentUtilityCommandBuffer.begin(&beginInfo);
+}
+
+void CDevice9::StopRecordingUtilityCommands()
+{
+	mUtilityRecordingCount--;
+
+	if (mUtilityRecordingCount > 0)
+	{
+		return;
+	}
+
+	mCurrentUtilityCommandBuffer.end();
+
+	vk::PipelineStageFlags pipelineFlag[] = { vk::PipelineStageFlagBits::eColorAttachmentOutput }; //eAllCommands
+	vk::SubmitInfo submitInfo;
+	submitInfo.pWaitDstStageMask = pipelineFlag;
+	submitInfo.commandBufferCount = 1;
+	submitInfo.pCommandBuffers = &mCurrentUtilityCommandBuffer;
+	mQueue.submit(1, &submitInfo, mUtilityFences[mUtilityIndex].get());
+
+	mUtilityRecordingCount = 0;
+}
+
+void CDevice9::CopyBuffer(vk::Buffer source, vk::Buffer destination, vk::DeviceSize size)
+{
+	BeginRecordingUtilityCommands();
+	{
+		auto const region = vk::BufferCopy().setSize(size);
+		mCurrentUtilityCommandBuffer.copyBuffer(source, destination, 1, &region);
+	}
+	StopRecordingUtilityCommands();
+}
+
+/*
+Builds a new pipeline for the given key. Render state comes from the key but the shader modules and vertex attributes come from the current device state.
+This is only called on a cache miss so it doesn't need to be fast.
+*/
+vk::UniquePipeline CDevice9::CreatePipeline(const PipelineKey& pipelineKey, CVertexDeclaration9* vertexDeclarationPointer, vk::ShaderModule vertexShader, vk::ShaderModule pixelShader, vk::RenderPass renderPass)
+{
+	auto& renderState = pipelineKey.mRenderState;
+	auto& vertexDeclaration = (*vertexDeclarationPointer); //If this is null we can't do anything anyway.
+
+	mPipelinesCreated++;
+
+	//At most vertex, geometry and fragment so keep these on the stack.
+	std::array<vk::PipelineShaderStageCreateInfo, 3> shaderStageInfo;
+	uint32_t shaderStageCount = 0;
+
+	if (vertexShader)
+	{
+		shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(vertexShader).setPName("main");
+
+
+		if (pixelShader)
+		{
+			shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(pixelShader).setPName("main");
+		}
+		else
+		{
+			shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_Passthrough.get()).setPName("main");
+		}
+	}
+	else
+	{
+		if (vertexDeclaration.mHasPosition && !vertexDeclaration.mHasNormal && !vertexDeclaration.mHasPSize && !vertexDeclaration.mHasColor1 && !vertexDeclaration.mHasColor2)
+		{
+			switch (vertexDeclaration.mTextureCount)
+			{
+			case 0:
+				if (vertexDeclaration.mIsTransformed)
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW.get()).setPName("main");
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ.get()).setPName("main");
+				}
+
+				if (renderState.mPointSpriteEnable)
+				{
+					Log(fatal) << "CDevice9::CreatePipeline point sprite not supported with hasPosition && !hasColor && !hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ.get()).setPName("main");
+				}
+				break;
+			case 1:
+				if (vertexDeclaration.mIsTransformed)
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW_TEX1.get()).setPName("main");
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_TEX1.get()).setPName("main");
+				}
+
+				if (renderState.mPointSpriteEnable)
+				{
+					Log(fatal) << "CDevice9::CreatePipeline point sprite not supported with hasPosition && !hasColor && !hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_TEX1.get()).setPName("main");
+				}
+				break;
+			case 2:
+				if (vertexDeclaration.mIsTransformed)
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW_TEX2.get()).setPName("main");
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_TEX2.get()).setPName("main");
+				}
+
+				if (renderState.mPointSpriteEnable)
+				{
+					Log(fatal) << "CDevice9::CreatePipeline point sprite not supported with hasPosition && !hasColor && !hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_TEX2.get()).setPName("main");
+				}
+				break;
+			default:
+				Log(fatal) << "CDevice9::CreatePipeline unsupported texture count " << vertexDeclaration.mTextureCount << std::endl;
+				break;
+			}
+		}
+		else if (vertexDeclaration.mHasPosition && !vertexDeclaration.mHasNormal && !vertexDeclaration.mHasPSize && vertexDeclaration.mHasColor1 && !vertexDeclaration.mHasColor2)
+		{
+			switch (vertexDeclaration.mTextureCount)
+			{
+			case 0:
+				if (vertexDeclaration.mIsTransformed)
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW_DIFFUSE.get()).setPName("main");
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_DIFFUSE.get()).setPName("main");
+				}
+
+				if (renderState.mPointSpriteEnable)
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eGeometry).setModule(mGeomShaderModule_XYZ_DIFFUSE.get()).setPName("main");
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_DIFFUSE_TEX1.get()).setPName("main");
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_DIFFUSE.get()).setPName("main");
+				}
+
+				break;
+			case 1:
+				if (vertexDeclaration.mIsTransformed)
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW_DIFFUSE_TEX1.get()).setPName("main");
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_DIFFUSE_TEX1.get()).setPName("main");
+				}
+
+				if (renderState.mPointSpriteEnable)
+				{
+					Log(fatal) << "CDevice9::CreatePipeline point sprite not supported with hasPosition && hasColor && !hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_DIFFUSE_TEX1.get()).setPName("main");
+				}
+				break;
+			case 2:
+				if (vertexDeclaration.mIsTransformed)
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW_DIFFUSE_TEX2.get()).setPName("main");
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_DIFFUSE_TEX2.get()).setPName("main");
+				}
+
+				if (renderState.mPointSpriteEnable)
+				{
+					Log(fatal) << "CDevice9::CreatePipeline point sprite not supported with hasPosition && hasColor && !hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_DIFFUSE_TEX2.get()).setPName("main");
+				}
+				break;
+			default:
+				Log(fatal) << "CDevice9::CreatePipeline unsupported texture count " << vertexDeclaration.mTextureCount << std::endl;
+				break;
+			}
+		}
+		else if (vertexDeclaration.mHasPosition && vertexDeclaration.mHasNormal && !vertexDeclaration.mHasPSize && vertexDeclaration.mHasColor1 && !vertexDeclaration.mHasColor2)
+		{
+			switch (vertexDeclaration.mTextureCount)
+			{
+			case 2:
+				shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2.get()).setPName("main");
+
+				if (renderState.mPointSpriteEnable)
+				{
+					Log(fatal) << "CDevice9::CreatePipeline point sprite not supported with hasPosition && hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2.get()).setPName("main");
+				}
+				break;
+			case 1:
+				shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX1.get()).setPName("main");
+				if (renderState.mPointSpriteEnable)
+				{
+					Log(fatal) << "CDevice9::CreatePipeline point sprite not supported with hasPosition && hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX1.get()).setPName("main");
+				}
+				break;
+			case 0:
+				shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL_DIFFUSE.get()).setPName("main");
+				if (renderState.mPointSpriteEnable)
+				{
+					Log(fatal) << "CDevice9::CreatePipeline point sprite not supported with hasPosition && hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL_DIFFUSE.get()).setPName("main");
+				}
+				break;
+			default:
+				Log(fatal) << "CDevice9::CreatePipeline unsupported texture count " << vertexDeclaration.mTextureCount << std::endl;
+				break;
+			}
+		}
+		else if (vertexDeclaration.mHasPosition  && vertexDeclaration.mHasNormal && !vertexDeclaration.mHasPSize && !vertexDeclaration.mHasColor1 && !vertexDeclaration.mHasColor2)
+		{
+			switch (vertexDeclaration.mTextureCount)
+			{
+			case 0:
+				shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL.get()).setPName("main");
+				if (renderState.mPointSpriteEnable)
+				{
+					Log(fatal) << "CDevice9::CreatePipeline point sprite not supported with hasPosition && !hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL.get()).setPName("main");
+				}
+				break;
+			case 1:
+				shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL_TEX1.get()).setPName("main");
+				if (renderState.mPointSpriteEnable)
+				{
+					Log(fatal) << "CDevice9::CreatePipeline point sprite not supported with hasPosition && !hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL_TEX1.get()).setPName("main");
+				}
+				break;
+			case 2:
+				shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL_TEX2.get()).setPName("main");
+				if (renderState.mPointSpriteEnable)
+				{
+					Log(fatal) << "CDevice9::CreatePipeline point sprite not supported with hasPosition && !hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
+				}
+				else
+				{
+					shaderStageInfo[shaderStageCount++] = vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL_TEX2.get()).setPName("main");
+				}
+				break;
+			default:
+				Log(fatal) << "CDevice9::CreatePipeline unsupported texture count " << vertexDeclaration.mTextureCount << std::endl;
+				break;
+			}
+		}
+		else
+		{
+			Log(fatal) << "CDevice9::CreatePipeline unsupported layout." << std::endl;
+			Log(fatal) << "CDevice9::CreatePipeline hasPosition = " << vertexDeclaration.mHasPosition << std::endl;
+			Log(fatal) << "CDevice9::CreatePipeline hasNormal = " << vertexDeclaration.mHasNormal << std::endl;
+			Log(fatal) << "CDevice9::CreatePipeline hasPSize = " << vertexDeclaration.mHasPSize << std::endl;
+			Log(fatal) << "CDevice9::CreatePipeline hasColor1 = " << vertexDeclaration.mHasColor1 << std::endl;
+			Log(fatal) << "CDevice9::CreatePipeline hasColor2 = " << vertexDeclaration.mHasColor2 << std::endl;
+			Log(fatal) << "CDevice9::CreatePipeline textureCount = " << vertexDeclaration.mTextureCount << std::endl;
+		}
+	}
+
+	std::array<vk::VertexInputBindingDescription, MAX_VERTEX_STREAMS> vertexInputBindingDescription;
+	uint32_t vertexInputBindingCount = 0;
+	for (int32_t i = 0; i < MAX_VERTEX_STREAMS; i++)
+	{
+		if (pipelineKey.mStreamMask & (1u << i))
+		{
+			auto inputRate = (pipelineKey.mInstanceMask & (1u << i)) ? vk::VertexInputRate::eInstance : vk::VertexInputRate::eVertex;
+			vertexInputBindingDescription[vertexInputBindingCount++] = vk::VertexInputBindingDescription(i, pipelineKey.mStreamStride[i], inputRate);
+		}
+	}
+
+	auto const vertexInputInfo = vk::PipelineVertexInputStateCreateInfo()
+		.setPVertexAttributeDescriptions(vertexDeclaration.mVertexInputAttributeDescription.data())
+		.setVertexAttributeDescriptionCount(vertexDeclaration.mVertexInputAttributeDescription.size())
+		.setPVertexBindingDescriptions(vertexInputBindingDescription.data())
+		.setVertexBindingDescriptionCount(vertexInputBindingCount);
+
+	auto const inputAssemblyInfo = vk::PipelineInputAssemblyStateCreateInfo().setTopology(ConvertPrimitiveType((D3DPRIMITIVETYPE)renderState.mPrimitiveType));
+	auto const viewportInfo = vk::PipelineViewportStateCreateInfo().setViewportCount(1).setScissorCount(1);
+	auto const rasterizationInfo = vk::PipelineRasterizationStateCreateInfo()
+		.setDepthClampEnable(VK_FALSE)
+		.setRasterizerDiscardEnable(VK_FALSE)
+		.setPolygonMode(ConvertFillMode((D3DFILLMODE)renderState.mFillMode))
+		.setCullMode(GetCullMode((D3DCULL)renderState.mCullMode))
+		.setFrontFace(GetFrontFace((D3DCULL)renderState.mCullMode))
+		.setDepthBiasEnable(VK_TRUE)
+		.setLineWidth(1.0f);
+
+	auto const multisampleInfo = vk::PipelineMultisampleStateCreateInfo();
+
+	auto const frontStencilOp = vk::StencilOpState()
+		.setReference(renderState.mStencilRef)
+		.setCompareMask(renderState.mStencilMask)
+		.setWriteMask(renderState.mStencilWriteMask)
+		.setFailOp(renderState.mCullMode != D3DCULL_CCW ? ConvertStencilOperation((D3DSTENCILOP)renderState.mCCWStencilFail) : ConvertStencilOperation((D3DSTENCILOP)renderState.mStencilFail))
+		.setPassOp(renderState.mCullMode != D3DCULL_CCW ? ConvertStencilOperation((D3DSTENCILOP)renderState.mCCWStencilPass) : ConvertStencilOperation((D3DSTENCILOP)renderState.mStencilPass))
+		.setCompareOp(renderState.mCullMode != D3DCULL_CCW ? ConvertCompareOperation((D3DCMPFUNC)renderState.mCCWStencilFunc) : ConvertCompareOperation((D3DCMPFUNC)renderState.mStencilFunc));
+	auto const backStencilOp = vk::StencilOpState()
+		.setReference(renderState.mStencilRef)
+		.setCompareMask(renderState.mStencilMask)
+		.setWriteMask(renderState.mStencilWriteMask)
+		.setFailOp(renderState.mCullMode == D3DCULL_CCW ? ConvertStencilOperation((D3DSTENCILOP)renderState.mCCWStencilFail) : ConvertStencilOperation((D3DSTENCILOP)renderState.mStencilFail))
+		.setPassOp(renderState.mCullMode == D3DCULL_CCW ? ConvertStencilOperation((D3DSTENCILOP)renderState.mCCWStencilPass) : ConvertStencilOperation((D3DSTENCILOP)renderState.mStencilPass))
+		.setCompareOp(renderState.mCullMode == D3DCULL_CCW ? ConvertCompareOperation((D3DCMPFUNC)renderState.mCCWStencilFunc) : ConvertCompareOperation((D3DCMPFUNC)renderState.mStencilFunc));
+	auto const depthStencilInfo = vk::PipelineDepthStencilStateCreateInfo()
+		.setDepthTestEnable(renderState.mZEnable)
+		.setDepthWriteEnable(renderState.mZWriteEnable)
+		.setDepthCompareOp(ConvertCompareOperation((D3DCMPFUNC)renderState.mZFunc))
+		.setDepthBoundsTestEnable(VK_FALSE)
+		.setStencilTestEnable(renderState.mStencilEnable)
+		.setFront(frontStencilOp)
+		.setBack(backStencilOp);
+
+	vk::PipelineColorBlendAttachmentState const colorBlendAttachments[1] =
+	{
+		vk::PipelineColorBlendAttachmentState()
+		.setColorWriteMask((vk::ColorComponentFlagBits)renderState.mColorWriteEnable)
+		.setBlendEnable(renderState.mAlphaBlendEnable)
+		.setColorBlendOp(ConvertColorOperation((D3DBLENDOP)renderState.mBlendOp))
+		.setSrcColorBlendFactor(ConvertColorFactor((D3DBLEND)renderState.mSrcBlend))
+		.setDstColorBlendFactor(ConvertColorFactor((D3DBLEND)renderState.mDestBlend))
+		.setAlphaBlendOp(ConvertColorOperation((D3DBLENDOP)renderState.mBlendOpAlpha))
+		.setSrcAlphaBlendFactor(ConvertColorFactor((D3DBLEND)renderState.mSrcBlendAlpha))
+		.setDstAlphaBlendFactor(ConvertColorFactor((D3DBLEND)renderState.mDestBlendAlpha))
+	};
+	auto const colorBlendInfo = vk::PipelineColorBlendStateCreateInfo().setAttachmentCount(1).setPAttachments(colorBlendAttachments);
+
+	vk::DynamicState dynamicStates[16] = { vk::DynamicState::eViewport, vk::DynamicState::eScissor, vk::DynamicState::eDepthBias };
+	uint32_t dynamicStateCount = 3;
+
+	if (renderState.mDynamicRenderState & DYNAMIC_RENDER_STATE_STENCIL)
+	{
+		dynamicStates[dynamicStateCount++] = vk::DynamicState::eStencilReference;
+		dynamicStates[dynamicStateCount++] = vk::DynamicState::eStencilCompareMask;
+		dynamicStates[dynamicStateCount++] = vk::DynamicState::eStencilWriteMask;
+	}
+
+#ifdef VK_EXT_extended_dynamic_state
+	if (renderState.mDynamicRenderState & DYNAMIC_RENDER_STATE_EXTENDED)
+	{
+		dynamicStates[dynamicStateCount++] = vk::DynamicState::eCullModeEXT;
+		dynamicStates[dynamicStateCount++] = vk::DynamicState::eFrontFaceEXT;
+		dynamicStates[dynamicStateCount++] = vk::DynamicState::ePrimitiveTopologyEXT;
+		dynamicStates[dynamicStateCount++] = vk::DynamicState::eDepthTestEnableEXT;
+		dynamicStates[dynamicStateCount++] = vk::DynamicState::eDepthWriteEnableEXT;
+		dynamicStates[dynamicStateCount++] = vk::DynamicState::eDepthCompareOpEXT;
+		dynamicStates[dynamicStateCount++] = vk::DynamicState::eStencilTestEnableEXT;
+		dynamicStates[dynamicStateCount++] = vk::DynamicState::eStencilOpEXT;
+	}
+#endif
+
+	auto const dynamicStateInfo = vk::PipelineDynamicStateCreateInfo().setPDynamicStates(dynamicStates).setDynamicStateCount(dynamicStateCount);
+
+	//Fixed function pipelines read their textures out of the bindless array when it's on.
+	const bool bindlessTextures = mBindlessTextures && !pixelShader;
+	if (bindlessTextures)
+	{
+		for (uint32_t i = 0; i < shaderStageCount; i++)
+		{
+			if (shaderStageInfo[i].stage == vk::ShaderStageFlagBits::eFragment)
+			{
+				shaderStageInfo[i].setPSpecializationInfo(&mBindlessSpecializationInfo);
+			}
+		}
+	}
+
+	auto const pipeline = vk::GraphicsPipelineCreateInfo()
+		.setStageCount(shaderStageCount)
+		.setPStages(shaderStageInfo.data())
+		.setPVertexInputState(&vertexInputInfo)
+		.setPInputAssemblyState(&inputAssemblyInfo)
+		.setPViewportState(&viewportInfo)
+		.setPRasterizationState(&rasterizationInfo)
+		.setPMultisampleState(&multisampleInfo)
+		.setPDepthStencilState(&depthStencilInfo)
+		.setPColorBlendState(&colorBlendInfo)
+		.setPDynamicState(&dynamicStateInfo)
+		.setLayout(bindlessTextures ? mBindlessPipelineLayout.get() : mPipelineLayout.get())
+		.setRenderPass(renderPass);
+
+#ifdef VK_EXT_graphics_pipeline_library
+	if (mPipelineLibrary)
+	{
+		auto linkedPipeline = LinkPipeline(pipelineKey, pipeline);
+		if (linkedPipeline)
+		{
+			return linkedPipeline;
+		}
+	}
+#endif
+
+	return mDevice->createGraphicsPipelineUnique(mPipelineCache.get(), pipeline);
+}
+
+/*
+Splits a full pipeline description into its four library parts, finds or compiles each one and then links them.
+Each part is keyed only on the state that goes into it so something like a blend change only compiles a new fragment output part.
+Returns a null pipeline if anything fails so the caller can fall back to a full compile.
+*/
+vk::UniquePipeline CDevice9::LinkPipeline(const PipelineKey& pipelineKey, const vk::GraphicsPipelineCreateInfo& pipelineInfo)
+{
+#ifdef VK_EXT_graphics_pipeline_library
+	const uint32_t dynamicRenderState = pipelineKey.mRenderState.mDynamicRenderState;
+	const VkPipelineLayout pipelineLayout = static_cast<VkPipelineLayout>(pipelineInfo.layout);
+	auto& vertexInputInfo = *pipelineInfo.pVertexInputState;
+	auto& rasterizationInfo = *pipelineInfo.pRasterizationState;
+	auto& depthStencilInfo = *pipelineInfo.pDepthStencilState;
+	auto& colorBlendInfo = *pipelineInfo.pColorBlendState;
+
+	//Vertex input interface
+	uint64_t vertexInputHash = HashBytes(&dynamicRenderState, sizeof(dynamicRenderState), (uint64_t)vk::GraphicsPipelineLibraryFlagBitsEXT::eVertexInputInterface);
+	vertexInputHash = HashBytes(vertexInputInfo.pVertexAttributeDescriptions, sizeof(vk::VertexInputAttributeDescription) * vertexInputInfo.vertexAttributeDescriptionCount, vertexInputHash);
+	vertexInputHash = HashBytes(vertexInputInfo.pVertexBindingDescriptions, sizeof(vk::VertexInputBindingDescription) * vertexInputInfo.vertexBindingDescriptionCount, vertexInputHash);
+	vertexInputHash = HashBytes(&pipelineInfo.pInputAssemblyState->topology, sizeof(vk::PrimitiveTopology), vertexInputHash);
+
+	//Pre-rasterization shaders and fragment shader. The module handles can be reused after a shader is released so the content hash goes in too.
+	vk::PipelineShaderStageCreateInfo preRasterizationStages[2];
+	uint32_t preRasterizationStageCount = 0;
+	vk::PipelineShaderStageCreateInfo fragmentStages[1];
+	uint32_t fragmentStageCount = 0;
+
+	uint64_t preRasterizationHash = HashBytes(&dynamicRenderState, sizeof(dynamicRenderState), (uint64_t)vk::GraphicsPipelineLibraryFlagBitsEXT::ePreRasterizationShaders);
+	preRasterizationHash = HashBytes(&pipelineKey.mVertexShaderHash, sizeof(pipelineKey.mVertexShaderHash), preRasterizationHash);
+	preRasterizationHash = HashBytes(&pipelineLayout, sizeof(pipelineLayout), preRasterizationHash);
+	preRasterizationHash = HashBytes(&pipelineKey.mRenderPassFormats, sizeof(pipelineKey.mRenderPassFormats), preRasterizationHash);
+	preRasterizationHash = HashBytes(&rasterizationInfo.polygonMode, sizeof(rasterizationInfo.polygonMode), preRasterizationHash);
+	preRasterizationHash = HashBytes(&rasterizationInfo.cullMode, sizeof(rasterizationInfo.cullMode), preRasterizationHash);
+	preRasterizationHash = HashBytes(&rasterizationInfo.frontFace, sizeof(rasterizationInfo.frontFace), preRasterizationHash);
+
+	uint64_t fragmentHash = HashBytes(&dynamicRenderState, sizeof(dynamicRenderState), (uint64_t)vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentShader);
+	fragmentHash = HashBytes(&pipelineKey.mPixelShaderHash, sizeof(pipelineKey.mPixelShaderHash), fragmentHash);
+	fragmentHash = HashBytes(&pipelineLayout, sizeof(pipelineLayout), fragmentHash);
+	fragmentHash = HashBytes(&pipelineKey.mRenderPassFormats, sizeof(pipelineKey.mRenderPassFormats), fragmentHash);
+	fragmentHash = HashBytes(&depthStencilInfo.depthTestEnable, sizeof(depthStencilInfo.depthTestEnable), fragmentHash);
+	fragmentHash = HashBytes(&depthStencilInfo.depthWriteEnable, sizeof(depthStencilInfo.depthWriteEnable), fragmentHash);
+	fragmentHash = HashBytes(&depthStencilInfo.depthCompareOp, sizeof(depthStencilInfo.depthCompareOp), fragmentHash);
+	fragmentHash = HashBytes(&depthStencilInfo.stencilTestEnable, sizeof(depthStencilInfo.stencilTestEnable), fragmentHash);
+	fragmentHash = HashBytes(&depthStencilInfo.front, sizeof(depthStencilInfo.front), fragmentHash);
+	fragmentHash = HashBytes(&depthStencilInfo.back, sizeof(depthStencilInfo.back), fragmentHash);
+
+	for (uint32_t i = 0; i < pipelineInfo.stageCount; i++)
+	{
+		auto& stage = pipelineInfo.pStages[i];
+		const VkShaderModule module = static_cast<VkShaderModule>(stage.module);
+		if (stage.stage == vk::ShaderStageFlagBits::eFragment)
+		{
+			fragmentStages[fragmentStageCount++] = stage;
+			fragmentHash = HashBytes(&module, sizeof(module), fragmentHash);
+		}
+		else
+		{
+			preRasterizationStages[preRasterizationStageCount++] = stage;
+			preRasterizationHash = HashBytes(&stage.stage, sizeof(stage.stage), preRasterizationHash);
+			preRasterizationHash = HashBytes(&module, sizeof(module), preRasterizationHash);
+		}
+	}
+
+	//Fragment output interface
+	uint64_t fragmentOutputHash = HashBytes(&dynamicRenderState, sizeof(dynamicRenderState), (uint64_t)vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentOutputInterface);
+	fragmentOutputHash = HashBytes(&pipelineKey.mRenderPassFormats, sizeof(pipelineKey.mRenderPassFormats), fragmentOutputHash);
+	fragmentOutputHash = HashBytes(colorBlendInfo.pAttachments, sizeof(vk::PipelineColorBlendAttachmentState) * colorBlendInfo.attachmentCount, fragmentOutputHash);
+
+	const vk::Pipeline libraries[4] =
+	{
+		GetPipelineLibrary(vertexInputHash, vk::GraphicsPipelineCreateInfo()
+			.setPVertexInputState(pipelineInfo.pVertexInputState)
+			.setPInputAssemblyState(pipelineInfo.pInputAssemblyState)
+			.setPDynamicState(pipelineInfo.pDynamicState),
+			(uint32_t)vk::GraphicsPipelineLibraryFlagBitsEXT::eVertexInputInterface),
+		GetPipelineLibrary(preRasterizationHash, vk::GraphicsPipelineCreateInfo()
+			.setStageCount(preRasterizationStageCount)
+			.setPStages(preRasterizationStages)
+			.setPViewportState(pipelineInfo.pViewportState)
+			.setPRasterizationState(pipelineInfo.pRasterizationState)
+			.setPDynamicState(pipelineInfo.pDynamicState)
+			.setLayout(pipelineInfo.layout)
+			.setRenderPass(pipelineInfo.renderPass),
+			(uint32_t)vk::GraphicsPipelineLibraryFlagBitsEXT::ePreRasterizationShaders),
+		GetPipelineLibrary(fragmentHash, vk::GraphicsPipelineCreateInfo()
+			.setStageCount(fragmentStageCount)
+			.setPStages(fragmentStages)
+			.setPDepthStencilState(pipelineInfo.pDepthStencilState)
+			.setPMultisampleState(pipelineInfo.pMultisampleState)
+			.setPDynamicState(pipelineInfo.pDynamicState)
+			.setLayout(pipelineInfo.layout)
+			.setRenderPass(pipelineInfo.renderPass),
+			(uint32_t)vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentShader),
+		GetPipelineLibrary(fragmentOutputHash, vk::GraphicsPipelineCreateInfo()
+			.setPColorBlendState(pipelineInfo.pColorBlendState)
+			.setPMultisampleState(pipelineInfo.pMultisampleState)
+			.setPDynamicState(pipelineInfo.pDynamicState)
+			.setRenderPass(pipelineInfo.renderPass),
+			(uint32_t)vk::GraphicsPipelineLibraryFlagBitsEXT::eFragmentOutputInterface)
+	};
+
+	for (auto& library : libraries)
+	{
+		if (!library)
+		{
+			return vk::UniquePipeline();
+		}
+	}
+
+	//No link time optimization flag so this is a fast link.
+	auto const libraryInfo = vk::PipelineLibraryCreateInfoKHR().setLibraryCount(4).setPLibraries(libraries);
+	auto const linkInfo = vk::GraphicsPipelineCreateInfo()
+		.setPNext(&libraryInfo)
+		.setLayout(pipelineInfo.layout)
+		.setRenderPass(pipelineInfo.renderPass);
+
+	vk::Pipeline pipeline;
+	vk::Result result = mDevice->createGraphicsPipelines(mPipelineCache.get(), 1, &linkInfo, nullptr, &pipeline);
+	if (result != vk::Result::eSuccess)
+	{
+		Log(warning) << "CDevice9::LinkPipeline vkCreateGraphicsPipelines failed with return code of " << result << std::endl;
+		return vk::UniquePipeline();
+	}
+
+	mPipelinesLinked++;
+	return vk::UniquePipeline(pipeline, mDevice.get());
+#else
+	return vk::UniquePipeline();
+#endif
+}
+
+/*
+Returns the library for the given part, compiling it if this is the first time it's been seen.
+This can be called from the compile threads so the lookup is locked but the compile isn't. If two threads race on the same part one of the results is thrown away.
+*/
+vk::Pipeline CDevice9::GetPipelineLibrary(uint64_t hash, vk::GraphicsPipelineCreateInfo pipelineInfo, uint32_t libraryFlags)
+{
+#ifdef VK_EXT_graphics_pipeline_library
+	{
+		std::lock_guard<std::mutex> lock(mPipelineLibraryMutex);
+		auto libraryIterator = mPipelineLibraries.find(hash);
+		if (libraryIterator != mPipelineLibraries.end())
+		{
+			return libraryIterator->second.get();
+		}
+	}
+
+	auto const libraryInfo = vk::GraphicsPipelineLibraryCreateInfoEXT().setFlags((vk::GraphicsPipelineLibraryFlagBitsEXT)libraryFlags);
+	pipelineInfo.setPNext(&libraryInfo).setFlags(vk::PipelineCreateFlagBits::eLibraryKHR);
+
+	vk::Pipeline library;
+	vk::Result result = mDevice->createGraphicsPipelines(mPipelineCache.get(), 1, &pipelineInfo, nullptr, &library);
+	if (result != vk::Result::eSuccess)
+	{
+		Log(warning) << "CDevice9::GetPipelineLibrary vkCreateGraphicsPipelines failed for library part " << libraryFlags << " with return code of " << result << std::endl;
+		return vk::Pipeline();
+	}
+
+	std::lock_guard<std::mutex> lock(mPipelineLibraryMutex);
+	return mPipelineLibraries.emplace(hash, vk::UniquePipeline(library, mDevice.get())).first->second.get();
+#else
+	return vk::Pipeline();
+#endif
+}
+
+void CDevice9::StartPipelineCompileThreads(int32_t threadCount)
+{
+	Log(info) << "CDevice9::StartPipelineCompileThreads starting " << threadCount << " pipeline compile threads." << std::endl;
+
+	mStopPipelineCompile = false;
+	for (int32_t i = 0; i < threadCount; i++)
+	{
+		mPipelineCompileThreads.emplace_back(&CDevice9::PipelineCompileThread, this);
+	}
+}
+
+void CDevice9::StopPipelineCompileThreads()
+{
+	if (mPipelineCompileThreads.empty())
+	{
+		return;
+	}
+
+	CancelPipelineCompiles();
+
+	{
+		std::lock_guard<std::mutex> lock(mPipelineCompileMutex);
+		mStopPipelineCompile = true;
+	}
+	mPipelineCompileCondition.notify_all();
+
+	for (auto& thread : mPipelineCompileThreads)
+	{
+		thread.join();
+	}
+	mPipelineCompileThreads.clear();
+}
+
+void CDevice9::PipelineCompileThread()
+{
+	std::unique_lock<std::mutex> lock(mPipelineCompileMutex);
+
+	while (true)
+	{
+		mPipelineCompileCondition.wait(lock, [this]() { return mStopPipelineCompile || !mPipelineCompileQueue.empty(); });
+
+		if (mStopPipelineCompile)
+		{
+			break;
+		}
+
+		PipelineCompileJob job = std::move(mPipelineCompileQueue.front());
+		mPipelineCompileQueue.pop_front();
+		mActivePipelineCompiles++;
+
+		//The pipeline cache is internally synchronized so the compile itself can run without the lock.
+		lock.unlock();
+		job.mPipeline = CreatePipeline(job.mPipelineKey, job.mVertexDeclaration, job.mVertexShaderModule, job.mPixelShaderModule, job.mRenderPass);
+		lock.lock();
+
+		mActivePipelineCompiles--;
+		mCompiledPipelines.push_back(std::move(job));
+		mHasCompiledPipelines = true;
+		mPipelineCompileIdleCondition.notify_all();
+	}
+}
+
+void CDevice9::QueuePipelineCompile(const PipelineKey& pipelineKey)
+{
+	auto& deviceState = mInternalDeviceState.mDeviceState;
+
+	//Hold a private reference so the game can release these while the worker is still using them.
+	PipelineCompileJob job;
+	job.mPipelineKey = pipelineKey;
+	job.mVertexDeclaration = deviceState.mVertexDeclaration;
+	job.mVertexShader = deviceState.mVertexShader;
+	job.mPixelShader = deviceState.mPixelShader;
+	job.mRenderPass = mCurrentRenderContainer->mRenderPass.get();
+
+	if (job.mVertexDeclaration != nullptr)
+	{
+		job.mVertexDeclaration->PrivateAddRef();
+	}
+
+	if (job.mVertexShader != nullptr)
+	{
+		job.mVertexShader->PrivateAddRef();
+		job.mVertexShaderModule = job.mVertexShader->mShader.get();
+	}
+
+	if (job.mPixelShader != nullptr)
+	{
+		job.mPixelShader->PrivateAddRef();
+		job.mPixelShaderModule = job.mPixelShader->mShader.get();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mPipelineCompileMutex);
+		mPipelineCompileQueue.push_back(std::move(job));
+	}
+	mPipelineCompileCondition.notify_one();
+}
+
+static void ReleasePipelineCompileJob(PipelineCompileJob& job)
+{
+	if (job.mVertexDeclaration != nullptr)
+	{
+		job.mVertexDeclaration->PrivateRelease();
+		job.mVertexDeclaration = nullptr;
+	}
+
+	if (job.mVertexShader != nullptr)
+	{
+		job.mVertexShader->PrivateRelease();
+		job.mVertexShader = nullptr;
+	}
+
+	if (job.mPixelShader != nullptr)
+	{
+		job.mPixelShader->PrivateRelease();
+		job.mPixelShader = nullptr;
+	}
+}
+
+void CDevice9::CancelPipelineCompiles()
+{
+	if (mPipelineCompileThreads.empty())
+	{
+		return;
+	}
+
+	//Drop anything that hasn't started and wait for the rest so nothing is left using the device.
+	std::deque<PipelineCompileJob> cancelledJobs;
+	{
+		std::unique_lock<std::mutex> lock(mPipelineCompileMutex);
+		cancelledJobs.swap(mPipelineCompileQueue);
+		mPipelineCompileIdleCondition.wait(lock, [this]() { return mActivePipelineCompiles == 0; });
+	}
+
+	for (auto& job : cancelledJobs)
+	{
+		ReleasePipelineCompileJob(job);
+	}
+
+	CollectCompiledPipelines();
+	mPendingPipelines.clear();
+	mBoundFallbackPipeline = false;
+}
+
+void CDevice9::CollectCompiledPipelines()
+{
+	if (!mHasCompiledPipelines)
+	{
+		return;
+	}
+
+	std::vector<PipelineCompileJob> compiledPipelines;
+	{
+		std::lock_guard<std::mutex> lock(mPipelineCompileMutex);
+		compiledPipelines.swap(mCompiledPipelines);
+		mHasCompiledPipelines = false;
+	}
+
+	for (auto& job : compiledPipelines)
+	{
+		mPendingPipelines.erase(job.mPipelineKey);
+		mPipelines.emplace(job.mPipelineKey, std::move(job.mPipeline));
+		ReleasePipelineCompileJob(job);
+		mPipelineCompilesCompleted++;
+	}
+}
+
+vk::Pipeline CDevice9::FindFallbackPipeline(const PipelineKey& pipelineKey)
+{
+	vk::Pipeline fallbackPipeline;
+	size_t fallbackDistance = SIZE_MAX;
+
+	uint32_t renderState[sizeof(PipelineRenderState) / sizeof(uint32_t)];
+	memcpy(renderState, &pipelineKey.mRenderState, sizeof(PipelineRenderState));
+
+	for (auto& pipeline : mPipelines)
+	{
+		auto& key = pipeline.first;
+
+		//Only fixed function state may differ. Anything touching the shader interface, topology or render pass can't be swapped.
+		if (key.mRenderPassFormats != pipelineKey.mRenderPassFormats
+			|| key.mVertexShaderHash != pipelineKey.mVertexShaderHash
+			|| key.mPixelShaderHash != pipelineKey.mPixelShaderHash
+			|| key.mVertexDeclarationHash != pipelineKey.mVertexDeclarationHash
+			|| key.mStreamMask != pipelineKey.mStreamMask
+			|| key.mInstanceMask != pipelineKey.mInstanceMask
+			|| key.mRenderState.mPrimitiveType != pipelineKey.mRenderState.mPrimitiveType
+			|| memcmp(key.mStreamStride, pipelineKey.mStreamStride, sizeof(pipelineKey.mStreamStride)) != 0)
+		{
+			continue;
+		}
+
+		//Closest means the fewest differing render state bits.
+		uint32_t otherRenderState[sizeof(PipelineRenderState) / sizeof(uint32_t)];
+		memcpy(otherRenderState, &key.mRenderState, sizeof(PipelineRenderState));
+
+		size_t distance = 0;
+		for (size_t i = 0; i < std::size(renderState); i++)
+		{
+			distance += std::bitset<32>(renderState[i] ^ otherRenderState[i]).count();
+		}
+
+		if (distance < fallbackDistance)
+		{
+			fallbackDistance = distance;
+			fallbackPipeline = pipeline.second.get();
+		}
+	}
+
+	return fallbackPipeline;
+}
+
+void CDevice9::RecordShader(uint64_t hash, const std::vector<uint32_t>& code)
+{
+	if (mPipelineDatabaseFile.empty())
+	{
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mRecordedShadersMutex);
+	mRecordedShaders.emplace(hash, code);
+}
+
+void CDevice9::RecordPipeline(const PipelineKey& pipelineKey)
+{
+	if (mPipelineDatabaseFile.empty() || !mRecordedPipelines.insert(pipelineKey).second)
+	{
+		return;
+	}
+
+	mPipelineDatabaseChanged = true;
+
+	auto vertexDeclaration = mInternalDeviceState.mDeviceState.mVertexDeclaration;
+	if (vertexDeclaration != nullptr && !mRecordedVertexDeclarations.count(vertexDeclaration->mHash))
+	{
+		auto& recordedVertexDeclaration = mRecordedVertexDeclarations[vertexDeclaration->mHash];
+		recordedVertexDeclaration.mFVF = vertexDeclaration->mFVF;
+		recordedVertexDeclaration.mVertexElements = vertexDeclaration->mVertexElements;
+	}
+}
+
+void CDevice9::LoadPipelineDatabase()
+{
+	if (mPipelineDatabaseFile.empty())
+	{
+		return;
+	}
+
+	std::ifstream input(mPipelineDatabaseFile, std::ios::binary);
+	if (!input)
+	{
+		Log(info) << "CDevice9::LoadPipelineDatabase no pipeline database found at " << mPipelineDatabaseFile << std::endl;
+		return;
+	}
+
+	PipelineDatabaseFileHeader header = {};
+	if (!input.read(reinterpret_cast<char*>(&header), sizeof(PipelineDatabaseFileHeader))
+		|| header.mMagic != PIPELINE_DATABASE_MAGIC
+		|| header.mVersion != PIPELINE_DATABASE_VERSION
+		|| header.mPipelineKeySize != sizeof(PipelineKey)
+		|| header.mDataSize > PIPELINE_CACHE_MAX_SIZE)
+	{
+		Log(info) << "CDevice9::LoadPipelineDatabase ignoring stale pipeline database " << mPipelineDatabaseFile << std::endl;
+		return;
+	}
+
+	std::vector<char> data(static_cast<size_t>(header.mDataSize));
+	if (!input.read(data.data(), data.size()) || HashBytes(data.data(), data.size()) != header.mDataHash)
+	{
+		Log(warning) << "CDevice9::LoadPipelineDatabase pipeline database is corrupt " << mPipelineDatabaseFile << std::endl;
+		return;
+	}
+
+	size_t position = 0;
+	auto read = [&](void* destination, size_t size) -> bool
+	{
+		if (size > data.size() - position)
+		{
+			return false;
+		}
+		memcpy(destination, data.data() + position, size);
+		position += size;
+		return true;
+	};
+
+	std::unordered_map<uint64_t, std::vector<uint32_t>> shaders;
+	std::unordered_map<uint64_t, RecordedVertexDeclaration> vertexDeclarations;
+	std::unordered_set<PipelineKey, PipelineKeyHasher> pipelines;
+	bool isValid = true;
+
+	for (uint32_t i = 0; isValid && i < header.mShaderCount; i++)
+	{
+		uint64_t hash = 0;
+		uint32_t wordCount = 0;
+		isValid = read(&hash, sizeof(uint64_t)) && read(&wordCount, sizeof(uint32_t)) && wordCount <= (data.size() - position) / sizeof(uint32_t);
+		if (isValid)
+		{
+			auto& code = shaders[hash];
+			code.resize(wordCount);
+			isValid = read(code.data(), wordCount * sizeof(uint32_t));
+		}
+	}
+
+	for (uint32_t i = 0; isValid && i < header.mVertexDeclarationCount; i++)
+	{
+		uint64_t hash = 0;
+		uint32_t elementCount = 0;
+		RecordedVertexDeclaration vertexDeclaration;
+		isValid = read(&hash, sizeof(uint64_t)) && read(&vertexDeclaration.mFVF, sizeof(DWORD)) && read(&elementCount, sizeof(uint32_t)) && elementCount <= (data.size() - position) / sizeof(D3DVERTEXELEMENT9);
+		if (isValid)
+		{
+			vertexDeclaration.mVertexElements.resize(elementCount);
+			isValid = read(vertexDeclaration.mVertexElements.data(), elementCount * sizeof(D3DVERTEXELEMENT9));
+			vertexDeclarations.emplace(hash, std::move(vertexDeclaration));
+		}
+	}
+
+	for (uint32_t i = 0; isValid && i < header.mPipelineCount; i++)
+	{
+		PipelineKey pipelineKey;
+		isValid = read(&pipelineKey, sizeof(PipelineKey));
+		if (isValid)
+		{
+			pipelines.insert(pipelineKey);
+		}
+	}
+
+	if (!isValid)
+	{
+		Log(warning) << "CDevice9::LoadPipelineDatabase pipeline database is corrupt " << mPipelineDatabaseFile << std::endl;
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mRecordedShadersMutex);
+		mRecordedShaders = std::move(shaders);
+	}
+	mRecordedVertexDeclarations = std::move(vertexDeclarations);
+	mRecordedPipelines = std::move(pipelines);
+
+	Log(info) << "CDevice9::LoadPipelineDatabase loaded " << mRecordedPipelines.size() << " pipelines from " << mPipelineDatabaseFile << std::endl;
+}
+
+void CDevice9::SavePipelineDatabase()
+{
+	if (mPipelineDatabaseFile.empty() || !mPipelineDatabaseChanged)
+	{
+		return;
+	}
+
+	mPipelineDatabaseChanged = false;
+
+	std::vector<char> data;
+	auto write = [&data](const void* source, size_t size)
+	{
+		data.insert(data.end(), reinterpret_cast<const char*>(source), reinterpret_cast<const char*>(source) + size);
+	};
+
+	//Only keep the shaders that a recorded pipeline actually uses so the database doesn't fill up with every shader the game ever loaded.
+	std::unordered_set<uint64_t> shaderHashes;
+	for (auto& pipelineKey : mRecordedPipelines)
+	{
+		shaderHashes.insert(pipelineKey.mVertexShaderHash);
+		shaderHashes.insert(pipelineKey.mPixelShaderHash);
+	}
+
+	PipelineDatabaseFileHeader header = {};
+	header.mMagic = PIPELINE_DATABASE_MAGIC;
+	header.mVersion = PIPELINE_DATABASE_VERSION;
+	header.mPipelineKeySize = sizeof(PipelineKey);
+
+	{
+		std::lock_guard<std::mutex> lock(mRecordedShadersMutex);
+		for (auto& shader : mRecordedShaders)
+		{
+			if (!shaderHashes.count(shader.first))
+			{
+				continue;
+			}
+
+			const uint32_t wordCount = static_cast<uint32_t>(shader.second.size());
+			write(&shader.first, sizeof(uint64_t));
+			write(&wordCount, sizeof(uint32_t));
+			write(shader.second.data(), wordCount * sizeof(uint32_t));
+			header.mShaderCount++;
+		}
+	}
+
+	for (auto& vertexDeclaration : mRecordedVertexDeclarations)
+	{
+		const uint32_t elementCount = static_cast<uint32_t>(vertexDeclaration.second.mVertexElements.size());
+		write(&vertexDeclaration.first, sizeof(uint64_t));
+		write(&vertexDeclaration.second.mFVF, sizeof(DWORD));
+		write(&elementCount, sizeof(uint32_t));
+		write(vertexDeclaration.second.mVertexElements.data(), elementCount * sizeof(D3DVERTEXELEMENT9));
+		header.mVertexDeclarationCount++;
+	}
+
+	for (auto& pipelineKey : mRecordedPipelines)
+	{
+		write(&pipelineKey, sizeof(PipelineKey));
+		header.mPipelineCount++;
+	}
+
+	header.mDataSize = data.size();
+	header.mDataHash = HashBytes(data.data(), data.size());
+
+	if (WriteFileAtomic(mPipelineDatabaseFile, &header, sizeof(PipelineDatabaseFileHeader), data.data(), data.size()))
+	{
+		Log(info) << "CDevice9::SavePipelineDatabase saved " << header.mPipelineCount << " pipelines to " << mPipelineDatabaseFile << std::endl;
+	}
+}
+
+void CDevice9::WarmUpPipelines()
+{
+	if (!mPipelineWarmUp || mRecordedPipelines.empty())
+	{
+		return;
+	}
+
+	const auto startTime = std::chrono::steady_clock::now();
+
+	std::unordered_map<uint64_t, vk::UniqueShaderModule> shaderModules;
+	std::unordered_map<uint64_t, std::unique_ptr<CVertexDeclaration9>> vertexDeclarations;
+	std::unordered_map<uint64_t, vk::UniqueRenderPass> renderPasses;
+	std::vector<PipelineCompileJob> jobs;
+	jobs.reserve(mRecordedPipelines.size());
+
+	//Returns false if the shader was never recorded which can happen if an older database was written before a converter change.
+	auto getShaderModule = [&](uint64_t hash, vk::ShaderModule& shaderModule) -> bool
+	{
+		if (!hash)
+		{
+			return true;
+		}
+
+		auto shaderModuleIterator = shaderModules.find(hash);
+		if (shaderModuleIterator == shaderModules.end())
+		{
+			std::lock_guard<std::mutex> lock(mRecordedShadersMutex);
+			auto shaderIterator = mRecordedShaders.find(hash);
+			if (shaderIterator == mRecordedShaders.end())
+			{
+				return false;
+			}
+
+			const vk::ShaderModuleCreateInfo moduleCreateInfo(vk::ShaderModuleCreateFlags(), shaderIterator->second.size() * sizeof(uint32_t), shaderIterator->second.data());
+			shaderModuleIterator = shaderModules.emplace(hash, mDevice->createShaderModuleUnique(moduleCreateInfo)).first;
+		}
+
+		shaderModule = shaderModuleIterator->second.get();
+		return true;
+	};
+
+	for (auto& pipelineKey : mRecordedPipelines)
+	{
+		//Keys recorded with a different set of dynamic state will never be looked up on this device.
+		if (mPipelines.count(pipelineKey) || pipelineKey.mRenderState.mDynamicRenderState != mDynamicRenderState)
+		{
+			continue;
+		}
+
+		PipelineCompileJob job;
+		job.mPipelineKey = pipelineKey;
+
+		auto vertexDeclarationIterator = vertexDeclarations.find(pipelineKey.mVertexDeclarationHash);
+		if (vertexDeclarationIterator == vertexDeclarations.end())
+		{
+			auto recordedIterator = mRecordedVertexDeclarations.find(pipelineKey.mVertexDeclarationHash);
+			if (recordedIterator == mRecordedVertexDeclarations.end())
+			{
+				continue;
+			}
+
+			auto& recordedVertexDeclaration = recordedIterator->second;
+			if (recordedVertexDeclaration.mFVF)
+			{
+				vertexDeclarationIterator = vertexDeclarations.emplace(pipelineKey.mVertexDeclarationHash, std::make_unique<CVertexDeclaration9>(this, recordedVertexDeclaration.mFVF)).first;
+			}
+			else
+			{
+				std::vector<D3DVERTEXELEMENT9> vertexElements = recordedVertexDeclaration.mVertexElements;
+				vertexElements.push_back(D3DDECL_END());
+				vertexDeclarationIterator = vertexDeclarations.emplace(pipelineKey.mVertexDeclarationHash, std::make_unique<CVertexDeclaration9>(this, vertexElements.data())).first;
+			}
+		}
+
+		//If the rebuilt declaration doesn't hash the same the layout code has changed since this was recorded.
+		if (vertexDeclarationIterator->second->mHash != pipelineKey.mVertexDeclarationHash)
+		{
+			continue;
+		}
+		job.mVertexDeclaration = vertexDeclarationIterator->second.get();
+
+		if (!getShaderModule(pipelineKey.mVertexShaderHash, job.mVertexShaderModule) || !getShaderModule(pipelineKey.mPixelShaderHash, job.mPixelShaderModule))
+		{
+			continue;
+		}
+
+		const uint64_t renderPassHash = HashBytes(&pipelineKey.mRenderPassFormats, sizeof(RenderPassFormats));
+		auto renderPassIterator = renderPasses.find(renderPassHash);
+		if (renderPassIterator == renderPasses.end())
+		{
+			renderPassIterator = renderPasses.emplace(renderPassHash, CreateRenderPass(mDevice.get(), pipelineKey.mRenderPassFormats)).first;
+		}
+		job.mRenderPass = renderPassIterator->second.get();
+
+		jobs.push_back(std::move(job));
+	}
+
+	//Startup is the one place we can throw every core at this without costing the game anything.
+	const int32_t threadCount = std::max(1, static_cast<int32_t>(std::thread::hardware_concurrency()));
+	std::atomic<size_t> nextJob = 0;
+	std::vector<std::thread> threads;
+	for (int32_t i = 0; i < threadCount; i++)
+	{
+		threads.emplace_back([this, &jobs, &nextJob]()
+		{
+			for (size_t j = nextJob++; j < jobs.size(); j = nextJob++)
+			{
+				auto& job = jobs[j];
+				job.mPipeline = CreatePipeline(job.mPipelineKey, job.mVertexDeclaration, job.mVertexShaderModule, job.mPixelShaderModule, job.mRenderPass);
+			}
+		});
+	}
+
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	for (auto& job : jobs)
+	{
+		mPipelines.emplace(job.mPipelineKey, std::move(job.mPipeline));
+	}
+
+	const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - startTime);
+	Log(info) << "CDevice9::WarmUpPipelines compiled " << jobs.size() << " of " << mRecordedPipelines.size() << " recorded pipelines in " << elapsed.count() << "ms using " << threadCount << " threads." << std::endl;
+}
+
+void CDevice9::ApplyDynamicRenderState()
+{
+	auto& renderState = mInternalDeviceState.mDeviceState.mRenderState;
+
+	if (mDynamicRenderState & DYNAMIC_RENDER_STATE_STENCIL)
+	{
+		mCurrentDrawCommandBuffer.setStencilReference(vk::StencilFaceFlagBits::eFront | vk::StencilFaceFlagBits::eBack, renderState[D3DRS_STENCILREF]);
+		mCurrentDrawCommandBuffer.setStencilCompareMask(vk::StencilFaceFlagBits::eFront | vk::StencilFaceFlagBits::eBack, renderState[D3DRS_STENCILMASK]);
+		mCurrentDrawCommandBuffer.setStencilWriteMask(vk::StencilFaceFlagBits::eFront | vk::StencilFaceFlagBits::eBack, renderState[D3DRS_STENCILWRITEMASK]);
+	}
+
+#ifdef VK_EXT_extended_dynamic_state
+	if (mDynamicRenderState & DYNAMIC_RENDER_STATE_EXTENDED)
+	{
+		const D3DCULL cullMode = (D3DCULL)renderState[D3DRS_CULLMODE];
+		const VkCommandBuffer commandBuffer = static_cast<VkCommandBuffer>(mCurrentDrawCommandBuffer);
+
+		mCmdSetCullModeEXT(commandBuffer, static_cast<VkCullModeFlags>(GetCullMode(cullMode)));
+		mCmdSetFrontFaceEXT(commandBuffer, static_cast<VkFrontFace>(GetFrontFace(cullMode)));
+		mCmdSetDepthTestEnableEXT(commandBuffer, renderState[D3DRS_ZENABLE] != D3DZB_FALSE);
+		mCmdSetDepthWriteEnableEXT(commandBuffer, renderState[D3DRS_ZWRITEENABLE] != FALSE);
+		mCmdSetDepthCompareOpEXT(commandBuffer, static_cast<VkCompareOp>(ConvertCompareOperation((D3DCMPFUNC)renderState[D3DRS_ZFUNC])));
+		mCmdSetStencilTestEnableEXT(commandBuffer, renderState[D3DRS_STENCILENABLE] != FALSE);
+
+		//Same face selection as the static path in CreatePipeline.
+		const bool isCCW = (cullMode == D3DCULL_CCW);
+		mCmdSetStencilOpEXT(commandBuffer, VK_STENCIL_FACE_FRONT_BIT,
+			static_cast<VkStencilOp>(ConvertStencilOperation((D3DSTENCILOP)renderState[isCCW ? D3DRS_STENCILFAIL : D3DRS_CCW_STENCILFAIL])),
+			static_cast<VkStencilOp>(ConvertStencilOperation((D3DSTENCILOP)renderState[isCCW ? D3DRS_STENCILPASS : D3DRS_CCW_STENCILPASS])),
+			VK_STENCIL_OP_KEEP,
+			static_cast<VkCompareOp>(ConvertCompareOperation((D3DCMPFUNC)renderState[isCCW ? D3DRS_STENCILFUNC : D3DRS_CCW_STENCILFUNC])));
+		mCmdSetStencilOpEXT(commandBuffer, VK_STENCIL_FACE_BACK_BIT,
+			static_cast<VkStencilOp>(ConvertStencilOperation((D3DSTENCILOP)renderState[isCCW ? D3DRS_CCW_STENCILFAIL : D3DRS_STENCILFAIL])),
+			static_cast<VkStencilOp>(ConvertStencilOperation((D3DSTENCILOP)renderState[isCCW ? D3DRS_CCW_STENCILPASS : D3DRS_STENCILPASS])),
+			VK_STENCIL_OP_KEEP,
+			static_cast<VkCompareOp>(ConvertCompareOperation((D3DCMPFUNC)renderState[isCCW ? D3DRS_CCW_STENCILFUNC : D3DRS_STENCILFUNC])));
+	}
+#endif
+}
+
+std::chrono::steady_clock::time_point CDevice9::StartDrawTime()
+{
+	if (!mPerformanceStats)
+	{
+		return {};
+	}
+
+	//Only this thread's count so the pipeline compiler and the application's own threads don't show up as draw allocations.
+	mDrawStartAllocations = GetThreadAllocationCount();
+	return std::chrono::steady_clock::now();
+}
+
+void CDevice9::RecordDrawTime(std::chrono::steady_clock::time_point drawStart)
+{
+	if (mPerformanceStats)
+	{
+		mFrameDrawTime += std::chrono::steady_clock::now() - drawStart;
+		mFrameDrawAllocations += GetThreadAllocationCount() - mDrawStartAllocations;
+		mFrameDraws++;
+	}
+}
+
+/*
+Writes one JSON object per line for the frame that was just presented so runs can be compared with a script.
+Counters that are kept for the whole session are written as the change since the last frame.
+*/
+void CDevice9::WritePerformanceStats()
+{
+	if (!mPerformanceStats)
+	{
+		return;
+	}
+
+	const auto now = std::chrono::steady_clock::now();
+	const uint64_t frameTime = std::chrono::duration_cast<std::chrono::nanoseconds>(now - mFrameStart).count();
+	const uint64_t drawTime = std::chrono::duration_cast<std::chrono::nanoseconds>(mFrameDrawTime).count();
+	const uint64_t pipelinesCreated = mPipelinesCreated;
+	const uint64_t allocations = GetAllocationCount();
+
+	mPerformanceStatsFile << "{\"frame\":" << mFrameCount
+		<< ",\"frame_ns\":" << frameTime
+		<< ",\"draws\":" << mFrameDraws
+		<< ",\"draw_ns\":" << drawTime
+		<< ",\"ns_per_draw\":" << (mFrameDraws ? drawTime / mFrameDraws : 0)
+		<< ",\"draws_skipped\":" << (mDrawsSkipped - mLastDrawsSkipped)
+		<< ",\"pipelines_created\":" << (pipelinesCreated - mLastPipelinesCreated)
+		<< ",\"pipelines\":" << mPipelines.size()
+		<< ",\"binds_issued\":" << (mBindsIssued - mLastBindsIssued)
+		<< ",\"binds_skipped\":" << (mBindsSkipped - mLastBindsSkipped)
+		<< ",\"descriptor_sets\":" << mTextureDescriptorSetCount[mFrameIndex]
+		<< ",\"descriptor_pools\":" << mTextureDescriptorPools[mFrameIndex].size()
+		<< ",\"uniform_bytes\":" << mFrameUniformBytes
+		<< ",\"matrix_multiplies\":" << mFrameMatrixMultiplies
+		<< ",\"frames_in_flight\":" << mFramesInFlight
+		<< ",\"command_buffers\":" << mFrameCommandBuffers
+		<< ",\"fence_wait_ns\":" << std::chrono::duration_cast<std::chrono::nanoseconds>(mFrameFenceWaitTime).count();
+#ifdef VK9_COUNT_ALLOCATIONS
+	mPerformanceStatsFile << ",\"allocations\":" << (allocations - mLastAllocations) //Includes other threads such as the pipeline compiler.
+		<< ",\"draw_allocations\":" << mFrameDrawAllocations; //Only what the draw calls themselves allocated.
+#endif
+	mPerformanceStatsFile << "}\n";
+
+	mFrameCount++;
+	mFrameDraws = 0;
+	mFrameDrawAllocations = 0;
+	mFrameUniformBytes = 0;
+	mFrameMatrixMultiplies = 0;
+	mFrameFenceWaitTime = {};
+	mFrameCommandBuffers = 0;
+	mFrameDrawTime = {};
+	mFrameStart = now;
+	mLastPipelinesCreated = pipelinesCreated;
+	mLastBindsIssued = mBindsIssued;
+	mLastBindsSkipped = mBindsSkipped;
+	mLastDrawsSkipped = mDrawsSkipped;
+	mLastAllocations = allocations;
+}
+
+/*
+Hands out a texture set for the current frame.
+When the current pool is full the next pool in this frame's chain is used and a new one is created if the chain runs out.
+Everything is given back by resetting the pools once the frame's fence has signaled so sets are never freed one at a time.
+*/
+vk::DescriptorSet CDevice9::AllocateTextureDescriptorSet()
+{
+	auto& descriptorPools = mTextureDescriptorPools[mFrameIndex];
+	auto& poolIndex = mTextureDescriptorPoolIndex[mFrameIndex];
+
+	vk::DescriptorSet descriptorSet;
+	for (; ; poolIndex++)
+	{
+		if (poolIndex >= descriptorPools.size())
+		{
+			const vk::DescriptorPoolSize descriptorPoolSize(vk::DescriptorType::eCombinedImageSampler, DESCRIPTOR_POOL_SETS * 16);
+			descriptorPools.push_back(mDevice->createDescriptorPoolUnique(vk::DescriptorPoolCreateInfo(vk::DescriptorPoolCreateFlags(), DESCRIPTOR_POOL_SETS, 1, &descriptorPoolSize)));
+			mTextureDescriptorPoolHighWater = std::max(mTextureDescriptorPoolHighWater, (uint64_t)descriptorPools.size());
+			Log(info) << "CDevice9::AllocateTextureDescriptorSet frame " << mFrameIndex << " now has " << descriptorPools.size() << " descriptor pools." << std::endl;
+		}
+
+		const vk::DescriptorSetAllocateInfo descriptorSetInfo(descriptorPools[poolIndex].get(), 1, &mTextureDescriptorLayout.get());
+		const vk::Result result = mDevice->allocateDescriptorSets(&descriptorSetInfo, &descriptorSet);
+		if (result == vk::Result::eSuccess)
+		{
+			break;
+		}
+		else if (result != vk::Result::eErrorOutOfPoolMemory && result != vk::Result::eErrorFragmentedPool)
+		{
+			Log(fatal) << "CDevice9::AllocateTextureDescriptorSet vkAllocateDescriptorSets failed with return code of " << result << std::endl;
+			return vk::DescriptorSet();
+		}
+		//Otherwise this pool is full so try the next one.
+	}
+
+	mTextureDescriptorSetCount[mFrameIndex]++;
+	mTextureDescriptorSetHighWater = std::max(mTextureDescriptorSetHighWater, mTextureDescriptorSetCount[mFrameIndex]);
+
+	return descriptorSet;
+}
+
+/*
+Creates a persistently mapped chunk for the uniform ring along with a set 0 that points at it.
+The buffers in the set are dynamic so the same set works for every copy of the blocks written into the chunk.
+*/
+UniformRingChunk CDevice9::CreateUniformRingChunk()
+{
+	UniformRingChunk chunk;
+
+	auto const ringBufferInfo = vk::BufferCreateInfo().setSize(UNIFORM_RING_SIZE).setUsage(vk::BufferUsageFlagBits::eUniformBuffer);
+	chunk.mBuffer = mDevice->createBufferUnique(ringBufferInfo);
+
+	vk::MemoryRequirements memoryRequirements;
+	mDevice->getBufferMemoryRequirements(chunk.mBuffer.get(), &memoryRequirements);
+
+	auto memoryAllocateInfo = vk::MemoryAllocateInfo().setAllocationSize(memoryRequirements.size).setMemoryTypeIndex(0);
+	FindMemoryTypeFromProperties(memoryRequirements.memoryTypeBits, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, &memoryAllocateInfo.memoryTypeIndex);
+	chunk.mMemory = mDevice->allocateMemoryUnique(memoryAllocateInfo);
+	mDevice->bindBufferMemory(chunk.mBuffer.get(), chunk.mMemory.get(), 0);
+
+	//Stays mapped until the memory is freed.
+	chunk.mData = reinterpret_cast<uint8_t*>(mDevice->mapMemory(chunk.mMemory.get(), 0, VK_WHOLE_SIZE));
+
+	const vk::DescriptorPoolSize descriptorPoolSize(vk::DescriptorType::eUniformBufferDynamic, UNIFORM_BLOCK_COUNT);
+	chunk.mDescriptorPool = mDevice->createDescriptorPoolUnique(vk::DescriptorPoolCreateInfo(vk::DescriptorPoolCreateFlags(), 1, 1, &descriptorPoolSize));
+
+	const vk::DescriptorSetAllocateInfo descriptorSetInfo(chunk.mDescriptorPool.get(), 1, &mDescriptorLayout.get());
+	const vk::Result result = mDevice->allocateDescriptorSets(&descriptorSetInfo, &chunk.mDescriptorSet);
+	if (result != vk::Result::eSuccess)
+	{
+		Log(fatal) << "CDevice9::CreateUniformRingChunk vkAllocateDescriptorSets failed with return code of " << result << std::endl;
+	}
+
+	for (auto& bufferInfo : mDescriptorUpdateData.mBufferInfo)
+	{
+		bufferInfo.buffer = chunk.mBuffer.get();
+	}
+	for (auto& writeDescriptorSet : mWriteDescriptorSet)
+	{
+		writeDescriptorSet.dstSet = chunk.mDescriptorSet;
+	}
+	mDevice->updateDescriptorSets(6, &mWriteDescriptorSet[0], 0, nullptr);
+	mDevice->updateDescriptorSets(2, &mWriteDescriptorSet[7], 0, nullptr);
+
+	return chunk;
+}
+
+/*
+Copies one stage's constants into the uniform ring in the I, B, F order the shaders expect and returns the bytes written.
+Float registers past the highest one the application has set are left out, so a shader that only uses c0-c15 costs 576 bytes instead of 4.4KB.
+Registers that were never set are left undefined, the same as a constant buffer nobody has written to.
+*/
+template <size_t floatCount>
+static uint32_t WriteShaderConstants(uint8_t* data, const int(&integers)[16][4], const int(&booleans)[16], const float(&floats)[floatCount][4], uint32_t floatRegisterCount)
+{
+	memcpy(data, integers, sizeof(integers));
+	data += sizeof(integers);
+	memcpy(data, booleans, sizeof(booleans));
+	data += sizeof(booleans);
+	memcpy(data, floats, floatRegisterCount * sizeof(float[4]));
+
+	return static_cast<uint32_t>(sizeof(integers) + sizeof(booleans) + floatRegisterCount * sizeof(float[4]));
+}
+
+/*
+The products are only redone after SetTransform changes world, view or projection, not once per draw or per transform set.
+*/
+const D3DMATRIX& CDevice9::GetModelView()
+{
+	if (mModelViewDirty)
+	{
+		const auto& deviceState = mInternalDeviceState.mDeviceState;
+		mModelView = deviceState.mTransform[D3DTS_WORLD] * deviceState.mTransform[D3DTS_VIEW];
+		mModelViewDirty = false;
+		mFrameMatrixMultiplies++;
+	}
+
+	return mModelView;
+}
+
+const D3DMATRIX& CDevice9::GetModelViewProjection()
+{
+	if (mModelViewProjectionDirty)
+	{
+		mModelViewProjection = GetModelView() * mInternalDeviceState.mDeviceState.mTransform[D3DTS_PROJECTION];
+		mModelViewProjectionDirty = false;
+		mFrameMatrixMultiplies++;
+	}
+
+	return mModelViewProjection;
+}
+
+/*
+Writes every uniform block that changed since the last draw straight into this frame's uniform ring and binds set 0 at the new offsets.
+The ring is host coherent so there is no copy to record, no barrier and no reason to end the render pass.
+Set 0 only points at one chunk so moving on to the next chunk means writing every block again.
+*/
+void CDevice9::FlushUniformBlocks()
+{
+	if (!mDirtyUniformBlocks)
+	{
+		return;
+	}
+
+	auto& deviceState = mInternalDeviceState.mDeviceState;
+	auto& chunks = mUniformRingChunks[mFrameIndex];
+	auto& chunkIndex = mUniformRingChunkIndex[mFrameIndex];
+
+	vk::DeviceSize size = 0;
+	for (uint32_t i = 0; i < UNIFORM_BLOCK_COUNT; i++)
+	{
+		if (mDirtyUniformBlocks & (1u << i))
+		{
+			size += mUniformBlockSizes[i];
+		}
+	}
+
+	if (chunkIndex < chunks.size() && mUniformRingOffset + size > UNIFORM_RING_SIZE)
+	{
+		chunkIndex++;
+		mUniformRingOffset = 0;
+		mDirtyUniformBlocks = UNIFORM_BLOCK_ALL;
+	}
+
+	if (chunkIndex >= chunks.size())
+	{
+		chunks.push_back(CreateUniformRingChunk());
+		mUniformRingChunkHighWater = std::max(mUniformRingChunkHighWater, (uint64_t)chunks.size());
+		Log(info) << "CDevice9::FlushUniformBlocks frame " << mFrameIndex << " now has " << chunks.size() << " uniform ring chunks." << std::endl;
+	}
+
+	auto& chunk = chunks[chunkIndex];
+	for (uint32_t i = 0; i < UNIFORM_BLOCK_COUNT; i++)
+	{
+		if (!(mDirtyUniformBlocks & (1u << i)))
+		{
+			continue;
+		}
+
+		uint8_t* data = chunk.mData + mUniformRingOffset;
+		uint32_t written = mUniformBlockSizes[i];
+		switch (i)
+		{
+		case UNIFORM_BLOCK_RENDER_STATE:
+			memcpy(data, deviceState.mRenderState.data(), sizeof(deviceState.mRenderState));
+			break;
+		case UNIFORM_BLOCK_LIGHT:
+		{
+			PaddedLight* lights = reinterpret_cast<PaddedLight*>(data);
+			for (size_t light = 0; light < deviceState.mLight.size(); light++)
+			{
+				lights[light] = deviceState.mLight[light];
+			}
+		}
+		break;
+		case UNIFORM_BLOCK_LIGHT_ENABLE:
+		{
+			//std140 puts each int in an array on its own 16 bytes.
+			int32_t* lightEnable = reinterpret_cast<int32_t*>(data);
+			for (size_t light = 0; light < deviceState.mLightEnableState.size(); light++)
+			{
+				lightEnable[light * 4] = deviceState.mLightEnableState[light];
+			}
+		}
+		break;
+		case UNIFORM_BLOCK_MATERIAL:
+			memcpy(data, &deviceState.mMaterial, sizeof(deviceState.mMaterial));
+			break;
+		case UNIFORM_BLOCK_TRANSFORMATION:
+		{
+			//mv takes the unused slot 1, world goes after the texture transforms. Slot 0 isn't read since mvp became a push constant.
+			D3DMATRIX* transforms = reinterpret_cast<D3DMATRIX*>(data);
+			transforms[1] = GetModelView();
+			memcpy(&transforms[D3DTS_VIEW], &deviceState.mTransform[D3DTS_VIEW], sizeof(D3DMATRIX) * (D3DTS_TEXTURE7 + 1 - D3DTS_VIEW));
+			transforms[PACKED_TRANSFORM_WORLD] = deviceState.mTransform[D3DTS_WORLD];
+		}
+		break;
+		case UNIFORM_BLOCK_TEXTURE_STAGE:
+		{
+			PaddedTextureStage* textureStages = reinterpret_cast<PaddedTextureStage*>(data);
+			for (size_t stage = 0; stage < deviceState.mTextureStageState.size(); stage++)
+			{
+				textureStages[stage] = PaddedTextureStage(deviceState.mTextureStageState[stage]);
+			}
+		}
+		break;
+		case UNIFORM_BLOCK_VERTEX_CONSTANT:
+			written = WriteShaderConstants(data, deviceState.mVertexShaderConstantI, deviceState.mVertexShaderConstantB, deviceState.mVertexShaderConstantF, mVertexShaderConstantFCount);
+			deviceState.mDirtyVertexShaderConstants = false;
+			break;
+		case UNIFORM_BLOCK_PIXEL_CONSTANT:
+			written = WriteShaderConstants(data, deviceState.mPixelShaderConstantI, deviceState.mPixelShaderConstantB, deviceState.mPixelShaderConstantF, mPixelShaderConstantFCount);
+			deviceState.mDirtyPixelShaderConstants = false;
+			break;
+		}
+
+		mUniformBlockOffsets[i] = static_cast<uint32_t>(mUniformRingOffset);
+		mUniformRingOffset += mUniformBlockSizes[i];
+		mFrameUniformBytes += written;
+	}
+
+	mDirtyUniformBlocks = 0;
+
+	//Set 0 is the same in both layouts so either one works, this just keeps to the one the texture set was bound with.
+	const vk::PipelineLayout pipelineLayout = mBoundState.mBindlessTextures ? mBindlessPipelineLayout.get() : mPipelineLayout.get();
+	mCurrentDrawCommandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipelineLayout, 0, 1, &chunk.mDescriptorSet, UNIFORM_BLOCK_COUNT, mUniformBlockOffsets.data());
+	mBindsIssued++;
+}
+
+/*
+Returns where this texture/sampler pair lives in the bindless array, writing it in the first time it is seen.
+The array is update-after-bind so a new entry can go in while earlier frames that use other entries are still running.
+*/
+uint32_t CDevice9::GetBindlessTextureIndex(vk::ImageView imageView, vk::Sampler sampler)
+{
+	auto& slots = mBindlessTextureSlots[static_cast<VkImageView>(imageView)];
+	for (auto& slot : slots)
+	{
+		if (slot.mSampler == static_cast<VkSampler>(sampler))
+		{
+			return slot.mIndex;
+		}
+	}
+
+	uint32_t index;
+	if (!mBindlessFreeSlots.empty())
+	{
+		index = mBindlessFreeSlots.back();
+		mBindlessFreeSlots.pop_back();
+	}
+	else if (mBindlessNextSlot < mBindlessTextureCount)
+	{
+		index = mBindlessNextSlot++;
+	}
+	else
+	{
+		if (!mBindlessFullLogged)
+		{
+			Log(warning) << "CDevice9::GetBindlessTextureIndex all " << mBindlessTextureCount << " bindless texture slots are in use." << std::endl;
+			mBindlessFullLogged = true;
+		}
+		return 0;
+	}
+
+	const vk::DescriptorImageInfo imageInfo(sampler, imageView, vk::ImageLayout::eShaderReadOnlyOptimal);
+	auto const writeDescriptorSet = vk::WriteDescriptorSet()
+		.setDstSet(mBindlessDescriptorSet)
+		.setDstBinding(0)
+		.setDstArrayElement(index)
+		.setDescriptorCount(1)
+		.setDescriptorType(vk::DescriptorType::eCombinedImageSampler)
+		.setPImageInfo(&imageInfo);
+	mDevice->updateDescriptorSets(1, &writeDescriptorSet, 0, nullptr);
+
+	slots.push_back({ static_cast<VkSampler>(sampler), index });
+
+	return index;
+}
+
+//Called when a texture goes away. Its slots are held back until the GPU is done with the current frame.
+void CDevice9::ReleaseBindlessTexture(vk::ImageView imageView)
+{
+	if (!mBindlessTextures)
+	{
+		return;
+	}
+
+	SynchronizeCommandStream(); //The slot lists belong to whichever thread is drawing.
+
+	auto slotIterator = mBindlessTextureSlots.find(static_cast<VkImageView>(imageView));
+	if (slotIterator == mBindlessTextureSlots.end())
+	{
+		return;
+	}
+
+	for (auto& slot : slotIterator->second)
+	{
+		mBindlessReleasedSlots[mFrameIndex].push_back(slot.mIndex);
+	}
+	mBindlessTextureSlots.erase(slotIterator);
+}
+
+//Called when a texture goes away. A new view can get the same handle so cached sets that point at this one can't be found again.
+void CDevice9::EvictDescriptorSets(vk::ImageView imageView)
+{
+	SynchronizeCommandStream(); //The cache belongs to whichever thread is drawing.
+
+	for (auto& descriptorSetCache : mDescriptorSetCache)
+	{
+		descriptorSetCache.Evict(static_cast<VkImageView>(imageView));
+	}
+}
+
+void CDevice9::BindPipeline(vk::Pipeline pipeline)
+{
+	if (mBoundState.mPipeline == pipeline)
+	{
+		mBindsSkipped++;
+		return;
+	}
+
+	mCurrentDrawCommandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, pipeline);
+	mBoundState.mPipeline = pipeline;
+	mBindsIssued++;
+}
+
+/*
+Binds a run of vertex buffers but trims off the slots at either end that are already bound.
+Anything in the middle that didn't change still goes along for the ride because splitting the call would cost more than it saves.
+*/
+void CDevice9::BindVertexBuffers(uint32_t firstBinding, uint32_t bindingCount, const vk::Buffer* buffers, const vk::DeviceSize* offsets)
+{
+	uint32_t first = 0;
+	uint32_t last = bindingCount;
+
+	while (first < last && mBoundState.mVertexBuffers[firstBinding + first] == buffers[first] && mBoundState.mVertexBufferOffsets[firstBinding + first] == offsets[first])
+	{
+		first++;
+	}
+
+	while (last > first && mBoundState.mVertexBuffers[firstBinding + last - 1] == buffers[last - 1] && mBoundState.mVertexBufferOffsets[firstBinding + last - 1] == offsets[last - 1])
+	{
+		last--;
+	}
+
+	mBindsSkipped += bindingCount - (last - first);
+
+	if (first == last)
+	{
+		return;
+	}
+
+	mCurrentDrawCommandBuffer.bindVertexBuffers(firstBinding + first, last - first, buffers + first, offsets + first);
+	for (uint32_t i = first; i < last; i++)
+	{
+		mBoundState.mVertexBuffers[firstBinding + i] = buffers[i];
+		mBoundState.mVertexBufferOffsets[firstBinding + i] = offsets[i];
+	}
+	mBindsIssued += last - first;
+}
+
+void CDevice9::BindIndexBuffer(vk::Buffer buffer, vk::IndexType indexType)
+{
+	if (mBoundState.mIndexBuffer == buffer && mBoundState.mIndexType == indexType)
+	{
+		mBindsSkipped++;
+		return;
+	}
+
+	mCurrentDrawCommandBuffer.bindIndexBuffer(buffer, 0, indexType);
+	mBoundState.mIndexBuffer = buffer;
+	mBoundState.mIndexType = indexType;
+	mBindsIssued++;
 }
 
-void CDevice9::BeginRecordingUtilityCommands()
+void CDevice9::BindDescriptorSet(vk::DescriptorSet descriptorSet)
 {
-	mUtilityRecordingCount++;
-
-	if (mUtilityRecordingCount > 1)
+	if (mBoundState.mDescriptorSet == descriptorSet)
 	{
+		mBindsSkipped++;
 		return;
 	}
 
-	mUtilityIndex = (mUtilityIndex++) % mUtilityCommandBuffers.size();
+	//The bindless array has to go through the layout it was made for.
+	const vk::PipelineLayout pipelineLayout = (descriptorSet == mBindlessDescriptorSet) ? mBindlessPipelineLayout.get() : mPipelineLayout.get();
+	mCurrentDrawCommandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, pipelineLayout, 1, 1, &descriptorSet, 0, nullptr);
+	mBoundState.mDescriptorSet = descriptorSet;
+	mBindsIssued++;
+}
 
-	mDevice->waitForFences(1, &mUtilityFences[mUtilityIndex].get(), VK_TRUE, UINT64_MAX);
-	mDevice->resetFences(1, &mUtilityFences[mUtilityIndex].get());
+//Samplers are shared by every slot with the same settings so this is a hash lookup rather than a search.
+vk::Sampler CDevice9::GetSampler(const std::array<DWORD, D3DSAMP_DMAPOFFSET + 1>& samplerState, uint32_t textureLOD)
+{
+	const SamplerKey samplerKey(samplerState, textureLOD);
 
-	mCurrentUtilityCommandBuffer = mUtilityCommandBuffers[mUtilityIndex].get();
+	auto& samplerContainer = mSamplerContainers[samplerKey];
+	if (!samplerContainer)
+	{
+		samplerContainer = std::make_unique<SamplerContainer>(mDevice.get(), samplerKey);
+	}
 
-	vk::CommandBufferBeginInfo beginInfo(vk::CommandBufferUsageFlagBits::eOneTimeSubmit);
-	mCurrentUtilityCommandBuffer.begin(&beginInfo);
+	return samplerContainer->mSampler.get();
 }
 
-void CDevice9::StopRecordingUtilityCommands()
+bool CDevice9::BeginDraw(D3DPRIMITIVETYPE primitiveType)
 {
-	mUtilityRecordingCount--;
-
-	if (mUtilityRecordingCount > 0)
+	//Give the GPU what's been recorded so far once this command buffer has enough draws or has been recording long enough.
+	if ((mSplitDrawCount && mCommandBufferDraws >= mSplitDrawCount) || (mSplitTime.count() && (std::chrono::steady_clock::now() - mCommandBufferStart) >= mSplitTime))
 	{
-		return;
+		SplitCommandBuffer();
 	}
+	mCommandBufferDraws++;
 
-	mCurrentUtilityCommandBuffer.end();
+	auto& deviceState = mInternalDeviceState.mDeviceState;
+	auto& pipelineKey = deviceState.mPipelineKey;
 
-	vk::PipelineStageFlags pipelineFlag[] = { vk::PipelineStageFlagBits::eColorAttachmentOutput }; //eAllCommands
-	vk::SubmitInfo submitInfo;
-	submitInfo.pWaitDstStageMask = pipelineFlag;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = &mCurrentUtilityCommandBuffer;
-	mQueue.submit(1, &submitInfo, mUtilityFences[mUtilityIndex].get());
+	//The primitive type and render pass don't come from a setter so fold them into the key here.
+	//With extended dynamic state only the topology class is baked and the exact topology goes on the command buffer.
+	const D3DPRIMITIVETYPE pipelinePrimitiveType = (mDynamicRenderState & DYNAMIC_RENDER_STATE_EXTENDED) ? GetPrimitiveTopologyClass(primitiveType) : primitiveType;
+	if (pipelineKey.mRenderState.mPrimitiveType != pipelinePrimitiveType || pipelineKey.mRenderPassFormats != mCurrentRenderContainer->mFormats)
+	{
+		pipelineKey.mRenderState.mPrimitiveType = pipelinePrimitiveType;
+		pipelineKey.mRenderPassFormats = mCurrentRenderContainer->mFormats;
+		deviceState.mCapturedPipelineKey = true;
+	}
 
-	mUtilityRecordingCount = 0;
-}
+	//Check to see if the pipeline is stale. If so find or create the pipeline for the current state and bind it.
+	//A stand-in pipeline is also treated as stale so the real one gets swapped in as soon as it's ready.
+	if (deviceState.mCapturedPipelineKey || mBoundFallbackPipeline)
+	{
+		CollectCompiledPipelines();
 
-void CDevice9::BeginDraw(D3DPRIMITIVETYPE primitiveType)
-{
-	//Check to see if the pipeline is stale. If so create a new one and bind it.
-	auto& deviceState = mInternalDeviceState.mDeviceState;
-	if ((mLastPrimitiveType != primitiveType)
-		|| deviceState.mCapturedVertexShader
-		|| deviceState.mCapturedPixelShader
-		|| deviceState.mCapturedAnyStreamFrequency
-		|| deviceState.mCapturedAnyStreamSource
-		|| deviceState.mCapturedFVF
-		|| deviceState.mCapturedVertexDeclaration
-		|| deviceState.mCapturedRenderState[D3DRS_CULLMODE]
-		|| deviceState.mCapturedRenderState[D3DRS_ZENABLE]
-		|| deviceState.mCapturedRenderState[D3DRS_ZWRITEENABLE]
-		|| deviceState.mCapturedRenderState[D3DRS_ZFUNC]
-		|| deviceState.mCapturedRenderState[D3DRS_STENCILREF]
-		|| deviceState.mCapturedRenderState[D3DRS_STENCILMASK]
-		|| deviceState.mCapturedRenderState[D3DRS_STENCILWRITEMASK]
-		|| deviceState.mCapturedRenderState[D3DRS_CCW_STENCILFAIL]
-		|| deviceState.mCapturedRenderState[D3DRS_STENCILFAIL]
-		|| deviceState.mCapturedRenderState[D3DRS_CCW_STENCILPASS]
-		|| deviceState.mCapturedRenderState[D3DRS_STENCILPASS]
-		|| deviceState.mCapturedRenderState[D3DRS_CCW_STENCILFUNC]
-		|| deviceState.mCapturedRenderState[D3DRS_STENCILFUNC]
-		|| deviceState.mCapturedRenderState[D3DRS_FILLMODE]
-		|| deviceState.mCapturedRenderState[D3DRS_COLORWRITEENABLE]
-		|| deviceState.mCapturedRenderState[D3DRS_ALPHABLENDENABLE]
-		|| deviceState.mCapturedRenderState[D3DRS_BLENDOP]
-		|| deviceState.mCapturedRenderState[D3DRS_SRCBLEND]
-		|| deviceState.mCapturedRenderState[D3DRS_DESTBLEND]
-		|| deviceState.mCapturedRenderState[D3DRS_BLENDOPALPHA]
-		|| deviceState.mCapturedRenderState[D3DRS_SRCBLENDALPHA]
-		|| deviceState.mCapturedRenderState[D3DRS_DESTBLENDALPHA]
-		|| deviceState.mCapturedRenderState[D3DRS_POINTSPRITEENABLE]
-		|| deviceState.mCapturedRenderState[D3DRS_POINTSIZE]
-		)
-	{
-		auto& vertexDeclaration = (*mInternalDeviceState.mDeviceState.mVertexDeclaration); //If this is null we can't do anything anyway.
-
-		std::vector<vk::PipelineShaderStageCreateInfo> shaderStageInfo;
-		shaderStageInfo.reserve(3);
-
-		if (mInternalDeviceState.mDeviceState.mVertexShader != nullptr)
-		{
-			shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mInternalDeviceState.mDeviceState.mVertexShader->mShader.get()).setPName("main"));
-
-
-			if (mInternalDeviceState.mDeviceState.mPixelShader != nullptr)
+		auto pipelineIterator = mPipelines.find(pipelineKey);
+		if (pipelineIterator != mPipelines.end())
+		{
+			BindPipeline(pipelineIterator->second.get());
+			mBoundFallbackPipeline = false;
+		}
+		else if (mAsyncPipelineCompile)
+		{
+			auto pendingIterator = mPendingPipelines.find(pipelineKey);
+			if (pendingIterator == mPendingPipelines.end())
 			{
-				shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mInternalDeviceState.mDeviceState.mPixelShader->mShader.get()).setPName("main"));
+				RecordPipeline(pipelineKey);
+				QueuePipelineCompile(pipelineKey);
+				pendingIterator = mPendingPipelines.emplace(pipelineKey, mAsyncPipelineFallback ? FindFallbackPipeline(pipelineKey) : vk::Pipeline()).first;
 			}
-			else
+
+			//Nothing close enough to draw with so drop the draw and check again next time.
+			if (!pendingIterator->second)
 			{
-				shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_Passthrough.get()).setPName("main"));
+				mDrawsSkipped++;
+				deviceState.mCapturedPipelineKey = true;
+				return false;
 			}
+
+			BindPipeline(pendingIterator->second);
+			mBoundFallbackPipeline = true;
+			mDrawsWithFallbackPipeline++;
 		}
 		else
 		{
-			if (vertexDeclaration.mHasPosition && !vertexDeclaration.mHasNormal && !vertexDeclaration.mHasPSize && !vertexDeclaration.mHasColor1 && !vertexDeclaration.mHasColor2)
-			{
-				switch (vertexDeclaration.mTextureCount)
-				{
-				case 0:
-					if (vertexDeclaration.mIsTransformed)
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW.get()).setPName("main"));
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ.get()).setPName("main"));
-					}
-
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						Log(fatal) << "CDevice9::BeginDraw point sprite not supported with hasPosition && !hasColor && !hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ.get()).setPName("main"));
-					}
-					break;
-				case 1:
-					if (vertexDeclaration.mIsTransformed)
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW_TEX1.get()).setPName("main"));
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_TEX1.get()).setPName("main"));
-					}
-
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						Log(fatal) << "CDevice9::BeginDraw point sprite not supported with hasPosition && !hasColor && !hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_TEX1.get()).setPName("main"));
-					}
-					break;
-				case 2:
-					if (vertexDeclaration.mIsTransformed)
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW_TEX2.get()).setPName("main"));
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_TEX2.get()).setPName("main"));
-					}
+			RecordPipeline(pipelineKey);
 
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						Log(fatal) << "CDevice9::BeginDraw point sprite not supported with hasPosition && !hasColor && !hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_TEX2.get()).setPName("main"));
-					}
-					break;
-				default:
-					Log(fatal) << "CDevice9::BeginDraw unsupported texture count " << vertexDeclaration.mTextureCount << std::endl;
-					break;
-				}
-			}
-			else if (vertexDeclaration.mHasPosition && !vertexDeclaration.mHasNormal && !vertexDeclaration.mHasPSize && vertexDeclaration.mHasColor1 && !vertexDeclaration.mHasColor2)
-			{
-				switch (vertexDeclaration.mTextureCount)
-				{
-				case 0:
-					if (vertexDeclaration.mIsTransformed)
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW_DIFFUSE.get()).setPName("main"));
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_DIFFUSE.get()).setPName("main"));
-					}
+			const vk::ShaderModule vertexShader = (deviceState.mVertexShader != nullptr) ? deviceState.mVertexShader->mShader.get() : vk::ShaderModule();
+			const vk::ShaderModule pixelShader = (deviceState.mPixelShader != nullptr) ? deviceState.mPixelShader->mShader.get() : vk::ShaderModule();
+			pipelineIterator = mPipelines.emplace(pipelineKey, CreatePipeline(pipelineKey, deviceState.mVertexDeclaration, vertexShader, pixelShader, mCurrentRenderContainer->mRenderPass.get())).first;
+			BindPipeline(pipelineIterator->second.get());
+		}
 
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eGeometry).setModule(mGeomShaderModule_XYZ_DIFFUSE.get()).setPName("main"));
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_DIFFUSE_TEX1.get()).setPName("main"));
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_DIFFUSE.get()).setPName("main"));
-					}
+		deviceState.mCapturedPipelineKey = false;
+	}
 
-					break;
-				case 1:
-					if (vertexDeclaration.mIsTransformed)
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW_DIFFUSE_TEX1.get()).setPName("main"));
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_DIFFUSE_TEX1.get()).setPName("main"));
-					}
+	if (deviceState.mCapturedDynamicRenderState)
+	{
+		ApplyDynamicRenderState();
+		deviceState.mCapturedDynamicRenderState = false;
+	}
 
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						Log(fatal) << "CDevice9::BeginDraw point sprite not supported with hasPosition && hasColor && !hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_DIFFUSE_TEX1.get()).setPName("main"));
-					}
-					break;
-				case 2:
-					if (vertexDeclaration.mIsTransformed)
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZRHW_DIFFUSE_TEX2.get()).setPName("main"));
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_DIFFUSE_TEX2.get()).setPName("main"));
-					}
+#ifdef VK_EXT_extended_dynamic_state
+	if ((mDynamicRenderState & DYNAMIC_RENDER_STATE_EXTENDED) && mBoundPrimitiveType != primitiveType)
+	{
+		mCmdSetPrimitiveTopologyEXT(static_cast<VkCommandBuffer>(mCurrentDrawCommandBuffer), static_cast<VkPrimitiveTopology>(ConvertPrimitiveType(primitiveType)));
+		mBoundPrimitiveType = primitiveType;
+	}
+#endif
 
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						Log(fatal) << "CDevice9::BeginDraw point sprite not supported with hasPosition && hasColor && !hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_DIFFUSE_TEX2.get()).setPName("main"));
-					}
-					break;
-				default:
-					Log(fatal) << "CDevice9::BeginDraw unsupported texture count " << vertexDeclaration.mTextureCount << std::endl;
-					break;
-				}
-			}
-			else if (vertexDeclaration.mHasPosition && vertexDeclaration.mHasNormal && !vertexDeclaration.mHasPSize && vertexDeclaration.mHasColor1 && !vertexDeclaration.mHasColor2)
-			{
-				switch (vertexDeclaration.mTextureCount)
-				{
-				case 2:
-					shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2.get()).setPName("main"));
+	//Check to see if the stream sources have been changed and if so bind the current buffers.
+	if (deviceState.mCapturedAnyStreamSource)
+	{
+		//This runs on every stream change so avoid touching the heap.
+		std::array<vk::DeviceSize, MAX_VERTEX_INPUTS> offsets;
+		std::array<vk::Buffer, MAX_VERTEX_INPUTS> vertexBuffers;
 
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						Log(fatal) << "CDevice9::BeginDraw point sprite not supported with hasPosition && hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2.get()).setPName("main"));
-					}
-					break;
-				case 1:
-					shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX1.get()).setPName("main"));
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						Log(fatal) << "CDevice9::BeginDraw point sprite not supported with hasPosition && hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX1.get()).setPName("main"));
-					}
-					break;
-				case 0:
-					shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL_DIFFUSE.get()).setPName("main"));
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						Log(fatal) << "CDevice9::BeginDraw point sprite not supported with hasPosition && hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL_DIFFUSE.get()).setPName("main"));
-					}
-					break;
-				default:
-					Log(fatal) << "CDevice9::BeginDraw unsupported texture count " << vertexDeclaration.mTextureCount << std::endl;
-					break;
-				}
-			}
-			else if (vertexDeclaration.mHasPosition  && vertexDeclaration.mHasNormal && !vertexDeclaration.mHasPSize && !vertexDeclaration.mHasColor1 && !vertexDeclaration.mHasColor2)
+		//Each stream goes in the binding with the same index because that's what the vertex declaration refers to.
+		//Runs of neighbouring streams go in one call and BindVertexBuffers drops any slots that are already bound.
+		uint32_t firstBinding = 0;
+		uint32_t bindingCount = 0;
+		for (uint32_t i = 0; i < MAX_VERTEX_INPUTS; i++)
+		{
+			auto& streamSource = deviceState.mStreamSource[i];
+			if (streamSource.vertexBuffer && streamSource.currentVertexBuffer)
 			{
-				switch (vertexDeclaration.mTextureCount)
+				if (!bindingCount)
 				{
-				case 0:
-					shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL.get()).setPName("main"));
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						Log(fatal) << "CDevice9::BeginDraw point sprite not supported with hasPosition && !hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL.get()).setPName("main"));
-					}
-					break;
-				case 1:
-					shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL_TEX1.get()).setPName("main"));
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						Log(fatal) << "CDevice9::BeginDraw point sprite not supported with hasPosition && !hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL_TEX1.get()).setPName("main"));
-					}
-					break;
-				case 2:
-					shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eVertex).setModule(mVertShaderModule_XYZ_NORMAL_TEX2.get()).setPName("main"));
-					if (deviceState.mRenderState[D3DRS_POINTSPRITEENABLE])
-					{
-						Log(fatal) << "CDevice9::BeginDraw point sprite not supported with hasPosition && !hasColor && hasNormal && " << vertexDeclaration.mTextureCount << std::endl;
-					}
-					else
-					{
-						shaderStageInfo.push_back(vk::PipelineShaderStageCreateInfo().setStage(vk::ShaderStageFlagBits::eFragment).setModule(mFragShaderModule_XYZ_NORMAL_TEX2.get()).setPName("main"));
-					}
-					break;
-				default:
-					Log(fatal) << "CDevice9::BeginDraw unsupported texture count " << vertexDeclaration.mTextureCount << std::endl;
-					break;
+					firstBinding = i;
 				}
+				vertexBuffers[bindingCount] = streamSource.currentVertexBuffer;
+				offsets[bindingCount] = streamSource.offset;
+				bindingCount++;
 			}
-			else
-			{
-				Log(fatal) << "CDevice9::BeginDraw unsupported layout." << std::endl;
-				Log(fatal) << "CDevice9::BeginDraw hasPosition = " << vertexDeclaration.mHasPosition << std::endl;
-				Log(fatal) << "CDevice9::BeginDraw hasNormal = " << vertexDeclaration.mHasNormal << std::endl;
-				Log(fatal) << "CDevice9::BeginDraw hasPSize = " << vertexDeclaration.mHasPSize << std::endl;
-				Log(fatal) << "CDevice9::BeginDraw hasColor1 = " << vertexDeclaration.mHasColor1 << std::endl;
-				Log(fatal) << "CDevice9::BeginDraw hasColor2 = " << vertexDeclaration.mHasColor2 << std::endl;
-				Log(fatal) << "CDevice9::BeginDraw textureCount = " << vertexDeclaration.mTextureCount << std::endl;
-			}
-		}
-
-		std::vector<vk::VertexInputBindingDescription> vertexInputBindingDescription;
-		for (int32_t i = 0; i < MAX_VERTEX_INPUTS; i++)
-		{
-			auto& streamSource = deviceState.mStreamSource[i];
-			if (streamSource.vertexBuffer && streamSource.vertexBuffer->mCurrentVertexBuffer)
+			else if (bindingCount)
 			{
-				auto inputRate = (deviceState.mStreamSourceFrequency[i] == D3DSTREAMSOURCE_INSTANCEDATA) ? vk::VertexInputRate::eInstance : vk::VertexInputRate::eVertex;
-				vertexInputBindingDescription.push_back(vk::VertexInputBindingDescription(i, streamSource.stride, inputRate));
+				BindVertexBuffers(firstBinding, bindingCount, vertexBuffers.data(), offsets.data());
+				bindingCount = 0;
 			}
 		}
 
-		auto const vertexInputInfo = vk::PipelineVertexInputStateCreateInfo()
-			.setPVertexAttributeDescriptions(vertexDeclaration.mVertexInputAttributeDescription.data())
-			.setVertexAttributeDescriptionCount(vertexDeclaration.mVertexInputAttributeDescription.size())
-			.setPVertexBindingDescriptions(vertexInputBindingDescription.data())
-			.setVertexBindingDescriptionCount(vertexInputBindingDescription.size());
-
-		auto const inputAssemblyInfo = vk::PipelineInputAssemblyStateCreateInfo().setTopology(ConvertPrimitiveType(primitiveType));
-		auto const viewportInfo = vk::PipelineViewportStateCreateInfo().setViewportCount(1).setScissorCount(1);
-		auto const rasterizationInfo = vk::PipelineRasterizationStateCreateInfo()
-			.setDepthClampEnable(VK_FALSE)
-			.setRasterizerDiscardEnable(VK_FALSE)
-			.setPolygonMode(ConvertFillMode((D3DFILLMODE)deviceState.mRenderState[D3DRS_FILLMODE]))
-			.setCullMode(GetCullMode((D3DCULL)deviceState.mRenderState[D3DRS_CULLMODE]))
-			.setFrontFace(GetFrontFace((D3DCULL)deviceState.mRenderState[D3DRS_CULLMODE]))
-			.setDepthBiasEnable(VK_TRUE)
-			.setLineWidth(1.0f);
-
-		auto const multisampleInfo = vk::PipelineMultisampleStateCreateInfo();
-
-		auto const frontStencilOp = vk::StencilOpState()
-			.setReference(deviceState.mRenderState[D3DRS_STENCILREF])
-			.setCompareMask(deviceState.mRenderState[D3DRS_STENCILMASK])
-			.setWriteMask(deviceState.mRenderState[D3DRS_STENCILWRITEMASK])
-			.setFailOp(deviceState.mRenderState[D3DRS_CULLMODE] != D3DCULL_CCW ? ConvertStencilOperation((D3DSTENCILOP)deviceState.mRenderState[D3DRS_CCW_STENCILFAIL]) : ConvertStencilOperation((D3DSTENCILOP)deviceState.mRenderState[D3DRS_STENCILFAIL]))
-			.setPassOp(deviceState.mRenderState[D3DRS_CULLMODE] != D3DCULL_CCW ? ConvertStencilOperation((D3DSTENCILOP)deviceState.mRenderState[D3DRS_CCW_STENCILPASS]) : ConvertStencilOperation((D3DSTENCILOP)deviceState.mRenderState[D3DRS_STENCILPASS]))
-			.setCompareOp(deviceState.mRenderState[D3DRS_CULLMODE] != D3DCULL_CCW ? ConvertCompareOperation((D3DCMPFUNC)deviceState.mRenderState[D3DRS_CCW_STENCILFUNC]) : ConvertCompareOperation((D3DCMPFUNC)deviceState.mRenderState[D3DRS_STENCILFUNC]));
-		auto const backStencilOp = vk::StencilOpState()
-			.setReference(deviceState.mRenderState[D3DRS_STENCILREF])
-			.setCompareMask(deviceState.mRenderState[D3DRS_STENCILMASK])
-			.setWriteMask(deviceState.mRenderState[D3DRS_STENCILWRITEMASK])
-			.setFailOp(deviceState.mRenderState[D3DRS_CULLMODE] == D3DCULL_CCW ? ConvertStencilOperation((D3DSTENCILOP)deviceState.mRenderState[D3DRS_CCW_STENCILFAIL]) : ConvertStencilOperation((D3DSTENCILOP)deviceState.mRenderState[D3DRS_STENCILFAIL]))
-			.setPassOp(deviceState.mRenderState[D3DRS_CULLMODE] == D3DCULL_CCW ? ConvertStencilOperation((D3DSTENCILOP)deviceState.mRenderState[D3DRS_CCW_STENCILPASS]) : ConvertStencilOperation((D3DSTENCILOP)deviceState.mRenderState[D3DRS_STENCILPASS]))
-			.setCompareOp(deviceState.mRenderState[D3DRS_CULLMODE] == D3DCULL_CCW ? ConvertCompareOperation((D3DCMPFUNC)deviceState.mRenderState[D3DRS_CCW_STENCILFUNC]) : ConvertCompareOperation((D3DCMPFUNC)deviceState.mRenderState[D3DRS_STENCILFUNC]));
-		auto const depthStencilInfo = vk::PipelineDepthStencilStateCreateInfo()
-			.setDepthTestEnable(deviceState.mRenderState[D3DRS_ZENABLE])
-			.setDepthWriteEnable(deviceState.mRenderState[D3DRS_ZWRITEENABLE])
-			.setDepthCompareOp(ConvertCompareOperation((D3DCMPFUNC)deviceState.mRenderState[D3DRS_ZFUNC]))
-			.setDepthBoundsTestEnable(VK_FALSE)
-			.setStencilTestEnable(deviceState.mRenderState[D3DRS_STENCILENABLE])
-			.setFront(frontStencilOp)
-			.setBack(backStencilOp);
-
-		vk::PipelineColorBlendAttachmentState const colorBlendAttachments[1] =
-		{
-			vk::PipelineColorBlendAttachmentState()
-			.setColorWriteMask((vk::ColorComponentFlagBits)deviceState.mRenderState[D3DRS_COLORWRITEENABLE])
-			.setBlendEnable(deviceState.mRenderState[D3DRS_ALPHABLENDENABLE])
-			.setColorBlendOp(ConvertColorOperation((D3DBLENDOP)deviceState.mRenderState[D3DRS_BLENDOP]))
-			.setSrcColorBlendFactor(ConvertColorFactor((D3DBLEND)deviceState.mRenderState[D3DRS_SRCBLEND]))
-			.setDstColorBlendFactor(ConvertColorFactor((D3DBLEND)deviceState.mRenderState[D3DRS_DESTBLEND]))
-			.setAlphaBlendOp(ConvertColorOperation((D3DBLENDOP)deviceState.mRenderState[D3DRS_BLENDOPALPHA]))
-			.setSrcAlphaBlendFactor(ConvertColorFactor((D3DBLEND)deviceState.mRenderState[D3DRS_SRCBLENDALPHA]))
-			.setDstAlphaBlendFactor(ConvertColorFactor((D3DBLEND)deviceState.mRenderState[D3DRS_DESTBLENDALPHA]))
-		};
-		auto const colorBlendInfo = vk::PipelineColorBlendStateCreateInfo().setAttachmentCount(1).setPAttachments(colorBlendAttachments);
-
-		vk::DynamicState const dynamicStates[3] = { vk::DynamicState::eViewport, vk::DynamicState::eScissor, vk::DynamicState::eDepthBias };
-		auto const dynamicStateInfo = vk::PipelineDynamicStateCreateInfo().setPDynamicStates(dynamicStates).setDynamicStateCount(3);
-		auto const pipeline = vk::GraphicsPipelineCreateInfo()
-			.setStageCount(shaderStageInfo.size())
-			.setPStages(shaderStageInfo.data())
-			.setPVertexInputState(&vertexInputInfo)
-			.setPInputAssemblyState(&inputAssemblyInfo)
-			.setPViewportState(&viewportInfo)
-			.setPRasterizationState(&rasterizationInfo)
-			.setPMultisampleState(&multisampleInfo)
-			.setPDepthStencilState(&depthStencilInfo)
-			.setPColorBlendState(&colorBlendInfo)
-			.setPDynamicState(&dynamicStateInfo)
-			.setLayout(mPipelineLayout.get())
-			.setRenderPass(mCurrentRenderContainer->mRenderPass.get());
-
-		mPipelines[mFrameIndex].push_back(mDevice->createGraphicsPipelineUnique(mPipelineCache.get(), pipeline));
-		mCurrentDrawCommandBuffer.bindPipeline(vk::PipelineBindPoint::eGraphics, mPipelines[mFrameIndex][mPipelines[mFrameIndex].size() - 1].get());
-
-		deviceState.mCapturedVertexShader = false;
-		deviceState.mCapturedPixelShader = false;
-		deviceState.mCapturedAnyStreamFrequency = false;
-		//deviceState.mCapturedAnyStreamSource = false; //leave it on for vertex bind.
-		deviceState.mCapturedFVF = false;
-		deviceState.mCapturedVertexDeclaration = false;
-		deviceState.mCapturedRenderState[D3DRS_CULLMODE] = false;
-		deviceState.mCapturedRenderState[D3DRS_ZENABLE] = false;
-		deviceState.mCapturedRenderState[D3DRS_ZWRITEENABLE] = false;
-		deviceState.mCapturedRenderState[D3DRS_ZFUNC] = false;
-		deviceState.mCapturedRenderState[D3DRS_STENCILREF] = false;
-		deviceState.mCapturedRenderState[D3DRS_STENCILMASK] = false;
-		deviceState.mCapturedRenderState[D3DRS_STENCILWRITEMASK] = false;
-		deviceState.mCapturedRenderState[D3DRS_CCW_STENCILFAIL] = false;
-		deviceState.mCapturedRenderState[D3DRS_STENCILFAIL] = false;
-		deviceState.mCapturedRenderState[D3DRS_CCW_STENCILPASS] = false;
-		deviceState.mCapturedRenderState[D3DRS_STENCILPASS] = false;
-		deviceState.mCapturedRenderState[D3DRS_CCW_STENCILFUNC] = false;
-		deviceState.mCapturedRenderState[D3DRS_STENCILFUNC] = false;
-		deviceState.mCapturedRenderState[D3DRS_FILLMODE] = false;
-		deviceState.mCapturedRenderState[D3DRS_COLORWRITEENABLE] = false;
-		deviceState.mCapturedRenderState[D3DRS_ALPHABLENDENABLE] = false;
-		deviceState.mCapturedRenderState[D3DRS_BLENDOP] = false;
-		deviceState.mCapturedRenderState[D3DRS_SRCBLEND] = false;
-		deviceState.mCapturedRenderState[D3DRS_DESTBLEND] = false;
-		deviceState.mCapturedRenderState[D3DRS_BLENDOPALPHA] = false;
-		deviceState.mCapturedRenderState[D3DRS_SRCBLENDALPHA] = false;
-		deviceState.mCapturedRenderState[D3DRS_DESTBLENDALPHA] = false;
-		deviceState.mCapturedRenderState[D3DRS_POINTSPRITEENABLE] = false;
-		deviceState.mCapturedRenderState[D3DRS_POINTSIZE] = true;
-
-		mLastPrimitiveType = primitiveType;
-	}
-
-	//Check to see if the stream sources have been changed and if so bind the current buffers.
-	if (deviceState.mCapturedAnyStreamSource)
-	{
-		std::vector<VkDeviceSize> offsets;
-		offsets.reserve(MAX_VERTEX_INPUTS);
-
-		std::vector<vk::Buffer> vertexBuffers;
-		vertexBuffers.reserve(MAX_VERTEX_INPUTS);
-
-		for (auto& streamSource : deviceState.mStreamSource)
+		if (bindingCount)
 		{
-			if (streamSource.vertexBuffer && streamSource.vertexBuffer->mCurrentVertexBuffer)
-			{
-				vertexBuffers.push_back(streamSource.vertexBuffer->mCurrentVertexBuffer);
-				offsets.push_back(streamSource.offset);
-			}
+			BindVertexBuffers(firstBinding, bindingCount, vertexBuffers.data(), offsets.data());
 		}
 
-		mCurrentDrawCommandBuffer.bindVertexBuffers(0, vertexBuffers.size(), vertexBuffers.data(), offsets.data());
-
 		mInternalDeviceState.mDeviceState.mCapturedAnyStreamSource = false;
 	}
 
@@ -2102,10 +4236,10 @@ void CDevice9::BeginDraw(D3DPRIMITIVETYPE primitiveType)
 			switch (mInternalDeviceState.mDeviceState.mIndexBuffer->mFormat)
 			{
 			case D3DFMT_INDEX16:
-				mCurrentDrawCommandBuffer.bindIndexBuffer(mInternalDeviceState.mDeviceState.mIndexBuffer->mCurrentIndexBuffer, 0, vk::IndexType::eUint16);
+				BindIndexBuffer(mInternalDeviceState.mDeviceState.mCurrentIndexBuffer, vk::IndexType::eUint16);
 				break;
 			case D3DFMT_INDEX32:
-				mCurrentDrawCommandBuffer.bindIndexBuffer(mInternalDeviceState.mDeviceState.mIndexBuffer->mCurrentIndexBuffer, 0, vk::IndexType::eUint32);
+				BindIndexBuffer(mInternalDeviceState.mDeviceState.mCurrentIndexBuffer, vk::IndexType::eUint32);
 				break;
 			default:
 				Log(warning) << "CDevice9::BeginDraw unknown index format! - " << mInternalDeviceState.mDeviceState.mIndexBuffer->mFormat << std::endl;
@@ -2116,22 +4250,18 @@ void CDevice9::BeginDraw(D3DPRIMITIVETYPE primitiveType)
 		mInternalDeviceState.mDeviceState.mCapturedIndexBuffer = false;
 	}
 
+	//Fixed function and shader pipelines use different texture sets when bindless is on so switching between them needs the textures redone.
+	const bool bindlessTextures = mBindlessTextures && deviceState.mPixelShader == nullptr;
+	if (mBoundState.mBindlessTextures != bindlessTextures)
+	{
+		mBoundState.mBindlessTextures = bindlessTextures;
+		deviceState.mCapturedAnyTexture = true;
+	}
+
 	//Check to see if the texture stuff has changed and if so update the descriptor set.
 	if (deviceState.mCapturedAnyTexture || deviceState.mCapturedAnySamplerState) //1==1 || 
 	{
-		//If we're out of descriptor sets to write into then allocate a new one.
-		if (mDescriptorSetIndex >= (int32_t)mDescriptorSets[mFrameIndex].size())
-		{
-			vk::DescriptorSet descriptorSet;
-			vk::DescriptorSetAllocateInfo descriptorSetInfo(mDescriptorPool.get(), 1, &mDescriptorLayout.get());
-			vk::Result result = mDevice->allocateDescriptorSets(&descriptorSetInfo, &descriptorSet);
-			if (result != vk::Result::eSuccess)
-			{
-				Log(fatal) << "CDevice9::BeginDraw vkAllocateDescriptorSets failed with return code of " << result << std::endl;
-				//return;
-			}
-			mDescriptorSets[mFrameIndex].push_back(descriptorSet);
-		}
+		DescriptorSetKey descriptorSetKey;
 
 		for (int32_t i = 0; i < 16; i++)
 		{
@@ -2144,108 +4274,116 @@ void CDevice9::BeginDraw(D3DPRIMITIVETYPE primitiveType)
 				{
 					CTexture9* texture = reinterpret_cast <CTexture9*>(deviceState.mTexture[i]);
 
-					mDescriptorImageInfo[i].imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
-					mDescriptorImageInfo[i].sampler = vk::Sampler();
-					mDescriptorImageInfo[i].imageView = texture->mImageView.get();
-
-					//Look for an existing sampler.
-					for (auto& samplerContainer : mSamplerContainers)
-					{
-						if (samplerContainer->mSamplerState == deviceState.mSamplerState[i] && samplerContainer->mTextureLOD == texture->mLevels)
-						{
-							mDescriptorImageInfo[i].sampler = samplerContainer->mSampler.get();
-						}
-					}
-
-					//If no matching sampler was found then make one.
-					if (mDescriptorImageInfo[i].sampler == vk::Sampler())
-					{
-						mSamplerContainers.push_back(std::make_unique<SamplerContainer>(mDevice.get(), deviceState.mSamplerState[i], texture->mLevels));
-						mDescriptorImageInfo[i].sampler = mSamplerContainers[mSamplerContainers.size() - 1]->mSampler.get();
-					}
+					mDescriptorUpdateData.mImageInfo[i].imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+					mDescriptorUpdateData.mImageInfo[i].sampler = GetSampler(deviceState.mSamplerState[i], texture->mLevels);
+					mDescriptorUpdateData.mImageInfo[i].imageView = texture->mImageView.get();
 				}
 				break;
 				case D3DRTYPE_VOLUMETEXTURE:
 				{
-					//mDescriptorImageInfo[i].imageView = reinterpret_cast <CVolumeTexture9*>(deviceState.mTexture[i])->mImageView.get();
+					//mDescriptorUpdateData.mImageInfo[i].imageView = reinterpret_cast <CVolumeTexture9*>(deviceState.mTexture[i])->mImageView.get();
 				}
 				break;
 				case D3DRTYPE_CUBETEXTURE:
 				{
 					CCubeTexture9* texture = reinterpret_cast <CCubeTexture9*>(deviceState.mTexture[i]);
 
-					mDescriptorImageInfo[i].imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
-					mDescriptorImageInfo[i].sampler = vk::Sampler();
-					mDescriptorImageInfo[i].imageView = texture->mImageView.get();
-
-					//Look for an existing sampler.
-					for (auto& samplerContainer : mSamplerContainers)
-					{
-						if (samplerContainer->mSamplerState == deviceState.mSamplerState[i] && samplerContainer->mTextureLOD == texture->mLevels)
-						{
-							mDescriptorImageInfo[i].sampler = samplerContainer->mSampler.get();
-						}
-					}
-
-					//If no matching sampler was found then make one.
-					if (mDescriptorImageInfo[i].sampler == vk::Sampler())
-					{
-						mSamplerContainers.push_back(std::make_unique<SamplerContainer>(mDevice.get(), deviceState.mSamplerState[i], texture->mLevels));
-						mDescriptorImageInfo[i].sampler = mSamplerContainers[mSamplerContainers.size() - 1]->mSampler.get();
-					}
+					mDescriptorUpdateData.mImageInfo[i].imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+					mDescriptorUpdateData.mImageInfo[i].sampler = GetSampler(deviceState.mSamplerState[i], texture->mLevels);
+					mDescriptorUpdateData.mImageInfo[i].imageView = texture->mImageView.get();
 				}
 				break;
 				}
 			}
 			else
 			{
-				mDescriptorImageInfo[i].imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
-				mDescriptorImageInfo[i].sampler = vk::Sampler();
-				mDescriptorImageInfo[i].imageView = mBlankTexture->mImageView.get();
+				mDescriptorUpdateData.mImageInfo[i].imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal;
+				mDescriptorUpdateData.mImageInfo[i].sampler = GetSampler(deviceState.mSamplerState[i], 0);
+				mDescriptorUpdateData.mImageInfo[i].imageView = mBlankTexture->mImageView.get();
+			}
 
-				//Look for an existing sampler.
-				for (auto& samplerContainer : mSamplerContainers)
-				{
-					if (samplerContainer->mSamplerState == deviceState.mSamplerState[i] && samplerContainer->mTextureLOD == 0)
-					{
-						mDescriptorImageInfo[i].sampler = samplerContainer->mSampler.get();
-					}
-				}
+			descriptorSetKey.mImageViews[i] = static_cast<VkImageView>(mDescriptorUpdateData.mImageInfo[i].imageView);
+			descriptorSetKey.mSamplers[i] = static_cast<VkSampler>(mDescriptorUpdateData.mImageInfo[i].sampler);
+		}
 
-				//If no matching sampler was found then make one.
-				if (mDescriptorImageInfo[i].sampler == vk::Sampler())
-				{
-					mSamplerContainers.push_back(std::make_unique<SamplerContainer>(mDevice.get(), deviceState.mSamplerState[i], 0));
-					mDescriptorImageInfo[i].sampler = mSamplerContainers[mSamplerContainers.size() - 1]->mSampler.get();
-				}
+		deviceState.mCapturedAnySamplerState = false;
+		deviceState.mCapturedAnyTexture = false;
+
+		//With bindless textures the array is already bound so only the indices need pushing.
+		//With push descriptors there is no set to find or write, the descriptors go straight into the command buffer.
+		auto& descriptorSetCache = mDescriptorSetCache[mFrameIndex];
+		vk::DescriptorSet descriptorSet;
+		if (bindlessTextures)
+		{
+			std::array<uint32_t, 8> textureIndices = {};
+			for (uint32_t i = 0; i < 16; i++)
+			{
+				textureIndices[i >> 1] |= GetBindlessTextureIndex(mDescriptorUpdateData.mImageInfo[i].imageView, mDescriptorUpdateData.mImageInfo[i].sampler) << ((i & 1) * 16);
 			}
-		}
 
-		mLastDescriptorSet = mDescriptorSets[mFrameIndex][mDescriptorSetIndex];
+			BindDescriptorSet(mBindlessDescriptorSet);
 
-		mWriteDescriptorSet[0].dstSet = mLastDescriptorSet;
-		mWriteDescriptorSet[1].dstSet = mLastDescriptorSet;
-		mWriteDescriptorSet[2].dstSet = mLastDescriptorSet;
-		mWriteDescriptorSet[3].dstSet = mLastDescriptorSet;
-		mWriteDescriptorSet[4].dstSet = mLastDescriptorSet;
-		mWriteDescriptorSet[5].dstSet = mLastDescriptorSet;
-		mWriteDescriptorSet[6].dstSet = mLastDescriptorSet;
-		mWriteDescriptorSet[6].pImageInfo = mDescriptorImageInfo;
-		mWriteDescriptorSet[7].dstSet = mLastDescriptorSet;
-		mWriteDescriptorSet[8].dstSet = mLastDescriptorSet;
+			if (!mBoundState.mTextureIndicesPushed || mBoundState.mTextureIndices != textureIndices)
+			{
+				mCurrentDrawCommandBuffer.pushConstants(mBindlessPipelineLayout.get(), vk::ShaderStageFlagBits::eFragment, TEXTURE_INDEX_PUSH_CONSTANT_OFFSET, sizeof(textureIndices), textureIndices.data());
+				mBoundState.mTextureIndices = textureIndices;
+				mBoundState.mTextureIndicesPushed = true;
+				mBindsIssued++;
+			}
+			else
+			{
+				mBindsSkipped++;
+			}
+		}
+		else if (mPushDescriptors)
+		{
+#ifdef VK_KHR_push_descriptor
+			mCmdPushDescriptorSetWithTemplateKHR(static_cast<VkCommandBuffer>(mCurrentDrawCommandBuffer), static_cast<VkDescriptorUpdateTemplate>(mDescriptorUpdateTemplate.get()), static_cast<VkPipelineLayout>(mPipelineLayout.get()), 1, &mDescriptorUpdateData);
+			mBoundState.mDescriptorSet = vk::DescriptorSet(); //Whatever set was bound there has been replaced.
+#endif
+		}
+		//If this combination was already written this frame just bind that set again.
+		else if ((descriptorSet = descriptorSetCache.Find(descriptorSetKey)))
+		{
+			BindDescriptorSet(descriptorSet);
+		}
+		else
+		{
+			descriptorSet = AllocateTextureDescriptorSet();
+			if (!descriptorSet)
+			{
+				deviceState.mCapturedAnyTexture = true; //Try again on the next draw.
+				return false;
+			}
 
-		mDevice->updateDescriptorSets(9, &mWriteDescriptorSet[0], 0, nullptr);
-		mCurrentDrawCommandBuffer.bindDescriptorSets(vk::PipelineBindPoint::eGraphics, mPipelineLayout.get(), 0, 1, &mLastDescriptorSet, 0, nullptr);
+			mDevice->updateDescriptorSetWithTemplate(descriptorSet, mDescriptorUpdateTemplate.get(), &mDescriptorUpdateData);
+			BindDescriptorSet(descriptorSet);
 
-		deviceState.mCapturedAnySamplerState = false;
-		deviceState.mCapturedAnyTexture = false;
+			descriptorSetCache.Insert(descriptorSetKey, descriptorSet);
+		}
+	}
 
-		mDescriptorSetIndex++;
+	//Push constants carry over between the two pipeline layouts because their ranges match.
+	if (!mBoundState.mMVPPushed)
+	{
+		mCurrentDrawCommandBuffer.pushConstants(mPipelineLayout.get(), vk::ShaderStageFlagBits::eVertex, MVP_PUSH_CONSTANT_OFFSET, sizeof(D3DMATRIX), &GetModelViewProjection());
+		mBoundState.mMVPPushed = true;
+	}
+
+	const uint32_t alphaReference = deviceState.mRenderState[D3DRS_ALPHAREF];
+	if (!mBoundState.mAlphaReferencePushed || mBoundState.mAlphaReference != alphaReference)
+	{
+		mCurrentDrawCommandBuffer.pushConstants(mPipelineLayout.get(), vk::ShaderStageFlagBits::eFragment, ALPHA_REFERENCE_PUSH_CONSTANT_OFFSET, sizeof(uint32_t), &alphaReference);
+		mBoundState.mAlphaReference = alphaReference;
+		mBoundState.mAlphaReferencePushed = true;
 	}
 
+	//Write whatever state changed since the last draw into the uniform ring.
+	FlushUniformBlocks();
+
 	if (mIsDrawing)
 	{
-		return;
+		return true;
 	}
 
 	vk::RenderPassBeginInfo renderPassBeginInfo;
@@ -2260,6 +4398,8 @@ void CDevice9::BeginDraw(D3DPRIMITIVETYPE primitiveType)
 	mCurrentDrawCommandBuffer.beginRenderPass(&renderPassBeginInfo, vk::SubpassContents::eInline);
 
 	mIsDrawing = true;
+
+	return true;
 }
 
 void CDevice9::StopDraw()
@@ -2294,6 +4434,13 @@ void CDevice9::RebuildRenderPass()
 
 HRESULT STDMETHODCALLTYPE CDevice9::Clear(DWORD Count, const D3DRECT *pRects, DWORD Flags, D3DCOLOR Color, float Z, DWORD Stencil)
 {
+	if (QueueCommands())
+	{
+		mCommandStream->Push(WorkItemType::Device_Clear, Count, CommandData{ pRects, Count * sizeof(D3DRECT) }, Flags, Color, Z, Stencil);
+
+		return D3D_OK;
+	}
+
 	BeginRecordingCommands();
 	StopDraw(); //Stop render pass if there is one open.
 
@@ -2301,16 +4448,17 @@ HRESULT STDMETHODCALLTYPE CDevice9::Clear(DWORD Count, const D3DRECT *pRects, DW
 	https://www.khronos.org/registry/vulkan/specs/1.1-extensions/man/html/VkRenderPassBeginInfo.html
 	The array is indexed by attachment number. Only elements corresponding to cleared attachments are used. Other elements of pClearValues are ignored.
 	*/
-	std::vector<vk::ClearValue> clearValues;
+	std::array<vk::ClearValue, 5> clearValues;
+	uint32_t clearValueCount = 0;
 	const std::array<float, 4> colorValues = { D3DCOLOR_R(Color), D3DCOLOR_G(Color), D3DCOLOR_B(Color), D3DCOLOR_A(Color) };
 	for (auto& renderTarget : mRenderTargets)
 	{
 		if (renderTarget)
 		{
-			clearValues.push_back(vk::ClearColorValue(colorValues));
+			clearValues[clearValueCount++] = vk::ClearColorValue(colorValues);
 		}
 	}
-	clearValues.push_back(vk::ClearDepthStencilValue(Z, Stencil));
+	clearValues[clearValueCount++] = vk::ClearDepthStencilValue(Z, Stencil);
 
 	if (((Flags & D3DCLEAR_TARGET) == D3DCLEAR_TARGET) && (((Flags & D3DCLEAR_STENCIL) == D3DCLEAR_STENCIL) || ((Flags & D3DCLEAR_ZBUFFER) == D3DCLEAR_ZBUFFER)))
 	{
@@ -2321,16 +4469,13 @@ HRESULT STDMETHODCALLTYPE CDevice9::Clear(DWORD Count, const D3DRECT *pRects, DW
 		renderPassBeginInfo.renderArea.offset.y = 0;
 		renderPassBeginInfo.renderArea.extent.width = mPresentationParameters.BackBufferWidth;
 		renderPassBeginInfo.renderArea.extent.height = mPresentationParameters.BackBufferHeight;
-		renderPassBeginInfo.clearValueCount = clearValues.size();
+		renderPassBeginInfo.clearValueCount = clearValueCount;
 		renderPassBeginInfo.pClearValues = clearValues.data();
 		mCurrentDrawCommandBuffer.beginRenderPass(&renderPassBeginInfo, vk::SubpassContents::eInline);
 		mCurrentDrawCommandBuffer.endRenderPass();
 	}
 	else if ((Flags & D3DCLEAR_TARGET) == D3DCLEAR_TARGET)
 	{
-		std::array<float, 4> colorValues = { D3DCOLOR_R(Color), D3DCOLOR_G(Color), D3DCOLOR_B(Color), D3DCOLOR_A(Color) };
-		clearValues.push_back(vk::ClearColorValue(colorValues));
-
 		vk::RenderPassBeginInfo renderPassBeginInfo;
 		renderPassBeginInfo.renderPass = mCurrentRenderContainer->mClearColorRenderPass.get();
 		renderPassBeginInfo.framebuffer = mCurrentRenderContainer->mClearColorFrameBuffers[mFrameIndex].get();
@@ -2338,15 +4483,13 @@ HRESULT STDMETHODCALLTYPE CDevice9::Clear(DWORD Count, const D3DRECT *pRects, DW
 		renderPassBeginInfo.renderArea.offset.y = 0;
 		renderPassBeginInfo.renderArea.extent.width = mPresentationParameters.BackBufferWidth;
 		renderPassBeginInfo.renderArea.extent.height = mPresentationParameters.BackBufferHeight;
-		renderPassBeginInfo.clearValueCount = clearValues.size();
+		renderPassBeginInfo.clearValueCount = clearValueCount;
 		renderPassBeginInfo.pClearValues = clearValues.data();
 		mCurrentDrawCommandBuffer.beginRenderPass(&renderPassBeginInfo, vk::SubpassContents::eInline);
 		mCurrentDrawCommandBuffer.endRenderPass();
 	}
 	else if (((Flags & D3DCLEAR_STENCIL) == D3DCLEAR_STENCIL) || ((Flags & D3DCLEAR_ZBUFFER) == D3DCLEAR_ZBUFFER))
 	{
-		clearValues.push_back(vk::ClearDepthStencilValue(Z, Stencil));
-
 		vk::RenderPassBeginInfo renderPassBeginInfo;
 		renderPassBeginInfo.renderPass = mCurrentRenderContainer->mClearDepthRenderPass.get();
 		renderPassBeginInfo.framebuffer = mCurrentRenderContainer->mClearDepthFrameBuffers[mFrameIndex].get();
@@ -2354,7 +4497,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::Clear(DWORD Count, const D3DRECT *pRects, DW
 		renderPassBeginInfo.renderArea.offset.y = 0;
 		renderPassBeginInfo.renderArea.extent.width = mPresentationParameters.BackBufferWidth;
 		renderPassBeginInfo.renderArea.extent.height = mPresentationParameters.BackBufferHeight;
-		renderPassBeginInfo.clearValueCount = clearValues.size();
+		renderPassBeginInfo.clearValueCount = clearValueCount;
 		renderPassBeginInfo.pClearValues = clearValues.data();
 		mCurrentDrawCommandBuffer.beginRenderPass(&renderPassBeginInfo, vk::SubpassContents::eInline);
 		mCurrentDrawCommandBuffer.endRenderPass();
@@ -2365,6 +4508,13 @@ HRESULT STDMETHODCALLTYPE CDevice9::Clear(DWORD Count, const D3DRECT *pRects, DW
 
 HRESULT STDMETHODCALLTYPE CDevice9::BeginScene() //
 {
+	if (QueueCommands())
+	{
+		mCommandStream->Push(WorkItemType::Device_BeginScene);
+
+		return D3D_OK;
+	}
+
 	BeginRecordingCommands();
 
 	//According to a tip from the Nine team games don't always use the begin/end scene functions correctly.
@@ -2381,7 +4531,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::EndScene()
 
 HRESULT STDMETHODCALLTYPE CDevice9::Present(const RECT *pSourceRect, const RECT *pDestRect, HWND hDestWindowOverride, const RGNDATA *pDirtyRegion)
 {
-	return mSwapChains[0]->Present(pSourceRect, pDestRect, hDestWindowOverride, pDirtyRegion, 0/*dwFlags*/);
+	return PresentEx(pSourceRect, pDestRect, hDestWindowOverride, pDirtyRegion, 0/*dwFlags*/);
 }
 
 ULONG STDMETHODCALLTYPE CDevice9::AddRef(void)
@@ -2427,6 +4577,9 @@ ULONG STDMETHODCALLTYPE CDevice9::Release(void)
 
 HRESULT STDMETHODCALLTYPE CDevice9::BeginStateBlock()
 {
+	//Setters check for a recording state block so the worker has to be done with the ones already queued.
+	SynchronizeCommandStream();
+
 	mRecordedDeviceState = new CStateBlock9(this, (D3DSTATEBLOCKTYPE)0);
 
 	mRecordedDeviceState->PrivateAddRef();
@@ -2436,6 +4589,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::BeginStateBlock()
 
 HRESULT STDMETHODCALLTYPE CDevice9::ColorFill(IDirect3DSurface9 *pSurface, const RECT *pRect, D3DCOLOR color)
 {
+	SynchronizeCommandStream();
+
 	BeginRecordingCommands();
 
 	//TODO: Implement.
@@ -2642,21 +4797,48 @@ HRESULT STDMETHODCALLTYPE CDevice9::DeletePatch(UINT Handle)
 	return E_NOTIMPL;
 }
 
-HRESULT STDMETHODCALLTYPE CDevice9::DrawIndexedPrimitive(D3DPRIMITIVETYPE Type, INT BaseVertexIndex, UINT MinIndex, UINT NumVertices, UINT StartIndex, UINT PrimitiveCount)
-{
+HRESULT STDMETHODCALLTYPE CDevice9::DrawIndexedPrimitive(D3DPRIMITIVETYPE Type, INT BaseVertexIndex, UINT MinIndex, UINT NumVertices, UINT StartIndex, UINT PrimitiveCount)
+{
+	if (QueueCommands())
+	{
+		auto lock = mCommandStream->LockProducer();
+		mCommandStream->Push(WorkItemType::Device_DrawIndexedPrimitive, Type, BaseVertexIndex, MinIndex, NumVertices, StartIndex, PrimitiveCount, CommandData{ GetRenamedBuffers(), sizeof(mRenamedBuffers) });
+
+		return D3D_OK;
+	}
+
+	if (!mCommandStream)
+	{
+		SetRenamedBuffers(GetRenamedBuffers());
+	}
+
+	const auto drawStart = StartDrawTime();
 	BeginRecordingCommands();
 
-	BeginDraw(Type);
+	if (BeginDraw(Type))
 	{
 		mCurrentDrawCommandBuffer.drawIndexed(ConvertPrimitiveCountToVertexCount(Type, PrimitiveCount), 1, StartIndex, BaseVertexIndex, 0);
 	}
 	//StopDraw();
 
+	RecordDrawTime(drawStart);
+
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::DrawIndexedPrimitiveUP(D3DPRIMITIVETYPE PrimitiveType, UINT MinVertexIndex, UINT NumVertices, UINT PrimitiveCount, const void *pIndexData, D3DFORMAT IndexDataFormat, const void *pVertexStreamZeroData, UINT VertexStreamZeroStride)
 {
+	if (QueueCommands())
+	{
+		const size_t indexSize = ConvertPrimitiveCountToBufferSize(PrimitiveType, PrimitiveCount, (IndexDataFormat == D3DFMT_INDEX16) ? 2 : 4);
+		const size_t vertexSize = ConvertPrimitiveCountToBufferSize(PrimitiveType, PrimitiveCount, VertexStreamZeroStride);
+
+		mCommandStream->Push(WorkItemType::Device_DrawIndexedPrimitiveUP, PrimitiveType, MinVertexIndex, NumVertices, PrimitiveCount, CommandData{ pIndexData, indexSize }, IndexDataFormat, CommandData{ pVertexStreamZeroData, vertexSize }, VertexStreamZeroStride);
+
+		return D3D_OK;
+	}
+
+	const auto drawStart = StartDrawTime();
 	BeginRecordingCommands();
 
 	mCurrentDrawCommandBuffer.updateBuffer(mUpVertexBuffer.get(), 0, ConvertPrimitiveCountToBufferSize(PrimitiveType, PrimitiveCount, VertexStreamZeroStride), pVertexStreamZeroData);
@@ -2669,23 +4851,23 @@ HRESULT STDMETHODCALLTYPE CDevice9::DrawIndexedPrimitiveUP(D3DPRIMITIVETYPE Prim
 		mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
 	}
 
-	BeginDraw(PrimitiveType);
+	if (BeginDraw(PrimitiveType))
 	{
 		mInternalDeviceState.mDeviceState.mCapturedAnyStreamSource = true; //Mark vertex streams as dirty so next draw will reset them.
 		mInternalDeviceState.mDeviceState.mCapturedIndexBuffer = true;
 
 		//TODO: check to see if I need a new pipeline. (I probably do because I'm getting a new stride)
 
-		const VkDeviceSize offsetInBytes = 0;
-		mCurrentDrawCommandBuffer.bindVertexBuffers(0, 1, &mUpVertexBuffer.get(), &offsetInBytes);
+		const vk::DeviceSize offsetInBytes = 0;
+		BindVertexBuffers(0, 1, &mUpVertexBuffer.get(), &offsetInBytes);
 
 		switch (IndexDataFormat)
 		{
 		case D3DFMT_INDEX16:
-			mCurrentDrawCommandBuffer.bindIndexBuffer(mUpIndexBuffer.get(), 0, vk::IndexType::eUint16);
+			BindIndexBuffer(mUpIndexBuffer.get(), vk::IndexType::eUint16);
 			break;
 		case D3DFMT_INDEX32:
-			mCurrentDrawCommandBuffer.bindIndexBuffer(mUpIndexBuffer.get(), 0, vk::IndexType::eUint32);
+			BindIndexBuffer(mUpIndexBuffer.get(), vk::IndexType::eUint32);
 			break;
 		default:
 			Log(warning) << "CDevice9::DrawIndexedPrimitiveUP unknown index format! - " << IndexDataFormat << std::endl;
@@ -2696,24 +4878,50 @@ HRESULT STDMETHODCALLTYPE CDevice9::DrawIndexedPrimitiveUP(D3DPRIMITIVETYPE Prim
 	}
 	//StopDraw();
 
+	RecordDrawTime(drawStart);
+
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::DrawPrimitive(D3DPRIMITIVETYPE PrimitiveType, UINT StartVertex, UINT PrimitiveCount)
 {
+	if (QueueCommands())
+	{
+		auto lock = mCommandStream->LockProducer();
+		mCommandStream->Push(WorkItemType::Device_DrawPrimitive, PrimitiveType, StartVertex, PrimitiveCount, CommandData{ GetRenamedBuffers(), sizeof(mRenamedBuffers) });
+
+		return D3D_OK;
+	}
+
+	if (!mCommandStream)
+	{
+		SetRenamedBuffers(GetRenamedBuffers());
+	}
+
+	const auto drawStart = StartDrawTime();
 	BeginRecordingCommands();
 
-	BeginDraw(PrimitiveType);
+	if (BeginDraw(PrimitiveType))
 	{
 		mCurrentDrawCommandBuffer.draw(ConvertPrimitiveCountToVertexCount(PrimitiveType, PrimitiveCount), 1, StartVertex, 0);
 	}
 	//StopDraw();
 
+	RecordDrawTime(drawStart);
+
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::DrawPrimitiveUP(D3DPRIMITIVETYPE PrimitiveType, UINT PrimitiveCount, const void *pVertexStreamZeroData, UINT VertexStreamZeroStride)
 {
+	if (QueueCommands())
+	{
+		mCommandStream->Push(WorkItemType::Device_DrawPrimitiveUP, PrimitiveType, PrimitiveCount, CommandData{ pVertexStreamZeroData, ConvertPrimitiveCountToBufferSize(PrimitiveType, PrimitiveCount, VertexStreamZeroStride) }, VertexStreamZeroStride);
+
+		return D3D_OK;
+	}
+
+	const auto drawStart = StartDrawTime();
 	BeginRecordingCommands();
 
 	mCurrentDrawCommandBuffer.updateBuffer(mUpVertexBuffer.get(), 0, ConvertPrimitiveCountToBufferSize(PrimitiveType, PrimitiveCount, VertexStreamZeroStride), pVertexStreamZeroData);
@@ -2725,19 +4933,21 @@ HRESULT STDMETHODCALLTYPE CDevice9::DrawPrimitiveUP(D3DPRIMITIVETYPE PrimitiveTy
 		mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
 	}
 
-	BeginDraw(PrimitiveType);
+	if (BeginDraw(PrimitiveType))
 	{
 		mInternalDeviceState.mDeviceState.mCapturedAnyStreamSource = true; //Mark vertex streams as dirty so next draw will reset them.
 
 		//TODO: check to see if I need a new pipeline. (I probably do because I'm getting a new stride)
 
-		const VkDeviceSize offsetInBytes = 0;
-		mCurrentDrawCommandBuffer.bindVertexBuffers(0, 1, &mUpVertexBuffer.get(), &offsetInBytes);
+		const vk::DeviceSize offsetInBytes = 0;
+		BindVertexBuffers(0, 1, &mUpVertexBuffer.get(), &offsetInBytes);
 
 		mCurrentDrawCommandBuffer.draw(ConvertPrimitiveCountToVertexCount(PrimitiveType, PrimitiveCount), 1, 0, 0);
 	}
 	//StopDraw();
 
+	RecordDrawTime(drawStart);
+
 	return D3D_OK;
 }
 
@@ -2803,7 +5013,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetBackBuffer(UINT  iSwapChain, UINT BackBuf
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetClipPlane(DWORD Index, float* pPlane)
 {
-	memcpy(pPlane, &mInternalDeviceState.mDeviceState.mClipPlane[Index], 4 * sizeof(float));
+	memcpy(pPlane, &GetApplicationDeviceState().mClipPlane[Index], 4 * sizeof(float));
 
 	return D3D_OK;
 }
@@ -2829,7 +5039,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetCreationParameters(D3DDEVICE_CREATION_PAR
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetCurrentTexturePalette(UINT *pPaletteNumber)
 {
-	(*pPaletteNumber) = mInternalDeviceState.mDeviceState.mPaletteNumber;
+	(*pPaletteNumber) = GetApplicationDeviceState().mPaletteNumber;
 
 	return D3D_OK;
 }
@@ -2871,12 +5081,14 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetDisplayMode(UINT  iSwapChain, D3DDISPLAYM
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetFrontBufferData(UINT  iSwapChain, IDirect3DSurface9 *pDestSurface)
 {
+	SynchronizeCommandStream();
+
 	return mSwapChains[iSwapChain]->GetFrontBufferData(pDestSurface);
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetFVF(DWORD *pFVF)
 {
-	(*pFVF) = mInternalDeviceState.mDeviceState.mFVF;
+	(*pFVF) = GetApplicationDeviceState().mFVF;
 
 	return D3D_OK;
 }
@@ -2895,7 +5107,7 @@ void STDMETHODCALLTYPE CDevice9::GetGammaRamp(UINT  iSwapChain, D3DGAMMARAMP *pR
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetIndices(IDirect3DIndexBuffer9 **ppIndexData) //,UINT *pBaseVertexIndex ?
 {
-	(*ppIndexData) = mInternalDeviceState.mDeviceState.mIndexBuffer;
+	(*ppIndexData) = GetApplicationDeviceState().mIndexBuffer;
 
 	if ((*ppIndexData) != nullptr)
 	{
@@ -2907,28 +5119,28 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetIndices(IDirect3DIndexBuffer9 **ppIndexDa
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetLight(DWORD Index, D3DLIGHT9 *pLight)
 {
-	(*pLight) = mInternalDeviceState.mDeviceState.mLight[Index];
+	(*pLight) = GetApplicationDeviceState().mLight[Index];
 
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetLightEnable(DWORD Index, BOOL *pEnable)
 {
-	(*pEnable) = mInternalDeviceState.mDeviceState.mLightEnableState[Index];
+	(*pEnable) = GetApplicationDeviceState().mLightEnableState[Index];
 
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetMaterial(D3DMATERIAL9 *pMaterial)
 {
-	(*pMaterial) = mInternalDeviceState.mDeviceState.mMaterial;
+	(*pMaterial) = GetApplicationDeviceState().mMaterial;
 
 	return D3D_OK;
 }
 
 FLOAT STDMETHODCALLTYPE CDevice9::GetNPatchMode()
 {
-	return mInternalDeviceState.mDeviceState.mNPatchMode;
+	return GetApplicationDeviceState().mNPatchMode;
 }
 
 UINT STDMETHODCALLTYPE CDevice9::GetNumberOfSwapChains()
@@ -2951,7 +5163,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetPaletteEntries(UINT PaletteNumber, PALETT
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShader(IDirect3DPixelShader9 **ppShader)
 {
-	(*ppShader) = mInternalDeviceState.mDeviceState.mPixelShader;
+	(*ppShader) = GetApplicationDeviceState().mPixelShader;
 
 	if ((*ppShader) != nullptr)
 	{
@@ -2962,21 +5174,21 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShader(IDirect3DPixelShader9 **ppSha
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShaderConstantB(UINT StartRegister, BOOL *pConstantData, UINT BoolCount)
 {
-	memcpy(pConstantData, &mInternalDeviceState.mDeviceState.mPixelShaderConstantB[StartRegister], BoolCount * sizeof(int));
+	memcpy(pConstantData, &GetApplicationDeviceState().mPixelShaderConstantB[StartRegister], BoolCount * sizeof(int));
 
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShaderConstantF(UINT StartRegister, float *pConstantData, UINT Vector4fCount)
 {
-	memcpy(pConstantData, &mInternalDeviceState.mDeviceState.mPixelShaderConstantF[StartRegister], Vector4fCount * sizeof(float[4]));
+	memcpy(pConstantData, &GetApplicationDeviceState().mPixelShaderConstantF[StartRegister], Vector4fCount * sizeof(float[4]));
 
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShaderConstantI(UINT StartRegister, int *pConstantData, UINT Vector4iCount)
 {
-	memcpy(pConstantData, &mInternalDeviceState.mDeviceState.mPixelShaderConstantI[StartRegister], Vector4iCount * sizeof(int[4]));
+	memcpy(pConstantData, &GetApplicationDeviceState().mPixelShaderConstantI[StartRegister], Vector4iCount * sizeof(int[4]));
 
 	return D3D_OK;
 }
@@ -2988,7 +5200,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetRasterStatus(UINT  iSwapChain, D3DRASTER_
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetRenderState(D3DRENDERSTATETYPE State, DWORD* pValue)
 {
-	(*pValue) = mInternalDeviceState.mDeviceState.mRenderState[State];
+	(*pValue) = GetApplicationDeviceState().mRenderState[State];
 
 	return D3D_OK;
 }
@@ -3017,12 +5229,12 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetSamplerState(DWORD Sampler, D3DSAMPLERSTA
 
 	if (index < 16)
 	{
-		(*pValue) = mInternalDeviceState.mDeviceState.mSamplerState[index][Type];
+		(*pValue) = GetApplicationDeviceState().mSamplerState[index][Type];
 	}
 	else if (index >= D3DVERTEXTEXTURESAMPLER0)
 	{
 		index = 16 + (index - D3DVERTEXTEXTURESAMPLER0);
-		(*pValue) = mInternalDeviceState.mDeviceState.mSamplerState[index][Type];
+		(*pValue) = GetApplicationDeviceState().mSamplerState[index][Type];
 	}
 	//else
 	//{
@@ -3034,7 +5246,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetSamplerState(DWORD Sampler, D3DSAMPLERSTA
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetScissorRect(RECT* pRect)
 {
-	(*pRect) = mInternalDeviceState.mDeviceState.mScissorRect;
+	(*pRect) = GetApplicationDeviceState().mScissorRect;
 
 	return D3D_OK;
 }
@@ -3050,7 +5262,7 @@ BOOL STDMETHODCALLTYPE CDevice9::GetSoftwareVertexProcessing()
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetStreamSource(UINT StreamNumber, IDirect3DVertexBuffer9** ppStreamData, UINT* pOffsetInBytes, UINT* pStride)
 {
-	auto& entry = mInternalDeviceState.mDeviceState.mStreamSource[StreamNumber];
+	auto& entry = GetApplicationDeviceState().mStreamSource[StreamNumber];
 
 	(*ppStreamData) = entry.vertexBuffer;
 	(*pOffsetInBytes) = entry.offset;
@@ -3061,7 +5273,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetStreamSource(UINT StreamNumber, IDirect3D
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetStreamSourceFreq(UINT StreamNumber, UINT *pDivider)
 {
-	(*pDivider) = mInternalDeviceState.mDeviceState.mStreamSourceFrequency[StreamNumber];
+	(*pDivider) = GetApplicationDeviceState().mStreamSourceFrequency[StreamNumber];
 
 	return D3D_OK;
 }
@@ -3092,7 +5304,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetTexture(DWORD Stage, IDirect3DBaseTexture
 	//TODO: revisit
 	if (Stage < 16)
 	{
-		(*ppTexture) = mInternalDeviceState.mDeviceState.mTexture[Stage];
+		(*ppTexture) = GetApplicationDeviceState().mTexture[Stage];
 	}
 	else
 	{
@@ -3109,21 +5321,21 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetTexture(DWORD Stage, IDirect3DBaseTexture
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD* pValue)
 {
-	(*pValue) = mInternalDeviceState.mDeviceState.mTextureStageState[Stage][Type];
+	(*pValue) = GetApplicationDeviceState().mTextureStageState[Stage][Type];
 
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetTransform(D3DTRANSFORMSTATETYPE State, D3DMATRIX* pMatrix)
 {
-	(*pMatrix) = mInternalDeviceState.mDeviceState.mTransform[State];
+	(*pMatrix) = GetApplicationDeviceState().mTransform[State];
 
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexDeclaration(IDirect3DVertexDeclaration9** ppDecl)
 {
-	(*ppDecl) = mInternalDeviceState.mDeviceState.mVertexDeclaration;
+	(*ppDecl) = GetApplicationDeviceState().mVertexDeclaration;
 
 	if ((*ppDecl) != nullptr)
 	{
@@ -3135,7 +5347,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetVertexDeclaration(IDirect3DVertexDeclarat
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShader(IDirect3DVertexShader9** ppShader)
 {
-	(*ppShader) = mInternalDeviceState.mDeviceState.mVertexShader;
+	(*ppShader) = GetApplicationDeviceState().mVertexShader;
 
 	if ((*ppShader) != nullptr)
 	{
@@ -3146,28 +5358,28 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShader(IDirect3DVertexShader9** ppS
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShaderConstantB(UINT StartRegister, BOOL* pConstantData, UINT BoolCount)
 {
-	memcpy(pConstantData, &mInternalDeviceState.mDeviceState.mVertexShaderConstantB[StartRegister], BoolCount * sizeof(int));
+	memcpy(pConstantData, &GetApplicationDeviceState().mVertexShaderConstantB[StartRegister], BoolCount * sizeof(int));
 
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShaderConstantF(UINT StartRegister, float* pConstantData, UINT Vector4fCount)
 {
-	memcpy(pConstantData, &mInternalDeviceState.mDeviceState.mVertexShaderConstantF[StartRegister], Vector4fCount * sizeof(float[4]));
+	memcpy(pConstantData, &GetApplicationDeviceState().mVertexShaderConstantF[StartRegister], Vector4fCount * sizeof(float[4]));
 
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShaderConstantI(UINT StartRegister, int* pConstantData, UINT Vector4iCount)
 {
-	memcpy(pConstantData, &mInternalDeviceState.mDeviceState.mVertexShaderConstantI[StartRegister], Vector4iCount * sizeof(int[4]));
+	memcpy(pConstantData, &GetApplicationDeviceState().mVertexShaderConstantI[StartRegister], Vector4iCount * sizeof(int[4]));
 
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetViewport(D3DVIEWPORT9* pViewport)
 {
-	(*pViewport) = mInternalDeviceState.mDeviceState.mViewport;
+	(*pViewport) = GetApplicationDeviceState().mViewport;
 
 	return D3D_OK;
 }
@@ -3180,19 +5392,18 @@ HRESULT STDMETHODCALLTYPE CDevice9::LightEnable(DWORD LightIndex, BOOL bEnable)
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.LightEnable(LightIndex, bEnable);
 
-		mCurrentDrawCommandBuffer.updateBuffer(mLightEnableBuffer.get(), LightIndex * (sizeof(BOOL) * 4), sizeof(BOOL), &bEnable);
+			mCommandStream->Push(WorkItemType::Device_LightEnable, LightIndex, bEnable);
 
-		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+			return D3D_OK;
 		}
 
 		mInternalDeviceState.LightEnable(LightIndex, bEnable);
+		mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_LIGHT_ENABLE);
 	}
 
 	return D3D_OK;
@@ -3227,6 +5438,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::Reset(D3DPRESENT_PARAMETERS *pPresentationPa
 		memcpy(&mPresentationParameters, pPresentationParameters, sizeof(D3DPRESENT_PARAMETERS));
 	}
 
+	SynchronizeCommandStream();
+
 	StopDraw(); //Stop render pass if there is one open.
 	StopRecordingCommands();
 	mDevice->waitIdle();
@@ -3243,6 +5456,16 @@ HRESULT CDevice9::SetClipPlane(DWORD Index, const float *pPlane)
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetClipPlane(Index, pPlane);
+
+			mCommandStream->Push(WorkItemType::Device_SetClipPlane, Index, CommandData{ pPlane, sizeof(float[4]) });
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
 		mInternalDeviceState.SetClipPlane(Index, pPlane);
@@ -3268,6 +5491,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetCurrentTexturePalette(UINT PaletteNumber)
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetCurrentTexturePalette(PaletteNumber);
+
+			mCommandStream->Push(WorkItemType::Device_SetCurrentTexturePalette, PaletteNumber);
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
 		mInternalDeviceState.SetCurrentTexturePalette(PaletteNumber);
@@ -3296,6 +5529,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetCursorProperties(UINT XHotSpot, UINT YHot
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetDepthStencilSurface(IDirect3DSurface9* pNewZStencil)
 {
+	SynchronizeCommandStream();
+
 	if (mDepthStencilSurface != pNewZStencil)
 	{
 		if (mDepthStencilSurface != nullptr)
@@ -3340,6 +5575,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetFVF(DWORD FVF)
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetFVF(FVF);
+
+			mCommandStream->Push(WorkItemType::Device_SetFVF, FVF);
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
 		mInternalDeviceState.SetFVF(FVF);
@@ -3385,9 +5630,21 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetIndices(IDirect3DIndexBuffer9* pIndexData
 	}
 	else
 	{
+		const vk::Buffer currentIndexBuffer = pIndexData ? reinterpret_cast<CIndexBuffer9*>(pIndexData)->mCurrentIndexBuffer : vk::Buffer();
+
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetIndices(pIndexData);
+
+			mCommandStream->PushReference(WorkItemType::Device_SetIndices, pIndexData, pIndexData, currentIndexBuffer);
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
-		mInternalDeviceState.SetIndices(pIndexData);
+		SetInternalIndices(pIndexData, currentIndexBuffer);
 	}
 
 	return D3D_OK;
@@ -3401,20 +5658,18 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetLight(DWORD Index, const D3DLIGHT9* pLigh
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetLight(Index, pLight);
 
-		PaddedLight light = (*pLight);
-		mCurrentDrawCommandBuffer.updateBuffer(mLightBuffer.get(), Index * sizeof(PaddedLight), sizeof(PaddedLight), &light);
+			mCommandStream->Push(WorkItemType::Device_SetLight, Index, CommandData{ pLight, sizeof(D3DLIGHT9) });
 
-		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+			return D3D_OK;
 		}
 
 		mInternalDeviceState.SetLight(Index, pLight);
+		mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_LIGHT);
 	}
 
 	return D3D_OK;
@@ -3428,19 +5683,18 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetMaterial(const D3DMATERIAL9* pMaterial)
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetMaterial(pMaterial);
 
-		mCurrentDrawCommandBuffer.updateBuffer(mMaterialBuffer.get(), 0, sizeof(D3DMATERIAL9), pMaterial);
+			mCommandStream->Push(WorkItemType::Device_SetMaterial, CommandData{ pMaterial, sizeof(D3DMATERIAL9) });
 
-		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+			return D3D_OK;
 		}
 
 		mInternalDeviceState.SetMaterial(pMaterial);
+		mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_MATERIAL);
 	}
 
 	return D3D_OK;
@@ -3454,6 +5708,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetNPatchMode(float nSegments)
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetNPatchMode(nSegments);
+
+			mCommandStream->Push(WorkItemType::Device_SetNPatchMode, nSegments);
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
 		mInternalDeviceState.SetNPatchMode(nSegments);
@@ -3479,6 +5743,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShader(IDirect3DPixelShader9* pShade
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetPixelShader(pShader);
+
+			mCommandStream->PushReference(WorkItemType::Device_SetPixelShader, pShader, pShader);
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
 		mInternalDeviceState.SetPixelShader(pShader);
@@ -3495,19 +5769,21 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShaderConstantB(UINT StartRegister,
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetPixelShaderConstantB(StartRegister, pConstantData, BoolCount);
 
-		mCurrentDrawCommandBuffer.updateBuffer(mPixelConstantBuffer.get(), sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantI) + StartRegister * sizeof(int), BoolCount * sizeof(int), pConstantData);
+			mCommandStream->Push(WorkItemType::Device_SetPixelShaderConstantB, StartRegister, CommandData{ pConstantData, BoolCount * sizeof(BOOL) }, BoolCount);
 
-		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+			return D3D_OK;
 		}
 
 		mInternalDeviceState.SetPixelShaderConstantB(StartRegister, pConstantData, BoolCount);
+		if (mInternalDeviceState.mDeviceState.mDirtyPixelShaderConstants)
+		{
+			mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_PIXEL_CONSTANT);
+		}
 	}
 
 	return D3D_OK;
@@ -3521,19 +5797,22 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShaderConstantF(UINT StartRegister,
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetPixelShaderConstantF(StartRegister, pConstantData, Vector4fCount);
 
-		mCurrentDrawCommandBuffer.updateBuffer(mPixelConstantBuffer.get(), sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantI) + sizeof(mInternalDeviceState.mDeviceState.mPixelShaderConstantB) + StartRegister * sizeof(float[4]), Vector4fCount * sizeof(float[4]), pConstantData);
+			mCommandStream->Push(WorkItemType::Device_SetPixelShaderConstantF, StartRegister, CommandData{ pConstantData, Vector4fCount * sizeof(float[4]) }, Vector4fCount);
 
-		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+			return D3D_OK;
 		}
 
 		mInternalDeviceState.SetPixelShaderConstantF(StartRegister, pConstantData, Vector4fCount);
+		mPixelShaderConstantFCount = std::max(mPixelShaderConstantFCount, static_cast<uint32_t>(StartRegister + Vector4fCount));
+		if (mInternalDeviceState.mDeviceState.mDirtyPixelShaderConstants)
+		{
+			mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_PIXEL_CONSTANT);
+		}
 	}
 
 	return D3D_OK;
@@ -3547,19 +5826,21 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShaderConstantI(UINT StartRegister,
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetPixelShaderConstantI(StartRegister, pConstantData, Vector4iCount);
 
-		mCurrentDrawCommandBuffer.updateBuffer(mPixelConstantBuffer.get(), StartRegister * sizeof(int[4]), Vector4iCount * sizeof(int[4]), pConstantData);
+			mCommandStream->Push(WorkItemType::Device_SetPixelShaderConstantI, StartRegister, CommandData{ pConstantData, Vector4iCount * sizeof(int[4]) }, Vector4iCount);
 
-		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+			return D3D_OK;
 		}
 
 		mInternalDeviceState.SetPixelShaderConstantI(StartRegister, pConstantData, Vector4iCount);
+		if (mInternalDeviceState.mDeviceState.mDirtyPixelShaderConstants)
+		{
+			mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_PIXEL_CONSTANT);
+		}
 	}
 
 	return D3D_OK;
@@ -3573,19 +5854,29 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetRenderState(D3DRENDERSTATETYPE State, DWO
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetRenderState(State, Value);
 
-		mCurrentDrawCommandBuffer.updateBuffer(mRenderStateBuffer.get(), State * sizeof(DWORD), sizeof(DWORD), &Value);
+			mCommandStream->Push(WorkItemType::Device_SetRenderState, State, Value);
 
-		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+			return D3D_OK;
 		}
 
 		mInternalDeviceState.SetRenderState(State, Value);
+
+		//Alpha reference is a push constant so changing it doesn't need a new copy of the block.
+		if (State != D3DRS_ALPHAREF)
+		{
+			mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_RENDER_STATE);
+		}
+
+		//World and view are left stale while lighting is off, see SetTransform.
+		if (State == D3DRS_LIGHTING)
+		{
+			mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_TRANSFORMATION);
+		}
 	}
 
 	return D3D_OK;
@@ -3593,6 +5884,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetRenderState(D3DRENDERSTATETYPE State, DWO
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetRenderTarget(DWORD RenderTargetIndex, IDirect3DSurface9* pRenderTarget)
 {
+	SynchronizeCommandStream();
+
 	if (mRenderTargets[RenderTargetIndex] != pRenderTarget)
 	{
 		if (mRenderTargets[RenderTargetIndex] != nullptr)
@@ -3628,6 +5921,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetSamplerState(DWORD Sampler, D3DSAMPLERSTA
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetSamplerState(Sampler, Type, Value);
+
+			mCommandStream->Push(WorkItemType::Device_SetSamplerState, Sampler, Type, Value);
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
 		mInternalDeviceState.SetSamplerState(Sampler, Type, Value);
@@ -3644,6 +5947,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetScissorRect(const RECT* pRect)
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetScissorRect(pRect);
+
+			mCommandStream->Push(WorkItemType::Device_SetScissorRect, CommandData{ pRect, sizeof(RECT) });
+
+			return D3D_OK;
+		}
+
 		BeginRecordingCommands();
 
 		const vk::Rect2D scissor(vk::Offset2D(pRect->left, pRect->top), vk::Extent2D(pRect->right, pRect->bottom));
@@ -3672,9 +5985,21 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetStreamSource(UINT StreamNumber, IDirect3D
 	}
 	else
 	{
+		const vk::Buffer currentVertexBuffer = pStreamData ? reinterpret_cast<CVertexBuffer9*>(pStreamData)->mCurrentVertexBuffer : vk::Buffer();
+
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetStreamSource(StreamNumber, pStreamData, OffsetInBytes, Stride);
+
+			mCommandStream->PushReference(WorkItemType::Device_SetStreamSource, pStreamData, StreamNumber, pStreamData, OffsetInBytes, Stride, currentVertexBuffer);
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
-		mInternalDeviceState.SetStreamSource(StreamNumber, pStreamData, OffsetInBytes, Stride);
+		SetInternalStreamSource(StreamNumber, pStreamData, OffsetInBytes, Stride, currentVertexBuffer);
 	}
 
 	return D3D_OK;
@@ -3688,6 +6013,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetStreamSourceFreq(UINT StreamNumber, UINT
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetStreamSourceFreq(StreamNumber, FrequencyParameter);
+
+			mCommandStream->Push(WorkItemType::Device_SetStreamSourceFreq, StreamNumber, FrequencyParameter);
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
 		mInternalDeviceState.SetStreamSourceFreq(StreamNumber, FrequencyParameter);
@@ -3704,6 +6039,17 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetTexture(DWORD Sampler, IDirect3DBaseTextu
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetTexture(Sampler, pTexture);
+
+			//The item holds a reference so the texture outlives the call even if the application releases it first.
+			mCommandStream->PushReference(WorkItemType::Device_SetTexture, pTexture, Sampler, pTexture);
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
 		mInternalDeviceState.SetTexture(Sampler, pTexture);
@@ -3720,21 +6066,18 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetTextureStageState(DWORD Stage, D3DTEXTURE
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
-
-		mInternalDeviceState.SetTextureStageState(Stage, Type, Value);
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetTextureStageState(Stage, Type, Value);
 
-		PaddedTextureStage textureStage(mInternalDeviceState.mDeviceState.mTextureStageState[Stage]);
-		mCurrentDrawCommandBuffer.updateBuffer(mTextureStageBuffer.get(), (Stage * sizeof(PaddedTextureStage)), sizeof(PaddedTextureStage), &textureStage);
+			mCommandStream->Push(WorkItemType::Device_SetTextureStageState, Stage, Type, Value);
 
-		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+			return D3D_OK;
 		}
 
+		mInternalDeviceState.SetTextureStageState(Stage, Type, Value);
+		mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_TEXTURE_STAGE);
 	}
 
 	return D3D_OK;
@@ -3748,14 +6091,24 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetTransform(D3DTRANSFORMSTATETYPE State, co
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			//The worker turns a null matrix into identity itself but the application's copy needs it now.
+			const D3DMATRIX identity = { 1, 0, 0, 0,
+										 0, 1, 0, 0,
+										 0, 0, 1, 0,
+										 0, 0, 0, 1 };
+
+			mApplicationDeviceState.SetTransform(State, pMatrix ? pMatrix : &identity);
+
+			mCommandStream->Push(WorkItemType::Device_SetTransform, State, CommandData{ pMatrix, sizeof(D3DMATRIX) });
+
+			return D3D_OK;
+		}
 
 		if (pMatrix)
 		{
-			const auto columnMajorMatrix = (*pMatrix);
-
-			mCurrentDrawCommandBuffer.updateBuffer(mTransformationBuffer.get(), State * sizeof(D3DMATRIX), sizeof(D3DMATRIX), &columnMajorMatrix);
 			mInternalDeviceState.SetTransform(State, pMatrix);
 		}
 		else
@@ -3766,29 +6119,32 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetTransform(D3DTRANSFORMSTATETYPE State, co
 										 0, 0, 1, 0,
 										 0, 0, 0, 1 };
 
-			mCurrentDrawCommandBuffer.updateBuffer(mTransformationBuffer.get(), State * sizeof(D3DMATRIX), sizeof(D3DMATRIX), &identity);
 			mInternalDeviceState.SetTransform(State, &identity);
 		}
 
-		//Update mvp matrix
-		//TODO: find out if 0 and 1 are really un-used or just undocumented.
-		//TODO: limit matrix multiply to when needs to happen. (Unless branch cost more than savings.)
-		const auto mvp =
-			mInternalDeviceState.mDeviceState.mTransform[D3DTS_WORLD] *
-			mInternalDeviceState.mDeviceState.mTransform[D3DTS_VIEW] *
-			mInternalDeviceState.mDeviceState.mTransform[D3DTS_PROJECTION];
-		mCurrentDrawCommandBuffer.updateBuffer(mTransformationBuffer.get(), 0, sizeof(D3DMATRIX), &mvp);
-
-		const auto mv =
-			mInternalDeviceState.mDeviceState.mTransform[D3DTS_WORLD] *
-			mInternalDeviceState.mDeviceState.mTransform[D3DTS_VIEW];
-		mCurrentDrawCommandBuffer.updateBuffer(mTransformationBuffer.get(), sizeof(D3DMATRIX), sizeof(D3DMATRIX), &mv);
-
+		/*
+		The mvp matrix is pushed at the next draw so a new world matrix costs a push constant rather than a copy of the transformation block.
+		Only the lighting code reads world, view and mv from the block so while lighting is off they don't need a new copy either.
+		*/
+		switch (State)
 		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+		case D3DTS_PROJECTION:
+			mModelViewProjectionDirty = true;
+			mBoundState.mMVPPushed = false;
+			break;
+		case D3DTS_WORLD:
+		case D3DTS_VIEW:
+			mModelViewDirty = true;
+			mModelViewProjectionDirty = true;
+			mBoundState.mMVPPushed = false;
+			if (mInternalDeviceState.mDeviceState.mRenderState[D3DRS_LIGHTING])
+			{
+				mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_TRANSFORMATION);
+			}
+			break;
+		default:
+			mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_TRANSFORMATION);
+			break;
 		}
 	}
 
@@ -3803,6 +6159,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetVertexDeclaration(IDirect3DVertexDeclarat
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetVertexDeclaration(pDecl);
+
+			mCommandStream->PushReference(WorkItemType::Device_SetVertexDeclaration, pDecl, pDecl);
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
 		mInternalDeviceState.SetVertexDeclaration(pDecl);
@@ -3819,6 +6185,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShader(IDirect3DVertexShader9* pSha
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetVertexShader(pShader);
+
+			mCommandStream->PushReference(WorkItemType::Device_SetVertexShader, pShader, pShader);
+
+			return D3D_OK;
+		}
+
 		//BeginRecordingCommands();
 
 		mInternalDeviceState.SetVertexShader(pShader);
@@ -3835,19 +6211,21 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShaderConstantB(UINT StartRegister,
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetVertexShaderConstantB(StartRegister, pConstantData, BoolCount);
 
-		mCurrentDrawCommandBuffer.updateBuffer(mVertexConstantBuffer.get(), sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantI) + StartRegister * sizeof(int), BoolCount * sizeof(int), pConstantData);
+			mCommandStream->Push(WorkItemType::Device_SetVertexShaderConstantB, StartRegister, CommandData{ pConstantData, BoolCount * sizeof(BOOL) }, BoolCount);
 
-		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+			return D3D_OK;
 		}
 
 		mInternalDeviceState.SetVertexShaderConstantB(StartRegister, pConstantData, BoolCount);
+		if (mInternalDeviceState.mDeviceState.mDirtyVertexShaderConstants)
+		{
+			mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_VERTEX_CONSTANT);
+		}
 	}
 
 	return D3D_OK;
@@ -3861,19 +6239,22 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShaderConstantF(UINT StartRegister,
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetVertexShaderConstantF(StartRegister, pConstantData, Vector4fCount);
 
-		mCurrentDrawCommandBuffer.updateBuffer(mVertexConstantBuffer.get(), sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantI) + sizeof(mInternalDeviceState.mDeviceState.mVertexShaderConstantB) + StartRegister * sizeof(float[4]), Vector4fCount * sizeof(float[4]), pConstantData);
+			mCommandStream->Push(WorkItemType::Device_SetVertexShaderConstantF, StartRegister, CommandData{ pConstantData, Vector4fCount * sizeof(float[4]) }, Vector4fCount);
 
-		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+			return D3D_OK;
 		}
 
 		mInternalDeviceState.SetVertexShaderConstantF(StartRegister, pConstantData, Vector4fCount);
+		mVertexShaderConstantFCount = std::max(mVertexShaderConstantFCount, static_cast<uint32_t>(StartRegister + Vector4fCount));
+		if (mInternalDeviceState.mDeviceState.mDirtyVertexShaderConstants)
+		{
+			mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_VERTEX_CONSTANT);
+		}
 	}
 
 	return D3D_OK;
@@ -3887,19 +6268,21 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShaderConstantI(UINT StartRegister,
 	}
 	else
 	{
-		BeginRecordingCommands();
-		StopDraw(); //Stop render pass if there is one open.
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetVertexShaderConstantI(StartRegister, pConstantData, Vector4iCount);
 
-		mCurrentDrawCommandBuffer.updateBuffer(mVertexConstantBuffer.get(), StartRegister * sizeof(int[4]), Vector4iCount * sizeof(int[4]), pConstantData);
+			mCommandStream->Push(WorkItemType::Device_SetVertexShaderConstantI, StartRegister, CommandData{ pConstantData, Vector4iCount * sizeof(int[4]) }, Vector4iCount);
 
-		{
-			const auto uboBarrier = vk::MemoryBarrier()
-				.setSrcAccessMask(vk::AccessFlagBits::eTransferWrite)
-				.setDstAccessMask(vk::AccessFlagBits::eVertexAttributeRead);
-			mCurrentDrawCommandBuffer.pipelineBarrier(vk::PipelineStageFlagBits::eTransfer, vk::PipelineStageFlagBits::eVertexInput, vk::DependencyFlags(), 1, &uboBarrier, 0, nullptr, 0, nullptr);
+			return D3D_OK;
 		}
 
 		mInternalDeviceState.SetVertexShaderConstantI(StartRegister, pConstantData, Vector4iCount);
+		if (mInternalDeviceState.mDeviceState.mDirtyVertexShaderConstants)
+		{
+			mDirtyUniformBlocks |= (1u << UNIFORM_BLOCK_VERTEX_CONSTANT);
+		}
 	}
 
 	return D3D_OK;
@@ -3913,6 +6296,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetViewport(const D3DVIEWPORT9* pViewport)
 	}
 	else
 	{
+		if (QueueCommands())
+		{
+			auto lock = mCommandStream->LockProducer();
+			mApplicationDeviceState.SetViewport(pViewport);
+
+			mCommandStream->Push(WorkItemType::Device_SetViewport, CommandData{ pViewport, sizeof(D3DVIEWPORT9) });
+
+			return D3D_OK;
+		}
+
 		mInternalDeviceState.SetViewport(pViewport);
 
 		if (mIsRecording)
@@ -4010,6 +6403,18 @@ HRESULT STDMETHODCALLTYPE CDevice9::ComposeRects(IDirect3DSurface9 *pSrc, IDirec
 
 HRESULT STDMETHODCALLTYPE CDevice9::PresentEx(const RECT *pSourceRect, const RECT *pDestRect, HWND hDestWindowOverride, const RGNDATA *pDirtyRegion, DWORD dwFlags)
 {
+	if (QueueCommands())
+	{
+		//Errors from the real present can't be reported back without waiting for it which would undo the point of queuing it.
+		mCommandStream->BeginFrame();
+		mApplicationFrame++;
+
+		const size_t regionSize = pDirtyRegion ? (pDirtyRegion->rdh.dwSize + pDirtyRegion->rdh.nRgnSize) : 0;
+		mCommandStream->Push(WorkItemType::Device_Present, CommandData{ pSourceRect, sizeof(RECT) }, CommandData{ pDestRect, sizeof(RECT) }, hDestWindowOverride, CommandData{ pDirtyRegion, regionSize }, dwFlags);
+
+		return D3D_OK;
+	}
+
 	return mSwapChains[0]->Present(pSourceRect, pDestRect, hDestWindowOverride, pDirtyRegion, dwFlags);
 }
 
@@ -4048,6 +6453,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::CheckResourceResidency(IDirect3DResource9 **
 HRESULT STDMETHODCALLTYPE CDevice9::SetMaximumFrameLatency(UINT MaxLatency)
 {
 	mMaxLatency = MaxLatency;
+	mPendingFramesInFlight = GetConfiguredFramesInFlight(); //Picked up at the start of the next frame.
 
 	return D3D_OK;
 }
@@ -4112,6 +6518,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::ResetEx(D3DPRESENT_PARAMETERS *pPresentation
 		memcpy(&mPresentationParameters, pPresentationParameters, sizeof(D3DPRESENT_PARAMETERS));
 	}
 
+	SynchronizeCommandStream();
+
 	StopDraw(); //Stop render pass if there is one open.
 	StopRecordingCommands();
 	mDevice->waitIdle();
@@ -4131,6 +6539,38 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetDisplayModeEx(UINT iSwapChain, D3DDISPLAY
 	return D3D_OK;
 }
 
+vk::UniqueRenderPass CreateRenderPass(vk::Device& device, const RenderPassFormats& formats)
+{
+	std::vector<vk::AttachmentDescription> attachments;
+	std::vector<vk::AttachmentReference> colorReference;
+
+	uint32_t index = 0;
+	for (auto& format : formats.mRenderTargetFormat)
+	{
+		if (format)
+		{
+			attachments.push_back(vk::AttachmentDescription(vk::AttachmentDescriptionFlags(), ConvertFormat((D3DFORMAT)format), vk::SampleCountFlagBits::e1, vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eDontCare, vk::ImageLayout::eColorAttachmentOptimal, vk::ImageLayout::eColorAttachmentOptimal));
+			colorReference.push_back(vk::AttachmentReference(index, vk::ImageLayout::eColorAttachmentOptimal));
+
+			index += 1;
+		}
+	}
+
+	vk::AttachmentReference depthReference(index, vk::ImageLayout::eDepthStencilAttachmentOptimal);
+	if (formats.mDepthStencilFormat)
+	{
+		attachments.push_back(vk::AttachmentDescription(vk::AttachmentDescriptionFlags(), ConvertFormat((D3DFORMAT)formats.mDepthStencilFormat), vk::SampleCountFlagBits::e1, vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eStore, vk::ImageLayout::eDepthStencilAttachmentOptimal, vk::ImageLayout::eDepthStencilAttachmentOptimal));
+	}
+
+	vk::SubpassDescription subpass(vk::SubpassDescriptionFlags(), vk::PipelineBindPoint::eGraphics, 0, nullptr, colorReference.size(), colorReference.data(), nullptr, formats.mDepthStencilFormat ? &depthReference : nullptr);
+	vk::SubpassDependency dependency;
+	dependency.srcStageMask = vk::PipelineStageFlagBits::eAllGraphics;
+	dependency.dstStageMask = vk::PipelineStageFlagBits::eAllGraphics;
+	dependency.dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
+
+	return device.createRenderPassUnique(vk::RenderPassCreateInfo(vk::RenderPassCreateFlags(), attachments.size(), attachments.data(), 1, &subpass, 1, &dependency));
+}
+
 RenderContainer::RenderContainer(vk::Device& device, CSurface9* depthStencilSurface, std::array<CSurface9*, 4>& renderTargets)
 	: mDepthStencilSurface(depthStencilSurface),
 	mRenderTargets(renderTargets)
@@ -4152,6 +6592,8 @@ RenderContainer::RenderContainer(vk::Device& device, CSurface9* depthStencilSurf
 			width = renderTarget->mWidth;
 			height = renderTarget->mHeight;
 
+			mFormats.mRenderTargetFormat[index] = renderTarget->mFormat;
+
 			frameAttachments.push_back(renderTarget->mImageView.get());
 			attachments.push_back(vk::AttachmentDescription(vk::AttachmentDescriptionFlags(), ConvertFormat(renderTarget->mFormat), vk::SampleCountFlagBits::e1, vk::AttachmentLoadOp::eLoad, vk::AttachmentStoreOp::eStore, vk::AttachmentLoadOp::eClear, vk::AttachmentStoreOp::eDontCare, vk::ImageLayout::eColorAttachmentOptimal, vk::ImageLayout::eColorAttachmentOptimal));
 
@@ -4165,6 +6607,14 @@ RenderContainer::RenderContainer(vk::Device& device, CSurface9* depthStencilSurf
 		}
 	}
 
+	if (depthStencilSurface)
+	{
+		mFormats.mDepthStencilFormat = depthStencilSurface->mFormat;
+	}
+
+	//The draw pass is shared with warm-up so recorded pipelines are guaranteed to be compatible with it.
+	mRenderPass = CreateRenderPass(device, mFormats);
+
 	if (depthStencilSurface)
 	{
 		frameAttachments.push_back(depthStencilSurface->mImageView.get());
@@ -4176,16 +6626,6 @@ RenderContainer::RenderContainer(vk::Device& device, CSurface9* depthStencilSurf
 
 		vk::AttachmentReference depthReference(index, vk::ImageLayout::eDepthStencilAttachmentOptimal);
 
-		{
-			vk::SubpassDescription subpass(vk::SubpassDescriptionFlags(), vk::PipelineBindPoint::eGraphics, 0, nullptr, colorReference.size(), colorReference.data(), nullptr, &depthReference);
-			vk::SubpassDependency dependency;
-			dependency.srcStageMask = vk::PipelineStageFlagBits::eAllGraphics;
-			dependency.dstStageMask = vk::PipelineStageFlagBits::eAllGraphics;
-			dependency.dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
-
-			mRenderPass = device.createRenderPassUnique(vk::RenderPassCreateInfo(vk::RenderPassCreateFlags(), attachments.size(), attachments.data(), 1, &subpass, 1, &dependency));
-		}
-
 		{
 			vk::SubpassDescription subpass(vk::SubpassDescriptionFlags(), vk::PipelineBindPoint::eGraphics, 0, nullptr, colorReference.size(), colorReference.data(), nullptr, &depthReference);
 			vk::SubpassDependency dependency;
@@ -4218,16 +6658,6 @@ RenderContainer::RenderContainer(vk::Device& device, CSurface9* depthStencilSurf
 	}
 	else
 	{
-		{
-			vk::SubpassDescription subpass(vk::SubpassDescriptionFlags(), vk::PipelineBindPoint::eGraphics, 0, nullptr, colorReference.size(), colorReference.data(), nullptr, nullptr);
-			vk::SubpassDependency dependency;
-			dependency.srcStageMask = vk::PipelineStageFlagBits::eAllGraphics;
-			dependency.dstStageMask = vk::PipelineStageFlagBits::eAllGraphics;
-			dependency.dstAccessMask = vk::AccessFlagBits::eColorAttachmentWrite | vk::AccessFlagBits::eDepthStencilAttachmentWrite;
-
-			mRenderPass = device.createRenderPassUnique(vk::RenderPassCreateInfo(vk::RenderPassCreateFlags(), attachments.size(), attachments.data(), 1, &subpass, 1, &dependency));
-		}
-
 		{
 			vk::SubpassDescription subpass(vk::SubpassDescriptionFlags(), vk::PipelineBindPoint::eGraphics, 0, nullptr, colorReference.size(), colorReference.data(), nullptr, nullptr);
 			vk::SubpassDependency dependency;
@@ -4268,25 +6698,25 @@ RenderContainer::RenderContainer(vk::Device& device, CSurface9* depthStencilSurf
 	framebufferCreateInfo.height = height;
 	framebufferCreateInfo.layers = 1;
 
-	for (int32_t i = 0; i < 3; i++)
+	for (int32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
 	{
 		mFrameBuffers.push_back(device.createFramebufferUnique(framebufferCreateInfo, nullptr));
 	}
 
 	framebufferCreateInfo.renderPass = mClearColorRenderPass.get();
-	for (int32_t i = 0; i < 3; i++)
+	for (int32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
 	{
 		mClearColorFrameBuffers.push_back(device.createFramebufferUnique(framebufferCreateInfo, nullptr));
 	}
 
 	framebufferCreateInfo.renderPass = mClearDepthRenderPass.get();
-	for (int32_t i = 0; i < 3; i++)
+	for (int32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
 	{
 		mClearDepthFrameBuffers.push_back(device.createFramebufferUnique(framebufferCreateInfo, nullptr));
 	}
 
 	framebufferCreateInfo.renderPass = mClearBothRenderPass.get();
-	for (int32_t i = 0; i < 3; i++)
+	for (int32_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
 	{
 		mClearBothFrameBuffers.push_back(device.createFramebufferUnique(framebufferCreateInfo, nullptr));
 	}
@@ -4297,23 +6727,34 @@ RenderContainer::~RenderContainer()
 
 }
 
-SamplerContainer::SamplerContainer(vk::Device& device, std::array<DWORD, D3DSAMP_DMAPOFFSET + 1>& samplerState, uint32_t textureLOD)
-	: mSamplerState(samplerState),
-	mTextureLOD(textureLOD)
+SamplerKey::SamplerKey(const std::array<DWORD, D3DSAMP_DMAPOFFSET + 1>& samplerState, uint32_t textureLOD) noexcept
+	: mMagFilter((uint32_t)ConvertFilter((D3DTEXTUREFILTERTYPE)samplerState[D3DSAMP_MAGFILTER])),
+	mMinFilter((uint32_t)ConvertFilter((D3DTEXTUREFILTERTYPE)samplerState[D3DSAMP_MINFILTER])),
+	mMipmapMode((uint32_t)ConvertMipmapMode((D3DTEXTUREFILTERTYPE)samplerState[D3DSAMP_MIPFILTER])),
+	mAddressModeU((uint32_t)ConvertTextureAddress((D3DTEXTUREADDRESS)samplerState[D3DSAMP_ADDRESSU])),
+	mAddressModeV((uint32_t)ConvertTextureAddress((D3DTEXTUREADDRESS)samplerState[D3DSAMP_ADDRESSV])),
+	mAddressModeW((uint32_t)ConvertTextureAddress((D3DTEXTUREADDRESS)samplerState[D3DSAMP_ADDRESSW])),
+	mMipLodBias(bit_cast(samplerState[D3DSAMP_MIPMAPLODBIAS])),
+	mMaxLod((samplerState[D3DSAMP_MIPFILTER] == D3DTEXF_NONE) ? 0.0f : std::max(bit_cast(samplerState[D3DSAMP_MAXMIPLEVEL]), (float)textureLOD))
+{
+
+}
+
+SamplerContainer::SamplerContainer(vk::Device& device, const SamplerKey& samplerKey)
 {
 	const vk::SamplerCreateInfo samplerCreateInfo = vk::SamplerCreateInfo()
-		.setMagFilter(ConvertFilter((D3DTEXTUREFILTERTYPE)mSamplerState[D3DSAMP_MAGFILTER]))
-		.setMinFilter(ConvertFilter((D3DTEXTUREFILTERTYPE)mSamplerState[D3DSAMP_MINFILTER]))
-		.setAddressModeU(ConvertTextureAddress((D3DTEXTUREADDRESS)mSamplerState[D3DSAMP_ADDRESSU]))
-		.setAddressModeV(ConvertTextureAddress((D3DTEXTUREADDRESS)mSamplerState[D3DSAMP_ADDRESSV]))
-		.setAddressModeW(ConvertTextureAddress((D3DTEXTUREADDRESS)mSamplerState[D3DSAMP_ADDRESSW]))
-		.setMipmapMode(ConvertMipmapMode((D3DTEXTUREFILTERTYPE)mSamplerState[D3DSAMP_MIPFILTER]))
-		.setMipLodBias(bit_cast(mSamplerState[D3DSAMP_MIPMAPLODBIAS]))
+		.setMagFilter((vk::Filter)samplerKey.mMagFilter)
+		.setMinFilter((vk::Filter)samplerKey.mMinFilter)
+		.setAddressModeU((vk::SamplerAddressMode)samplerKey.mAddressModeU)
+		.setAddressModeV((vk::SamplerAddressMode)samplerKey.mAddressModeV)
+		.setAddressModeW((vk::SamplerAddressMode)samplerKey.mAddressModeW)
+		.setMipmapMode((vk::SamplerMipmapMode)samplerKey.mMipmapMode)
+		.setMipLodBias(samplerKey.mMipLodBias)
 		.setBorderColor(vk::BorderColor::eFloatOpaqueWhite)
 		.setUnnormalizedCoordinates(VK_FALSE)
 		.setCompareOp(vk::CompareOp::eNever)
 		.setMinLod(0.0f)
-		.setMaxLod((mSamplerState[D3DSAMP_MIPFILTER] == D3DTEXF_NONE) ? 0.0f : std::max(bit_cast(mSamplerState[D3DSAMP_MAXMIPLEVEL]), (float)textureLOD));
+		.setMaxLod(samplerKey.mMaxLod);
 
 	//TODO: handle anisotropy
 
@@ -26,9 +26,14 @@ misrepresented as being the original software.
 
 #include "CStateBlock9.h"
 #include "CTexture9.h"
+#include "CommandStream.h"
 
 #include<vector>
 #include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <deque>
+#include <algorithm>
 
 class C9;
 class CSwapChain9;
@@ -42,6 +47,233 @@ class CVertexDeclaration9;
 class RenderContainer;
 class SamplerContainer;
 
+//Everything a worker thread needs to build a pipeline without touching the device state.
+struct PipelineCompileJob
+{
+	PipelineKey mPipelineKey;
+	CVertexDeclaration9* mVertexDeclaration = nullptr;
+	CVertexShader9* mVertexShader = nullptr;
+	CPixelShader9* mPixelShader = nullptr;
+	vk::ShaderModule mVertexShaderModule;
+	vk::ShaderModule mPixelShaderModule;
+	vk::RenderPass mRenderPass;
+	vk::UniquePipeline mPipeline;
+};
+
+//Enough to rebuild a vertex declaration when replaying recorded pipelines.
+struct RecordedVertexDeclaration
+{
+	DWORD mFVF = 0;
+	std::vector<D3DVERTEXELEMENT9> mVertexElements;
+};
+
+//Uniform blocks in set 0 in binding order. Each has a dynamic offset into the uniform ring.
+#define UNIFORM_BLOCK_RENDER_STATE 0
+#define UNIFORM_BLOCK_LIGHT 1
+#define UNIFORM_BLOCK_LIGHT_ENABLE 2
+#define UNIFORM_BLOCK_MATERIAL 3
+#define UNIFORM_BLOCK_TRANSFORMATION 4
+#define UNIFORM_BLOCK_TEXTURE_STAGE 5
+#define UNIFORM_BLOCK_VERTEX_CONSTANT 6
+#define UNIFORM_BLOCK_PIXEL_CONSTANT 7
+#define UNIFORM_BLOCK_COUNT 8
+#define UNIFORM_BLOCK_ALL ((1u << UNIFORM_BLOCK_COUNT) - 1u)
+
+//Only the transforms the shaders read go in the transformation block. Has to match TransformationBlock in CommonShader.
+#define PACKED_TRANSFORM_WORLD 24
+#define PACKED_TRANSFORM_COUNT 25
+
+//Shadow of what is bound on the current draw command buffer so binds that wouldn't change anything can be skipped.
+struct BoundCommandBufferState
+{
+	vk::Pipeline mPipeline;
+	std::array<vk::Buffer, MAX_VERTEX_INPUTS> mVertexBuffers = {};
+	std::array<vk::DeviceSize, MAX_VERTEX_INPUTS> mVertexBufferOffsets = {};
+	vk::Buffer mIndexBuffer;
+	vk::IndexType mIndexType = vk::IndexType::eUint16;
+	vk::DescriptorSet mDescriptorSet; //Texture set, set 0 is bound by FlushUniformBlocks whenever a block changes.
+	bool mBindlessTextures = false; //Whether the last draw read its textures from the bindless array.
+	bool mTextureIndicesPushed = false;
+	std::array<uint32_t, 8> mTextureIndices = {}; //16 bit bindless index per texture stage, two to a uint.
+	bool mMVPPushed = false; //Cleared when world, view or projection changes.
+	bool mAlphaReferencePushed = false;
+	uint32_t mAlphaReference = 0;
+};
+
+//A host visible buffer the uniform blocks are written straight into along with the set 0 that points at it.
+struct UniformRingChunk
+{
+	vk::UniqueBuffer mBuffer;
+	vk::UniqueDeviceMemory mMemory;
+	uint8_t* mData = nullptr;
+	vk::UniqueDescriptorPool mDescriptorPool;
+	vk::DescriptorSet mDescriptorSet;
+};
+
+//A texture/sampler pair written into the bindless array.
+struct BindlessTextureSlot
+{
+	VkSampler mSampler;
+	uint32_t mIndex;
+};
+
+/*
+Only the sampler states that end up in vk::SamplerCreateInfo, already converted to Vulkan values.
+That way D3D states that produce the same Vulkan sampler share it no matter which slot they came from.
+*/
+struct alignas(8) SamplerKey
+{
+	uint32_t mMagFilter = 0;
+	uint32_t mMinFilter = 0;
+	uint32_t mMipmapMode = 0;
+	uint32_t mAddressModeU = 0;
+	uint32_t mAddressModeV = 0;
+	uint32_t mAddressModeW = 0;
+	float mMipLodBias = 0.0f;
+	float mMaxLod = 0.0f;
+
+	SamplerKey() = default;
+	SamplerKey(const std::array<DWORD, D3DSAMP_DMAPOFFSET + 1>& samplerState, uint32_t textureLOD) noexcept;
+
+	bool operator==(const SamplerKey& other) const noexcept
+	{
+		return !memcmp(this, &other, sizeof(SamplerKey));
+	}
+};
+
+struct SamplerKeyHasher
+{
+	size_t operator()(const SamplerKey& key) const noexcept
+	{
+		return static_cast<size_t>(HashWords(reinterpret_cast<const uint64_t*>(&key), sizeof(SamplerKey) / sizeof(uint64_t)));
+	}
+};
+
+//The image view and sampler in each texture slot. The buffers in the descriptor set are the same for every draw so this is all that can change.
+struct DescriptorSetKey
+{
+	std::array<VkImageView, 16> mImageViews = {};
+	std::array<VkSampler, 16> mSamplers = {};
+
+	bool operator==(const DescriptorSetKey& other) const noexcept
+	{
+		return !memcmp(this, &other, sizeof(DescriptorSetKey));
+	}
+};
+
+struct DescriptorSetKeyHasher
+{
+	size_t operator()(const DescriptorSetKey& key) const noexcept
+	{
+		return static_cast<size_t>(HashWords(reinterpret_cast<const uint64_t*>(&key), sizeof(DescriptorSetKey) / sizeof(uint64_t)));
+	}
+};
+
+#define DESCRIPTOR_SET_CACHE_SIZE 1024 //Has to be a power of two.
+#define DESCRIPTOR_SET_CACHE_LOAD (DESCRIPTOR_SET_CACHE_SIZE * 3 / 4)
+
+/*
+Texture sets already written this frame so switching back to a material is just a bind.
+It's an open addressed table that is allocated once, entries from an older generation count as empty so clearing it for a new frame is an increment and a steady state frame never touches the heap.
+Once it is too full new sets just aren't remembered, the draw still gets a set written for it.
+*/
+class DescriptorSetCache
+{
+public:
+	DescriptorSetCache()
+		: mEntries(DESCRIPTOR_SET_CACHE_SIZE)
+	{
+
+	}
+
+	vk::DescriptorSet Find(const DescriptorSetKey& key) const noexcept
+	{
+		for (size_t i = DescriptorSetKeyHasher()(key); ; i++)
+		{
+			const Entry& entry = mEntries[i & (DESCRIPTOR_SET_CACHE_SIZE - 1)];
+			if (entry.mGeneration != mGeneration)
+			{
+				return vk::DescriptorSet();
+			}
+
+			//An evicted entry keeps its key so a recycled handle can't find the old set through it.
+			if (entry.mDescriptorSet && entry.mKey == key)
+			{
+				return entry.mDescriptorSet;
+			}
+		}
+	}
+
+	void Insert(const DescriptorSetKey& key, vk::DescriptorSet descriptorSet) noexcept
+	{
+		for (size_t i = DescriptorSetKeyHasher()(key); ; i++)
+		{
+			Entry& entry = mEntries[i & (DESCRIPTOR_SET_CACHE_SIZE - 1)];
+			if (entry.mGeneration != mGeneration)
+			{
+				if (mCount >= DESCRIPTOR_SET_CACHE_LOAD)
+				{
+					return;
+				}
+				mCount++;
+			}
+			else if (entry.mDescriptorSet)
+			{
+				continue;
+			}
+
+			entry.mKey = key;
+			entry.mDescriptorSet = descriptorSet;
+			entry.mGeneration = mGeneration;
+			return;
+		}
+	}
+
+	//Drops every set using the view but leaves the slot taken so lookups that probed past it still do.
+	void Evict(VkImageView imageView) noexcept
+	{
+		for (auto& entry : mEntries)
+		{
+			if (entry.mGeneration == mGeneration && std::find(entry.mKey.mImageViews.begin(), entry.mKey.mImageViews.end(), imageView) != entry.mKey.mImageViews.end())
+			{
+				entry.mDescriptorSet = vk::DescriptorSet();
+			}
+		}
+	}
+
+	void Clear() noexcept
+	{
+		mCount = 0;
+		if (++mGeneration == 0)
+		{
+			for (auto& entry : mEntries)
+			{
+				entry.mGeneration = 0;
+			}
+			mGeneration = 1;
+		}
+	}
+
+private:
+	struct Entry
+	{
+		DescriptorSetKey mKey;
+		vk::DescriptorSet mDescriptorSet;
+		uint32_t mGeneration = 0;
+	};
+
+	std::vector<Entry> mEntries;
+	uint32_t mGeneration = 1;
+	uint32_t mCount = 0;
+};
+
+//Buffer infos for set 0 (bindings 0-5, 7 and 8) and image infos for the texture set. The update template reads the image infos from here.
+struct DescriptorUpdateData
+{
+	vk::DescriptorBufferInfo mBufferInfo[9];
+	vk::DescriptorImageInfo mImageInfo[16];
+};
+
 template <typename T1>
 struct Pair
 {
@@ -64,6 +296,8 @@ vk::BlendOp ConvertColorOperation(D3DBLENDOP input) noexcept;
 vk::Filter ConvertFilter(D3DTEXTUREFILTERTYPE input) noexcept;
 vk::SamplerAddressMode ConvertTextureAddress(D3DTEXTUREADDRESS input) noexcept;
 vk::SamplerMipmapMode ConvertMipmapMode(D3DTEXTUREFILTERTYPE input) noexcept;
+vk::UniqueRenderPass CreateRenderPass(vk::Device& device, const RenderPassFormats& formats);
+D3DPRIMITIVETYPE GetPrimitiveTopologyClass(D3DPRIMITIVETYPE input) noexcept;
 //std::array<std::array<float, 4>, 4> ConvertRowMajorToColumnMajor(const D3DMATRIX& matrix);
 
 class CDevice9 : public IDirect3DDevice9Ex
@@ -91,9 +325,9 @@ public:
 	//Vulkan
 	vk::UniqueDevice mDevice;
 	vk::UniqueCommandPool mCommandPool;
-	vk::UniqueDescriptorPool mDescriptorPool;
 	vk::Queue mQueue;
 	vk::UniqueDescriptorSetLayout mDescriptorLayout;
+	vk::UniqueDescriptorSetLayout mTextureDescriptorLayout;
 	vk::UniquePipelineLayout mPipelineLayout;
 	vk::UniquePipelineCache mPipelineCache;
 
@@ -102,22 +336,137 @@ public:
 	std::vector<vk::UniqueCommandBuffer> mDrawCommandBuffers;
 	std::vector<vk::UniqueFence> mDrawFences;
 	uint32_t mFrameIndex = 0;
+	uint32_t mFramesInFlight = DEFAULT_FRAMES_IN_FLIGHT;
+	std::atomic<uint32_t> mPendingFramesInFlight = DEFAULT_FRAMES_IN_FLIGHT; //SetMaximumFrameLatency can change it from the application thread while the worker is drawing.
+	std::array<std::chrono::steady_clock::duration, MAX_FRAMES_IN_FLIGHT> mFenceWaitTime = {};
 	bool mIsRecording = false;
 
+	//Command Buffer Splitting
+	uint32_t mSplitDrawCount = 0; //Zero leaves a frame in one command buffer.
+	std::chrono::microseconds mSplitTime = {};
+	std::array<std::vector<vk::UniqueCommandBuffer>, MAX_FRAMES_IN_FLIGHT> mSplitCommandBuffers; //Every piece of a frame after the first, reused once the frame's fence signals.
+	std::array<std::vector<vk::UniqueSemaphore>, MAX_FRAMES_IN_FLIGHT> mSplitSemaphores; //Each piece signals one that the next piece waits on.
+	size_t mSplitIndex = 0;
+	uint32_t mCommandBufferDraws = 0;
+	std::chrono::steady_clock::time_point mCommandBufferStart;
+	uint64_t mCommandBufferSplits = 0;
+
 	std::vector<vk::UniqueCommandBuffer> mUtilityCommandBuffers;
 	std::vector<vk::UniqueFence> mUtilityFences;
 	uint32_t mUtilityIndex = 0;
 	int32_t mUtilityRecordingCount = 0;
 	bool mIsDrawing = false;
 
-	std::array<std::vector<vk::UniquePipeline>, 3> mPipelines;
-	std::array<std::vector<vk::DescriptorSet>, 3> mDescriptorSets;
-	int32_t mDescriptorSetIndex=0;
-	vk::DescriptorSet mLastDescriptorSet;
-
-	vk::DescriptorBufferInfo mDescriptorBufferInfo[9];
+	std::unordered_map<PipelineKey, vk::UniquePipeline, PipelineKeyHasher> mPipelines;
+	std::string mPipelineCacheFile;
+	int32_t mPipelineCacheSaveInterval = 60;
+	size_t mPipelineCountAtLastSave = 0;
+	std::chrono::steady_clock::time_point mLastPipelineCacheSave;
+
+	//Async Pipeline Compilation
+	bool mAsyncPipelineCompile = false;
+	bool mAsyncPipelineFallback = true;
+	bool mBoundFallbackPipeline = false;
+	bool mStopPipelineCompile = false;
+	int32_t mActivePipelineCompiles = 0;
+	std::vector<std::thread> mPipelineCompileThreads;
+	std::mutex mPipelineCompileMutex;
+	std::condition_variable mPipelineCompileCondition;
+	std::condition_variable mPipelineCompileIdleCondition;
+	std::deque<PipelineCompileJob> mPipelineCompileQueue;
+	std::vector<PipelineCompileJob> mCompiledPipelines;
+	std::atomic<bool> mHasCompiledPipelines = false;
+	std::unordered_map<PipelineKey, vk::Pipeline, PipelineKeyHasher> mPendingPipelines; //The value is the stand-in pipeline which may be null.
+	uint64_t mPipelineCompilesCompleted = 0;
+	uint64_t mDrawsSkipped = 0;
+	uint64_t mDrawsWithFallbackPipeline = 0;
+
+	//Performance Stats
+	bool mPerformanceStats = false;
+	std::ofstream mPerformanceStatsFile;
+	uint64_t mFrameCount = 0;
+	uint64_t mFrameDraws = 0;
+	std::chrono::steady_clock::duration mFrameDrawTime = {};
+	std::chrono::steady_clock::time_point mFrameStart;
+	std::atomic<uint64_t> mPipelinesCreated = 0;
+	uint64_t mLastPipelinesCreated = 0;
+	uint64_t mLastBindsIssued = 0;
+	uint64_t mLastBindsSkipped = 0;
+	uint64_t mLastDrawsSkipped = 0;
+	uint64_t mLastAllocations = 0;
+	uint64_t mDrawStartAllocations = 0;
+	uint64_t mFrameDrawAllocations = 0;
+	uint64_t mFrameUniformBytes = 0;
+	uint64_t mFrameMatrixMultiplies = 0;
+	uint64_t mFrameCommandBuffers = 0;
+	std::chrono::steady_clock::duration mFrameFenceWaitTime = {};
+
+	//Redundant Bind Elimination
+	BoundCommandBufferState mBoundState;
+	uint64_t mBindsIssued = 0;
+	uint64_t mBindsSkipped = 0;
+
+	//Pipeline Libraries
+	bool mPipelineLibrary = false;
+	std::mutex mPipelineLibraryMutex;
+	std::unordered_map<uint64_t, vk::UniquePipeline> mPipelineLibraries; //Keyed by a hash of the state that goes into each part.
+	std::atomic<uint64_t> mPipelinesLinked = 0;
+
+	//Dynamic Render State
+	uint32_t mDynamicRenderState = 0;
+	D3DPRIMITIVETYPE mBoundPrimitiveType = (D3DPRIMITIVETYPE)0;
+#ifdef VK_EXT_extended_dynamic_state
+	PFN_vkCmdSetCullModeEXT mCmdSetCullModeEXT = nullptr;
+	PFN_vkCmdSetFrontFaceEXT mCmdSetFrontFaceEXT = nullptr;
+	PFN_vkCmdSetPrimitiveTopologyEXT mCmdSetPrimitiveTopologyEXT = nullptr;
+	PFN_vkCmdSetDepthTestEnableEXT mCmdSetDepthTestEnableEXT = nullptr;
+	PFN_vkCmdSetDepthWriteEnableEXT mCmdSetDepthWriteEnableEXT = nullptr;
+	PFN_vkCmdSetDepthCompareOpEXT mCmdSetDepthCompareOpEXT = nullptr;
+	PFN_vkCmdSetStencilTestEnableEXT mCmdSetStencilTestEnableEXT = nullptr;
+	PFN_vkCmdSetStencilOpEXT mCmdSetStencilOpEXT = nullptr;
+#endif
+
+	//Pipeline Warm-up
+	std::string mPipelineDatabaseFile;
+	bool mPipelineWarmUp = true;
+	bool mLoadedPipelineDatabase = false;
+	bool mPipelineDatabaseChanged = false;
+	std::mutex mRecordedShadersMutex; //Shaders are created on the application thread while the worker saves the database.
+	std::unordered_map<uint64_t, std::vector<uint32_t>> mRecordedShaders;
+	std::unordered_map<uint64_t, RecordedVertexDeclaration> mRecordedVertexDeclarations;
+	std::unordered_set<PipelineKey, PipelineKeyHasher> mRecordedPipelines;
+	std::array<std::vector<vk::UniqueDescriptorPool>, MAX_FRAMES_IN_FLIGHT> mTextureDescriptorPools; //Grows when a frame runs out and is reset once the frame's fence signals.
+	std::array<size_t, MAX_FRAMES_IN_FLIGHT> mTextureDescriptorPoolIndex = {};
+	std::array<uint64_t, MAX_FRAMES_IN_FLIGHT> mTextureDescriptorSetCount = {};
+	uint64_t mTextureDescriptorSetHighWater = 0;
+	uint64_t mTextureDescriptorPoolHighWater = 0;
+	std::array<DescriptorSetCache, MAX_FRAMES_IN_FLIGHT> mDescriptorSetCache;
+
+	DescriptorUpdateData mDescriptorUpdateData;
 	vk::WriteDescriptorSet mWriteDescriptorSet[9];
-	vk::DescriptorImageInfo mDescriptorImageInfo[16];
+	vk::UniqueDescriptorUpdateTemplate mDescriptorUpdateTemplate;
+
+	//Push Descriptors
+	bool mPushDescriptors = false;
+#ifdef VK_KHR_push_descriptor
+	PFN_vkCmdPushDescriptorSetWithTemplateKHR mCmdPushDescriptorSetWithTemplateKHR = nullptr;
+#endif
+
+	//Bindless Textures
+	bool mBindlessTextures = false;
+	uint32_t mBindlessTextureCount = 0;
+	vk::UniqueDescriptorSetLayout mBindlessDescriptorLayout;
+	vk::UniquePipelineLayout mBindlessPipelineLayout;
+	vk::UniqueDescriptorPool mBindlessDescriptorPool;
+	vk::DescriptorSet mBindlessDescriptorSet;
+	std::unordered_map<VkImageView, std::vector<BindlessTextureSlot>> mBindlessTextureSlots;
+	std::vector<uint32_t> mBindlessFreeSlots;
+	std::array<std::vector<uint32_t>, MAX_FRAMES_IN_FLIGHT> mBindlessReleasedSlots; //Can't be reused until the frame they were released in is done on the GPU.
+	uint32_t mBindlessNextSlot = 0;
+	bool mBindlessFullLogged = false;
+	vk::SpecializationMapEntry mBindlessSpecializationEntries[2];
+	uint32_t mBindlessSpecializationData[2] = {};
+	vk::SpecializationInfo mBindlessSpecializationInfo;
 
 	/*
 	The idea with these two is to set these to one of the command buffers from the vectors.
@@ -127,31 +476,23 @@ public:
 	vk::CommandBuffer mCurrentUtilityCommandBuffer;
 	
 
-	//FF Buffers
-	vk::UniqueBuffer mRenderStateBuffer;
-	vk::UniqueDeviceMemory mRenderStateBufferMemory;
-
-	vk::UniqueBuffer mTextureStageBuffer;
-	vk::UniqueDeviceMemory mTextureStageBufferMemory;
-
-	vk::UniqueBuffer mLightBuffer;
-	vk::UniqueDeviceMemory mLightBufferMemory;
-
-	vk::UniqueBuffer mLightEnableBuffer;
-	vk::UniqueDeviceMemory mLightEnableBufferMemory;
-
-	vk::UniqueBuffer mMaterialBuffer;
-	vk::UniqueDeviceMemory mMaterialBufferMemory;
-
-	vk::UniqueBuffer mTransformationBuffer;
-	vk::UniqueDeviceMemory mTransformationBufferMemory;
-
-	//Shader Constant Buffers
-	vk::UniqueBuffer mVertexConstantBuffer;
-	vk::UniqueDeviceMemory mVertexConstantBufferMemory;
-
-	vk::UniqueBuffer mPixelConstantBuffer;
-	vk::UniqueDeviceMemory mPixelConstantBufferMemory;
+	//Uniform Ring (FF state and shader constants)
+	std::array<std::vector<UniformRingChunk>, MAX_FRAMES_IN_FLIGHT> mUniformRingChunks; //Grows when a frame runs out and is reused once the frame's fence signals.
+	std::array<size_t, MAX_FRAMES_IN_FLIGHT> mUniformRingChunkIndex = {};
+	vk::DeviceSize mUniformRingOffset = 0;
+	vk::DeviceSize mUniformBufferAlignment = 256;
+	std::array<uint32_t, UNIFORM_BLOCK_COUNT> mUniformBlockSizes = {};
+	std::array<uint32_t, UNIFORM_BLOCK_COUNT> mUniformBlockOffsets = {};
+	uint32_t mDirtyUniformBlocks = UNIFORM_BLOCK_ALL;
+	uint32_t mVertexShaderConstantFCount = 0; //One past the highest float register the application has set, only that much is copied.
+	uint32_t mPixelShaderConstantFCount = 0;
+	uint64_t mUniformRingChunkHighWater = 0;
+
+	//Transform Products (worked out at draw time and only after world, view or projection change)
+	D3DMATRIX mModelView = {};
+	D3DMATRIX mModelViewProjection = {};
+	bool mModelViewDirty = true;
+	bool mModelViewProjectionDirty = true;
 
 	//Up Buffers
 	vk::UniqueBuffer mUpVertexBuffer;
@@ -216,19 +557,77 @@ public:
 
 	//Helper Functions
 	void ResetVulkanDevice();
+	std::vector<char> LoadPipelineCache();
+	void SavePipelineCache();
+	uint32_t GetConfiguredFramesInFlight();
+	void WaitForFrame(uint32_t frameIndex);
+	void ReleaseFrameResources(uint32_t frameIndex);
 	void BeginRecordingCommands();
+	void BeginDrawCommandBuffer(vk::CommandBuffer commandBuffer);
+	void SplitCommandBuffer();
 	void StopRecordingCommands();
 	void BeginRecordingUtilityCommands();
 	void StopRecordingUtilityCommands();
-	void BeginDraw(D3DPRIMITIVETYPE primitiveType);
+	void CopyBuffer(vk::Buffer source, vk::Buffer destination, vk::DeviceSize size);
+	vk::UniquePipeline CreatePipeline(const PipelineKey& pipelineKey, CVertexDeclaration9* vertexDeclaration, vk::ShaderModule vertexShader, vk::ShaderModule pixelShader, vk::RenderPass renderPass);
+	vk::UniquePipeline LinkPipeline(const PipelineKey& pipelineKey, const vk::GraphicsPipelineCreateInfo& pipelineInfo);
+	vk::Pipeline GetPipelineLibrary(uint64_t hash, vk::GraphicsPipelineCreateInfo pipelineInfo, uint32_t libraryFlags);
+	void StartPipelineCompileThreads(int32_t threadCount);
+	void StopPipelineCompileThreads();
+	void PipelineCompileThread();
+	void QueuePipelineCompile(const PipelineKey& pipelineKey);
+	void CancelPipelineCompiles();
+	void CollectCompiledPipelines();
+	vk::Pipeline FindFallbackPipeline(const PipelineKey& pipelineKey);
+	void RecordShader(uint64_t hash, const std::vector<uint32_t>& code);
+	void RecordPipeline(const PipelineKey& pipelineKey);
+	void LoadPipelineDatabase();
+	void SavePipelineDatabase();
+	void WarmUpPipelines();
+	void ApplyDynamicRenderState();
+	void BindPipeline(vk::Pipeline pipeline);
+	void BindVertexBuffers(uint32_t firstBinding, uint32_t bindingCount, const vk::Buffer* buffers, const vk::DeviceSize* offsets);
+	void BindIndexBuffer(vk::Buffer buffer, vk::IndexType indexType);
+	void BindDescriptorSet(vk::DescriptorSet descriptorSet);
+	vk::DescriptorSet AllocateTextureDescriptorSet();
+	UniformRingChunk CreateUniformRingChunk();
+	void FlushUniformBlocks();
+	const D3DMATRIX& GetModelView();
+	const D3DMATRIX& GetModelViewProjection();
+	uint32_t GetBindlessTextureIndex(vk::ImageView imageView, vk::Sampler sampler);
+	void ReleaseBindlessTexture(vk::ImageView imageView);
+	void EvictDescriptorSets(vk::ImageView imageView);
+	vk::Sampler GetSampler(const std::array<DWORD, D3DSAMP_DMAPOFFSET + 1>& samplerState, uint32_t textureLOD);
+	bool BeginDraw(D3DPRIMITIVETYPE primitiveType);
 	void StopDraw();
 	void RebuildRenderPass();
+	std::chrono::steady_clock::time_point StartDrawTime();
+	void RecordDrawTime(std::chrono::steady_clock::time_point drawStart);
+	void WritePerformanceStats();
 	
 
 	//D3D9 State
 	CStateBlock9 mInternalDeviceState;
 	CStateBlock9* mRecordedDeviceState = nullptr;
 
+	//Command Stream (optional worker thread that owns recording and submission)
+	CStateBlock9 mApplicationDeviceState; //What the application has set, the worker's copy can be behind it.
+	std::unique_ptr<CommandStream> mCommandStream;
+
+	bool QueueCommands() const;
+	void SynchronizeCommandStream();
+	DeviceState& GetApplicationDeviceState();
+
+	//Buffer renaming (locks pick a new version on the application thread and draws carry it to whoever records them)
+	std::atomic<uint64_t> mApplicationFrame = 0; //Presents the application has made, queued or not.
+	bool mBuffersRenamed = false;
+	std::array<vk::Buffer, MAX_VERTEX_STREAMS + 1> mRenamedBuffers; //Every stream then the index buffer.
+
+	void SetInternalStreamSource(UINT StreamNumber, IDirect3DVertexBuffer9* pStreamData, UINT OffsetInBytes, UINT Stride, vk::Buffer currentVertexBuffer);
+	void SetInternalIndices(IDirect3DIndexBuffer9* pIndexData, vk::Buffer currentIndexBuffer);
+	const vk::Buffer* GetRenamedBuffers();
+	void SetRenamedBuffers(const vk::Buffer* renamedBuffers);
+
 	//Misc
 	PAINTSTRUCT* mPaintInformation = {};
 
@@ -242,9 +641,8 @@ public:
 	std::vector<CSwapChain9*> mSwapChains;
 	std::vector< std::unique_ptr<RenderContainer> > mRenderContainers;
 	std::vector< std::unique_ptr<CVertexDeclaration9> > mVertexDeclarations;
-	std::vector< std::unique_ptr<SamplerContainer> > mSamplerContainers;
+	std::unordered_map<SamplerKey, std::unique_ptr<SamplerContainer>, SamplerKeyHasher> mSamplerContainers;
 	RenderContainer* mCurrentRenderContainer=nullptr;
-	D3DPRIMITIVETYPE mLastPrimitiveType = D3DPT_FORCE_DWORD;
 	std::unique_ptr<CTexture9> mBlankTexture;
 
 public:
@@ -399,6 +797,7 @@ public:
 	CSurface9* mDepthStencilSurface = nullptr;
 	std::array<CSurface9*, 4> mRenderTargets = {};
 
+	RenderPassFormats mFormats;
 	vk::UniqueRenderPass mRenderPass;
 	std::vector <vk::UniqueFramebuffer> mFrameBuffers;
 
@@ -415,11 +814,9 @@ public:
 class SamplerContainer
 {
 public:
-	SamplerContainer(vk::Device& device, std::array<DWORD, D3DSAMP_DMAPOFFSET + 1>& samplerState, uint32_t textureLOD);
+	SamplerContainer(vk::Device& device, const SamplerKey& samplerKey);
 	~SamplerContainer();
 
-	std::array<DWORD, D3DSAMP_DMAPOFFSET + 1> mSamplerState = {};
-	uint32_t mTextureLOD = {};
 	vk::UniqueSampler mSampler;
 
 };
@@ -34,6 +34,8 @@ CPixelShader9::CPixelShader9(CDevice9* device,const DWORD* pFunction)
 	mShader = converter.Convert((uint32_t*)pFunction);
 
 	mSize = converter.mSize;
+	mHash = HashBytes(converter.mInstructions.data(), converter.mInstructions.size() * sizeof(uint32_t));
+	mDevice->RecordShader(mHash, converter.mInstructions);
 
 	if (mSize)
 	{
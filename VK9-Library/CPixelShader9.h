@@ -45,6 +45,7 @@ public:
 
 	//Misc
 	vk::UniqueShaderModule mShader;
+	uint64_t mHash = 0;
 private:
 	CDevice9* mDevice = nullptr;
 public:
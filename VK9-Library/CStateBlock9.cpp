@@ -255,27 +255,65 @@ void CStateBlock9::SetPixelShader(IDirect3DPixelShader9* pixelShader)
 
 	mDeviceState.mCapturedPixelShader = true;
 	mDeviceState.mPixelShader = reinterpret_cast <CPixelShader9*>(pixelShader);
+
+	const uint64_t hash = (mDeviceState.mPixelShader != nullptr) ? mDeviceState.mPixelShader->mHash : 0;
+	if (mDeviceState.mPipelineKey.mPixelShaderHash != hash)
+	{
+		mDeviceState.mPipelineKey.mPixelShaderHash = hash;
+		mDeviceState.mCapturedPipelineKey = true;
+	}
 }
 
 void CStateBlock9::SetPixelShaderConstantB(unsigned int startRegister, const int* constantData, unsigned int count)
 {
-	memcpy(&mDeviceState.mPixelShaderConstantB[startRegister], constantData, count * sizeof(int));
+	//Only registers that actually change are marked so setting the same values again costs nothing at the next draw.
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (memcmp(&mDeviceState.mPixelShaderConstantB[startRegister + i], &constantData[i], sizeof(int)))
+		{
+			memcpy(&mDeviceState.mPixelShaderConstantB[startRegister + i], &constantData[i], sizeof(int));
+			mDeviceState.mDirtyPixelShaderConstants = true;
+		}
+	}
 }
 
 void CStateBlock9::SetPixelShaderConstantF(unsigned int startRegister, const float* constantData, unsigned int count)
 {
-	memcpy(&mDeviceState.mPixelShaderConstantF[startRegister], constantData, count * sizeof(float[4]));
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (memcmp(mDeviceState.mPixelShaderConstantF[startRegister + i], &constantData[i * 4], sizeof(float[4])))
+		{
+			memcpy(mDeviceState.mPixelShaderConstantF[startRegister + i], &constantData[i * 4], sizeof(float[4]));
+			mDeviceState.mDirtyPixelShaderConstants = true;
+		}
+	}
 }
 
 void CStateBlock9::SetPixelShaderConstantI(unsigned int startRegister, const int* constantData, unsigned int count)
 {
-	memcpy(&mDeviceState.mPixelShaderConstantI[startRegister], constantData, count * sizeof(int[4]));
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (memcmp(mDeviceState.mPixelShaderConstantI[startRegister + i], &constantData[i * 4], sizeof(int[4])))
+		{
+			memcpy(mDeviceState.mPixelShaderConstantI[startRegister + i], &constantData[i * 4], sizeof(int[4]));
+			mDeviceState.mDirtyPixelShaderConstants = true;
+		}
+	}
 }
 
 void CStateBlock9::SetRenderState(D3DRENDERSTATETYPE state, unsigned long value)
 {
 	mDeviceState.mCapturedRenderState[state] = true;
 	mDeviceState.mRenderState[state] = value;
+
+	if (mDeviceState.mPipelineKey.SetRenderState(state, value))
+	{
+		mDeviceState.mCapturedPipelineKey = true;
+	}
+	else if (mDeviceState.mPipelineKey.IsDynamicRenderState(state))
+	{
+		mDeviceState.mCapturedDynamicRenderState = true;
+	}
 }
 
 void CStateBlock9::SetSamplerState(unsigned long index, D3DSAMPLERSTATETYPE state, unsigned long value)
@@ -315,6 +353,20 @@ void CStateBlock9::SetStreamSource(unsigned int stream, IDirect3DVertexBuffer9*
 	mDeviceState.mStreamSource[stream].vertexBuffer = reinterpret_cast <CVertexBuffer9*>(vertexBuffer);
 	mDeviceState.mStreamSource[stream].offset = offset;
 	mDeviceState.mStreamSource[stream].stride = stride;
+
+	if (stream < MAX_VERTEX_STREAMS)
+	{
+		auto& pipelineKey = mDeviceState.mPipelineKey;
+		const uint16_t streamBit = (1u << stream);
+		const uint16_t streamMask = (vertexBuffer != nullptr) ? (pipelineKey.mStreamMask | streamBit) : (pipelineKey.mStreamMask & ~streamBit);
+		const uint16_t streamStride = (vertexBuffer != nullptr) ? stride : 0;
+		if (pipelineKey.mStreamMask != streamMask || pipelineKey.mStreamStride[stream] != streamStride)
+		{
+			pipelineKey.mStreamMask = streamMask;
+			pipelineKey.mStreamStride[stream] = streamStride;
+			mDeviceState.mCapturedPipelineKey = true;
+		}
+	}
 }
 
 void CStateBlock9::SetStreamSourceFreq(unsigned int streamNumber, unsigned int divider)
@@ -322,6 +374,18 @@ void CStateBlock9::SetStreamSourceFreq(unsigned int streamNumber, unsigned int d
 	mDeviceState.mCapturedAnyStreamFrequency = true;
 	mDeviceState.mCapturedStreamSourceFrequency[streamNumber] = true;
 	mDeviceState.mStreamSourceFrequency[streamNumber] = divider;
+
+	if (streamNumber < MAX_VERTEX_STREAMS)
+	{
+		auto& pipelineKey = mDeviceState.mPipelineKey;
+		const uint16_t streamBit = (1u << streamNumber);
+		const uint16_t instanceMask = ((divider & D3DSTREAMSOURCE_INSTANCEDATA) == D3DSTREAMSOURCE_INSTANCEDATA) ? (pipelineKey.mInstanceMask | streamBit) : (pipelineKey.mInstanceMask & ~streamBit);
+		if (pipelineKey.mInstanceMask != instanceMask)
+		{
+			pipelineKey.mInstanceMask = instanceMask;
+			mDeviceState.mCapturedPipelineKey = true;
+		}
+	}
 }
 
 void CStateBlock9::SetTexture(unsigned long index, IDirect3DBaseTexture9* texture)
@@ -405,6 +469,13 @@ void CStateBlock9::SetVertexDeclaration(IDirect3DVertexDeclaration9* vertexDecla
 
 	mDeviceState.mCapturedVertexDeclaration = true;
 	mDeviceState.mVertexDeclaration = reinterpret_cast <CVertexDeclaration9*>(vertexDeclaration);
+
+	const uint64_t hash = (mDeviceState.mVertexDeclaration != nullptr) ? mDeviceState.mVertexDeclaration->mHash : 0;
+	if (mDeviceState.mPipelineKey.mVertexDeclarationHash != hash)
+	{
+		mDeviceState.mPipelineKey.mVertexDeclarationHash = hash;
+		mDeviceState.mCapturedPipelineKey = true;
+	}
 }
 
 void CStateBlock9::SetVertexShader(IDirect3DVertexShader9* vertexShader)
@@ -420,21 +491,49 @@ void CStateBlock9::SetVertexShader(IDirect3DVertexShader9* vertexShader)
 
 	mDeviceState.mCapturedVertexShader = true;
 	mDeviceState.mVertexShader = reinterpret_cast <CVertexShader9*>(vertexShader);
+
+	const uint64_t hash = (mDeviceState.mVertexShader != nullptr) ? mDeviceState.mVertexShader->mHash : 0;
+	if (mDeviceState.mPipelineKey.mVertexShaderHash != hash)
+	{
+		mDeviceState.mPipelineKey.mVertexShaderHash = hash;
+		mDeviceState.mCapturedPipelineKey = true;
+	}
 }
 
 void CStateBlock9::SetVertexShaderConstantB(unsigned int startRegister, const int* constantData, unsigned int count)
 {
-	memcpy(&mDeviceState.mVertexShaderConstantB[startRegister], constantData, count * sizeof(int));
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (memcmp(&mDeviceState.mVertexShaderConstantB[startRegister + i], &constantData[i], sizeof(int)))
+		{
+			memcpy(&mDeviceState.mVertexShaderConstantB[startRegister + i], &constantData[i], sizeof(int));
+			mDeviceState.mDirtyVertexShaderConstants = true;
+		}
+	}
 }
 
 void CStateBlock9::SetVertexShaderConstantF(unsigned int startRegister, const float* constantData, unsigned int count)
 {
-	memcpy(&mDeviceState.mVertexShaderConstantF[startRegister], constantData, count * sizeof(float[4]));
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (memcmp(mDeviceState.mVertexShaderConstantF[startRegister + i], &constantData[i * 4], sizeof(float[4])))
+		{
+			memcpy(mDeviceState.mVertexShaderConstantF[startRegister + i], &constantData[i * 4], sizeof(float[4]));
+			mDeviceState.mDirtyVertexShaderConstants = true;
+		}
+	}
 }
 
 void CStateBlock9::SetVertexShaderConstantI(unsigned int startRegister, const int* constantData, unsigned int count)
 {
-	memcpy(&mDeviceState.mVertexShaderConstantI[startRegister], constantData, count * sizeof(int[4]));
+	for (unsigned int i = 0; i < count; i++)
+	{
+		if (memcmp(mDeviceState.mVertexShaderConstantI[startRegister + i], &constantData[i * 4], sizeof(int[4])))
+		{
+			memcpy(mDeviceState.mVertexShaderConstantI[startRegister + i], &constantData[i * 4], sizeof(int[4]));
+			mDeviceState.mDirtyVertexShaderConstants = true;
+		}
+	}
 }
 
 void CStateBlock9::CaptureRenderState(D3DRENDERSTATETYPE state)
@@ -290,6 +290,13 @@ HRESULT STDMETHODCALLTYPE CSwapChain9::GetRasterStatus(D3DRASTER_STATUS *pRaster
 
 HRESULT STDMETHODCALLTYPE CSwapChain9::Present(const RECT *pSourceRect, const RECT *pDestRect, HWND hDestWindowOverride, const RGNDATA *pDirtyRegion, DWORD dwFlags)
 {
+	mDevice->SynchronizeCommandStream(); //The device queues its own presents, this is for swap chains the application presents directly.
+
+	if (!mDevice->mCommandStream || !mDevice->mCommandStream->IsWorkerThread())
+	{
+		mDevice->mApplicationFrame++; //Queued presents were counted when they were queued.
+	}
+
 	if (pSourceRect)
 	{
 		Log(warning) << "CSwapChain9::Present SourceRect is not implemented!" << std::endl;
@@ -386,6 +393,8 @@ HRESULT STDMETHODCALLTYPE CSwapChain9::Present(const RECT *pSourceRect, const RE
 	presentInfo.pImageIndices = &mImageIndex;
 	mQueue.presentKHR(&presentInfo); //use present queue.
 
+	mDevice->WritePerformanceStats();
+
 	return D3D_OK;
 }
 
@@ -155,6 +155,9 @@ CTexture9::~CTexture9()
 {
 	Log(info) << "CTexture9::~CTexture9" << std::endl;
 
+	mDevice->ReleaseBindlessTexture(mImageView.get());
+	mDevice->EvictDescriptorSets(mImageView.get());
+
 	for (int32_t i = 0; i < (int32_t)mSurfaces.size(); i++)
 	{
 		mSurfaces[i]->Release();
@@ -34,11 +34,9 @@ CVertexBuffer9::CVertexBuffer9(CDevice9* device, UINT Length, DWORD Usage, DWORD
 	mIsDirty(true),
 	mLockCount(0)
 {
-	AddStagingBuffer();
-	AddVertexBuffer();
-
-	mCurrentVertexBuffer = mVertexBuffers[mDevice->mFrameIndex][0].get();
-	mCurrentVertexBufferMemory = mVertexBufferMemories[mDevice->mFrameIndex][0].get();
+	AddVersions(1);
+	SetCurrentVersion(mFreeVersions.back());
+	mFreeVersions.pop_back();
 }
 
 CVertexBuffer9::~CVertexBuffer9()
@@ -63,38 +61,99 @@ ULONG CVertexBuffer9::PrivateRelease(void)
 	return ref;
 }
 
-void CVertexBuffer9::AddStagingBuffer()
+/*
+Adds a block of versions that share one staging and one device allocation, each buffer is bound at its own offset.
+Versions are still separate buffers so draws and copies carry them around the same way as before.
+*/
+void CVertexBuffer9::AddVersions(uint32_t count)
 {
-	auto const bufferInfo = vk::BufferCreateInfo().setSize(mLength + 192 + 1024).setUsage(vk::BufferUsageFlagBits::eTransferSrc);
+	auto& device = mDevice->mDevice;
+	const size_t first = mVertexBuffers.size();
 
-	mStagingBuffer = mDevice->mDevice->createBufferUnique(bufferInfo);
+	auto const stagingBufferInfo = vk::BufferCreateInfo().setSize(mLength + 192 + 1024).setUsage(vk::BufferUsageFlagBits::eTransferSrc);
+	auto const vertexBufferInfo = vk::BufferCreateInfo().setSize(mLength + 192 + 1024).setUsage(vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst);
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		mStagingBuffers.push_back(device->createBufferUnique(stagingBufferInfo));
+		mVertexBuffers.push_back(device->createBufferUnique(vertexBufferInfo));
+	}
 
+	//Every buffer in the block is created the same way so the first one's requirements cover them all.
 	vk::MemoryRequirements mem_reqs;
-	mDevice->mDevice->getBufferMemoryRequirements(mStagingBuffer.get(), &mem_reqs);
+	device->getBufferMemoryRequirements(mStagingBuffers[first].get(), &mem_reqs);
+	const vk::DeviceSize stagingStride = (mem_reqs.size + mem_reqs.alignment - 1) & ~(mem_reqs.alignment - 1);
 
-	auto mem_alloc = vk::MemoryAllocateInfo().setAllocationSize(mem_reqs.size).setMemoryTypeIndex(0);
+	auto mem_alloc = vk::MemoryAllocateInfo().setAllocationSize(stagingStride * count).setMemoryTypeIndex(0);
 	mDevice->FindMemoryTypeFromProperties(mem_reqs.memoryTypeBits, vk::MemoryPropertyFlagBits::eHostVisible | vk::MemoryPropertyFlagBits::eHostCoherent, &mem_alloc.memoryTypeIndex);
+	mStagingBufferMemories.push_back(device->allocateMemoryUnique(mem_alloc));
+	char* stagingData = reinterpret_cast<char*>(device->mapMemory(mStagingBufferMemories.back().get(), 0, VK_WHOLE_SIZE));
 
-	mStagingBufferMemory = mDevice->mDevice->allocateMemoryUnique(mem_alloc);
+	device->getBufferMemoryRequirements(mVertexBuffers[first].get(), &mem_reqs);
+	const vk::DeviceSize vertexStride = (mem_reqs.size + mem_reqs.alignment - 1) & ~(mem_reqs.alignment - 1);
 
-	mDevice->mDevice->bindBufferMemory(mStagingBuffer.get(), mStagingBufferMemory.get(), 0);
+	mem_alloc.setAllocationSize(vertexStride * count).setMemoryTypeIndex(0);
+	mDevice->FindMemoryTypeFromProperties(mem_reqs.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &mem_alloc.memoryTypeIndex);
+	mVertexBufferMemories.push_back(device->allocateMemoryUnique(mem_alloc));
+
+	for (uint32_t i = 0; i < count; i++)
+	{
+		device->bindBufferMemory(mStagingBuffers[first + i].get(), mStagingBufferMemories.back().get(), stagingStride * i);
+		device->bindBufferMemory(mVertexBuffers[first + i].get(), mVertexBufferMemories.back().get(), vertexStride * i);
+		mStagingData.push_back(stagingData + stagingStride * i);
+	}
+
+	//Backwards so the lowest new version is handed out first.
+	for (size_t i = first + count; i > first; i--)
+	{
+		mFreeVersions.push_back((int32_t)(i - 1));
+	}
 }
 
-void CVertexBuffer9::AddVertexBuffer()
+void CVertexBuffer9::SetCurrentVersion(int32_t index)
 {
-	auto const bufferInfo = vk::BufferCreateInfo().setSize(mLength + 192 + 1024).setUsage(vk::BufferUsageFlagBits::eVertexBuffer | vk::BufferUsageFlagBits::eTransferDst);
+	mIndex = index;
 
-	mVertexBuffers[mDevice->mFrameIndex].push_back(mDevice->mDevice->createBufferUnique(bufferInfo));
+	mCurrentStagingBuffer = mStagingBuffers[index].get();
+	mCurrentStagingData = mStagingData[index];
 
-	vk::MemoryRequirements mem_reqs;
-	mDevice->mDevice->getBufferMemoryRequirements(mVertexBuffers[mDevice->mFrameIndex][mVertexBuffers[mDevice->mFrameIndex].size() - 1].get(), &mem_reqs);
+	mCurrentVertexBuffer = mVertexBuffers[index].get();
+}
 
-	auto mem_alloc = vk::MemoryAllocateInfo().setAllocationSize(mem_reqs.size).setMemoryTypeIndex(0);
-	mDevice->FindMemoryTypeFromProperties(mem_reqs.memoryTypeBits, vk::MemoryPropertyFlagBits::eDeviceLocal, &mem_alloc.memoryTypeIndex);
+/*
+Switches to a version no queued draw can be reading so a lock doesn't have to wait for the worker or the GPU.
+Draws queued from here on carry the new version to the worker, see CDevice9::GetRenamedBuffers.
+*/
+void CVertexBuffer9::Rename(bool keepContents)
+{
+	const uint64_t frame = mDevice->mApplicationFrame;
+	const char* lastStagingData = mCurrentStagingData;
+
+	mRetiredVersions.emplace_back(frame, mIndex);
+
+	if (mRetiredVersions.front().first + MAX_RENAMED_BUFFER_FRAMES <= frame)
+	{
+		SetCurrentVersion(mRetiredVersions.front().second);
+		mRetiredVersions.pop_front();
+	}
+	else
+	{
+		if (mFreeVersions.empty())
+		{
+			AddVersions((uint32_t)mVertexBuffers.size());
+		}
+		SetCurrentVersion(mFreeVersions.back());
+		mFreeVersions.pop_back();
+	}
 
-	mVertexBufferMemories[mDevice->mFrameIndex].push_back(mDevice->mDevice->allocateMemoryUnique(mem_alloc));
+	//Whatever the lock doesn't write has to carry over unless the application threw it away.
+	if (keepContents)
+	{
+		memcpy(mCurrentStagingData, lastStagingData, mLength);
+	}
 
-	mDevice->mDevice->bindBufferMemory(mVertexBuffers[mDevice->mFrameIndex][mVertexBuffers[mDevice->mFrameIndex].size() - 1].get(), mVertexBufferMemories[mDevice->mFrameIndex][mVertexBufferMemories[mDevice->mFrameIndex].size() - 1].get(), 0);
+	mIsUploaded = false;
+	mDevice->mBuffersRenamed = true;
 }
 
 ULONG STDMETHODCALLTYPE CVertexBuffer9::AddRef(void)
@@ -231,6 +290,12 @@ HRESULT STDMETHODCALLTYPE CVertexBuffer9::GetDesc(D3DVERTEXBUFFER_DESC* pDesc)
 
 HRESULT STDMETHODCALLTYPE CVertexBuffer9::Lock(UINT OffsetToLock, UINT SizeToLock, VOID** ppbData, DWORD Flags)
 {
+	//Writes that could land on queued data get a new version below, only reading a static buffer waits for the worker.
+	if ((Flags & D3DLOCK_READONLY) && !(mUsage & D3DUSAGE_DYNAMIC))
+	{
+		mDevice->SynchronizeCommandStream();
+	}
+
 	InterlockedIncrement(&mLockCount);
 
 	if (mPool == D3DPOOL_MANAGED)
@@ -244,44 +309,29 @@ HRESULT STDMETHODCALLTYPE CVertexBuffer9::Lock(UINT OffsetToLock, UINT SizeToLoc
 	mOffsetToLock = OffsetToLock;
 	mSizeToLock = SizeToLock;
 
-	if (mLastFrameIndex != mDevice->mFrameIndex)
+	if (!(Flags & (D3DLOCK_READONLY | D3DLOCK_NOOVERWRITE)) && mIsUploaded)
 	{
-		mIndex = 0;
-		mLastFrameIndex = mDevice->mFrameIndex;
-	}
-	else
-	{
-		if ((Flags & D3DLOCK_NOOVERWRITE) != D3DLOCK_NOOVERWRITE && (Flags & D3DLOCK_READONLY) != D3DLOCK_READONLY)
-		{
-			mIndex++;
-		}
-	}
-
-	if (mIndex > (int32_t)mVertexBuffers[mDevice->mFrameIndex].size() - 1)
-	{
-		AddVertexBuffer();
+		Rename(!(Flags & D3DLOCK_DISCARD));
 	}
 
-	mCurrentVertexBuffer = mVertexBuffers[mDevice->mFrameIndex][mIndex].get();
-	mCurrentVertexBufferMemory = mVertexBufferMemories[mDevice->mFrameIndex][mIndex].get();
-
-	(*ppbData) = mDevice->mDevice->mapMemory(mStagingBufferMemory.get(), OffsetToLock, VK_WHOLE_SIZE);
+	(*ppbData) = mCurrentStagingData + OffsetToLock;
 
 	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CVertexBuffer9::Unlock()
 {
-	mDevice->mDevice->unmapMemory(mStagingBufferMemory.get());
-
-	mDevice->BeginRecordingUtilityCommands();
+	//The worker records the copy when it gets there so it lands after the draws that were queued against the last version.
+	if (mDevice->QueueCommands())
+	{
+		mDevice->mCommandStream->PushReference(WorkItemType::Device_CopyBuffer, this, mCurrentStagingBuffer, mCurrentVertexBuffer, (vk::DeviceSize)(mLength + 192 + 1024));
+	}
+	else
 	{
-		auto const region = vk::BufferCopy().setSize(mLength + 192 + 1024);
-		mDevice->mCurrentUtilityCommandBuffer.copyBuffer(mStagingBuffer.get(), mCurrentVertexBuffer, 1, &region);
+		mDevice->CopyBuffer(mCurrentStagingBuffer, mCurrentVertexBuffer, mLength + 192 + 1024);
 	}
-	mDevice->StopRecordingUtilityCommands();
 
-	//mDevice->mDevice->waitIdle();
+	mIsUploaded = true;
 
 	InterlockedDecrement(&mLockCount);
 
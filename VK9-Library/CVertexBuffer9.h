@@ -24,6 +24,8 @@ misrepresented as being the original software.
 #include <vulkan/vk_sdk_platform.h>
 #include "d3d9.h"
 
+#include <deque>
+
 class CDevice9;
 
 class CVertexBuffer9 : public IDirect3DVertexBuffer9
@@ -39,18 +41,23 @@ public:
 	ULONG PrivateAddRef(void);
 	ULONG PrivateRelease(void);
 
-	//Buffers (Staging and Vertex)
-	std::array<std::vector<vk::UniqueBuffer>, 2> mVertexBuffers;
-	std::array<std::vector<vk::UniqueDeviceMemory>,2> mVertexBufferMemories;
+	//Buffers (Staging and Vertex), every version has its own staging buffer so a queued copy reads what was written before the next lock.
+	//Versions come in blocks that share one allocation per kind and each new block is as big as all the ones before it, so allocations only grow with the log of the version count.
+	std::vector<vk::UniqueDeviceMemory> mVertexBufferMemories; //One per block.
+	std::vector<vk::UniqueDeviceMemory> mStagingBufferMemories;
+	std::vector<vk::UniqueBuffer> mVertexBuffers; //One per version.
+	std::vector<vk::UniqueBuffer> mStagingBuffers;
+	std::vector<char*> mStagingData; //Staging blocks stay mapped for the life of the buffer.
 
-	int32_t mLastFrameIndex = 0;
+	std::deque<std::pair<uint64_t, int32_t>> mRetiredVersions; //The application frame each version stopped being current in, oldest first.
+	std::vector<int32_t> mFreeVersions; //Never used yet.
 	int32_t mIndex = 0;
+	bool mIsUploaded = false; //Nothing can be drawing from a version that was never unlocked.
 
-	vk::UniqueBuffer mStagingBuffer;
-	vk::UniqueDeviceMemory mStagingBufferMemory;
+	vk::Buffer mCurrentStagingBuffer;
+	char* mCurrentStagingData = nullptr;
 
 	vk::Buffer mCurrentVertexBuffer;
-	vk::DeviceMemory mCurrentVertexBufferMemory;
 
 	//D3D9 State
 	UINT mLength;
@@ -65,8 +72,9 @@ public:
 	UINT mSizeToLock = 0;
 
 	//Helper Functions
-	void AddStagingBuffer();
-	void AddVertexBuffer();
+	void AddVersions(uint32_t count);
+	void SetCurrentVersion(int32_t index);
+	void Rename(bool keepContents);
 
 private:
 	CDevice9* mDevice;
@@ -21,6 +21,7 @@ misrepresented as being the original software.
 #include "CVertexDeclaration9.h"
 #include "CDevice9.h"
 #include "LogManager.h"
+#include "Hash.h"
 //#include "PrivateTypes.h"
 
 static uint32_t UsageOffsets[14] =
@@ -230,7 +231,7 @@ CVertexDeclaration9::CVertexDeclaration9(CDevice9* device, const D3DVERTEXELEMEN
 		i++;
 	}
 
-	auto test = 0;
+	UpdateHash();
 }
 
 CVertexDeclaration9::CVertexDeclaration9(CDevice9* device, DWORD fvf)
@@ -376,6 +377,16 @@ CVertexDeclaration9::CVertexDeclaration9(CDevice9* device, DWORD fvf)
 
 		offset += (sizeof(float) * 2);
 	}
+
+	UpdateHash();
+}
+
+void CVertexDeclaration9::UpdateHash() noexcept
+{
+	//The layout flags are derived from the elements/fvf so hashing those plus the attributes covers everything the pipeline cares about.
+	mHash = HashBytes(mVertexElements.data(), mVertexElements.size() * sizeof(D3DVERTEXELEMENT9));
+	mHash = HashBytes(&mFVF, sizeof(DWORD), mHash);
+	mHash = HashBytes(mVertexInputAttributeDescription.data(), mVertexInputAttributeDescription.size() * sizeof(vk::VertexInputAttributeDescription), mHash);
 }
 
 CVertexDeclaration9::~CVertexDeclaration9()
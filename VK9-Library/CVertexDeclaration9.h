@@ -70,6 +70,9 @@ public:
 	BOOL mHasSample = 0;
 
 	std::vector<vk::VertexInputAttributeDescription> mVertexInputAttributeDescription;
+	uint64_t mHash = 0;
+
+	void UpdateHash() noexcept;
 
 private:
 	CDevice9* mDevice;
@@ -0,0 +1,135 @@
+#pragma once
+
+/*
+Copyright(c) 2019 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include "WorkItemType.h"
+#include "d3d9.h"
+
+#define COMMAND_PACKET_ALIGNMENT 8
+
+/*
+A command packet is this header followed by its arguments in the order they were pushed.
+Each argument takes a whole number of alignment slots and copied data follows a slot holding its size.
+Packets are written back to back into the command stream's chunks so nothing in a packet needs freeing.
+*/
+struct CommandPacket
+{
+	WorkItemType WorkItemType;
+	uint32_t Size; //The header, arguments and copied data.
+	IUnknown* Caller; //Referenced until the chunk holding the packet is recycled on the application thread.
+	std::atomic<uint32_t>* Completion; //Only set when the application thread is going to wait on the packet.
+};
+
+static_assert(std::is_trivially_copyable<CommandPacket>::value, "Command packets are copied around as raw memory.");
+
+//Memory an argument points at, it's copied into the packet and a null pointer stays null.
+struct CommandData
+{
+	const void* Data;
+	size_t Size;
+};
+
+inline constexpr size_t AlignCommandSize(size_t size) noexcept
+{
+	return (size + (COMMAND_PACKET_ALIGNMENT - 1)) & ~(size_t)(COMMAND_PACKET_ALIGNMENT - 1);
+}
+
+#define COMMAND_PACKET_HEADER_SIZE AlignCommandSize(sizeof(CommandPacket))
+
+template <typename T>
+inline size_t GetCommandArgumentSize(const T&) noexcept
+{
+	static_assert(std::is_trivially_copyable<T>::value, "Command arguments are copied as raw memory.");
+	return AlignCommandSize(sizeof(T));
+}
+
+inline size_t GetCommandArgumentSize(const CommandData& data) noexcept
+{
+	return COMMAND_PACKET_ALIGNMENT + (data.Data ? AlignCommandSize(data.Size) : 0);
+}
+
+template <typename T>
+inline void WriteCommandArgument(char*& cursor, const T& value) noexcept
+{
+	memcpy(cursor, &value, sizeof(T));
+	cursor += AlignCommandSize(sizeof(T));
+}
+
+inline void WriteCommandArgument(char*& cursor, const CommandData& data) noexcept
+{
+	const uint32_t header[2] = { data.Data != nullptr, (uint32_t)data.Size };
+	memcpy(cursor, header, sizeof(header));
+	cursor += COMMAND_PACKET_ALIGNMENT;
+
+	if (data.Data)
+	{
+		memcpy(cursor, data.Data, data.Size);
+		cursor += AlignCommandSize(data.Size);
+	}
+}
+
+/*
+Reads a packet's arguments back in the order they were written.
+Every read moves the cursor so reads need to be separate statements rather than arguments to the same call.
+*/
+class CommandReader
+{
+public:
+	explicit CommandReader(const CommandPacket& packet) noexcept
+		: mCursor(reinterpret_cast<const char*>(&packet) + COMMAND_PACKET_HEADER_SIZE)
+	{
+
+	}
+
+	template <typename T>
+	T Read() noexcept
+	{
+		T value;
+		memcpy(&value, mCursor, sizeof(T));
+		mCursor += AlignCommandSize(sizeof(T));
+		return value;
+	}
+
+	//Points into the packet so it's only good until the packet's chunk is recycled.
+	template <typename T>
+	const T* ReadData() noexcept
+	{
+		uint32_t header[2];
+		memcpy(header, mCursor, sizeof(header));
+		mCursor += COMMAND_PACKET_ALIGNMENT;
+
+		if (!header[0])
+		{
+			return nullptr;
+		}
+
+		auto data = reinterpret_cast<const T*>(mCursor);
+		mCursor += AlignCommandSize(header[1]);
+		return data;
+	}
+
+private:
+	const char* mCursor;
+};
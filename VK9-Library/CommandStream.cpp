@@ -0,0 +1,491 @@
+/*
+Copyright(c) 2019 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include "CommandStream.h"
+#include "CDevice9.h"
+#include "LogManager.h"
+
+static_assert(MAX_RENAMED_BUFFER_FRAMES > MAX_FRAMES_IN_FLIGHT + COMMAND_STREAM_MAX_QUEUED_FRAMES, "A renamed buffer could be reused while a queued frame still reads it.");
+
+CommandStream::CommandStream(CDevice9* device, bool multithreaded)
+	: mDevice(device),
+	mMultithreaded(multithreaded),
+	mFinishedChunks(16)
+{
+	mWorkerThread = std::thread(&CommandStream::Run, this);
+	mWorkerThreadId = mWorkerThread.get_id(); //Nothing is queued yet so the worker can't ask before this is set.
+}
+
+CommandStream::~CommandStream()
+{
+	Push(WorkItemType::Device_Destroy);
+	mWorkerThread.join();
+
+	//Every packet still sitting in a chunk holds its reference, recycled chunks start again from zero.
+	for (auto& chunk : mChunks)
+	{
+		for (size_t offset = 0; offset < chunk->Used;)
+		{
+			auto packet = reinterpret_cast<CommandPacket*>(chunk->Data.get() + offset);
+			if (packet->Caller)
+			{
+				mFinishedCallers.push_back(packet->Caller);
+			}
+			offset += packet->Size;
+		}
+	}
+	ReleaseFinishedCallers();
+
+	Log(info) << "CommandStream::~CommandStream packets queued " << mPacketsQueued << " synchronizations " << mSynchronizeCount << " chunks allocated " << mChunks.size() << " queue waits " << mPackets.mParkCount << std::endl;
+}
+
+CommandPacket* CommandStream::Allocate(size_t size)
+{
+	//There always has to be room left for the packet that hands the chunk back.
+	const size_t retireSize = COMMAND_PACKET_HEADER_SIZE + AlignCommandSize(sizeof(CommandChunk*));
+
+	if (mCurrentChunk == nullptr || mCurrentChunk->Used + size + retireSize > mCurrentChunk->Capacity)
+	{
+		if (mCurrentChunk != nullptr)
+		{
+			RetireChunk();
+		}
+		mCurrentChunk = GetChunk(size + retireSize);
+	}
+
+	auto packet = reinterpret_cast<CommandPacket*>(mCurrentChunk->Data.get() + mCurrentChunk->Used);
+	mCurrentChunk->Used += size;
+
+	return packet;
+}
+
+void CommandStream::RetireChunk()
+{
+	CommandChunk* chunk = mCurrentChunk;
+	mCurrentChunk = nullptr;
+
+	auto packet = reinterpret_cast<CommandPacket*>(chunk->Data.get() + chunk->Used);
+	packet->WorkItemType = WorkItemType::CommandStream_RetireChunk;
+	packet->Size = (uint32_t)(COMMAND_PACKET_HEADER_SIZE + AlignCommandSize(sizeof(CommandChunk*)));
+	packet->Caller = nullptr;
+	packet->Completion = nullptr;
+
+	char* cursor = reinterpret_cast<char*>(packet) + COMMAND_PACKET_HEADER_SIZE;
+	WriteCommandArgument(cursor, chunk);
+	chunk->Used += packet->Size;
+
+	Submit(packet);
+}
+
+CommandChunk* CommandStream::GetChunk(size_t size)
+{
+	CommandChunk* chunk = nullptr;
+
+	if (mFinishedChunks.try_dequeue(chunk))
+	{
+		//The references are released after the packet is submitted because a release can run a destructor that queues more work.
+		for (size_t offset = 0; offset < chunk->Used;)
+		{
+			auto packet = reinterpret_cast<CommandPacket*>(chunk->Data.get() + offset);
+			if (packet->Caller)
+			{
+				mFinishedCallers.push_back(packet->Caller);
+			}
+			offset += packet->Size;
+		}
+
+		if (chunk->Capacity < size)
+		{
+			chunk->Data.reset(new char[size]);
+			chunk->Capacity = size;
+		}
+	}
+	else
+	{
+		mChunks.push_back(std::make_unique<CommandChunk>());
+		chunk = mChunks.back().get();
+		chunk->Capacity = (size > COMMAND_STREAM_CHUNK_SIZE) ? size : COMMAND_STREAM_CHUNK_SIZE;
+		chunk->Data.reset(new char[chunk->Capacity]);
+	}
+
+	chunk->Used = 0;
+
+	return chunk;
+}
+
+void CommandStream::Submit(CommandPacket* packet)
+{
+	mPacketsQueued++;
+	mPackets.Push(packet);
+
+	if (!mFinishedCallers.empty())
+	{
+		ReleaseFinishedCallers();
+	}
+}
+
+void CommandStream::ReleaseFinishedCallers()
+{
+	//Popped one at a time because a release can end up back here.
+	while (!mFinishedCallers.empty())
+	{
+		IUnknown* caller = mFinishedCallers.back();
+		mFinishedCallers.pop_back();
+		caller->Release();
+	}
+}
+
+void CommandStream::Synchronize()
+{
+	if (IsWorkerThread())
+	{
+		return;
+	}
+
+	std::atomic<uint32_t> completion = 0;
+
+	{
+		auto lock = LockProducer();
+
+		mSynchronizeCount++;
+
+		CommandPacket* packet = Allocate(COMMAND_PACKET_HEADER_SIZE);
+		packet->WorkItemType = WorkItemType::None;
+		packet->Size = (uint32_t)COMMAND_PACKET_HEADER_SIZE;
+		packet->Caller = nullptr;
+		packet->Completion = &completion;
+		Submit(packet);
+	}
+
+	//The worker is usually close behind so spin for a bit before going to sleep.
+	for (uint32_t i = 0; i < COMMAND_STREAM_SPIN_COUNT; i++)
+	{
+		if (completion.load(std::memory_order_acquire))
+		{
+			return;
+		}
+		std::this_thread::yield();
+	}
+
+	std::unique_lock<std::mutex> lock(mCompletionMutex);
+	mCompletionCondition.wait(lock, [&completion]() { return completion.load(std::memory_order_acquire) != 0; });
+}
+
+void CommandStream::BeginFrame()
+{
+	auto isFrameFree = [this]() { return mQueuedFrames.load(std::memory_order_acquire) < COMMAND_STREAM_MAX_QUEUED_FRAMES; };
+
+	//Spin for a bit like Synchronize does but a worker that's a whole frame behind can take a while so sleep after that.
+	for (uint32_t i = 0; i < COMMAND_STREAM_SPIN_COUNT && !isFrameFree(); i++)
+	{
+		std::this_thread::yield();
+	}
+
+	if (!isFrameFree())
+	{
+		std::unique_lock<std::mutex> lock(mCompletionMutex);
+		mCompletionCondition.wait(lock, isFrameFree);
+	}
+
+	mQueuedFrames++;
+}
+
+void CommandStream::Run()
+{
+	CommandPacket* packet = nullptr;
+
+	while (true)
+	{
+		mPackets.Pop(packet);
+
+		if (packet->WorkItemType == WorkItemType::Device_Destroy)
+		{
+			break;
+		}
+
+		Execute(*packet);
+
+		if (packet->Completion)
+		{
+			//Stored under the lock so a waiter can't check the flag and then miss the notify.
+			{
+				std::lock_guard<std::mutex> lock(mCompletionMutex);
+				packet->Completion->store(1, std::memory_order_release);
+			}
+			mCompletionCondition.notify_all(); //Several threads can be waiting on a multithreaded device.
+		}
+	}
+}
+
+void CommandStream::Execute(const CommandPacket& packet)
+{
+	CommandReader reader(packet);
+
+	switch (packet.WorkItemType)
+	{
+	case WorkItemType::None:
+		break;
+	case WorkItemType::CommandStream_RetireChunk:
+		mFinishedChunks.enqueue(reader.Read<CommandChunk*>());
+		break;
+	case WorkItemType::Device_BeginScene:
+		mDevice->BeginScene();
+		break;
+	case WorkItemType::Device_Clear:
+	{
+		const auto count = reader.Read<DWORD>();
+		const auto rects = reader.ReadData<D3DRECT>();
+		const auto flags = reader.Read<DWORD>();
+		const auto color = reader.Read<D3DCOLOR>();
+		const auto z = reader.Read<float>();
+		const auto stencil = reader.Read<DWORD>();
+		mDevice->Clear(count, rects, flags, color, z, stencil);
+	}
+	break;
+	case WorkItemType::Device_Present:
+	{
+		const auto sourceRect = reader.ReadData<RECT>();
+		const auto destRect = reader.ReadData<RECT>();
+		const auto window = reader.Read<HWND>();
+		const auto dirtyRegion = reader.ReadData<RGNDATA>();
+		const auto flags = reader.Read<DWORD>();
+		mDevice->PresentEx(sourceRect, destRect, window, dirtyRegion, flags);
+
+		//Decremented under the lock for the same reason completions are stored under it.
+		{
+			std::lock_guard<std::mutex> lock(mCompletionMutex);
+			mQueuedFrames--;
+		}
+		mCompletionCondition.notify_all();
+	}
+	break;
+	case WorkItemType::Device_CopyBuffer:
+	{
+		const auto source = reader.Read<vk::Buffer>();
+		const auto destination = reader.Read<vk::Buffer>();
+		const auto size = reader.Read<vk::DeviceSize>();
+		mDevice->CopyBuffer(source, destination, size);
+	}
+	break;
+	case WorkItemType::Device_DrawIndexedPrimitive:
+	{
+		const auto type = reader.Read<D3DPRIMITIVETYPE>();
+		const auto baseVertexIndex = reader.Read<INT>();
+		const auto minIndex = reader.Read<UINT>();
+		const auto numVertices = reader.Read<UINT>();
+		const auto startIndex = reader.Read<UINT>();
+		const auto primitiveCount = reader.Read<UINT>();
+		mDevice->SetRenamedBuffers(reader.ReadData<vk::Buffer>());
+		mDevice->DrawIndexedPrimitive(type, baseVertexIndex, minIndex, numVertices, startIndex, primitiveCount);
+	}
+	break;
+	case WorkItemType::Device_DrawIndexedPrimitiveUP:
+	{
+		const auto primitiveType = reader.Read<D3DPRIMITIVETYPE>();
+		const auto minVertexIndex = reader.Read<UINT>();
+		const auto numVertices = reader.Read<UINT>();
+		const auto primitiveCount = reader.Read<UINT>();
+		const auto indexData = reader.ReadData<void>();
+		const auto indexDataFormat = reader.Read<D3DFORMAT>();
+		const auto vertexStreamZeroData = reader.ReadData<void>();
+		const auto vertexStreamZeroStride = reader.Read<UINT>();
+		mDevice->DrawIndexedPrimitiveUP(primitiveType, minVertexIndex, numVertices, primitiveCount, indexData, indexDataFormat, vertexStreamZeroData, vertexStreamZeroStride);
+	}
+	break;
+	case WorkItemType::Device_DrawPrimitive:
+	{
+		const auto primitiveType = reader.Read<D3DPRIMITIVETYPE>();
+		const auto startVertex = reader.Read<UINT>();
+		const auto primitiveCount = reader.Read<UINT>();
+		mDevice->SetRenamedBuffers(reader.ReadData<vk::Buffer>());
+		mDevice->DrawPrimitive(primitiveType, startVertex, primitiveCount);
+	}
+	break;
+	case WorkItemType::Device_DrawPrimitiveUP:
+	{
+		const auto primitiveType = reader.Read<D3DPRIMITIVETYPE>();
+		const auto primitiveCount = reader.Read<UINT>();
+		const auto vertexStreamZeroData = reader.ReadData<void>();
+		const auto vertexStreamZeroStride = reader.Read<UINT>();
+		mDevice->DrawPrimitiveUP(primitiveType, primitiveCount, vertexStreamZeroData, vertexStreamZeroStride);
+	}
+	break;
+	case WorkItemType::Device_LightEnable:
+	{
+		const auto lightIndex = reader.Read<DWORD>();
+		const auto enable = reader.Read<BOOL>();
+		mDevice->LightEnable(lightIndex, enable);
+	}
+	break;
+	case WorkItemType::Device_SetClipPlane:
+	{
+		const auto index = reader.Read<DWORD>();
+		const auto plane = reader.ReadData<float>();
+		mDevice->SetClipPlane(index, plane);
+	}
+	break;
+	case WorkItemType::Device_SetCurrentTexturePalette:
+		mDevice->SetCurrentTexturePalette(reader.Read<UINT>());
+		break;
+	case WorkItemType::Device_SetFVF:
+		mDevice->SetFVF(reader.Read<DWORD>());
+		break;
+	case WorkItemType::Device_SetIndices:
+	{
+		const auto indexData = reader.Read<IDirect3DIndexBuffer9*>();
+		const auto currentIndexBuffer = reader.Read<vk::Buffer>();
+		mDevice->SetInternalIndices(indexData, currentIndexBuffer);
+	}
+	break;
+	case WorkItemType::Device_SetLight:
+	{
+		const auto index = reader.Read<DWORD>();
+		const auto light = reader.ReadData<D3DLIGHT9>();
+		mDevice->SetLight(index, light);
+	}
+	break;
+	case WorkItemType::Device_SetMaterial:
+		mDevice->SetMaterial(reader.ReadData<D3DMATERIAL9>());
+		break;
+	case WorkItemType::Device_SetNPatchMode:
+		mDevice->SetNPatchMode(reader.Read<float>());
+		break;
+	case WorkItemType::Device_SetPixelShader:
+		mDevice->SetPixelShader(reader.Read<IDirect3DPixelShader9*>());
+		break;
+	case WorkItemType::Device_SetPixelShaderConstantB:
+	{
+		const auto startRegister = reader.Read<UINT>();
+		const auto constantData = reader.ReadData<BOOL>();
+		const auto count = reader.Read<UINT>();
+		mDevice->SetPixelShaderConstantB(startRegister, constantData, count);
+	}
+	break;
+	case WorkItemType::Device_SetPixelShaderConstantF:
+	{
+		const auto startRegister = reader.Read<UINT>();
+		const auto constantData = reader.ReadData<float>();
+		const auto count = reader.Read<UINT>();
+		mDevice->SetPixelShaderConstantF(startRegister, constantData, count);
+	}
+	break;
+	case WorkItemType::Device_SetPixelShaderConstantI:
+	{
+		const auto startRegister = reader.Read<UINT>();
+		const auto constantData = reader.ReadData<int>();
+		const auto count = reader.Read<UINT>();
+		mDevice->SetPixelShaderConstantI(startRegister, constantData, count);
+	}
+	break;
+	case WorkItemType::Device_SetRenderState:
+	{
+		const auto state = reader.Read<D3DRENDERSTATETYPE>();
+		const auto value = reader.Read<DWORD>();
+		mDevice->SetRenderState(state, value);
+	}
+	break;
+	case WorkItemType::Device_SetSamplerState:
+	{
+		const auto sampler = reader.Read<DWORD>();
+		const auto type = reader.Read<D3DSAMPLERSTATETYPE>();
+		const auto value = reader.Read<DWORD>();
+		mDevice->SetSamplerState(sampler, type, value);
+	}
+	break;
+	case WorkItemType::Device_SetScissorRect:
+		mDevice->SetScissorRect(reader.ReadData<RECT>());
+		break;
+	case WorkItemType::Device_SetStreamSource:
+	{
+		const auto streamNumber = reader.Read<UINT>();
+		const auto streamData = reader.Read<IDirect3DVertexBuffer9*>();
+		const auto offsetInBytes = reader.Read<UINT>();
+		const auto stride = reader.Read<UINT>();
+		const auto currentVertexBuffer = reader.Read<vk::Buffer>();
+		mDevice->SetInternalStreamSource(streamNumber, streamData, offsetInBytes, stride, currentVertexBuffer);
+	}
+	break;
+	case WorkItemType::Device_SetStreamSourceFreq:
+	{
+		const auto streamNumber = reader.Read<UINT>();
+		const auto frequencyParameter = reader.Read<UINT>();
+		mDevice->SetStreamSourceFreq(streamNumber, frequencyParameter);
+	}
+	break;
+	case WorkItemType::Device_SetTexture:
+	{
+		const auto sampler = reader.Read<DWORD>();
+		const auto texture = reader.Read<IDirect3DBaseTexture9*>();
+		mDevice->SetTexture(sampler, texture);
+	}
+	break;
+	case WorkItemType::Device_SetTextureStageState:
+	{
+		const auto stage = reader.Read<DWORD>();
+		const auto type = reader.Read<D3DTEXTURESTAGESTATETYPE>();
+		const auto value = reader.Read<DWORD>();
+		mDevice->SetTextureStageState(stage, type, value);
+	}
+	break;
+	case WorkItemType::Device_SetTransform:
+	{
+		const auto state = reader.Read<D3DTRANSFORMSTATETYPE>();
+		const auto matrix = reader.ReadData<D3DMATRIX>();
+		mDevice->SetTransform(state, matrix);
+	}
+	break;
+	case WorkItemType::Device_SetVertexDeclaration:
+		mDevice->SetVertexDeclaration(reader.Read<IDirect3DVertexDeclaration9*>());
+		break;
+	case WorkItemType::Device_SetVertexShader:
+		mDevice->SetVertexShader(reader.Read<IDirect3DVertexShader9*>());
+		break;
+	case WorkItemType::Device_SetVertexShaderConstantB:
+	{
+		const auto startRegister = reader.Read<UINT>();
+		const auto constantData = reader.ReadData<BOOL>();
+		const auto count = reader.Read<UINT>();
+		mDevice->SetVertexShaderConstantB(startRegister, constantData, count);
+	}
+	break;
+	case WorkItemType::Device_SetVertexShaderConstantF:
+	{
+		const auto startRegister = reader.Read<UINT>();
+		const auto constantData = reader.ReadData<float>();
+		const auto count = reader.Read<UINT>();
+		mDevice->SetVertexShaderConstantF(startRegister, constantData, count);
+	}
+	break;
+	case WorkItemType::Device_SetVertexShaderConstantI:
+	{
+		const auto startRegister = reader.Read<UINT>();
+		const auto constantData = reader.ReadData<int>();
+		const auto count = reader.Read<UINT>();
+		mDevice->SetVertexShaderConstantI(startRegister, constantData, count);
+	}
+	break;
+	case WorkItemType::Device_SetViewport:
+		mDevice->SetViewport(reader.ReadData<D3DVIEWPORT9>());
+		break;
+	default:
+		Log(warning) << "CommandStream::Execute unknown packet type " << packet.WorkItemType << std::endl;
+		break;
+	}
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+/*
+Copyright(c) 2019 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <atomic>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include "readerwriterqueue.h"
+#include "BoundedQueue.h"
+#include "CommandPacket.h"
+
+class CDevice9;
+
+#define COMMAND_STREAM_MAX_QUEUED_FRAMES 2
+#define COMMAND_STREAM_CHUNK_SIZE (1024 * 1024)
+#define COMMAND_STREAM_SPIN_COUNT 4096
+#define COMMAND_STREAM_QUEUE_CAPACITY 4096
+
+struct CommandChunk
+{
+	std::unique_ptr<char[]> Data;
+	size_t Capacity = 0;
+	size_t Used = 0;
+};
+
+/*
+The command stream moves Vulkan recording and submission onto a worker thread.
+The device queues state changes, draws and presents as packets and the worker replays them by calling the same device methods.
+Anything else that touches Vulkan calls Synchronize first so the worker is idle while it runs on the application thread.
+Buffer locks don't, they rename the buffer and the version a draw should use travels in the packets that bind or draw with it.
+Packets are written into chunks which the worker hands back once it has run everything in them, so once a few chunks exist queuing a call doesn't allocate.
+The packet queue is bounded so a producer that gets too far ahead waits for the worker instead of growing it.
+Devices created with D3DCREATE_MULTITHREADED serialize their producers with a lock so packets and chunks from different threads can't interleave.
+*/
+class CommandStream
+{
+public:
+	CommandStream(CDevice9* device, bool multithreaded);
+	~CommandStream();
+
+	bool IsWorkerThread() const { return std::this_thread::get_id() == mWorkerThreadId; }
+
+	//Held across updating the application's copy of the state and queuing the call so both happen in the same order, it's free on a single threaded device.
+	std::unique_lock<std::recursive_mutex> LockProducer()
+	{
+		return mMultithreaded ? std::unique_lock<std::recursive_mutex>(mProducerMutex) : std::unique_lock<std::recursive_mutex>();
+	}
+
+	template <typename... Arguments>
+	void Push(WorkItemType workItemType, const Arguments&... arguments)
+	{
+		PushReference(workItemType, nullptr, arguments...);
+	}
+
+	//Keeps caller alive until the worker is done with the packet.
+	template <typename... Arguments>
+	void PushReference(WorkItemType workItemType, IUnknown* caller, const Arguments&... arguments)
+	{
+		auto lock = LockProducer();
+
+		const size_t size = COMMAND_PACKET_HEADER_SIZE + (GetCommandArgumentSize(arguments) + ... + 0);
+
+		CommandPacket* packet = Allocate(size);
+		packet->WorkItemType = workItemType;
+		packet->Size = (uint32_t)size;
+		packet->Caller = caller;
+		packet->Completion = nullptr;
+
+		if (caller)
+		{
+			caller->AddRef();
+		}
+
+		char* cursor = reinterpret_cast<char*>(packet) + COMMAND_PACKET_HEADER_SIZE;
+		(WriteCommandArgument(cursor, arguments), ...);
+
+		Submit(packet);
+	}
+
+	void Synchronize();
+
+	//Keeps the application from getting more than a couple of frames ahead of the worker.
+	void BeginFrame();
+
+	uint64_t mPacketsQueued = 0;
+	uint64_t mSynchronizeCount = 0;
+
+private:
+	CDevice9* mDevice = nullptr;
+	bool mMultithreaded = false;
+	std::recursive_mutex mProducerMutex; //Recursive because releasing a finished reference can queue more work.
+
+	std::thread mWorkerThread;
+	std::thread::id mWorkerThreadId;
+
+	BoundedQueue<CommandPacket*, COMMAND_STREAM_QUEUE_CAPACITY> mPackets;
+	moodycamel::ReaderWriterQueue<CommandChunk*> mFinishedChunks; //Handed back so references are released on the application thread.
+	std::vector<std::unique_ptr<CommandChunk>> mChunks;
+	CommandChunk* mCurrentChunk = nullptr;
+	std::vector<IUnknown*> mFinishedCallers;
+
+	//Only used once a synchronize or a new frame has spun for a while without the worker catching up.
+	std::mutex mCompletionMutex;
+	std::condition_variable mCompletionCondition;
+
+	std::atomic<uint32_t> mQueuedFrames = 0;
+
+	CommandPacket* Allocate(size_t size);
+	void RetireChunk();
+	CommandChunk* GetChunk(size_t size);
+	void Submit(CommandPacket* packet);
+	void ReleaseFinishedCallers();
+
+	void Run();
+	void Execute(const CommandPacket& packet);
+};
@@ -27,12 +27,21 @@ misrepresented as being the original software.
 #include<vector>
 
 #include "BitCast.h"
+#include "Hash.h"
 
  //On my test hardware this was 32.
 #define MAX_VERTEX_INPUTS 32
 #define MAX_PIXEL_SHADER_CONST 256
 #define MAX_VERTEX_SHADER_CONST 256
 
+//Per frame resources are sized for the deepest setting and only the first mFramesInFlight of them are used.
+#define MAX_FRAMES_IN_FLIGHT 3
+#define DEFAULT_FRAMES_IN_FLIGHT 2
+
+//Buffers are renamed on the application thread which can be COMMAND_STREAM_MAX_QUEUED_FRAMES presents ahead of the worker.
+//The worker has only waited for the frame before the one it's recording so a retired version isn't reused until this many frames later.
+#define MAX_RENAMED_BUFFER_FRAMES (MAX_FRAMES_IN_FLIGHT + 3)
+
 class CSurface9;
 class CIndexBuffer9;
 class CVertexBuffer9;
@@ -134,6 +143,241 @@ struct StreamSource
 	CVertexBuffer9* vertexBuffer;
 	unsigned int offset;
 	unsigned int stride;
+	vk::Buffer currentVertexBuffer; //The version of the buffer that was current when the stream was set or last renamed.
+};
+
+//D3D9 only exposes 16 streams (see MaxStreams in GetDeviceCaps) even though Vulkan gives us more bindings.
+#define MAX_VERTEX_STREAMS 16
+
+//Groups of render state that are set on the command buffer instead of being baked into the pipeline.
+#define DYNAMIC_RENDER_STATE_STENCIL 1 //Stencil reference, compare mask and write mask are core Vulkan.
+#define DYNAMIC_RENDER_STATE_EXTENDED 2 //Cull mode, front face, topology, depth and stencil ops need VK_EXT_extended_dynamic_state.
+
+/*
+The render states that get baked into a pipeline packed into as few bits as the D3D9 enums allow.
+Unknown values are truncated which is fine because the converters would reject them anyway.
+Booleans are the exception, D3D9 treats any non-zero value as TRUE so they're normalized before they go into a single bit.
+*/
+struct PipelineRenderState
+{
+	uint32_t mPrimitiveType : 3;
+	uint32_t mCullMode : 2;
+	uint32_t mFillMode : 2;
+	uint32_t mZEnable : 2;
+	uint32_t mZWriteEnable : 1;
+	uint32_t mZFunc : 4;
+	uint32_t mStencilEnable : 1;
+	uint32_t mStencilFunc : 4;
+	uint32_t mCCWStencilFunc : 4;
+	uint32_t mPointSpriteEnable : 1;
+	uint32_t mAlphaBlendEnable : 1;
+	uint32_t mColorWriteEnable : 4;
+
+	uint32_t mStencilFail : 4;
+	uint32_t mStencilPass : 4;
+	uint32_t mCCWStencilFail : 4;
+	uint32_t mCCWStencilPass : 4;
+	uint32_t mBlendOp : 3;
+	uint32_t mBlendOpAlpha : 3;
+	uint32_t mSrcBlend : 5;
+
+	uint32_t mDestBlend : 5;
+	uint32_t mSrcBlendAlpha : 5;
+	uint32_t mDestBlendAlpha : 5;
+	uint32_t mStencilRef : 8;
+
+	uint32_t mStencilMask : 8;
+	uint32_t mStencilWriteMask : 8;
+	uint32_t mDynamicRenderState : 2;
+};
+
+/*
+The attachment formats of a render pass.
+Pipelines only care about render pass compatibility so this stands in for the handle and stays valid between runs.
+*/
+struct RenderPassFormats
+{
+	uint32_t mRenderTargetFormat[4] = {};
+	uint32_t mDepthStencilFormat = 0;
+
+	bool operator==(const RenderPassFormats& other) const noexcept
+	{
+		return memcmp(this, &other, sizeof(RenderPassFormats)) == 0;
+	}
+
+	bool operator!=(const RenderPassFormats& other) const noexcept
+	{
+		return memcmp(this, &other, sizeof(RenderPassFormats)) != 0;
+	}
+};
+
+/*
+Everything that goes into a vk::GraphicsPipelineCreateInfo.
+This is kept up to date by the state block setters so BeginDraw only has to hash it when mCapturedPipelineKey is set.
+Shaders are identified by a hash of the converted SPIR-V rather than handle so keys can be recorded and replayed on the next run.
+*/
+struct alignas(64) PipelineKey
+{
+	uint64_t mVertexShaderHash;
+	uint64_t mPixelShaderHash;
+	uint64_t mVertexDeclarationHash;
+	RenderPassFormats mRenderPassFormats;
+	uint16_t mStreamStride[MAX_VERTEX_STREAMS];
+	uint16_t mStreamMask;
+	uint16_t mInstanceMask;
+	PipelineRenderState mRenderState;
+
+	PipelineKey() noexcept
+	{
+		memset(this, 0, sizeof(PipelineKey));
+	}
+
+	bool operator==(const PipelineKey& other) const noexcept
+	{
+		return memcmp(this, &other, sizeof(PipelineKey)) == 0;
+	}
+
+	bool operator!=(const PipelineKey& other) const noexcept
+	{
+		return memcmp(this, &other, sizeof(PipelineKey)) != 0;
+	}
+
+	//Returns true if the state is set on the command buffer for pipelines built from this key.
+	bool IsDynamicRenderState(D3DRENDERSTATETYPE state) const noexcept
+	{
+		switch (state)
+		{
+		case D3DRS_STENCILREF:
+		case D3DRS_STENCILMASK:
+		case D3DRS_STENCILWRITEMASK:
+			return (mRenderState.mDynamicRenderState & DYNAMIC_RENDER_STATE_STENCIL) != 0;
+		case D3DRS_CULLMODE:
+		case D3DRS_ZENABLE:
+		case D3DRS_ZWRITEENABLE:
+		case D3DRS_ZFUNC:
+		case D3DRS_STENCILENABLE:
+		case D3DRS_STENCILFAIL:
+		case D3DRS_STENCILPASS:
+		case D3DRS_STENCILFUNC:
+		case D3DRS_CCW_STENCILFAIL:
+		case D3DRS_CCW_STENCILPASS:
+		case D3DRS_CCW_STENCILFUNC:
+			return (mRenderState.mDynamicRenderState & DYNAMIC_RENDER_STATE_EXTENDED) != 0;
+		default:
+			return false;
+		}
+	}
+
+	//Dynamic states are left out of the key so changing the mode means rebuilding the baked fields from scratch.
+	void SetDynamicRenderState(uint32_t dynamicRenderState, const DWORD* renderState) noexcept
+	{
+		memset(&mRenderState, 0, sizeof(PipelineRenderState));
+		mRenderState.mDynamicRenderState = dynamicRenderState;
+
+		for (int32_t state = 0; state <= D3DRS_BLENDOPALPHA; state++)
+		{
+			SetRenderState((D3DRENDERSTATETYPE)state, renderState[state]);
+		}
+	}
+
+	//Returns true if the state is baked into the pipeline and the value changed.
+	bool SetRenderState(D3DRENDERSTATETYPE state, DWORD value) noexcept
+	{
+		if (IsDynamicRenderState(state))
+		{
+			return false;
+		}
+
+		const PipelineRenderState previous = mRenderState;
+
+		switch (state)
+		{
+		case D3DRS_CULLMODE:
+			mRenderState.mCullMode = value;
+			break;
+		case D3DRS_FILLMODE:
+			mRenderState.mFillMode = value;
+			break;
+		case D3DRS_ZENABLE:
+			mRenderState.mZEnable = value;
+			break;
+		case D3DRS_ZWRITEENABLE:
+			mRenderState.mZWriteEnable = (value != FALSE);
+			break;
+		case D3DRS_ZFUNC:
+			mRenderState.mZFunc = value;
+			break;
+		case D3DRS_STENCILENABLE:
+			mRenderState.mStencilEnable = (value != FALSE);
+			break;
+		case D3DRS_STENCILREF:
+			mRenderState.mStencilRef = value;
+			break;
+		case D3DRS_STENCILMASK:
+			mRenderState.mStencilMask = value;
+			break;
+		case D3DRS_STENCILWRITEMASK:
+			mRenderState.mStencilWriteMask = value;
+			break;
+		case D3DRS_STENCILFAIL:
+			mRenderState.mStencilFail = value;
+			break;
+		case D3DRS_STENCILPASS:
+			mRenderState.mStencilPass = value;
+			break;
+		case D3DRS_STENCILFUNC:
+			mRenderState.mStencilFunc = value;
+			break;
+		case D3DRS_CCW_STENCILFAIL:
+			mRenderState.mCCWStencilFail = value;
+			break;
+		case D3DRS_CCW_STENCILPASS:
+			mRenderState.mCCWStencilPass = value;
+			break;
+		case D3DRS_CCW_STENCILFUNC:
+			mRenderState.mCCWStencilFunc = value;
+			break;
+		case D3DRS_COLORWRITEENABLE:
+			mRenderState.mColorWriteEnable = value;
+			break;
+		case D3DRS_ALPHABLENDENABLE:
+			mRenderState.mAlphaBlendEnable = (value != FALSE);
+			break;
+		case D3DRS_BLENDOP:
+			mRenderState.mBlendOp = value;
+			break;
+		case D3DRS_SRCBLEND:
+			mRenderState.mSrcBlend = value;
+			break;
+		case D3DRS_DESTBLEND:
+			mRenderState.mDestBlend = value;
+			break;
+		case D3DRS_BLENDOPALPHA:
+			mRenderState.mBlendOpAlpha = value;
+			break;
+		case D3DRS_SRCBLENDALPHA:
+			mRenderState.mSrcBlendAlpha = value;
+			break;
+		case D3DRS_DESTBLENDALPHA:
+			mRenderState.mDestBlendAlpha = value;
+			break;
+		case D3DRS_POINTSPRITEENABLE:
+			mRenderState.mPointSpriteEnable = (value != FALSE);
+			break;
+		default:
+			return false;
+		}
+
+		return memcmp(&previous, &mRenderState, sizeof(PipelineRenderState)) != 0;
+	}
+};
+
+struct PipelineKeyHasher
+{
+	size_t operator()(const PipelineKey& key) const noexcept
+	{
+		return static_cast<size_t>(HashWords(reinterpret_cast<const uint64_t*>(&key), sizeof(PipelineKey) / sizeof(uint64_t)));
+	}
 };
 
 struct DeviceState
@@ -146,6 +390,7 @@ struct DeviceState
 
 	bool mCapturedIndexBuffer = false;
 	CIndexBuffer9* mIndexBuffer = nullptr;
+	vk::Buffer mCurrentIndexBuffer;
 
 	// + 3 is for extra state I'm sticking on the end.
 	bool mCapturedRenderState[D3DRS_BLENDOPALPHA + 1 + 3] = {};
@@ -207,6 +452,11 @@ struct DeviceState
 	int mVertexShaderConstantI[16][4] = {};
 	int mVertexShaderConstantB[16] = {};
 
+	//Set when a register's value changed since the device last copied the stage's constants into the uniform ring. A set that doesn't change anything leaves these alone.
+	//Each copy goes to a fresh spot in the ring so the whole live range is written regardless of which registers changed.
+	bool mDirtyPixelShaderConstants = false;
+	bool mDirtyVertexShaderConstants = false;
+
 	bool mCapturedClipPlane[6] = {};
 	float mClipPlane[6][4] = {};
 
@@ -215,4 +465,9 @@ struct DeviceState
 
 	bool mCapturedPaletteNumber = false;
 	unsigned int mPaletteNumber = 0;
+
+	//Single dirty bit for everything in the pipeline key so the draw path doesn't have to check each state.
+	bool mCapturedPipelineKey = true;
+	bool mCapturedDynamicRenderState = true;
+	PipelineKey mPipelineKey;
 };
\ No newline at end of file
@@ -0,0 +1,51 @@
+#pragma once
+
+/*
+Copyright(c) 2019 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <cstdint>
+#include <cstddef>
+
+/*
+64-bit FNV-1a. This is used for the pipeline/sampler keys which are plain old data so hashing the raw bytes is fine.
+Keys must be zeroed before filling them in so padding doesn't change the result.
+*/
+inline uint64_t HashBytes(const void* data, size_t size, uint64_t hash = 14695981039346656037ull) noexcept
+{
+	auto bytes = reinterpret_cast<const uint8_t*>(data);
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+//Same idea as HashBytes but a word at a time for keys that are padded out to a multiple of 8 bytes.
+inline uint64_t HashWords(const uint64_t* data, size_t count, uint64_t hash = 14695981039346656037ull) noexcept
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ull;
+		hash ^= (hash >> 32);
+	}
+	return hash;
+}
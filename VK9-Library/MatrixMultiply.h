@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+Copyright(c) 2019 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#include <windows.h>
+#include <d3d9types.h>
+#include <xmmintrin.h>
+
+/*
+The 4x4 multiply behind D3DMATRIX operator*.
+It lives in a header so vk9-matrix-bench can time it against the scalar version without going through the DLL.
+*/
+inline D3DMATRIX MultiplyMatrix(const D3DMATRIX& m1, const D3DMATRIX& m2) noexcept
+{
+	D3DMATRIX result;
+
+	//Each row of the result is the rows of m2 scaled by the matching row of m1 and summed, so a row is four multiplies and three adds wide.
+	//The adds happen in the same order as the scalar version so the results match bit for bit.
+	const __m128 row0 = _mm_loadu_ps(m2.m[0]);
+	const __m128 row1 = _mm_loadu_ps(m2.m[1]);
+	const __m128 row2 = _mm_loadu_ps(m2.m[2]);
+	const __m128 row3 = _mm_loadu_ps(m2.m[3]);
+
+	for (int i = 0; i < 4; i++)
+	{
+		__m128 sum = _mm_mul_ps(_mm_set1_ps(m1.m[i][0]), row0);
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(m1.m[i][1]), row1));
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(m1.m[i][2]), row2));
+		sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(m1.m[i][3]), row3));
+		_mm_storeu_ps(result.m[i], sum);
+	}
+
+	return result;
+}
+
+//The original version, kept as the baseline for the benchmark.
+inline D3DMATRIX MultiplyMatrixScalar(const D3DMATRIX& m1, const D3DMATRIX& m2) noexcept
+{
+	D3DMATRIX result;
+
+	for (int i = 0; i < 4; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			result.m[i][j] = m1.m[i][0] * m2.m[0][j] + m1.m[i][1] * m2.m[1][j] + m1.m[i][2] * m2.m[2][j] + m1.m[i][3] * m2.m[3][j];
+		}
+	}
+
+	return result;
+}
@@ -2472,12 +2472,12 @@ void ShaderConverter::GenerateSamplerBlock()
 	mDecorateInstructions.push_back(Pack(4, spv::OpDecorate)); //size,Type
 	mDecorateInstructions.push_back(imageArrayTypeId); //target (Id)
 	mDecorateInstructions.push_back(spv::DecorationDescriptorSet); //Decoration Type (Id)
-	mDecorateInstructions.push_back(0); //descriptor set index
+	mDecorateInstructions.push_back(1); //descriptor set index (textures have their own set)
 
 	mDecorateInstructions.push_back(Pack(4, spv::OpDecorate)); //size,Type
 	mDecorateInstructions.push_back(imageArrayTypeId); //target (Id)
 	mDecorateInstructions.push_back(spv::DecorationBinding); //Decoration Type (Id)
-	mDecorateInstructions.push_back(7); //binding index.
+	mDecorateInstructions.push_back(0); //binding index.
 
 	//Create pointer type with layout.
 	mTypeInstructions.push_back(Pack(4, spv::OpTypePointer)); //size,Type
@@ -40,7 +40,7 @@ out gl_PerVertex
 
 void main() 
 {
-	gl_Position = vec4(position.xyz,1.0) * transformations[D3DTS_MVP];
+	gl_Position = vec4(position.xyz,1.0) * mvp;
 
 	ColorPair color = CalculateGlobalIllumination(position, norm, vec4(1.0), vec4(0.0));
 
@@ -41,7 +41,7 @@ out gl_PerVertex
 
 void main() 
 {
-	gl_Position = vec4(position.xyz,1.0) * transformations[D3DTS_MVP];
+	gl_Position = vec4(position.xyz,1.0) * mvp;
 
 	ColorPair color = CalculateGlobalIllumination(position, norm, Convert(attr2), vec4(0.0));
 
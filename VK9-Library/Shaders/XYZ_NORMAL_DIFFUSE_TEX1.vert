@@ -43,7 +43,7 @@ out gl_PerVertex
 
 void main() 
 {
-	gl_Position = vec4(position.xyz,1.0) * transformations[D3DTS_MVP];
+	gl_Position = vec4(position.xyz,1.0) * mvp;
 
 	texcoord1 = t0.xy;
 
@@ -86,12 +86,16 @@ enum WorkItemType
 	, Device_SetVertexShaderConstantF
 	, Device_SetVertexShaderConstantI
 	, Device_SetViewport
+	, Device_SetStreamSourceFreq
+	, Device_SetClipPlane
+	, Device_SetCurrentTexturePalette
 	, Device_StretchRect
 	, Device_UpdateSurface
 	, Device_UpdateTexture
 	, Device_GetAvailableTextureMem
 	, Device_SetRenderTarget
 	, Device_SetDepthStencilSurface
+	, Device_CopyBuffer
 	, Device_Destroy
 	, VertexBuffer_Create
 	, VertexBuffer_Lock
@@ -130,4 +134,5 @@ enum WorkItemType
 	, Volume_Destroy
 	, Shader_Create
 	, Shader_Destroy
+	, CommandStream_RetireChunk
 };
@@ -0,0 +1,491 @@
+/*
+Copyright(c) 2019 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+/*
+vk9-bench drives the draw entry points with synthetic workloads and prints one JSON object per workload.
+Point VK_ICD_FILENAMES at a software ICD such as lavapipe or SwiftShader to run it without a GPU.
+With --assert-zero-draw-allocations it exits non-zero if any steady state draw call hit the heap, which is how the allocation test runs it.
+Each workload gets a fresh device with its own stats file so the per-frame counters the library writes can be summed afterwards.
+It writes VK9.conf into the working directory because that is where the library reads its configuration from.
+*/
+
+#include <windows.h>
+#include <d3d9.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+struct Vertex
+{
+	float X, Y, Z;
+	DWORD Color;
+};
+
+#define BENCH_FVF (D3DFVF_XYZ | D3DFVF_DIFFUSE)
+#define BENCH_TRIANGLES 64
+
+struct BenchOptions
+{
+	uint32_t WarmUpFrames = 10;
+	uint32_t Frames = 100;
+	uint32_t DrawsPerFrame = 1000;
+	bool AssertZeroDrawAllocations = false;
+	std::vector<std::string> Configuration; //Extra Key = Value lines for VK9.conf.
+};
+
+struct BenchContext
+{
+	IDirect3DDevice9* Device = nullptr;
+	IDirect3DVertexBuffer9* VertexBuffer = nullptr;
+	IDirect3DIndexBuffer9* IndexBuffer = nullptr;
+	IDirect3DTexture9* Textures[2] = {};
+	IDirect3DStateBlock9* StateBlocks[2] = {};
+	Vertex UpVertices[3];
+};
+
+struct BenchResult
+{
+	double NanosecondsPerDraw = 0.0;
+	double DriverNanosecondsPerDraw = 0.0;
+	uint64_t PipelinesCreated = 0;
+	double AllocationsPerFrame = -1.0; //Negative when the library was built without VK9_COUNT_ALLOCATIONS.
+	double DrawAllocations = -1.0;
+};
+
+typedef void(*WorkloadFunction)(BenchContext& context, uint32_t draws);
+
+struct Workload
+{
+	const char* Name;
+	WorkloadFunction Run;
+};
+
+static void DrawPrimitiveWorkload(BenchContext& context, uint32_t draws)
+{
+	for (uint32_t i = 0; i < draws; i++)
+	{
+		context.Device->DrawPrimitive(D3DPT_TRIANGLELIST, (i % BENCH_TRIANGLES) * 3, 1);
+	}
+}
+
+static void DrawIndexedPrimitiveWorkload(BenchContext& context, uint32_t draws)
+{
+	for (uint32_t i = 0; i < draws; i++)
+	{
+		context.Device->DrawIndexedPrimitive(D3DPT_TRIANGLELIST, 0, 0, BENCH_TRIANGLES * 3, (i % BENCH_TRIANGLES) * 3, 1);
+	}
+}
+
+static void DrawPrimitiveUPWorkload(BenchContext& context, uint32_t draws)
+{
+	for (uint32_t i = 0; i < draws; i++)
+	{
+		context.Device->DrawPrimitiveUP(D3DPT_TRIANGLELIST, 1, context.UpVertices, sizeof(Vertex));
+	}
+}
+
+//Flips between a handful of states so every draw is a state change but the pipeline set stays small.
+static void StateChangeWorkload(BenchContext& context, uint32_t draws)
+{
+	for (uint32_t i = 0; i < draws; i++)
+	{
+		context.Device->SetRenderState(D3DRS_ALPHABLENDENABLE, (i & 1) ? TRUE : FALSE);
+		context.Device->SetRenderState(D3DRS_CULLMODE, (i & 2) ? D3DCULL_CW : D3DCULL_CCW);
+		context.Device->SetRenderState(D3DRS_ZWRITEENABLE, (i & 4) ? TRUE : FALSE);
+		context.Device->SetTexture(0, context.Textures[i & 1]);
+		context.Device->DrawPrimitive(D3DPT_TRIANGLELIST, (i % BENCH_TRIANGLES) * 3, 1);
+	}
+}
+
+static void StateBlockApplyWorkload(BenchContext& context, uint32_t draws)
+{
+	for (uint32_t i = 0; i < draws; i++)
+	{
+		context.StateBlocks[i & 1]->Apply();
+		context.Device->DrawPrimitive(D3DPT_TRIANGLELIST, (i % BENCH_TRIANGLES) * 3, 1);
+	}
+}
+
+static const Workload Workloads[] =
+{
+	{ "draw_primitive", DrawPrimitiveWorkload },
+	{ "draw_indexed_primitive", DrawIndexedPrimitiveWorkload },
+	{ "draw_primitive_up", DrawPrimitiveUPWorkload },
+	{ "state_change", StateChangeWorkload },
+	{ "state_block_apply", StateBlockApplyWorkload }
+};
+
+static bool WriteConfiguration(const BenchOptions& options, const std::string& statsFile)
+{
+	std::ofstream file("VK9.conf", std::ios::out | std::ios::trunc);
+	if (!file.is_open())
+	{
+		return false;
+	}
+
+	file << "LogFile = vk9-bench.log\n";
+	file << "VSync = 0\n";
+	file << "PipelineWarmUp = 0\n"; //Otherwise the previous run's pipelines are created up front.
+	file << "PerformanceStatsFile = " << statsFile << "\n";
+	for (auto& line : options.Configuration)
+	{
+		file << line << "\n";
+	}
+
+	return true;
+}
+
+//The stats file has one flat JSON object per line so a key search is enough.
+static bool ReadStat(const std::string& line, const char* key, double& value)
+{
+	const std::string search = std::string("\"") + key + "\":";
+	const size_t position = line.find(search);
+	if (position == std::string::npos)
+	{
+		return false;
+	}
+	value = strtod(line.c_str() + position + search.size(), nullptr);
+	return true;
+}
+
+static bool CreateResources(BenchContext& context)
+{
+	auto device = context.Device;
+
+	//Tiny triangles so a software rasterizer spends its time on the draws and not the pixels.
+	if (FAILED(device->CreateVertexBuffer(sizeof(Vertex) * BENCH_TRIANGLES * 3, D3DUSAGE_WRITEONLY, BENCH_FVF, D3DPOOL_MANAGED, &context.VertexBuffer, nullptr)))
+	{
+		return false;
+	}
+
+	Vertex* vertices = nullptr;
+	context.VertexBuffer->Lock(0, 0, (void**)&vertices, 0);
+	for (uint32_t i = 0; i < BENCH_TRIANGLES; i++)
+	{
+		const float x = -1.0f + (i % 8) * 0.25f;
+		const float y = -1.0f + (i / 8) * 0.25f;
+		vertices[i * 3 + 0] = { x, y, 0.5f, 0xFFFF0000 };
+		vertices[i * 3 + 1] = { x + 0.01f, y, 0.5f, 0xFF00FF00 };
+		vertices[i * 3 + 2] = { x, y + 0.01f, 0.5f, 0xFF0000FF };
+	}
+	memcpy(context.UpVertices, vertices, sizeof(context.UpVertices));
+	context.VertexBuffer->Unlock();
+
+	if (FAILED(device->CreateIndexBuffer(sizeof(WORD) * BENCH_TRIANGLES * 3, D3DUSAGE_WRITEONLY, D3DFMT_INDEX16, D3DPOOL_MANAGED, &context.IndexBuffer, nullptr)))
+	{
+		return false;
+	}
+
+	WORD* indices = nullptr;
+	context.IndexBuffer->Lock(0, 0, (void**)&indices, 0);
+	for (WORD i = 0; i < BENCH_TRIANGLES * 3; i++)
+	{
+		indices[i] = i;
+	}
+	context.IndexBuffer->Unlock();
+
+	for (uint32_t i = 0; i < 2; i++)
+	{
+		if (FAILED(device->CreateTexture(4, 4, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &context.Textures[i], nullptr)))
+		{
+			return false;
+		}
+
+		D3DLOCKED_RECT lockedRect = {};
+		context.Textures[i]->LockRect(0, &lockedRect, nullptr, 0);
+		for (uint32_t row = 0; row < 4; row++)
+		{
+			DWORD* pixels = (DWORD*)((char*)lockedRect.pBits + row * lockedRect.Pitch);
+			for (uint32_t column = 0; column < 4; column++)
+			{
+				pixels[column] = i ? 0xFFFFFFFF : 0xFF808080;
+			}
+		}
+		context.Textures[i]->UnlockRect(0);
+	}
+
+	device->SetFVF(BENCH_FVF);
+	device->SetStreamSource(0, context.VertexBuffer, 0, sizeof(Vertex));
+	device->SetIndices(context.IndexBuffer);
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+
+	//Two blocks that differ in blend, depth and texture so every Apply changes the pipeline key.
+	device->BeginStateBlock();
+	device->SetRenderState(D3DRS_ZENABLE, D3DZB_TRUE);
+	device->SetRenderState(D3DRS_ALPHABLENDENABLE, FALSE);
+	device->SetTexture(0, context.Textures[0]);
+	device->EndStateBlock(&context.StateBlocks[0]);
+
+	device->BeginStateBlock();
+	device->SetRenderState(D3DRS_ZENABLE, D3DZB_FALSE);
+	device->SetRenderState(D3DRS_ALPHABLENDENABLE, TRUE);
+	device->SetRenderState(D3DRS_SRCBLEND, D3DBLEND_SRCALPHA);
+	device->SetRenderState(D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+	device->SetTexture(0, context.Textures[1]);
+	device->EndStateBlock(&context.StateBlocks[1]);
+
+	return context.StateBlocks[0] && context.StateBlocks[1];
+}
+
+static void ReleaseResources(BenchContext& context)
+{
+	for (auto stateBlock : context.StateBlocks)
+	{
+		if (stateBlock)
+		{
+			stateBlock->Release();
+		}
+	}
+
+	for (auto texture : context.Textures)
+	{
+		if (texture)
+		{
+			texture->Release();
+		}
+	}
+
+	if (context.IndexBuffer)
+	{
+		context.IndexBuffer->Release();
+	}
+
+	if (context.VertexBuffer)
+	{
+		context.VertexBuffer->Release();
+	}
+}
+
+static void PumpMessages()
+{
+	MSG message;
+	while (PeekMessageW(&message, nullptr, 0, 0, PM_REMOVE))
+	{
+		TranslateMessage(&message);
+		DispatchMessageW(&message);
+	}
+}
+
+static bool RunWorkload(HWND window, const BenchOptions& options, const Workload& workload, BenchResult& result)
+{
+	const std::string statsFile = std::string("vk9-bench-") + workload.Name + ".jsonl";
+	if (!WriteConfiguration(options, statsFile))
+	{
+		fprintf(stderr, "vk9-bench: unable to write VK9.conf\n");
+		return false;
+	}
+
+	IDirect3D9* d3d9 = Direct3DCreate9(D3D_SDK_VERSION);
+	if (!d3d9)
+	{
+		fprintf(stderr, "vk9-bench: Direct3DCreate9 failed\n");
+		return false;
+	}
+
+	D3DPRESENT_PARAMETERS presentationParameters = {};
+	presentationParameters.Windowed = TRUE;
+	presentationParameters.SwapEffect = D3DSWAPEFFECT_DISCARD;
+	presentationParameters.BackBufferFormat = D3DFMT_X8R8G8B8;
+	presentationParameters.BackBufferWidth = 640;
+	presentationParameters.BackBufferHeight = 480;
+	presentationParameters.EnableAutoDepthStencil = TRUE;
+	presentationParameters.AutoDepthStencilFormat = D3DFMT_D24S8;
+	presentationParameters.PresentationInterval = D3DPRESENT_INTERVAL_IMMEDIATE;
+	presentationParameters.hDeviceWindow = window;
+
+	BenchContext context;
+	if (FAILED(d3d9->CreateDevice(D3DADAPTER_DEFAULT, D3DDEVTYPE_HAL, window, D3DCREATE_HARDWARE_VERTEXPROCESSING, &presentationParameters, &context.Device)))
+	{
+		fprintf(stderr, "vk9-bench: CreateDevice failed for %s\n", workload.Name);
+		d3d9->Release();
+		return false;
+	}
+
+	bool succeeded = CreateResources(context);
+	std::chrono::steady_clock::duration drawTime = {};
+
+	for (uint32_t frame = 0; succeeded && frame < options.WarmUpFrames + options.Frames; frame++)
+	{
+		PumpMessages();
+
+		context.Device->Clear(0, nullptr, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, 0xFF000000, 1.0f, 0);
+		context.Device->BeginScene();
+
+		const auto start = std::chrono::steady_clock::now();
+		workload.Run(context, options.DrawsPerFrame);
+		if (frame >= options.WarmUpFrames)
+		{
+			drawTime += std::chrono::steady_clock::now() - start;
+		}
+
+		context.Device->EndScene();
+		context.Device->Present(nullptr, nullptr, nullptr, nullptr);
+	}
+
+	ReleaseResources(context);
+	context.Device->Release();
+	d3d9->Release();
+
+	if (!succeeded)
+	{
+		fprintf(stderr, "vk9-bench: unable to create resources for %s\n", workload.Name);
+		return false;
+	}
+
+	const double draws = (double)options.Frames * options.DrawsPerFrame;
+	result.NanosecondsPerDraw = std::chrono::duration_cast<std::chrono::nanoseconds>(drawTime).count() / draws;
+
+	//The library writes a line per present so the warm up frames are the first lines.
+	std::ifstream stats(statsFile);
+	std::string line;
+	double driverDrawTime = 0.0;
+	double allocations = 0.0;
+	double drawAllocations = 0.0;
+	bool hasAllocations = false;
+	for (uint32_t frame = 0; std::getline(stats, line); frame++)
+	{
+		if (frame < options.WarmUpFrames)
+		{
+			continue;
+		}
+
+		double value = 0.0;
+		if (ReadStat(line, "draw_ns", value))
+		{
+			driverDrawTime += value;
+		}
+		if (ReadStat(line, "pipelines_created", value))
+		{
+			result.PipelinesCreated += (uint64_t)value;
+		}
+		if (ReadStat(line, "allocations", value))
+		{
+			allocations += value;
+			hasAllocations = true;
+		}
+		if (ReadStat(line, "draw_allocations", value))
+		{
+			drawAllocations += value;
+		}
+	}
+
+	result.DriverNanosecondsPerDraw = driverDrawTime / draws;
+	result.AllocationsPerFrame = hasAllocations ? allocations / options.Frames : -1.0;
+	result.DrawAllocations = hasAllocations ? drawAllocations : -1.0;
+
+	return true;
+}
+
+static bool ParseOptions(int argc, char** argv, BenchOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const bool hasValue = (i + 1 < argc);
+		if (!strcmp(argv[i], "--frames") && hasValue)
+		{
+			options.Frames = (uint32_t)strtoul(argv[++i], nullptr, 10);
+		}
+		else if (!strcmp(argv[i], "--warm-up-frames") && hasValue)
+		{
+			options.WarmUpFrames = (uint32_t)strtoul(argv[++i], nullptr, 10);
+		}
+		else if (!strcmp(argv[i], "--draws") && hasValue)
+		{
+			options.DrawsPerFrame = (uint32_t)strtoul(argv[++i], nullptr, 10);
+		}
+		else if (!strcmp(argv[i], "--assert-zero-draw-allocations"))
+		{
+			options.AssertZeroDrawAllocations = true;
+		}
+		else if (!strcmp(argv[i], "--config") && hasValue)
+		{
+			options.Configuration.push_back(argv[++i]); //For example "CommandStream = 1".
+		}
+		else
+		{
+			fprintf(stderr, "usage: vk9-bench [--frames N] [--warm-up-frames N] [--draws N] [--assert-zero-draw-allocations] [--config \"Key = Value\"]...\n");
+			return false;
+		}
+	}
+
+	return options.Frames && options.DrawsPerFrame;
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		return 1;
+	}
+
+	HWND window = CreateWindowExW(0, L"STATIC", L"vk9-bench", WS_OVERLAPPEDWINDOW, CW_USEDEFAULT, CW_USEDEFAULT, 640, 480, nullptr, nullptr, GetModuleHandleW(nullptr), nullptr);
+	if (!window)
+	{
+		fprintf(stderr, "vk9-bench: unable to create a window\n");
+		return 1;
+	}
+
+	int returnValue = 0;
+	for (auto& workload : Workloads)
+	{
+		BenchResult result;
+		if (!RunWorkload(window, options, workload, result))
+		{
+			returnValue = 1;
+			continue;
+		}
+
+		printf("{\"workload\":\"%s\",\"frames\":%u,\"draws_per_frame\":%u,\"ns_per_draw\":%.1f,\"driver_ns_per_draw\":%.1f,\"pipelines_created\":%llu,\"allocations_per_frame\":",
+			workload.Name, options.Frames, options.DrawsPerFrame, result.NanosecondsPerDraw, result.DriverNanosecondsPerDraw, (unsigned long long)result.PipelinesCreated);
+		if (result.AllocationsPerFrame < 0.0)
+		{
+			printf("null,\"draw_allocations\":null}\n");
+		}
+		else
+		{
+			printf("%.1f,\"draw_allocations\":%.0f}\n", result.AllocationsPerFrame, result.DrawAllocations);
+		}
+		fflush(stdout);
+
+		if (options.AssertZeroDrawAllocations)
+		{
+			if (result.DrawAllocations < 0.0)
+			{
+				fprintf(stderr, "vk9-bench: the library was built without VK9_COUNT_ALLOCATIONS so draw allocations can't be checked\n");
+				returnValue = 1;
+			}
+			else if (result.DrawAllocations > 0.0)
+			{
+				fprintf(stderr, "vk9-bench: %s made %.0f heap allocations inside steady state draw calls\n", workload.Name, result.DrawAllocations);
+				returnValue = 1;
+			}
+		}
+	}
+
+	DestroyWindow(window);
+
+	return returnValue;
+}
@@ -0,0 +1,128 @@
+/*
+Copyright(c) 2019 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+/*
+vk9-matrix-bench times the SSE multiply behind D3DMATRIX operator* against the scalar version it replaced.
+Both kernels run over the same world, view and projection sets and the results must match bit for bit or it fails.
+*/
+
+#include "MatrixMultiply.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#define MATRIX_BENCH_SETS 1024
+
+typedef D3DMATRIX(*MultiplyFunction)(const D3DMATRIX& m1, const D3DMATRIX& m2);
+
+struct MatrixSet
+{
+	D3DMATRIX World;
+	D3DMATRIX View;
+	D3DMATRIX Projection;
+};
+
+static void FillMatrix(D3DMATRIX& matrix, uint32_t& seed)
+{
+	for (int i = 0; i < 4; i++)
+	{
+		for (int j = 0; j < 4; j++)
+		{
+			seed = seed * 1664525 + 1013904223;
+			matrix.m[i][j] = (float)(seed >> 8) / (float)(1 << 24) * 2.0f - 1.0f;
+		}
+	}
+}
+
+//Mirrors a draw: world * view * projection for the mvp push constant.
+template <MultiplyFunction Multiply>
+static double Run(const std::vector<MatrixSet>& sets, std::vector<D3DMATRIX>& results, uint32_t rounds)
+{
+	const auto start = std::chrono::steady_clock::now();
+
+	for (uint32_t round = 0; round < rounds; round++)
+	{
+		for (size_t i = 0; i < sets.size(); i++)
+		{
+			results[i] = Multiply(Multiply(sets[i].World, sets[i].View), sets[i].Projection);
+		}
+	}
+
+	const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	return (double)elapsed / ((double)rounds * sets.size() * 2);
+}
+
+int main(int argc, char** argv)
+{
+	uint32_t rounds = 2000;
+	if (argc > 1)
+	{
+		rounds = (uint32_t)strtoul(argv[1], nullptr, 10);
+	}
+
+	if (!rounds)
+	{
+		fprintf(stderr, "usage: vk9-matrix-bench [rounds]\n");
+		return 1;
+	}
+
+	uint32_t seed = 1;
+	std::vector<MatrixSet> sets(MATRIX_BENCH_SETS);
+	for (auto& set : sets)
+	{
+		FillMatrix(set.World, seed);
+		FillMatrix(set.View, seed);
+		FillMatrix(set.Projection, seed);
+	}
+
+	std::vector<D3DMATRIX> scalarResults(sets.size());
+	std::vector<D3DMATRIX> sseResults(sets.size());
+
+	//One untimed pass each so neither kernel pays for the first touch of the result arrays.
+	Run<MultiplyMatrixScalar>(sets, scalarResults, 1);
+	Run<MultiplyMatrix>(sets, sseResults, 1);
+
+	const double scalarTime = Run<MultiplyMatrixScalar>(sets, scalarResults, rounds);
+	const double sseTime = Run<MultiplyMatrix>(sets, sseResults, rounds);
+
+	uint32_t mismatches = 0;
+	for (size_t i = 0; i < sets.size(); i++)
+	{
+		if (memcmp(&scalarResults[i], &sseResults[i], sizeof(D3DMATRIX)))
+		{
+			mismatches++;
+		}
+	}
+
+	printf("{\"kernel\":\"scalar\",\"multiplies\":%llu,\"ns_per_multiply\":%.2f}\n", (unsigned long long)rounds * sets.size() * 2, scalarTime);
+	printf("{\"kernel\":\"sse\",\"multiplies\":%llu,\"ns_per_multiply\":%.2f,\"speedup\":%.2f,\"mismatches\":%u}\n", (unsigned long long)rounds * sets.size() * 2, sseTime, sseTime > 0.0 ? scalarTime / sseTime : 0.0, mismatches);
+
+	if (mismatches)
+	{
+		fprintf(stderr, "vk9-matrix-bench: %u results differ between the SSE and scalar kernels\n", mismatches);
+		return 1;
+	}
+
+	return 0;
+}
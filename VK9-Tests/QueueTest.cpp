@@ -0,0 +1,226 @@
+/*
+Copyright(c) 2019 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+/*
+vk9-queue-test stresses BoundedQueue with several producers and consumers the way a D3DCREATE_MULTITHREADED device does.
+Every item has to come out exactly once and each consumer has to see every producer's items in the order they were pushed.
+With --benchmark it instead times single producer single consumer transfers against moodycamel::ReaderWriterQueue.
+*/
+
+#include "BoundedQueue.h"
+#include "readerwriterqueue.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#define QUEUE_TEST_STOP UINT64_MAX
+
+//The producer goes in the high half and its sequence number in the low half.
+inline uint64_t MakeItem(uint32_t producer, uint32_t sequence) noexcept
+{
+	return ((uint64_t)producer << 32) | sequence;
+}
+
+template <size_t Capacity>
+static bool RunStressTest(uint32_t producerCount, uint32_t consumerCount, uint32_t itemsPerProducer)
+{
+	auto queue = std::make_unique<BoundedQueue<uint64_t, Capacity>>();
+	std::unique_ptr<std::atomic<uint32_t>[]> deliveries(new std::atomic<uint32_t>[(size_t)producerCount * itemsPerProducer]);
+	for (size_t i = 0; i < (size_t)producerCount * itemsPerProducer; i++)
+	{
+		deliveries[i] = 0;
+	}
+	std::atomic<uint32_t> orderErrors = 0;
+
+	std::vector<std::thread> consumers;
+	for (uint32_t consumer = 0; consumer < consumerCount; consumer++)
+	{
+		consumers.emplace_back([&]()
+		{
+			//Items from one producer can be split across consumers but each consumer's share has to stay in order.
+			std::vector<int64_t> lastSequence(producerCount, -1);
+			uint64_t item;
+
+			while (true)
+			{
+				queue->Pop(item);
+				if (item == QUEUE_TEST_STOP)
+				{
+					break;
+				}
+
+				const uint32_t producer = (uint32_t)(item >> 32);
+				const uint32_t sequence = (uint32_t)item;
+				if (producer >= producerCount || sequence >= itemsPerProducer || (int64_t)sequence <= lastSequence[producer])
+				{
+					orderErrors++;
+					continue;
+				}
+
+				lastSequence[producer] = sequence;
+				deliveries[(size_t)producer * itemsPerProducer + sequence]++;
+			}
+		});
+	}
+
+	std::vector<std::thread> producers;
+	for (uint32_t producer = 0; producer < producerCount; producer++)
+	{
+		producers.emplace_back([&, producer]()
+		{
+			for (uint32_t sequence = 0; sequence < itemsPerProducer; sequence++)
+			{
+				//Mix both paths so TryPush racing the blocking Push gets covered too.
+				const uint64_t item = MakeItem(producer, sequence);
+				if ((sequence & 1) || !queue->TryPush(item))
+				{
+					queue->Push(item);
+				}
+			}
+		});
+	}
+
+	for (auto& thread : producers)
+	{
+		thread.join();
+	}
+
+	//Everything real is already queued ahead of these so each consumer drains its share before stopping.
+	for (uint32_t consumer = 0; consumer < consumerCount; consumer++)
+	{
+		queue->Push(QUEUE_TEST_STOP);
+	}
+
+	for (auto& thread : consumers)
+	{
+		thread.join();
+	}
+
+	uint64_t lost = 0;
+	uint64_t duplicated = 0;
+	for (size_t i = 0; i < (size_t)producerCount * itemsPerProducer; i++)
+	{
+		const uint32_t count = deliveries[i];
+		if (!count)
+		{
+			lost++;
+		}
+		else if (count > 1)
+		{
+			duplicated++;
+		}
+	}
+
+	const bool passed = !lost && !duplicated && !orderErrors;
+	printf("{\"test\":\"stress\",\"capacity\":%u,\"producers\":%u,\"consumers\":%u,\"items\":%llu,\"lost\":%llu,\"duplicated\":%llu,\"out_of_order\":%u,\"parks\":%llu,\"passed\":%s}\n",
+		(uint32_t)Capacity, producerCount, consumerCount, (unsigned long long)producerCount * itemsPerProducer, (unsigned long long)lost, (unsigned long long)duplicated, orderErrors.load(), (unsigned long long)queue->mParkCount.load(), passed ? "true" : "false");
+	fflush(stdout);
+
+	return passed;
+}
+
+template <typename PushFunction, typename PopFunction>
+static double TimeTransfer(uint64_t items, PushFunction push, PopFunction pop)
+{
+	const auto start = std::chrono::steady_clock::now();
+
+	std::thread consumer([&]()
+	{
+		for (uint64_t i = 0; i < items; i++)
+		{
+			pop();
+		}
+	});
+
+	for (uint64_t i = 0; i < items; i++)
+	{
+		push(i);
+	}
+
+	consumer.join();
+
+	const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+	return (double)elapsed / items;
+}
+
+static void PrintThroughput(const char* queueName, uint64_t items, double nanosecondsPerItem)
+{
+	printf("{\"test\":\"throughput\",\"queue\":\"%s\",\"items\":%llu,\"ns_per_item\":%.1f,\"items_per_second\":%.0f}\n",
+		queueName, (unsigned long long)items, nanosecondsPerItem, nanosecondsPerItem > 0.0 ? 1e9 / nanosecondsPerItem : 0.0);
+	fflush(stdout);
+}
+
+//Both sides get the same capacity, the command stream's packet queue is one producer and one consumer unless the device is multithreaded.
+static void RunThroughputBenchmark(uint64_t items)
+{
+	{
+		auto queue = std::make_unique<BoundedQueue<uint64_t, 1024>>();
+		const double time = TimeTransfer(items, [&](uint64_t item) { queue->Push(item); }, [&]() { uint64_t item; queue->Pop(item); });
+		PrintThroughput("BoundedQueue", items, time);
+	}
+
+	{
+		moodycamel::ReaderWriterQueue<uint64_t> queue(1024);
+		const double time = TimeTransfer(items,
+			[&](uint64_t item) { while (!queue.try_enqueue(item)) { std::this_thread::yield(); } },
+			[&]() { uint64_t item; while (!queue.try_dequeue(item)) { std::this_thread::yield(); } });
+		PrintThroughput("ReaderWriterQueue", items, time);
+	}
+
+	{
+		moodycamel::BlockingReaderWriterQueue<uint64_t> queue(1024);
+		const double time = TimeTransfer(items,
+			[&](uint64_t item) { while (!queue.try_enqueue(item)) { std::this_thread::yield(); } },
+			[&]() { uint64_t item; queue.wait_dequeue(item); });
+		PrintThroughput("BlockingReaderWriterQueue", items, time);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	if (argc > 1 && !strcmp(argv[1], "--benchmark"))
+	{
+		RunThroughputBenchmark(argc > 2 ? strtoull(argv[2], nullptr, 10) : 10000000);
+		return 0;
+	}
+
+	if (argc > 1)
+	{
+		fprintf(stderr, "usage: vk9-queue-test [--benchmark [items]]\n");
+		return 1;
+	}
+
+	bool passed = true;
+
+	//A tiny ring keeps both sides wrapping and parking, a larger one lets producers run ahead.
+	passed &= RunStressTest<8>(1, 1, 200000);
+	passed &= RunStressTest<8>(4, 1, 50000);
+	passed &= RunStressTest<8>(1, 4, 200000);
+	passed &= RunStressTest<8>(4, 4, 50000);
+	passed &= RunStressTest<1024>(8, 8, 50000);
+
+	return passed ? 0 : 1;
+}